@@ -0,0 +1,173 @@
+/*
+ * sdb_bench.c - per request latency of sdbsc -S against one sdbsc per request
+ *
+ * Run in the directory of a database served by sdbsc -S holding students
+ * 1 to students.  Times finds of random students and delete/add pairs
+ * over one connection to the server, then finds run as one sdbsc process
+ * each, reading the database itself (sdbsc -f) or asking the server
+ * (sdbsc -C -f), which is what a shell script calling sdbsc pays.
+ * Latencies are in microseconds.
+ *
+ * usage: sdb_bench path/to/sdbsc students [requests]
+ *
+ * Not part of sdbsc, the makefile only compiles the .c files of submission/.
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../sdbsc.h"
+#include "../sdb_proto.h"
+
+#define DEF_REQUESTS    100000
+#define SPAWN_RUNS      500
+
+extern char **environ;
+
+static double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+static void report(const char *name, double *lat, int num) {
+    double sum = 0;
+
+    qsort(lat, num, sizeof(double), cmp_double);
+    for (int i = 0; i < num; i++) {
+        sum += lat[i];
+    }
+    printf("%-20s %8d %10.1f %10.1f %10.1f %10.1f\n", name, num, sum / num,
+           lat[num / 2], lat[(int)(num * 0.99)], lat[num - 1]);
+}
+
+static void call(int sock, sdb_header_t *hdr, student_t *s, int want) {
+    if (sdb_call(sock, hdr, s, s, sizeof(student_t)) != NO_ERROR ||
+        hdr->status != want) {
+        fprintf(stderr, "request %d for id %d failed: %d\n", hdr->op, hdr->id,
+                hdr->status);
+        exit(1);
+    }
+}
+
+static void bench_gets(int sock, int students, double *lat, int num) {
+    sdb_header_t hdr;
+    student_t s;
+
+    for (int i = 0; i < num; i++) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.op = SDB_OP_GET;
+        hdr.id = 1 + rand() % students;
+        lat[i] = now_us();
+        call(sock, &hdr, &s, NO_ERROR);
+        lat[i] = now_us() - lat[i];
+    }
+    report("socket get", lat, num);
+}
+
+static void bench_changes(int sock, int students, double *lat, int num) {
+    sdb_header_t hdr;
+    student_t s;
+
+    // every student deleted is added back, the database stays the same
+    for (int i = 0; i < num; i++) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.op = SDB_OP_GET;
+        hdr.id = 1 + rand() % students;
+        call(sock, &hdr, &s, NO_ERROR);
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.op = SDB_OP_DEL;
+        hdr.id = s.id;
+        lat[i] = now_us();
+        call(sock, &hdr, &s, NO_ERROR);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.op = SDB_OP_ADD;
+        hdr.msg_len = sizeof(s);
+        call(sock, &hdr, &s, NO_ERROR);
+        lat[i] = (now_us() - lat[i]) / 2;
+    }
+    report("socket del+add / 2", lat, num);
+}
+
+static void bench_spawn(const char *name, char *sdbsc, bool client, int students,
+                        double *lat, int num) {
+    posix_spawn_file_actions_t fa;
+    char id[16];
+    char *argv[5];
+    int argc = 0;
+    int status;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    argv[argc++] = sdbsc;
+    if (client) {
+        argv[argc++] = "-C";
+    }
+    argv[argc++] = "-f";
+    argv[argc++] = id;
+    argv[argc] = NULL;
+
+    for (int i = 0; i < num; i++) {
+        snprintf(id, sizeof(id), "%d", 1 + rand() % students);
+        lat[i] = now_us();
+        if (posix_spawn(&pid, sdbsc, &fa, NULL, argv, environ) != 0 ||
+            waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s %s failed\n", name, id);
+            exit(1);
+        }
+        lat[i] = now_us() - lat[i];
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    report(name, lat, num);
+}
+
+int main(int argc, char *argv[]) {
+    int students = (argc > 2) ? atoi(argv[2]) : 0;
+    int requests = (argc > 3) ? atoi(argv[3]) : DEF_REQUESTS;
+    double *lat;
+    int sock;
+
+    if (argc < 3 || students < 1 || requests < 1) {
+        fprintf(stderr, "usage: %s path/to/sdbsc students [requests]\n", argv[0]);
+        return 1;
+    }
+    sock = sdb_connect(DB_SOCK_FILE);
+    if (sock < 0) {
+        perror(DB_SOCK_FILE);
+        return 1;
+    }
+    lat = malloc((requests > SPAWN_RUNS ? requests : SPAWN_RUNS) * sizeof(double));
+    if (lat == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%-20s %8s %10s %10s %10s %10s\n", "us per request", "requests",
+           "avg", "p50", "p99", "max");
+    bench_gets(sock, students, lat, requests);
+    bench_changes(sock, students, lat, requests / 10 ? requests / 10 : 1);
+    bench_spawn("process sdbsc -f", argv[1], false, students, lat, SPAWN_RUNS);
+    bench_spawn("process sdbsc -C -f", argv[1], true, students, lat, SPAWN_RUNS);
+
+    close(sock);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/bash
+#
+# server_bench.sh - request latency of sdbsc -S, see bench/sdb_bench.c
+#
+# Loads STUDENTS students into a scratch database, serves it with
+# ./sdbsc -S (or ./sdbsc -s -S with -s as the third argument) and runs
+# ./sdb-bench against it.  Run it from the directory holding sdbsc and
+# sdb-bench, on the file system you want to measure.
+#
+# usage: bench/server_bench.sh [students] [requests] [-s]
+
+STUDENTS=${1:-100000}
+REQUESTS=${2:-100000}
+SYNC=$3
+SDBSC=$(realpath ./sdbsc)
+BENCH=$(realpath ./sdb-bench)
+DIR=$(mktemp -d "$PWD/server_bench.XXXXXX")
+
+trap '[ -n "$SERVER" ] && kill "$SERVER"; rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+awk -v n=$STUDENTS 'BEGIN {
+    for (i = 1; i <= n; i++) printf "%d,first%d,last%d,%d\n", i, i, i % 5000, i % 501
+}' | "$SDBSC" -b - > /dev/null || exit 1
+
+"$SDBSC" $SYNC -S > /dev/null &
+SERVER=$!
+while [ ! -S student.db.sock ]; do
+    kill -0 "$SERVER" 2> /dev/null || exit 1
+    sleep 0.05
+done
+
+"$BENCH" "$SDBSC" "$STUDENTS" "$REQUESTS"
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# stress.sh - several sdbsc processes changing one database at once
+#
+# First ROUNDS races of 8 processes adding, then deleting, the same
+# student, each must have exactly one winner.  Then 1, 2, 4 and 8 writers
+# with their own ids run ./sdbsc -s -B with one change per log commit (an
+# fdatasync() per change) while a reader keeps printing the database; the
+# changes/s of all writers together shows how well they run in parallel,
+# and the count at the end that no change was lost.  Every run starts
+# from an empty database in a scratch directory, run it from the
+# directory holding sdbsc, on the file system you want to measure.
+#
+# usage: bench/stress.sh [changes per writer] [rounds]
+
+OPS=${1:-500}
+ROUNDS=${2:-20}
+SDBSC=$(realpath ./sdbsc)
+DIR=$(mktemp -d "$PWD/stress.XXXXXX")
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# races for one id, every process prints whether it won
+for ((r = 1; r <= ROUNDS; r++)); do
+    for p in 1 2 3 4 5 6 7 8; do
+        "$SDBSC" -a $r race "p$p" 300 &
+    done > add.out
+    wait
+    for p in 1 2 3 4 5 6 7 8; do
+        "$SDBSC" -d $r &
+    done > del.out
+    wait
+    [ "$(grep -c 'added to database' add.out)" -eq 1 ] || fail "round $r: not one add"
+    [ "$(grep -c 'was deleted' del.out)" -eq 1 ] || fail "round $r: not one delete"
+done
+[ "$("$SDBSC" -c)" = "Database contains no student records." ] || fail "races left students"
+echo "$ROUNDS rounds of 8 racing adds and deletes: one winner each"
+
+printf "%-8s %8s %10s %12s %8s\n" "writers" "changes" "ms" "changes/s" "reads"
+for n in 1 2 4 8; do
+    rm -f student.db*
+    for ((w = 0; w < n; w++)); do
+        awk -v w=$w -v n=$OPS 'BEGIN {
+            for (i = 1; i <= n; i++) printf "a %d first%d last%d %d\n", w * n + i, i, w, i % 401
+        }' > "writer.$w"
+    done
+
+    start=$(date +%s%N)
+    pids=()
+    for ((w = 0; w < n; w++)); do
+        "$SDBSC" -s -B "writer.$w" 1 > /dev/null &
+        pids+=($!)
+    done
+    reads=0
+    while kill -0 "${pids[@]}" 2> /dev/null; do
+        "$SDBSC" -p > /dev/null || fail "reader failed"
+        reads=$((reads + 1))
+    done
+    for pid in "${pids[@]}"; do
+        wait "$pid" || fail "$n writers: a writer failed"
+    done
+    end=$(date +%s%N)
+
+    [ "$("$SDBSC" -c)" = "Database contains $((n * OPS)) student record(s)." ] ||
+        fail "$n writers: $("$SDBSC" -c)"
+    ms=$(( (end - start) / 1000000 ))
+    printf "%-8d %8d %10d %12d %8d\n" $n $((n * OPS)) $ms \
+        $(( n * OPS * 1000 / (ms > 0 ? ms : 1) )) $reads
+done
@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# wal_bench.sh - durable adds and deletes, fsync per change vs group commit
+#
+# Runs the same batch of changes through ./sdbsc -s -B with one change
+# per log commit (an fdatasync() per change) and with larger groups, and
+# once without -s for the cost of the changes alone.  Every run starts
+# from an empty database in a scratch directory, run it from the
+# directory holding sdbsc, on the file system you want to measure.
+#
+# usage: bench/wal_bench.sh [changes] [group sizes...]
+
+OPS=${1:-5000}
+shift
+SIZES=${@:-1 8 32 128}
+SDBSC=$(realpath ./sdbsc)
+DIR=$(mktemp -d "$PWD/wal_bench.XXXXXX")
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# adds of OPS students, then deletes of every other one
+awk -v n=$OPS 'BEGIN {
+    for (i = 1; i <= n; i++) printf "a %d first%d last%d %d\n", i, i, i, i % 501
+    for (i = 1; i <= n; i += 2) printf "d %d\n", i
+}' > changes.txt
+total=$(wc -l < changes.txt)
+
+run() {
+    local label=$1
+    shift
+    local start end ms
+
+    rm -f student.db*
+    start=$(date +%s%N)
+    "$SDBSC" "$@" > /dev/null || { echo "$label: sdbsc failed" >&2; exit 1; }
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    printf "%-16s %8d %10d %12d\n" "$label" $total $ms \
+        $(( total * 1000 / (ms > 0 ? ms : 1) ))
+}
+
+printf "%-16s %8s %10s %12s\n" "mode" "changes" "ms" "changes/s"
+run "no -s" -B changes.txt
+for g in $SIZES; do
+    run "-s group $g" -s -B changes.txt $g
+done
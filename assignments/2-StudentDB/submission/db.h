@@ -1,6 +1,8 @@
 #ifndef __DB_H__
     #define __DB_H__
 
+#include <stdint.h>
+
 // Basic student database record.  Note:
 //  1. id must be > 0.  A student id==0 means the record has been deleted
 //  2. gpa is an int, should be between 0<=gpa<=500, real gpa is gpa/100.0 this
@@ -31,5 +33,104 @@ static const int DELETED_STUDENT_ID = 0;
 
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
+#define DB_HDR_FILE "student.db.hdr"        //header of DB_FILE, see below
+
+//The header of the database lives in its own small file, so the database
+//keeps the layout above: student id at offset id * STUDENT_RECORD_SIZE.
+//It counts the live records and has one bit per student id, set when the
+//slot of that id holds a student.  A header that is missing, of another
+//version, marked dirty (a process changed the database and did not
+//finish), written for another database file or older than the last
+//change of the file is rebuilt from the records the next time the
+//database is opened.  Every change records the ctime of the file, which
+//a copy over it moves and touch cannot set back.
+#define DB_HDR_MAGIC    0x48424453          //"SDBH"
+#define DB_HDR_VERSION  2
+#define DB_BITMAP_WORDS ((MAX_STD_ID + 64) / 64)
+
+typedef struct db_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t dirty;             //changes in progress, do not trust
+    uint64_t db_ino;            //inode of the database described
+    uint64_t db_size;           //its size when the header was written
+    uint64_t db_ctime;          //its ctime in ns after the last change
+    uint64_t built;             //db_ctime when the header was rebuilt
+    uint32_t live;              //students in the database
+    uint32_t reserved;
+    uint64_t bitmap[DB_BITMAP_WORDS];
+} db_header_t;
+
+//Secondary indexes, one file each next to the database.  The last name
+//index is an array sorted by last name and id, searched with a binary
+//search.  The GPA index keeps the ids in buckets, one per GPA value:
+//the ids with GPA g are ids[start[g]] to ids[start[g + 1] - 1], in id
+//order.  Both are sized for MAX_STD_ID students, the files are sparse.
+//An index is rebuilt like the header when it is missing, dirty or does
+//not match the header.
+#define DB_LNAME_IDX_FILE   "student.db.lname"
+#define DB_GPA_IDX_FILE     "student.db.gpa"
+#define DB_IDX_MAGIC        0x58444953      //"SIDX"
+#define DB_IDX_VERSION      2
+
+typedef struct db_index_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t dirty;             //changes in progress, do not trust
+    uint64_t db_ino;            //same as the header it was written with
+    uint64_t db_size;
+    uint64_t built;
+    uint32_t count;             //entries, the live students
+    uint32_t reserved;
+} db_index_hdr_t;
+
+typedef struct db_lname_entry {
+    char    lname[32];          //as in student_t, may fill all 32 bytes
+    int32_t id;
+} db_lname_entry_t;
+
+typedef struct db_lname_index {
+    db_index_hdr_t   hdr;
+    db_lname_entry_t entries[MAX_STD_ID];
+} db_lname_index_t;
+
+typedef struct db_gpa_index {
+    db_index_hdr_t hdr;
+    uint32_t       start[MAX_STD_GPA + 2];
+    int32_t        ids[MAX_STD_ID];
+} db_gpa_index_t;
+
+//Write-ahead log of every add and delete, one record per change, appended
+//in groups.  With -s a group is made durable with a single fdatasync()
+//of the log, and a checkpoint syncs the database and empties the log.
+//A log starts with a WAL_OP_BOOT record naming the boot it was written
+//in: within that boot the page cache holds every logged change, after a
+//reboot open_db() replays the log.  The sum covers the record with sum
+//set to 0, a torn record at the end fails it.
+#define DB_WAL_FILE         "student.db.wal"
+#define DB_WAL_MAGIC        0x4c415753      //"SWAL"
+#define WAL_OP_ADD          1
+#define WAL_OP_DEL          2
+#define WAL_OP_BOOT         3               //boot id in student.lname
+
+typedef struct db_wal_rec {
+    uint32_t  magic;
+    uint32_t  sum;
+    uint32_t  op;               //WAL_OP_ADD, WAL_OP_DEL or WAL_OP_BOOT
+    uint32_t  reserved;
+    student_t student;          //the student added, the id of the one deleted
+} db_wal_rec_t;
+
+//Locks on the database file, fcntl() OFD locks, so concurrent processes
+//can share it.  The record of id is locked on its own 64 bytes, shared
+//to read it and exclusive to change it, and a scan locks all records at
+//once.  Two bytes past the last possible record stand for the log, held
+//shared by a process with changes not committed yet and exclusive to
+//checkpoint or replay it, and for the header and indexes, held around
+//every change to them.  Locks are always taken in that order: log,
+//records, header.
+#define DB_LOCK_RECORDS     ((MAX_STD_ID + 1) * STUDENT_RECORD_SIZE)
+#define DB_LOCK_WAL         DB_LOCK_RECORDS
+#define DB_LOCK_META        (DB_LOCK_RECORDS + 1)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "sdbsc.h"
+#include "sdb_proto.h"
+
+/*
+ *  Messages of the database server, see sdb_proto.h.  Nothing in here
+ *  touches the database, so the benchmark links this file alone.
+ */
+
+/*
+ *  sdb_connect
+ *      path:  socket of the server, DB_SOCK_FILE
+ *
+ *  returns:  the connected socket, or ERR_SDB_COMM with errno set
+ */
+int sdb_connect(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    int sock;
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return ERR_SDB_COMM;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+
+        close(sock);
+        errno = saved;
+        return ERR_SDB_COMM;
+    }
+    return sock;
+}
+
+/*
+ *  sdb_send_more
+ *      sock:     connected socket
+ *      hdr:      header to send, the identity and version are filled in
+ *      payload:  hdr->msg_len bytes sent after it, NULL if there are none
+ *      sent:     bytes of the message already sent, updated
+ *
+ *  Sends the rest of the message with one sendmsg() when the socket takes
+ *  it all, a large SDB_OP_PRINT response may need more.  On a non blocking
+ *  socket it stops when the socket is full, call it again once poll()
+ *  reports POLLOUT.  MSG_NOSIGNAL keeps a vanished peer from killing the
+ *  process with SIGPIPE.
+ *
+ *  returns:  1 once the whole message is sent, 0 if the socket is full,
+ *            or ERR_SDB_COMM
+ */
+int sdb_send_more(int sock, sdb_header_t *hdr, const void *payload, uint32_t *sent)
+{
+    struct iovec iov[2];
+    struct msghdr msg = {0};
+    uint32_t total = sizeof(sdb_header_t) + hdr->msg_len;
+    uint32_t off;
+    ssize_t n;
+
+    hdr->proto_id = SDB_PROTO_IDENTITY;
+    hdr->proto_ver = SDB_PROTO_VERSION;
+
+    while (*sent < total) {
+        msg.msg_iov = iov;
+        if (*sent < sizeof(sdb_header_t)) {
+            iov[0].iov_base = (char *)hdr + *sent;
+            iov[0].iov_len = sizeof(sdb_header_t) - *sent;
+            iov[1].iov_base = (void *)payload;
+            iov[1].iov_len = hdr->msg_len;
+            msg.msg_iovlen = (hdr->msg_len > 0) ? 2 : 1;
+        } else {
+            off = *sent - sizeof(sdb_header_t);
+            iov[0].iov_base = (char *)payload + off;
+            iov[0].iov_len = hdr->msg_len - off;
+            msg.msg_iovlen = 1;
+        }
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : ERR_SDB_COMM;
+        }
+        *sent += n;
+    }
+    return 1;
+}
+
+/*
+ *  sdb_send
+ *      sock:     connected socket
+ *      hdr:      header to send, the identity and version are filled in
+ *      payload:  hdr->msg_len bytes sent after it, NULL if there are none
+ *
+ *  returns:  NO_ERROR, or ERR_SDB_COMM
+ */
+int sdb_send(int sock, sdb_header_t *hdr, const void *payload)
+{
+    uint32_t sent = 0;
+
+    return (sdb_send_more(sock, hdr, payload, &sent) == 1) ? NO_ERROR : ERR_SDB_COMM;
+}
+
+/*
+ *  sdb_recv_more
+ *      sock:     connected socket
+ *      hdr:      receives the header
+ *      payload:  receives the payload
+ *      max:      size of payload, a longer message is malformed
+ *      got:      bytes of the message already received, updated
+ *
+ *  Receives the rest of a message.  On a non blocking socket it stops
+ *  when nothing more has arrived, call it again once poll() reports
+ *  POLLIN.  The header is checked as soon as it is complete.
+ *
+ *  returns:  1 once the whole message arrived, 0 if more is needed,
+ *            ERR_SDB_COMM if the peer left or the read failed, or
+ *            ERR_SDB_PROTO
+ */
+int sdb_recv_more(int sock, sdb_header_t *hdr, void *payload, uint32_t max, uint32_t *got)
+{
+    ssize_t n;
+
+    while (1) {
+        if (*got < sizeof(sdb_header_t)) {
+            n = recv(sock, (char *)hdr + *got, sizeof(sdb_header_t) - *got, 0);
+        } else if (*got < sizeof(sdb_header_t) + hdr->msg_len) {
+            n = recv(sock, (char *)payload + (*got - sizeof(sdb_header_t)),
+                     sizeof(sdb_header_t) + hdr->msg_len - *got, 0);
+        } else {
+            return 1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : ERR_SDB_COMM;
+        }
+        if (n == 0) {
+            return ERR_SDB_COMM;
+        }
+        *got += n;
+        if (*got == sizeof(sdb_header_t) &&
+            (hdr->proto_id != SDB_PROTO_IDENTITY || hdr->proto_ver != SDB_PROTO_VERSION ||
+             hdr->msg_len > max)) {
+            return ERR_SDB_PROTO;
+        }
+    }
+}
+
+/*
+ *  sdb_recv
+ *      sock:     connected socket
+ *      hdr:      receives the header
+ *      payload:  receives the payload
+ *      max:      size of payload, a longer message is malformed
+ *
+ *  returns:  NO_ERROR, ERR_SDB_COMM or ERR_SDB_PROTO
+ */
+int sdb_recv(int sock, sdb_header_t *hdr, void *payload, uint32_t max)
+{
+    uint32_t got = 0;
+    int rc;
+
+    rc = sdb_recv_more(sock, hdr, payload, max, &got);
+    if (rc == 1) {
+        return NO_ERROR;
+    }
+    return (rc == 0) ? ERR_SDB_COMM : rc;
+}
+
+/*
+ *  sdb_call
+ *      sock:  connected socket
+ *      hdr:   the request, receives the header of the response
+ *      req:   payload of the request, hdr->msg_len bytes
+ *      rsp:   receives the payload of the response
+ *      max:   size of rsp
+ *
+ *  Sends one request and waits for its response.
+ *
+ *  returns:  NO_ERROR, ERR_SDB_COMM or ERR_SDB_PROTO
+ */
+int sdb_call(int sock, sdb_header_t *hdr, const void *req, void *rsp, uint32_t max)
+{
+    uint16_t op = hdr->op;
+    int rc;
+
+    hdr->msg_dir = SDB_DIR_REQ;
+    rc = sdb_send(sock, hdr, req);
+    if (rc == NO_ERROR) {
+        rc = sdb_recv(sock, hdr, rsp, max);
+    }
+    if (rc == NO_ERROR && (hdr->msg_dir != SDB_DIR_RSP || hdr->op != op)) {
+        rc = ERR_SDB_PROTO;
+    }
+    return rc;
+}
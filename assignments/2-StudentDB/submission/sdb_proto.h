@@ -0,0 +1,59 @@
+#ifndef __SDB_PROTO_H__
+#define __SDB_PROTO_H__
+
+//Note its better to use standard and predictable
+//size values for data types in network protocols
+#include <stdint.h>
+
+#include "db.h" //get student record type
+
+//Wire format of the database server (sdbsc -S) and its clients (sdbsc -C),
+//after demos/sockets/protocol.h.  Every message is a FIXED size header
+//followed by msg_len bytes of payload.  The server only listens on a Unix
+//domain socket, so both ends are the same machine and the fields are in
+//host byte order.
+#define DB_SOCK_FILE        "student.db.sock"
+
+typedef struct sdb_header {
+    uint16_t  proto_id;         //SDB_PROTO_IDENTITY
+    uint16_t  proto_ver;        //SDB_PROTO_VERSION
+    uint16_t  msg_dir;          //SDB_DIR_REQ or SDB_DIR_RSP
+    uint16_t  op;               //SDB_OP_*, echoed in the response
+    int32_t   id;               //student id of a get or del
+    int32_t   status;           //response: NO_ERROR, ERR_*, or the count
+    uint32_t  msg_len;          //bytes of payload after the header
+} sdb_header_t;
+
+//the msg is what will be sent over the wire, the header
+//followed by the data
+typedef struct sdb_msg {
+    sdb_header_t hdr;
+    uint8_t      payload[];
+} sdb_msg_t;
+
+//payloads:  SDB_OP_ADD sends the student_t to add, a found SDB_OP_GET
+//gets the student_t back and SDB_OP_PRINT every student, in id order
+#define SDB_OP_GET          1
+#define SDB_OP_ADD          2
+#define SDB_OP_DEL          3
+#define SDB_OP_COUNT        4
+#define SDB_OP_PRINT        5
+
+#define SDB_PROTO_IDENTITY  0x5344      //"SD"
+#define SDB_PROTO_VERSION   1
+#define SDB_DIR_REQ         1
+#define SDB_DIR_RSP         2
+#define SDB_MAX_PAYLOAD     ((MAX_STD_ID + 1) * STUDENT_RECORD_SIZE)
+
+#define ERR_SDB_COMM        -10     //the socket failed or the peer left
+#define ERR_SDB_PROTO       -11     //malformed message
+
+//protocol prototypes for sdb_proto.c
+int sdb_connect(const char *path);
+int sdb_send(int sock, sdb_header_t *hdr, const void *payload);
+int sdb_send_more(int sock, sdb_header_t *hdr, const void *payload, uint32_t *sent);
+int sdb_recv(int sock, sdb_header_t *hdr, void *payload, uint32_t max);
+int sdb_recv_more(int sock, sdb_header_t *hdr, void *payload, uint32_t max, uint32_t *got);
+int sdb_call(int sock, sdb_header_t *hdr, const void *req, void *rsp, uint32_t max);
+
+#endif
@@ -0,0 +1,539 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdb_proto.h"
+
+/*
+ *  The query server (sdbsc -S) keeps the database open and mapped in one
+ *  long running process, so a request costs a message each way on a Unix
+ *  domain socket instead of starting sdbsc, opening the database and
+ *  faulting in its pages.  One thread serves every client with poll():
+ *  a round runs the requests that arrived whole since the last one,
+ *  commits the changes of the round to the log as one group (one
+ *  fdatasync() with -s), runs the gets and prints of the round and only
+ *  then sends the responses, so a client hears of a change once it is as
+ *  durable as the same change made by sdbsc itself.
+ *
+ *  Client sockets are non blocking.  A request is gathered over as many
+ *  rounds as it takes to arrive, and a response the socket cannot take
+ *  at once is finished when poll() reports POLLOUT, so a client that
+ *  sends or reads slowly only holds up itself.  The next request of a
+ *  client is read once its last response is sent.
+ *
+ *  The server takes the same locks as any other sdbsc process, the
+ *  command line tools can still be used next to it.
+ */
+
+#define SRV_MAX_CLIENTS     64
+
+typedef struct srv_reply {
+    sdb_header_t  hdr;
+    student_t     student;      // payload of SDB_OP_GET
+    student_t    *list;         // payload of SDB_OP_PRINT, malloc()ed
+    bool          change;       // add or delete, answered after the commit
+    bool          read;         // get or print, run after the commit
+} srv_reply_t;
+
+// one per entry of the poll array, the listening socket's is not used
+typedef struct srv_client {
+    sdb_header_t  req;          // request being received
+    student_t     body;         // its payload, no request has a larger one
+    uint32_t      got;          // bytes of the request received
+    srv_reply_t   reply;        // response to the last request
+    uint32_t      sent;         // bytes of the response sent
+    bool          sending;      // the response is not all sent yet
+} srv_client_t;
+
+static volatile sig_atomic_t srv_stop = 0;
+
+static void srv_on_signal(int sig)
+{
+    (void)sig;
+    srv_stop = 1;
+}
+
+/*
+ *  srv_listen
+ *      path:  socket to listen on
+ *
+ *  A socket left by a server that died is removed, one that still
+ *  answers belongs to a running server.
+ *
+ *  returns:  the non blocking listening socket, ERR_DB_OP if a server is
+ *            running, or ERR_DB_FILE
+ *
+ *  console:  M_ERR_SRV_RUNNING  another server owns the socket
+ */
+static int srv_listen(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    int sock;
+    int other;
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return ERR_DB_FILE;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (errno != EADDRINUSE) {
+            goto fail;
+        }
+        other = sdb_connect(path);
+        if (other >= 0) {
+            close(other);
+            close(sock);
+            printf(M_ERR_SRV_RUNNING, path);
+            return ERR_DB_OP;
+        }
+        unlink(path);
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            goto fail;
+        }
+    }
+    if (listen(sock, SOMAXCONN) == -1) {
+        goto fail;
+    }
+    return sock;
+
+fail:
+    perror(path);
+    close(sock);
+    return ERR_DB_FILE;
+}
+
+/*
+ *  srv_request
+ *      fd:   linux file descriptor of the database
+ *      cli:  client whose request arrived whole
+ *
+ *  Runs the request into cli->reply.  Adds and deletes are logged but not
+ *  committed, gets and prints are left to srv_read(), see run_server().
+ *
+ *  returns:  NO_ERROR, or ERR_SDB_PROTO when the client sent something
+ *            else, it is then dropped
+ */
+static int srv_request(int fd, srv_client_t *cli)
+{
+    student_t s = cli->body;
+    char fname[sizeof(s.fname) + 1] = {0};
+    char lname[sizeof(s.lname) + 1] = {0};
+    srv_reply_t *reply = &cli->reply;
+    sdb_header_t *hdr = &reply->hdr;
+
+    memset(reply, 0, sizeof(*reply));
+    *hdr = cli->req;
+    cli->got = 0;
+    if (hdr->msg_dir != SDB_DIR_REQ) {
+        return ERR_SDB_PROTO;
+    }
+    hdr->msg_dir = SDB_DIR_RSP;
+
+    switch (hdr->op) {
+    case SDB_OP_GET:
+    case SDB_OP_PRINT:
+        reply->read = true;
+        break;
+    case SDB_OP_ADD:
+        if (hdr->msg_len != sizeof(student_t) || validate_range(s.id, s.gpa) == EXIT_FAIL_ARGS) {
+            return ERR_SDB_PROTO;
+        }
+        memcpy(fname, s.fname, sizeof(s.fname));
+        memcpy(lname, s.lname, sizeof(s.lname));
+        hdr->status = add_student(fd, s.id, fname, lname, s.gpa);
+        hdr->id = s.id;
+        hdr->msg_len = 0;
+        reply->change = true;
+        break;
+    case SDB_OP_DEL:
+        hdr->status = del_student(fd, hdr->id);
+        hdr->msg_len = 0;
+        reply->change = true;
+        break;
+    case SDB_OP_COUNT:
+        hdr->status = count_students(fd);
+        hdr->msg_len = 0;
+        break;
+    default:
+        return ERR_SDB_PROTO;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  srv_read
+ *      fd:     linux file descriptor of the database
+ *      reply:  a get or print read by srv_request(), receives the response
+ *
+ *  Runs once the changes of the round are committed.  Every lock of the
+ *  server is on the same open file description, so a read lock on a
+ *  record logged but not committed would replace the write lock of the
+ *  change, and its unlock would let another process change the record and
+ *  commit first, replaying the log would then apply the two out of order.
+ */
+static void srv_read(int fd, srv_reply_t *reply)
+{
+    sdb_header_t *hdr = &reply->hdr;
+    int rc;
+
+    if (hdr->op == SDB_OP_GET) {
+        hdr->status = get_student(fd, hdr->id, &reply->student);
+        hdr->msg_len = (hdr->status == NO_ERROR) ? sizeof(student_t) : 0;
+    } else {
+        rc = snapshot_db(fd, &reply->list);
+        hdr->status = (rc < 0) ? ERR_DB_FILE : NO_ERROR;
+        hdr->msg_len = (rc < 0) ? 0 : rc * sizeof(student_t);
+    }
+}
+
+/*
+ *  srv_send
+ *      pfd:  poll entry of the client
+ *      cli:  client with a response to send
+ *
+ *  Sends what the socket takes of the response, the rest is sent when
+ *  poll() reports POLLOUT.  Once it is all sent the next request is
+ *  read.
+ *
+ *  returns:  NO_ERROR, or ERR_SDB_COMM if the client left
+ */
+static int srv_send(struct pollfd *pfd, srv_client_t *cli)
+{
+    srv_reply_t *reply = &cli->reply;
+    void *payload = (reply->list != NULL) ? (void *)reply->list : &reply->student;
+    int rc;
+
+    rc = sdb_send_more(pfd->fd, &reply->hdr, payload, &cli->sent);
+    if (rc < 0) {
+        return rc;
+    }
+    cli->sending = (rc == 0);
+    pfd->events = cli->sending ? POLLOUT : POLLIN;
+    if (!cli->sending) {
+        free(reply->list);
+        reply->list = NULL;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  srv_drop
+ *      pfd:  poll entry of the client, its fd is set to -1
+ *      cli:  the client
+ *
+ *  Closes the connection of a client that left or broke the protocol.
+ */
+static void srv_drop(struct pollfd *pfd, srv_client_t *cli)
+{
+    close(pfd->fd);
+    pfd->fd = -1;
+    free(cli->reply.list);
+    cli->reply.list = NULL;
+}
+
+/*
+ *  srv_accept
+ *      listen_sock:  non blocking listening socket
+ *      pfd:          poll array, receives the new clients
+ *      clients:      state of each entry of pfd
+ *      nfds:         entries in use, updated
+ *
+ *  Accepts every waiting client there is room for, with a non blocking
+ *  socket.
+ */
+static void srv_accept(int listen_sock, struct pollfd *pfd, srv_client_t *clients, int *nfds)
+{
+    int sock;
+
+    while (*nfds < SRV_MAX_CLIENTS + 1) {
+        sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            return;
+        }
+        memset(&clients[*nfds], 0, sizeof(srv_client_t));
+        pfd[*nfds].fd = sock;
+        pfd[*nfds].events = POLLIN;
+        (*nfds)++;
+    }
+}
+
+/*
+ *  run_server
+ *      fd:  linux file descriptor of the open database
+ *
+ *  Serves get, add, delete, count and print requests on DB_SOCK_FILE
+ *  until SIGINT or SIGTERM, see the top of this file.  The console
+ *  messages of the operations are meant for the client, which prints its
+ *  own, so stdout goes to /dev/null once the server has started.
+ *
+ *  returns:  NO_ERROR       stopped by a signal
+ *            ERR_DB_OP      another server is running
+ *            ERR_DB_FILE    the socket could not be set up
+ *
+ *  console:  M_SRV_STARTED      the server is listening
+ *            M_ERR_SRV_RUNNING  another server owns the socket
+ */
+int run_server(int fd)
+{
+    struct pollfd pfd[SRV_MAX_CLIENTS + 1];
+    srv_client_t clients[SRV_MAX_CLIENTS + 1];
+    int ready[SRV_MAX_CLIENTS];     // slots with a request this round
+    struct sigaction sa = {0};
+    int listen_sock;
+    int nfds = 1;
+
+    listen_sock = srv_listen(DB_SOCK_FILE);
+    if (listen_sock < 0) {
+        return listen_sock;
+    }
+
+    // no SA_RESTART, a signal ends the wait in poll()
+    sa.sa_handler = srv_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // a round has at most one change per client, committed together
+    set_wal_group(SRV_MAX_CLIENTS);
+    printf(M_SRV_STARTED, DB_FILE, DB_SOCK_FILE);
+    fflush(stdout);
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+    }
+
+    pfd[0].fd = listen_sock;
+    while (!srv_stop) {
+        bool changed = false;
+        int nrep = 0;
+        int rc;
+        int j;
+
+        pfd[0].events = (nfds < SRV_MAX_CLIENTS + 1) ? POLLIN : 0;
+        if (poll(pfd, nfds, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        // finish sending earlier responses and gather the requests,
+        // only the ones that arrived whole run in this round
+        for (int i = 1; i < nfds; i++) {
+            srv_client_t *cli = &clients[i];
+
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+            if (cli->sending) {
+                if (srv_send(&pfd[i], cli) != NO_ERROR) {
+                    srv_drop(&pfd[i], cli);
+                }
+                continue;
+            }
+            rc = sdb_recv_more(pfd[i].fd, &cli->req, &cli->body, sizeof(cli->body), &cli->got);
+            if (rc == 0) {
+                continue;
+            }
+            if (rc < 0 || srv_request(fd, cli) != NO_ERROR) {
+                srv_drop(&pfd[i], cli);
+                continue;
+            }
+            changed |= cli->reply.change;
+            ready[nrep++] = i;
+        }
+
+        // one log write, and with -s one fdatasync(), for the whole round
+        rc = changed ? wal_commit(fd) : NO_ERROR;
+        for (int i = 0; i < nrep; i++) {
+            if (clients[ready[i]].reply.read) {
+                srv_read(fd, &clients[ready[i]].reply);
+            }
+        }
+        for (int i = 0; i < nrep; i++) {
+            srv_client_t *cli = &clients[ready[i]];
+
+            if (cli->reply.change && rc != NO_ERROR) {
+                cli->reply.hdr.status = ERR_DB_FILE;
+            }
+            cli->sent = 0;
+            if (srv_send(&pfd[ready[i]], cli) != NO_ERROR) {
+                srv_drop(&pfd[ready[i]], cli);
+            }
+        }
+
+        // drop the clients that left, then take in new ones
+        j = 1;
+        for (int i = 1; i < nfds; i++) {
+            if (pfd[i].fd != -1) {
+                clients[j] = clients[i];
+                pfd[j++] = pfd[i];
+            }
+        }
+        nfds = j;
+        if (pfd[0].revents & POLLIN) {
+            srv_accept(listen_sock, pfd, clients, &nfds);
+        }
+    }
+
+    for (int i = 1; i < nfds; i++) {
+        srv_drop(&pfd[i], &clients[i]);
+    }
+    close(listen_sock);
+    unlink(DB_SOCK_FILE);
+    return NO_ERROR;
+}
+
+/*
+ *  run_client
+ *      argc:  arguments after -C
+ *      argv:  the program name and the option, as sdbsc takes them
+ *
+ *  Sends -a, -c, -d, -f or -p to a server started with -S and prints the
+ *  answer the way sdbsc prints the result of the same option, with the
+ *  same exit code.
+ *
+ *  returns:  the exit code for the shell
+ *
+ *  console:  the messages of the option
+ *            M_ERR_SRV_OPT      the option is not served
+ *            M_ERR_SRV_CONNECT  no server is running
+ */
+int run_client(int argc, char *argv[])
+{
+    sdb_header_t hdr = {0};
+    student_t s = {0};
+    student_t *list = NULL;
+    char opt = argv[1][1];
+    int sock;
+    int rc;
+
+    switch (opt) {
+    case 'a':
+        if (argc != 6) {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        s.id = atoi(argv[2]);
+        s.gpa = atoi(argv[5]);
+        if (validate_range(s.id, s.gpa) == EXIT_FAIL_ARGS) {
+            printf(M_ERR_STD_RNG);
+            return EXIT_FAIL_ARGS;
+        }
+        strncpy(s.fname, argv[3], sizeof(s.fname));
+        strncpy(s.lname, argv[4], sizeof(s.lname));
+        hdr.op = SDB_OP_ADD;
+        hdr.id = s.id;
+        hdr.msg_len = sizeof(student_t);
+        break;
+    case 'd':
+    case 'f':
+        if (argc != 3) {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        hdr.op = (opt == 'd') ? SDB_OP_DEL : SDB_OP_GET;
+        hdr.id = atoi(argv[2]);
+        break;
+    case 'c':
+        hdr.op = SDB_OP_COUNT;
+        break;
+    case 'p':
+        hdr.op = SDB_OP_PRINT;
+        list = malloc(SDB_MAX_PAYLOAD);
+        if (list == NULL) {
+            perror("malloc");
+            return EXIT_FAIL_DB;
+        }
+        break;
+    default:
+        printf(M_ERR_SRV_OPT, opt);
+        return EXIT_FAIL_ARGS;
+    }
+
+    sock = sdb_connect(DB_SOCK_FILE);
+    if (sock < 0) {
+        printf(M_ERR_SRV_CONNECT, DB_SOCK_FILE);
+        free(list);
+        return EXIT_FAIL_DB;
+    }
+    rc = sdb_call(sock, &hdr, &s, (list != NULL) ? (void *)list : &s,
+                  (list != NULL) ? (uint32_t)SDB_MAX_PAYLOAD : sizeof(s));
+    close(sock);
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        free(list);
+        return EXIT_FAIL_DB;
+    }
+
+    switch (opt) {
+    case 'a':
+        if (hdr.status == NO_ERROR) {
+            printf(M_STD_ADDED, hdr.id);
+        } else if (hdr.status == ERR_DB_OP) {
+            printf(M_ERR_DB_ADD_DUP, hdr.id);
+        } else {
+            printf(M_ERR_DB_WRITE);
+        }
+        break;
+    case 'd':
+        if (hdr.status == NO_ERROR) {
+            printf(M_STD_DEL_MSG, hdr.id);
+        } else if (hdr.status == ERR_DB_OP) {
+            printf(M_STD_NOT_FND_MSG, hdr.id);
+        } else {
+            printf(M_ERR_DB_WRITE);
+        }
+        break;
+    case 'f':
+        if (hdr.status == NO_ERROR) {
+            print_student(&s);
+        } else if (hdr.status == SRCH_NOT_FOUND) {
+            printf(M_STD_NOT_FND_MSG, hdr.id);
+        } else {
+            printf(M_ERR_DB_READ);
+        }
+        break;
+    case 'c':
+        if (hdr.status > 0) {
+            printf(M_DB_RECORD_CNT, hdr.status);
+        } else if (hdr.status == 0) {
+            printf(M_DB_EMPTY);
+        } else {
+            printf(M_ERR_DB_READ);
+        }
+        break;
+    case 'p':
+        if (hdr.status != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+        } else if (hdr.msg_len == 0) {
+            printf(M_DB_EMPTY);
+        } else {
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            for (uint32_t i = 0; i < hdr.msg_len / sizeof(student_t); i++) {
+                float realGPA = list[i].gpa / 100.0;
+
+                printf(STUDENT_PRINT_FMT_STRING, list[i].id, list[i].fname,
+                       list[i].lname, realGPA);
+            }
+        }
+        break;
+    }
+    free(list);
+    return (hdr.status < 0) ? EXIT_FAIL_DB : EXIT_OK;
+}
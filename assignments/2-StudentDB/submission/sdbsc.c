@@ -1,14 +1,1171 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h> //c library for system call file routines
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
 
 // database include files
 #include "db.h"
 #include "sdbsc.h"
+#include "sdb_proto.h"
+
+/*
+ *  The database file is used through a shared memory mapping, so the
+ *  record of student id is simply db_map[id]: a lookup is one memory
+ *  access and a scan walks the mapping, neither makes a system call per
+ *  record.  Changes are written into the mapping and reach the file when
+ *  the kernel writes the page back, or right away with set_db_sync().
+ *
+ *  The header in DB_HDR_FILE (see db.h) is mapped next to it.  Its
+ *  occupancy bitmap answers whether a slot is used without touching the
+ *  record, and its live count makes counting O(1).
+ *
+ *  Several processes can use the database at once, see the lock layout
+ *  in db.h.  A change holds the lock of its record from checking the
+ *  slot until the change is committed to the log, so two adds of one id
+ *  cannot both succeed while changes to different ids run side by side.
+ *  The record, header and indexes are changed together in a short
+ *  section under the header lock (meta_begin() to meta_end()), so they
+ *  agree whenever that lock is free.
+ */
+static student_t *db_map = NULL;    // records of the mapped file
+static size_t db_map_len = 0;       // bytes mapped, the file size
+static int db_map_fd = -1;          // file the mapping belongs to
+static db_header_t *db_hdr = NULL;  // header of that file
+static db_lname_index_t *db_lname = NULL;   // secondary indexes, mapped
+static db_gpa_index_t *db_gpa = NULL;       // by map_idx() when needed
+static bool db_sync = false;        // sync the log, see wal_commit()
+
+#define SCAN_PREFETCH   16          // records a scan prefetches ahead
+#define BULK_IOV_MAX    1024        // records per pwritev(), the Linux IOV_MAX
+#define WAL_GROUP_MAX   128         // changes committed by one log fdatasync()
+#define WAL_CHECKPOINT  (1 << 20)   // log bytes that trigger a checkpoint
+
+static int wal_fd = -1;             // DB_WAL_FILE, if it exists
+static bool wal_locked = false;     // log lock held shared, see wal_lock()
+static db_wal_rec_t wal_group[WAL_GROUP_MAX];   // changes not committed yet
+static int wal_pending = 0;
+static int wal_group_max = WAL_GROUP_MAX;
+
+static void unmap_idx(void);
+
+/*
+ *  set_db_sync
+ *      sync:  true to make every change durable through the write-ahead
+ *             log before the program exits
+ */
+void set_db_sync(bool sync)
+{
+    db_sync = sync;
+}
+
+/*
+ *  set_wal_group
+ *      ops:  changes committed together with one fdatasync() of the log,
+ *            1 syncs every change on its own
+ */
+void set_wal_group(int ops)
+{
+    wal_group_max = (ops < 1) ? 1 : (ops > WAL_GROUP_MAX) ? WAL_GROUP_MAX : ops;
+}
+
+/*
+ *  db_lock
+ *      fd:     linux file descriptor of the database
+ *      type:   F_RDLCK, F_WRLCK or F_UNLCK
+ *      start:  first byte of the range, see the lock layout in db.h
+ *      len:    bytes in the range
+ *
+ *  Takes or drops an open file description lock, waiting while another
+ *  process holds a conflicting one.  Unlike classic POSIX locks they are
+ *  not dropped when some other descriptor of the file is closed, and
+ *  they belong to the open file rather than the process.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int db_lock(int fd, short type, off_t start, off_t len)
+{
+    struct flock fl = {0};
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            return ERR_DB_FILE;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  lock_record
+ *      fd:    linux file descriptor of the database
+ *      id:    student id
+ *      type:  F_RDLCK, F_WRLCK or F_UNLCK
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int lock_record(int fd, int id, short type)
+{
+    return db_lock(fd, type, (off_t)id * STUDENT_RECORD_SIZE, STUDENT_RECORD_SIZE);
+}
+
+/*
+ *  hdr_used
+ *      id:  student id
+ *
+ *  returns:  true if the header says the slot of id holds a student
+ */
+static bool hdr_used(int id)
+{
+    return id >= 0 && id <= MAX_STD_ID &&
+           (db_hdr->bitmap[id / 64] >> (id % 64)) & 1;
+}
+
+/*
+ *  hdr_next
+ *      id:  first student id to look at
+ *
+ *  Finds the next used slot in the occupancy bitmap, 64 slots per word
+ *  with count trailing zeros, so empty regions are skipped without
+ *  touching their records.
+ *
+ *  returns:  the smallest used id >= id, or -1 if there is none
+ */
+static int hdr_next(int id)
+{
+    uint64_t bits;
+    int w = id / 64;
+
+    if (id < 0 || w >= DB_BITMAP_WORDS) {
+        return -1;
+    }
+    bits = db_hdr->bitmap[w] & (~0ULL << (id % 64));
+    while (bits == 0) {
+        if (++w == DB_BITMAP_WORDS) {
+            return -1;
+        }
+        bits = db_hdr->bitmap[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+/*
+ *  meta_begin
+ *      fd:  linux file descriptor of the database
+ *
+ *  Starts a change of the header and indexes: takes the header lock and
+ *  marks them dirty.  A process that dies before meta_end() leaves the
+ *  mark and the next one to map them rebuilds them.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int meta_begin(int fd)
+{
+    if (db_lock(fd, F_WRLCK, DB_LOCK_META, 1) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (db_hdr != NULL) {
+        db_hdr->dirty = 1;
+    }
+    if (db_lname != NULL) {
+        db_lname->hdr.dirty = db_gpa->hdr.dirty = 1;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  ctime_ns
+ *      st:  status of the database file
+ *
+ *  returns:  the ctime of the file in ns
+ */
+static uint64_t ctime_ns(struct stat *st)
+{
+    return (uint64_t)st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+}
+
+/*
+ *  meta_end
+ *      fd:  linux file descriptor of the database
+ *
+ *  Ends a change started with meta_begin(), the header and indexes agree
+ *  with the records again.  The header takes the ctime the change left
+ *  on the file, writes through the mapping set it when they fault.
+ */
+static void meta_end(int fd)
+{
+    struct stat st;
+
+    if (db_hdr != NULL) {
+        // after a compress fd is the replaced file, compress_db() stamps
+        // the new one
+        if (fstat(fd, &st) == 0 && (uint64_t)st.st_ino == db_hdr->db_ino) {
+            db_hdr->db_ctime = ctime_ns(&st);
+        }
+        db_hdr->dirty = 0;
+    }
+    if (db_lname != NULL) {
+        db_lname->hdr.dirty = db_gpa->hdr.dirty = 0;
+    }
+    db_lock(fd, F_UNLCK, DB_LOCK_META, 1);
+}
+
+/*
+ *  hdr_mark
+ *      id:    student id whose slot changed
+ *      used:  true if a student was added, false if one was deleted
+ *
+ *  Call it between meta_begin() and meta_end().
+ */
+static void hdr_mark(int id, bool used)
+{
+    uint64_t bit = 1ULL << (id % 64);
+
+    if (used && !(db_hdr->bitmap[id / 64] & bit)) {
+        db_hdr->bitmap[id / 64] |= bit;
+        db_hdr->live++;
+    } else if (!used && (db_hdr->bitmap[id / 64] & bit)) {
+        db_hdr->bitmap[id / 64] &= ~bit;
+        db_hdr->live--;
+    }
+}
+
+/*
+ *  hdr_rebuild
+ *      st:  status of the database file
+ *
+ *  Sets the header from the records, one pass over the mapping.
+ */
+static void hdr_rebuild(struct stat *st)
+{
+    int num = db_map_len / STUDENT_RECORD_SIZE;
+
+    memset(db_hdr, 0, sizeof(db_header_t));
+    if (num > MAX_STD_ID + 1) {
+        num = MAX_STD_ID + 1;
+    }
+    if (num > 0) {
+        madvise(db_map, db_map_len, MADV_SEQUENTIAL);
+    }
+    for (int i = 0; i < num; i++) {
+        if (i + SCAN_PREFETCH < num) {
+            __builtin_prefetch(&db_map[i + SCAN_PREFETCH]);
+        }
+        if (db_map[i].id != DELETED_STUDENT_ID) {
+            db_hdr->bitmap[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+    for (int w = 0; w < DB_BITMAP_WORDS; w++) {
+        db_hdr->live += __builtin_popcountll(db_hdr->bitmap[w]);
+    }
+    db_hdr->magic = DB_HDR_MAGIC;
+    db_hdr->version = DB_HDR_VERSION;
+    db_hdr->db_ino = st->st_ino;
+    db_hdr->db_size = st->st_size;
+    db_hdr->db_ctime = db_hdr->built = ctime_ns(st);
+}
+
+/*
+ *  map_hdr
+ *      st:  status of the database file before map_db() grew it
+ *
+ *  Maps DB_HDR_FILE, creating it if needed, and rebuilds it unless it is
+ *  a clean header of this very file, unchanged since the header was
+ *  last written.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int map_hdr(struct stat *st)
+{
+    void *map = MAP_FAILED;
+    int hdr_fd;
+
+    hdr_fd = open(DB_HDR_FILE, O_RDWR | O_CREAT | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (hdr_fd == -1) {
+        perror(DB_HDR_FILE);
+        return ERR_DB_FILE;
+    }
+    if (ftruncate(hdr_fd, sizeof(db_header_t)) == 0) {
+        map = mmap(NULL, sizeof(db_header_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, hdr_fd, 0);
+    }
+    close(hdr_fd);
+    if (map == MAP_FAILED) {
+        perror(DB_HDR_FILE);
+        return ERR_DB_FILE;
+    }
+    db_hdr = map;
+
+    if (db_hdr->magic != DB_HDR_MAGIC || db_hdr->version != DB_HDR_VERSION ||
+        db_hdr->dirty || db_hdr->db_ino != (uint64_t)st->st_ino ||
+        db_hdr->db_size != (uint64_t)st->st_size ||
+        db_hdr->db_ctime != ctime_ns(st)) {
+        hdr_rebuild(st);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  unmap_db
+ *
+ *  Drops the mapping of the database file, its header and indexes, call
+ *  it before the file descriptor is closed.  The header is kept up to
+ *  date by every change, there is nothing to write back.
+ */
+void unmap_db(void)
+{
+    unmap_idx();
+    if (db_hdr != NULL) {
+        munmap(db_hdr, sizeof(db_header_t));
+    }
+    if (db_map != NULL) {
+        munmap(db_map, db_map_len);
+    }
+    db_hdr = NULL;
+    db_map = NULL;
+    db_map_len = 0;
+    db_map_fd = -1;
+}
+
+/*
+ *  map_db
+ *      fd:    linux file descriptor
+ *      need:  bytes the mapping must cover.  A shorter file is extended
+ *             with ftruncate(), which leaves a hole, the same as writing
+ *             past its end.
+ *
+ *  Maps the database file and its header, or remaps the file when it has
+ *  to grow, or another process grew it.  A mapping that already covers
+ *  need is reused without any system call.  Growing the file and checking
+ *  the header happen under the header lock, so two processes growing the
+ *  file at once cannot shrink it back.
+ *
+ *  returns:  NO_ERROR       the file is mapped, an empty file maps nothing
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  Does not produce any console I/O used by other functions
+ */
+int map_db(int fd, off_t need)
+{
+    struct stat st;
+    off_t size;
+    void *map;
+
+    if (fd == db_map_fd && (off_t)db_map_len >= need) {
+        return NO_ERROR;
+    }
+    if (fd != db_map_fd) {
+        unmap_db();
+    } else if (db_map != NULL) {
+        munmap(db_map, db_map_len);
+        db_map = NULL;
+        db_map_len = 0;
+    }
+
+    if (meta_begin(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+    size = st.st_size;
+    if (size < need) {
+        if (ftruncate(fd, need) == -1) {
+            perror("ftruncate");
+            goto fail;
+        }
+        size = need;
+    }
+
+    db_map_fd = fd;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            goto fail;
+        }
+        db_map = map;
+        db_map_len = size;
+    }
+    if (db_hdr == NULL && map_hdr(&st) != NO_ERROR) {
+        goto fail;
+    }
+    // the header and indexes follow the size of the file
+    if (db_hdr->db_size < (uint64_t)size) {
+        db_hdr->db_size = size;
+        if (db_lname != NULL) {
+            db_lname->hdr.db_size = db_gpa->hdr.db_size = size;
+        }
+    }
+    meta_end(fd);
+    return NO_ERROR;
+
+fail:
+    meta_end(fd);
+    unmap_db();
+    return ERR_DB_FILE;
+}
+
+/*
+ *  db_records
+ *
+ *  returns:  the number of whole records in the mapping
+ */
+static int db_records(void)
+{
+    return db_map_len / STUDENT_RECORD_SIZE;
+}
+
+/*
+ *  read_lock
+ *      fd:     linux file descriptor of the database
+ *      start:  first byte of the range to lock shared, see db.h
+ *      len:    bytes in the range
+ *
+ *  Takes a shared lock for a read of the mapping, remapping first if
+ *  another process grew the file, so every id the header or an index
+ *  names is mapped while the lock is held.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int read_lock(int fd, off_t start, off_t len)
+{
+    for (;;) {
+        if (map_db(fd, 0) != NO_ERROR || map_db(fd, db_hdr->db_size) != NO_ERROR ||
+            db_lock(fd, F_RDLCK, start, len) != NO_ERROR) {
+            return ERR_DB_FILE;
+        }
+        if (db_hdr->db_size <= db_map_len) {
+            return NO_ERROR;
+        }
+        db_lock(fd, F_UNLCK, start, len);
+    }
+}
+
+/*
+ *  map_file
+ *      path:  sidecar file of the database
+ *      size:  bytes to map, the file is grown (sparse) to that size
+ *
+ *  returns:  the shared mapping of the file, or NULL on error
+ */
+static void *map_file(const char *path, size_t size)
+{
+    void *map = MAP_FAILED;
+    int file_fd;
+
+    file_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (file_fd == -1) {
+        perror(path);
+        return NULL;
+    }
+    if (ftruncate(file_fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd, 0);
+    }
+    close(file_fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ *  lname_cmp
+ *
+ *  Orders last name index entries by last name, then id.  Last names
+ *  are compared over the 32 bytes of student_t, they may not be null
+ *  terminated.
+ */
+static int lname_cmp(const char *lname_a, int id_a, const char *lname_b, int id_b)
+{
+    int rc = strncmp(lname_a, lname_b, sizeof(((student_t *)0)->lname));
+
+    if (rc != 0) {
+        return rc;
+    }
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static int cmp_lname_entry(const void *a, const void *b)
+{
+    const db_lname_entry_t *ea = a;
+    const db_lname_entry_t *eb = b;
+
+    return lname_cmp(ea->lname, ea->id, eb->lname, eb->id);
+}
+
+/*
+ *  lname_lower_bound
+ *
+ *  returns:  index of the first last name entry not ordered before
+ *            (lname, id), a binary search
+ */
+static int lname_lower_bound(const char *lname, int id)
+{
+    int lo = 0;
+    int hi = db_lname->hdr.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (lname_cmp(db_lname->entries[mid].lname, db_lname->entries[mid].id,
+                      lname, id) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ *  gpa_position
+ *
+ *  returns:  where id goes in the GPA bucket of gpa, a binary search
+ */
+static int gpa_position(int gpa, int id)
+{
+    int lo = db_gpa->start[gpa];
+    int hi = db_gpa->start[gpa + 1];
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (db_gpa->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ *  idx_rebuild
+ *
+ *  Builds both indexes from the students the header marks as used: the
+ *  last name entries are sorted with qsort(), the GPA buckets are laid
+ *  out with a counting sort, which keeps the ids of a bucket in order.
+ */
+static void idx_rebuild(void)
+{
+    int num = 0;
+    int id;
+
+    memset(&db_lname->hdr, 0, sizeof(db_index_hdr_t));
+    memset(&db_gpa->hdr, 0, sizeof(db_index_hdr_t));
+    memset(db_gpa->start, 0, sizeof(db_gpa->start));
+
+    for (id = hdr_next(0); id >= 0 && id < db_records(); id = hdr_next(id + 1)) {
+        memcpy(db_lname->entries[num].lname, db_map[id].lname,
+               sizeof(db_lname->entries[num].lname));
+        db_lname->entries[num].id = id;
+        db_gpa->start[db_map[id].gpa + 1]++;
+        num++;
+    }
+    qsort(db_lname->entries, num, sizeof(db_lname_entry_t), cmp_lname_entry);
+
+    for (int g = 1; g <= MAX_STD_GPA + 1; g++) {
+        db_gpa->start[g] += db_gpa->start[g - 1];
+    }
+    for (id = hdr_next(0); id >= 0 && id < db_records(); id = hdr_next(id + 1)) {
+        // start[g] is used as the fill position of bucket g, it ends up
+        // at the start of bucket g + 1 and is shifted back below
+        db_gpa->ids[db_gpa->start[db_map[id].gpa]++] = id;
+    }
+    memmove(&db_gpa->start[1], &db_gpa->start[0], (MAX_STD_GPA + 1) * sizeof(uint32_t));
+    db_gpa->start[0] = 0;
+
+    db_lname->hdr.magic = db_gpa->hdr.magic = DB_IDX_MAGIC;
+    db_lname->hdr.version = db_gpa->hdr.version = DB_IDX_VERSION;
+    db_lname->hdr.count = db_gpa->hdr.count = num;
+    db_lname->hdr.db_ino = db_gpa->hdr.db_ino = db_hdr->db_ino;
+    db_lname->hdr.db_size = db_gpa->hdr.db_size = db_hdr->db_size;
+    db_lname->hdr.built = db_gpa->hdr.built = db_hdr->built;
+}
+
+/*
+ *  idx_valid
+ *
+ *  returns:  true if an index was written clean together with the header
+ */
+static bool idx_valid(db_index_hdr_t *idx)
+{
+    return idx->magic == DB_IDX_MAGIC && idx->version == DB_IDX_VERSION &&
+           !idx->dirty && idx->db_ino == db_hdr->db_ino &&
+           idx->db_size == db_hdr->db_size && idx->built == db_hdr->built &&
+           idx->count == db_hdr->live;
+}
+
+/*
+ *  map_idx
+ *
+ *  Maps the secondary indexes of the mapped database, rebuilding them if
+ *  either one cannot be trusted.  Only the operations that use or change
+ *  them pay for this.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int map_idx(void)
+{
+    int fd = db_map_fd;
+
+    if (db_lname != NULL) {
+        return NO_ERROR;
+    }
+    if (meta_begin(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    db_lname = map_file(DB_LNAME_IDX_FILE, sizeof(db_lname_index_t));
+    db_gpa = map_file(DB_GPA_IDX_FILE, sizeof(db_gpa_index_t));
+    if (db_lname == NULL || db_gpa == NULL) {
+        if (db_lname != NULL) {
+            munmap(db_lname, sizeof(db_lname_index_t));
+        }
+        if (db_gpa != NULL) {
+            munmap(db_gpa, sizeof(db_gpa_index_t));
+        }
+        db_lname = NULL;
+        db_gpa = NULL;
+        meta_end(fd);
+        return ERR_DB_FILE;
+    }
+    if (!idx_valid(&db_lname->hdr) || !idx_valid(&db_gpa->hdr)) {
+        idx_rebuild();
+    }
+    meta_end(fd);
+    return NO_ERROR;
+}
+
+/*
+ *  unmap_idx
+ */
+static void unmap_idx(void)
+{
+    if (db_lname == NULL) {
+        return;
+    }
+    munmap(db_lname, sizeof(db_lname_index_t));
+    munmap(db_gpa, sizeof(db_gpa_index_t));
+    db_lname = NULL;
+    db_gpa = NULL;
+}
+
+/*
+ *  idx_insert
+ *      s:  student that was just added
+ *
+ *  Inserts the student into both indexes, a binary search for its place
+ *  and a memmove() of the entries after it.  Call it between meta_begin()
+ *  and meta_end().
+ */
+static void idx_insert(student_t *s)
+{
+    int pos;
+
+    pos = lname_lower_bound(s->lname, s->id);
+    memmove(&db_lname->entries[pos + 1], &db_lname->entries[pos],
+            (db_lname->hdr.count - pos) * sizeof(db_lname_entry_t));
+    memcpy(db_lname->entries[pos].lname, s->lname, sizeof(s->lname));
+    db_lname->entries[pos].id = s->id;
+    db_lname->hdr.count++;
+
+    pos = gpa_position(s->gpa, s->id);
+    memmove(&db_gpa->ids[pos + 1], &db_gpa->ids[pos],
+            (db_gpa->hdr.count - pos) * sizeof(int32_t));
+    db_gpa->ids[pos] = s->id;
+    for (int g = s->gpa + 1; g <= MAX_STD_GPA + 1; g++) {
+        db_gpa->start[g]++;
+    }
+    db_gpa->hdr.count++;
+}
+
+/*
+ *  idx_remove
+ *      s:  student about to be deleted
+ */
+static void idx_remove(student_t *s)
+{
+    int pos;
+
+    pos = lname_lower_bound(s->lname, s->id);
+    if (pos < (int)db_lname->hdr.count && db_lname->entries[pos].id == s->id) {
+        db_lname->hdr.count--;
+        memmove(&db_lname->entries[pos], &db_lname->entries[pos + 1],
+                (db_lname->hdr.count - pos) * sizeof(db_lname_entry_t));
+    }
+
+    pos = gpa_position(s->gpa, s->id);
+    if (pos < (int)db_gpa->start[s->gpa + 1] && db_gpa->ids[pos] == s->id) {
+        db_gpa->hdr.count--;
+        memmove(&db_gpa->ids[pos], &db_gpa->ids[pos + 1],
+                (db_gpa->hdr.count - pos) * sizeof(int32_t));
+        for (int g = s->gpa + 1; g <= MAX_STD_GPA + 1; g++) {
+            db_gpa->start[g]--;
+        }
+    }
+}
+
+/*
+ *  The write-ahead log makes the changes of -s durable without syncing
+ *  the database: add_student() and del_student() change the mapping and
+ *  append a record of the change to wal_group, and a group of up to
+ *  wal_group_max records is written to DB_WAL_FILE with one write() and,
+ *  with -s, one fdatasync().  Once the log passes WAL_CHECKPOINT bytes a
+ *  checkpoint syncs the database, which holds every change the log does,
+ *  and empties the log.  Changes made without -s are logged too, unsynced,
+ *  so a replay cannot undo them with an older change of the same slot.
+ *
+ *  A change keeps its record locked until its group is written, so the
+ *  log has the changes of a slot in the order they were made, and holds
+ *  the log lock shared so no checkpoint or replay runs in between.
+ *
+ *  A record sets a slot to a student or to empty, so replaying the log in
+ *  order on whatever part of it reached the database gives the state it
+ *  was committed with.  Within one boot the page cache holds every change
+ *  the log does, even those of processes that died, so the log is only
+ *  replayed after a reboot; see wal_recover().
+ */
+
+/*
+ *  wal_sum
+ *
+ *  returns:  FNV-1a checksum of a log record with its sum set to 0
+ */
+static uint32_t wal_sum(db_wal_rec_t *rec)
+{
+    db_wal_rec_t copy = *rec;
+    unsigned char *p = (unsigned char *)&copy;
+    uint32_t sum = 2166136261u;
+
+    copy.sum = 0;
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        sum = (sum ^ p[i]) * 16777619u;
+    }
+    return sum;
+}
+
+/*
+ *  wal_boot_id
+ *      id:  receives the 32 hex digits of the boot id
+ *
+ *  Reads /proc/sys/kernel/random/boot_id.  A build with -DSDB_TEST_HOOKS
+ *  (make test) takes SDB_BOOT_ID instead when it is set, which lets the
+ *  tests pretend the machine rebooted.
+ *
+ *  returns:  false if the boot id is not known
+ */
+static bool wal_boot_id(char id[32])
+{
+    static char boot[32];
+    static int known = -1;
+
+    if (known == -1) {
+        char buf[64] = {0};
+#ifdef SDB_TEST_HOOKS
+        char *env = getenv("SDB_BOOT_ID");
+#else
+        char *env = NULL;
+#endif
+        int n = 0;
+
+        if (env != NULL) {
+            strncpy(buf, env, sizeof(buf) - 1);
+        } else {
+            int boot_fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+
+            if (boot_fd != -1) {
+                if (read(boot_fd, buf, sizeof(buf) - 1) < 0) {
+                    buf[0] = '\0';
+                }
+                close(boot_fd);
+            }
+        }
+        for (char *p = buf; *p != '\0' && n < 32; p++) {
+            if (isxdigit((unsigned char)*p)) {
+                boot[n++] = *p;
+            }
+        }
+        known = n > 0;
+    }
+    memcpy(id, boot, 32);
+    return known;
+}
+
+/*
+ *  wal_set
+ *      rec:  log record to fill in
+ *      op:   WAL_OP_ADD, WAL_OP_DEL or WAL_OP_BOOT
+ *      s:    the student added or deleted, NULL for WAL_OP_BOOT
+ */
+static void wal_set(db_wal_rec_t *rec, int op, const student_t *s)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = DB_WAL_MAGIC;
+    rec->op = op;
+    if (op == WAL_OP_ADD) {
+        rec->student = *s;
+    } else if (op == WAL_OP_DEL) {
+        rec->student.id = s->id;
+    } else {
+        wal_boot_id(rec->student.lname);
+    }
+    rec->sum = wal_sum(rec);
+}
+
+/*
+ *  wal_open
+ *      create:  create the log if it does not exist
+ *
+ *  returns:  NO_ERROR, wal_fd is -1 if there is no log, or ERR_DB_FILE
+ */
+static int wal_open(bool create)
+{
+    if (wal_fd != -1) {
+        return NO_ERROR;
+    }
+    wal_fd = open(DB_WAL_FILE, O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0),
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (wal_fd == -1) {
+        if (!create && errno == ENOENT) {
+            return NO_ERROR;
+        }
+        perror(DB_WAL_FILE);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  wal_size
+ *
+ *  returns:  bytes in the log, other processes append to it too
+ */
+static off_t wal_size(void)
+{
+    struct stat st;
+
+    if (wal_fd == -1 || fstat(wal_fd, &st) == -1) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+/*
+ *  wal_checkpoint
+ *      fd:  linux file descriptor of the database
+ *
+ *  Syncs the database, its header and indexes, which then hold everything
+ *  the log does, and empties the log.  fdatasync() writes the dirty pages
+ *  of the file no matter which process changed them through its mapping.
+ *  The caller holds the log lock exclusive, so no change is in progress.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_checkpoint(int fd)
+{
+    if (fdatasync(fd) == -1 ||
+        (db_hdr != NULL && msync(db_hdr, sizeof(db_header_t), MS_SYNC) == -1) ||
+        (db_lname != NULL && msync(db_lname, sizeof(db_lname_index_t), MS_SYNC) == -1) ||
+        (db_gpa != NULL && msync(db_gpa, sizeof(db_gpa_index_t), MS_SYNC) == -1) ||
+        (wal_size() > 0 && (ftruncate(wal_fd, 0) == -1 || fdatasync(wal_fd) == -1))) {
+        perror("wal_checkpoint");
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  wal_lock
+ *      fd:    linux file descriptor of the database
+ *      type:  F_RDLCK before a change, F_WRLCK to checkpoint or replay,
+ *             F_UNLCK
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_lock(int fd, short type)
+{
+    if (type == F_RDLCK && wal_locked) {
+        return NO_ERROR;
+    }
+    if (db_lock(fd, type, DB_LOCK_WAL, 1) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    wal_locked = (type == F_RDLCK);
+    return NO_ERROR;
+}
+
+/*
+ *  wal_commit
+ *      fd:  linux file descriptor of the database
+ *
+ *  Writes the changes of wal_group to the log, one write() for the whole
+ *  group, and with -s one fdatasync().  Then the records of the group and
+ *  the log lock are released, and the log is checkpointed when it has
+ *  grown too long.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int wal_commit(int fd)
+{
+    db_wal_rec_t boot;
+    struct iovec iov[2];
+    ssize_t len = wal_pending * sizeof(db_wal_rec_t);
+    int n = 0;
+    int rc = NO_ERROR;
+
+    if (wal_pending > 0) {
+        // an empty log starts with the boot it is written in
+        if (wal_size() == 0) {
+            wal_set(&boot, WAL_OP_BOOT, NULL);
+            iov[n].iov_base = &boot;
+            iov[n++].iov_len = sizeof(boot);
+            len += sizeof(boot);
+        }
+        iov[n].iov_base = wal_group;
+        iov[n++].iov_len = wal_pending * sizeof(db_wal_rec_t);
+        if (writev(wal_fd, iov, n) != len || (db_sync && fdatasync(wal_fd) == -1)) {
+            perror(DB_WAL_FILE);
+            rc = ERR_DB_FILE;
+        }
+    }
+
+    for (int i = 0; i < wal_pending; i++) {
+        lock_record(fd, wal_group[i].student.id, F_UNLCK);
+    }
+    wal_pending = 0;
+    if (wal_locked) {
+        wal_lock(fd, F_UNLCK);
+    }
+
+    if (rc == NO_ERROR && wal_size() >= WAL_CHECKPOINT) {
+        if (wal_lock(fd, F_WRLCK) != NO_ERROR) {
+            return ERR_DB_FILE;
+        }
+        if (wal_size() >= WAL_CHECKPOINT) {
+            rc = wal_checkpoint(fd);
+        }
+        wal_lock(fd, F_UNLCK);
+    }
+    return rc;
+}
+
+/*
+ *  lock_change
+ *      fd:  linux file descriptor of the database
+ *      id:  student id about to be added or deleted
+ *
+ *  Takes the log lock shared and the record of id exclusive.  A process
+ *  never waits for a record while it holds others, two batches waiting
+ *  for each other's records would deadlock, so when the record is busy
+ *  the pending group is committed first.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int lock_change(int fd, int id)
+{
+    struct flock fl = {0};
+
+    if (wal_lock(fd, F_RDLCK) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)id * STUDENT_RECORD_SIZE;
+    fl.l_len = STUDENT_RECORD_SIZE;
+    if (fcntl(fd, F_OFD_SETLK, &fl) == 0) {
+        return NO_ERROR;
+    }
+    if (errno != EAGAIN && errno != EACCES) {
+        perror("fcntl");
+        return ERR_DB_FILE;
+    }
+    if (wal_pending > 0 &&
+        (wal_commit(fd) != NO_ERROR || wal_lock(fd, F_RDLCK) != NO_ERROR)) {
+        return ERR_DB_FILE;
+    }
+    return lock_record(fd, id, F_WRLCK);
+}
+
+/*
+ *  unlock_change
+ *      fd:  linux file descriptor of the database
+ *      id:  student id that was not changed after all
+ *
+ *  A change of the same id still waiting in the group, e.g. the first of
+ *  two adds in one -B batch, keeps the record locked until wal_commit().
+ */
+static void unlock_change(int fd, int id)
+{
+    int i = 0;
+
+    while (i < wal_pending && wal_group[i].student.id != id) {
+        i++;
+    }
+    if (i == wal_pending) {
+        lock_record(fd, id, F_UNLCK);
+    }
+    if (wal_pending == 0 && wal_locked) {
+        wal_lock(fd, F_UNLCK);
+    }
+}
+
+/*
+ *  wal_log
+ *      fd:  linux file descriptor of the database
+ *      op:  WAL_OP_ADD or WAL_OP_DEL
+ *      s:   the student added or deleted
+ *
+ *  Records a change that was just made in the mapping, its record stays
+ *  locked until the group is committed.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_log(int fd, int op, student_t *s)
+{
+    if (wal_open(true) != NO_ERROR) {
+        unlock_change(fd, s->id);
+        return ERR_DB_FILE;
+    }
+    wal_set(&wal_group[wal_pending++], op, s);
+    if (wal_pending >= wal_group_max) {
+        return wal_commit(fd);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  wal_current
+ *      rec:  first record of the log
+ *
+ *  returns:  true if the log was started in this boot, its changes are
+ *            all in the page cache
+ */
+static bool wal_current(db_wal_rec_t *rec)
+{
+    char boot[32];
+
+    return wal_boot_id(boot) && rec->magic == DB_WAL_MAGIC &&
+           rec->sum == wal_sum(rec) && rec->op == WAL_OP_BOOT &&
+           memcmp(rec->student.lname, boot, sizeof(boot)) == 0;
+}
+
+/*
+ *  wal_recover
+ *      fd:  linux file descriptor of the database
+ *
+ *  Replays a log written before the last reboot, up to a torn record at
+ *  its end, with the log and every record locked.  The header and indexes
+ *  are rebuilt from the result and the database checkpointed.  A log of
+ *  this boot costs one pread() to recognize.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_recover(int fd)
+{
+    db_wal_rec_t recs[WAL_GROUP_MAX];
+    struct stat st;
+    off_t off = 0;
+    int rc = NO_ERROR;
+
+    if (wal_open(false) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (wal_fd == -1 || wal_size() == 0 ||
+        (pread(wal_fd, recs, sizeof(db_wal_rec_t), 0) == sizeof(db_wal_rec_t) &&
+         wal_current(&recs[0]))) {
+        return NO_ERROR;
+    }
+
+    if (wal_lock(fd, F_WRLCK) != NO_ERROR ||
+        db_lock(fd, F_WRLCK, 0, DB_LOCK_RECORDS) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    // another process may have replayed it while this one waited
+    if (wal_size() == 0 ||
+        (pread(wal_fd, recs, sizeof(db_wal_rec_t), 0) == sizeof(db_wal_rec_t) &&
+         wal_current(&recs[0]))) {
+        goto done;
+    }
+
+    for (bool torn = false; !torn; ) {
+        ssize_t n = pread(wal_fd, recs, sizeof(recs), off);
+
+        torn = n < (ssize_t)sizeof(db_wal_rec_t);
+        for (int i = 0; !torn && i < n / (ssize_t)sizeof(db_wal_rec_t); i++) {
+            db_wal_rec_t *rec = &recs[i];
+            int id = rec->student.id;
+
+            torn = rec->magic != DB_WAL_MAGIC || rec->sum != wal_sum(rec);
+            if (torn || rec->op == WAL_OP_BOOT) {
+                continue;
+            }
+            if ((rec->op != WAL_OP_ADD && rec->op != WAL_OP_DEL) ||
+                id < MIN_STD_ID || id > MAX_STD_ID) {
+                torn = true;
+                continue;
+            }
+            if (map_db(fd, rec->op == WAL_OP_ADD ? (off_t)(id + 1) * STUDENT_RECORD_SIZE : 0) != NO_ERROR) {
+                rc = ERR_DB_FILE;
+                goto done;
+            }
+            if (id < db_records()) {
+                db_map[id] = (rec->op == WAL_OP_ADD) ? rec->student : EMPTY_STUDENT_RECORD;
+            }
+        }
+        off += n;
+    }
+
+    if (map_db(fd, 0) != NO_ERROR || map_idx() != NO_ERROR || fstat(fd, &st) == -1 ||
+        meta_begin(fd) != NO_ERROR) {
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+    hdr_rebuild(&st);
+    idx_rebuild();
+    meta_end(fd);
+    rc = wal_checkpoint(fd);
+
+done:
+    db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+    wal_lock(fd, F_UNLCK);
+    return rc;
+}
+
+/*
+ *  wal_close
+ *      fd:  linux file descriptor of the database
+ *
+ *  Commits what is still in wal_group, call it before unmap_db().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int wal_close(int fd)
+{
+    int rc = wal_commit(fd);
+
+    if (wal_fd != -1) {
+        close(wal_fd);
+        wal_fd = -1;
+    }
+    return rc;
+}
 
 /*
  *  open_db
@@ -23,6 +1180,8 @@
  */
 int open_db(char *dbFile, bool should_truncate)
 {
+    int rc;
+
     // Set permissions: rw-rw----
     // see sys/stat.h for constants
     mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
@@ -31,9 +1190,6 @@ int open_db(char *dbFile, bool should_truncate)
     // create it if it does not exist
     int flags = O_RDWR | O_CREAT;
 
-    if (should_truncate)
-        flags += O_TRUNC;
-
     // Now open file
     int fd = open(dbFile, flags, mode);
 
@@ -44,6 +1200,39 @@ int open_db(char *dbFile, bool should_truncate)
         return ERR_DB_FILE;
     }
 
+    // Empty the database and the log together, with every lock held so
+    // no change is half done and a replay cannot bring students back
+    if (should_truncate)
+    {
+        rc = NO_ERROR;
+        if (wal_open(false) != NO_ERROR ||
+            wal_lock(fd, F_WRLCK) != NO_ERROR ||
+            db_lock(fd, F_WRLCK, 0, DB_LOCK_RECORDS) != NO_ERROR ||
+            ftruncate(fd, 0) == -1 ||
+            (wal_size() > 0 && ftruncate(wal_fd, 0) == -1))
+        {
+            rc = ERR_DB_FILE;
+        }
+        db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+        wal_lock(fd, F_UNLCK);
+        wal_pending = 0;
+        if (rc != NO_ERROR)
+        {
+            printf(M_ERR_DB_OPEN);
+            close(fd);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // Replay the changes the log holds, see wal_recover()
+    rc = should_truncate ? NO_ERROR : wal_recover(fd);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_OPEN);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
     return fd;
 }
 
@@ -62,36 +1251,35 @@ int open_db(char *dbFile, bool should_truncate)
  */
 int get_student(int fd, int id, student_t *s)
 {
-    student_t record;
-    ssize_t bytesRead;
-
     if (s == NULL) {
         return ERR_DB_FILE;
     }
 
-    // Seek to the beginning of the file
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+    if (map_db(fd, 0) != NO_ERROR) {
         perror(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    // Read the records one by one
-    while ((bytesRead = read(fd, &record, STUDENT_RECORD_SIZE)) > 0) {
-        if (memcmp(&record, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
-            if (record.id == id) {
-                *s = record;
-                return NO_ERROR;
-            }
-        }
+    // The id is the index of the record, the header knows whether the
+    // slot holds a student without touching it
+    if (id < MIN_STD_ID || id > MAX_STD_ID || !hdr_used(id)) {
+        return SRCH_NOT_FOUND;
     }
 
-    // Handle read error
-    if (bytesRead == -1) {
-        perror(M_ERR_DB_READ);
+    // A shared lock on the record, a change in progress is not seen half
+    // done.  The file may have grown since it was mapped.
+    if (lock_record(fd, id, F_RDLCK) != NO_ERROR || map_db(fd, db_hdr->db_size) != NO_ERROR) {
+        lock_record(fd, id, F_UNLCK);
         return ERR_DB_FILE;
     }
+    if (id >= db_records() || db_map[id].id != id) {
+        lock_record(fd, id, F_UNLCK);
+        return SRCH_NOT_FOUND;
+    }
 
-    return SRCH_NOT_FOUND;
+    *s = db_map[id];
+    lock_record(fd, id, F_UNLCK);
+    return NO_ERROR;
 }
 
 /*
@@ -102,54 +1290,397 @@ int get_student(int fd, int id, student_t *s)
  *      lname:  student last name
  *      gpa:    GPA as an integer (range defined in db.h)
  *
- *  Adds a new student to the database.  After calculating the index for the
- *  student, check if there is another student already at that location.  A good
- *  way is to use something like memcmp() to ensure that the location for this
- *  student contains all zero byes indicating the space is empty.
+ *  Adds a new student to the database.  After calculating the index for the
+ *  student, check if there is another student already at that location.  A good
+ *  way is to use something like memcmp() to ensure that the location for this
+ *  student contains all zero byes indicating the space is empty.
+ *
+ *  The file is grown to end with the record if it is shorter, and the
+ *  record is written into the mapping.
+ *
+ *  returns:  NO_ERROR       student added to database
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           already exists)
+ *
+ *
+ *  console:  M_STD_ADDED       on success
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_READ     error reading or seeking the database file
+ *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *
+ */
+int add_student(int fd, int id, char *fname, char *lname, int gpa)
+{
+    student_t new_s = {0};
+    off_t end = (off_t)(id + 1) * STUDENT_RECORD_SIZE;
+
+    if (id < 0) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    // The record stays locked from the check for a student until the
+    // change is in the log, one of two processes adding id wins
+    if (lock_change(fd, id) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    if (map_db(fd, end) != NO_ERROR || map_idx() != NO_ERROR) {
+        unlock_change(fd, id);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    if (db_map[id].id != 0) {
+        unlock_change(fd, id);
+        printf(M_ERR_DB_ADD_DUP, id);
+        return ERR_DB_OP;
+    }
+
+    new_s.id = id;
+    new_s.gpa = gpa;
+    strncpy(new_s.fname, fname, 24);
+    strncpy(new_s.lname, lname, 32);
+
+    if (meta_begin(fd) != NO_ERROR) {
+        unlock_change(fd, id);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    hdr_mark(id, true);
+    db_map[id] = new_s;
+    idx_insert(&db_map[id]);
+    meta_end(fd);
+    if (wal_log(fd, WAL_OP_ADD, &new_s) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    printf(M_STD_ADDED, new_s.id);
+    return NO_ERROR;
+}
+
+/*
+ *  parse_bulk_line
+ *      line:  one line of a bulk load file, changed in place
+ *      s:     receives the student
+ *
+ *  Splits "id,first_name,last_name,gpa" with the gpa as a 3 digit int,
+ *  the same values -a takes.  Blanks around the fields are ignored.
+ *
+ *  returns:  NO_ERROR       s holds a student that passed validate_range()
+ *            ERR_DB_OP      the line is not a valid student
+ */
+static int parse_bulk_line(char *line, student_t *s)
+{
+    char *field[4];
+    char *end;
+    int num = 0;
+    long val;
+
+    for (char *tok = strtok(line, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (num == 4) {
+            return ERR_DB_OP;
+        }
+        while (isspace((unsigned char)*tok)) {
+            tok++;
+        }
+        end = tok + strlen(tok);
+        while (end > tok && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        field[num++] = tok;
+    }
+    if (num != 4 || *field[1] == '\0' || *field[2] == '\0') {
+        return ERR_DB_OP;
+    }
+
+    // Both values are range checked as a long, a cast to int first would
+    // let a large negative number wrap into range
+    memset(s, 0, sizeof(student_t));
+    errno = 0;
+    val = strtol(field[0], &end, 10);
+    if (*field[0] == '\0' || *end != '\0' || errno == ERANGE ||
+        val < MIN_STD_ID || val > MAX_STD_ID) {
+        return ERR_DB_OP;
+    }
+    s->id = (int)val;
+    errno = 0;
+    val = strtol(field[3], &end, 10);
+    if (*field[3] == '\0' || *end != '\0' || errno == ERANGE ||
+        val < MIN_STD_GPA || val > MAX_STD_GPA) {
+        return ERR_DB_OP;
+    }
+    s->gpa = (int)val;
+    if (validate_range(s->id, s->gpa) != NO_ERROR) {
+        return ERR_DB_OP;
+    }
+    strncpy(s->fname, field[1], sizeof(s->fname));
+    strncpy(s->lname, field[2], sizeof(s->lname));
+    return NO_ERROR;
+}
+
+// qsort() is not stable, ties are broken by the place of the record in
+// the input so the first line of a student given twice is the one added
+static int cmp_student_id(const void *a, const void *b)
+{
+    const student_t *sa = *(student_t *const *)a;
+    const student_t *sb = *(student_t *const *)b;
+
+    if (sa->id != sb->id) {
+        return (sa->id > sb->id) - (sa->id < sb->id);
+    }
+    return (sa > sb) - (sa < sb);
+}
+
+/*
+ *  bulk_load
+ *      fd:    linux file descriptor
+ *      path:  file of students to add, one "id,first_name,last_name,gpa"
+ *             per line, or "-" for stdin
+ *
+ *  Adds many students in one run.  Every line is parsed and checked with
+ *  validate_range(), a first line that does not start with a number is
+ *  taken as a header.  The students are sorted by id and students with
+ *  neighbouring ids are written together with one pwritev() of up to
+ *  BULK_IOV_MAX records, so a full database is loaded with about a hundred
+ *  system calls instead of three per student.
+ *
+ *  Lines that are not valid students, and students already in the
+ *  database or given twice, are reported and skipped, the others are
+ *  still added.  Of a student given twice the first line is added.
+ *
+ *  returns:  NO_ERROR       every student was added
+ *            ERR_DB_OP      some lines were skipped
+ *            ERR_DB_FILE    database or input file I/O issue
+ *
+ *  console:  M_BULK_LOADED     on success, how many students were added
+ *            M_ERR_BULK_LINE   a line was not a valid student
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_OPEN     the input file could not be opened
+ *            M_ERR_DB_WRITE    error writing to db file
+ */
+int bulk_load(int fd, char *path)
+{
+    struct iovec iov[BULK_IOV_MAX];
+    student_t *recs = NULL;
+    student_t **sorted = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    int cap = 0;
+    int num = 0;
+    int added = 0;
+    int skipped = 0;
+    int line_no = 0;
+    int rc = NO_ERROR;
+    FILE *in;
+
+    in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
+    // Step 1: Parse every line into the record array
+    while (getline(&line, &line_sz, in) != -1) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        if (num == cap) {
+            student_t *grown = realloc(recs, (cap ? cap * 2 : 1024) * sizeof(student_t));
+            if (grown == NULL) {
+                perror("realloc");
+                rc = ERR_DB_FILE;
+                goto done;
+            }
+            recs = grown;
+            cap = cap ? cap * 2 : 1024;
+        }
+        if (parse_bulk_line(line, &recs[num]) != NO_ERROR) {
+            if (line_no > 1 || isdigit((unsigned char)line[strspn(line, " \t")])) {
+                printf(M_ERR_BULK_LINE, line_no);
+                skipped++;
+            }
+            continue;
+        }
+        num++;
+    }
+
+    // Step 2: Sort pointers to the records by id, the records stay put
+    sorted = malloc((num ? num : 1) * sizeof(student_t *));
+    if (sorted == NULL) {
+        perror("bulk_load");
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+    for (int i = 0; i < num; i++) {
+        sorted[i] = &recs[i];
+    }
+    qsort(sorted, num, sizeof(student_t *), cmp_student_id);
+
+    // Step 3: Lock out every other change, these writes bypass the log so
+    // it is checkpointed first, a replay must not find older changes
+    if (wal_open(false) != NO_ERROR ||
+        wal_lock(fd, F_WRLCK) != NO_ERROR ||
+        db_lock(fd, F_WRLCK, 0, DB_LOCK_RECORDS) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+        goto unlock;
+    }
+    if (map_db(fd, num ? (off_t)(sorted[num - 1]->id + 1) * STUDENT_RECORD_SIZE : 0) != NO_ERROR ||
+        map_idx() != NO_ERROR || (wal_size() > 0 && wal_checkpoint(fd) != NO_ERROR) ||
+        meta_begin(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+        goto unlock;
+    }
+
+    // Step 4: Write every run of neighbouring ids with pwritev(), the file
+    // was grown to hold the last one
+    for (int i = 0; i < num; ) {
+        int first = sorted[i]->id;
+        int cnt = 0;
+
+        while (i < num && cnt < BULK_IOV_MAX && sorted[i]->id == first + cnt) {
+            if ((i > 0 && sorted[i - 1]->id == sorted[i]->id) ||
+                db_map[sorted[i]->id].id != 0) {
+                break;
+            }
+            iov[cnt].iov_base = sorted[i];
+            iov[cnt].iov_len = STUDENT_RECORD_SIZE;
+            cnt++;
+            i++;
+        }
+        if (cnt == 0) {
+            printf(M_ERR_DB_ADD_DUP, sorted[i]->id);
+            skipped++;
+            i++;
+            continue;
+        }
+        if (pwritev(fd, iov, cnt, (off_t)first * STUDENT_RECORD_SIZE) !=
+            (ssize_t)cnt * STUDENT_RECORD_SIZE) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+            break;
+        }
+        for (int j = first; j < first + cnt; j++) {
+            hdr_mark(j, true);
+        }
+        added += cnt;
+    }
+    // the writes show through the mapping, the indexes are rebuilt from it
+    idx_rebuild();
+    meta_end(fd);
+
+    if (rc == NO_ERROR && db_sync && added > 0 && wal_checkpoint(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+    if (rc == NO_ERROR) {
+        printf(M_BULK_LOADED, added);
+        if (skipped > 0) {
+            rc = ERR_DB_OP;
+        }
+    }
+
+unlock:
+    db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+    wal_lock(fd, F_UNLCK);
+
+done:
+    free(line);
+    free(recs);
+    free(sorted);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return rc;
+}
+
+/*
+ *  run_batch
+ *      fd:    linux file descriptor
+ *      path:  file of commands, "-" reads them from stdin
+ *
+ *  Runs many adds and deletes in one process, one command per line:
  *
- *  returns:  NO_ERROR       student added to database
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           already exists)
+ *      a id first_name last_name gpa
+ *      d id
  *
+ *  with the gpa as a 3 digit int.  With -s the changes are logged and
+ *  committed in groups (see set_wal_group()), so a group shares a single
+ *  fdatasync() of the log instead of syncing every change.  Blank lines
+ *  and lines starting with # are skipped.
  *
- *  console:  M_STD_ADDED       on success
- *            M_ERR_DB_ADD_DUP  student already exists
- *            M_ERR_DB_READ     error reading or seeking the database file
- *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *  returns:  NO_ERROR       every command succeeded
+ *            ERR_DB_OP      some commands failed or were not understood
+ *            ERR_DB_FILE    database or input file I/O issue
  *
+ *  console:  the messages of add_student() and del_student()
+ *            M_ERR_BATCH_LINE  a line is not a command
+ *            M_ERR_STD_RNG     id or gpa out of range
+ *            M_ERR_DB_OPEN     the input file could not be opened
+ *            M_ERR_DB_WRITE    error writing to db file or the log
  */
-int add_student(int fd, int id, char *fname, char *lname, int gpa)
+int run_batch(int fd, char *path)
 {
-    student_t new_s = {0};
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
+    char fname[64];
+    char lname[64];
+    char *line = NULL;
+    size_t line_sz = 0;
+    int line_no = 0;
+    int failed = 0;
+    int rc = NO_ERROR;
+    int id;
+    int gpa;
+    FILE *in;
+
+    in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        printf(M_ERR_DB_OPEN);
         return ERR_DB_FILE;
     }
 
-    if (read(fd, &new_s, STUDENT_RECORD_SIZE) == -1) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
+    while (rc != ERR_DB_FILE && getline(&line, &line_sz, in) != -1) {
+        char *cmd = line + strspn(line, " \t");
 
-    if (new_s.id != 0) {
-        printf(M_ERR_DB_ADD_DUP, id);
-        return ERR_DB_OP;
+        line_no++;
+        if (*cmd == '\0' || *cmd == '\n' || *cmd == '#') {
+            continue;
+        }
+        if (sscanf(cmd, "a %d %63s %63s %d", &id, fname, lname, &gpa) == 4) {
+            if (validate_range(id, gpa) != NO_ERROR) {
+                printf(M_ERR_STD_RNG);
+                failed++;
+                continue;
+            }
+            rc = add_student(fd, id, fname, lname, gpa);
+        } else if (sscanf(cmd, "d %d", &id) == 1) {
+            rc = del_student(fd, id);
+        } else {
+            printf(M_ERR_BATCH_LINE, line_no);
+            failed++;
+            continue;
+        }
+        if (rc != NO_ERROR) {
+            failed++;
+        }
     }
 
-    new_s.id = id;
-    new_s.gpa = gpa;
-    strncpy(new_s.fname, fname, 24);
-    strncpy(new_s.lname, lname, 32);
-
-    if (write(fd, &new_s, STUDENT_RECORD_SIZE) == -1) { 
+    if (rc != ERR_DB_FILE && wal_commit(fd) != NO_ERROR) {
         printf(M_ERR_DB_WRITE);
-        return ERR_DB_FILE;
+        rc = ERR_DB_FILE;
     }
-
-    printf(M_STD_ADDED, new_s.id);
-    return NO_ERROR;
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (rc == ERR_DB_FILE) {
+        return rc;
+    }
+    return failed ? ERR_DB_OP : NO_ERROR;
 }
 
 /*
@@ -176,37 +1707,45 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa)
  */
 int del_student(int fd, int id)
 {
-    student_t student = {0};
-    off_t offset = id * STUDENT_RECORD_SIZE;
+    student_t old_s;
 
-    // Seek to the student record position
-    if (lseek(fd, offset, SEEK_SET) == -1) {
+    if (id < MIN_STD_ID || id > MAX_STD_ID) {
+        printf(M_STD_NOT_FND_MSG, id);
+        return ERR_DB_OP;
+    }
+    // Map the file as another process may have grown it, a record past
+    // its end was never added
+    if (lock_change(fd, id) != NO_ERROR) {
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
-
-    // Read the student record
-    ssize_t bytes_read = read(fd, &student, STUDENT_RECORD_SIZE);
-    if (bytes_read == -1) {
+    if (map_db(fd, 0) != NO_ERROR || map_db(fd, db_hdr->db_size) != NO_ERROR ||
+        map_idx() != NO_ERROR) {
+        unlock_change(fd, id);
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
     // Check if the student exists
-    if (student.id == 0) {
+    if (!hdr_used(id) || id >= db_records() || db_map[id].id == 0) {
+        unlock_change(fd, id);
         printf(M_STD_NOT_FND_MSG, id);
         return ERR_DB_OP;
     }
 
-    // Seek back to the same position to overwrite the record
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
+    // Write an empty student record to "delete" the student, logged once
+    // the meta section is over as a commit may checkpoint
+    if (meta_begin(fd) != NO_ERROR) {
+        unlock_change(fd, id);
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
-
-    // Write an empty student record to "delete" the student
-    ssize_t bytes_written = write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE);
-    if (bytes_written != STUDENT_RECORD_SIZE) {
+    old_s = db_map[id];
+    hdr_mark(id, false);
+    idx_remove(&db_map[id]);
+    db_map[id] = EMPTY_STUDENT_RECORD;
+    meta_end(fd);
+    if (wal_log(fd, WAL_OP_DEL, &old_s) != NO_ERROR) {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
@@ -215,6 +1754,22 @@ int del_student(int fd, int id)
     return NO_ERROR;
 }
 
+/*
+ *  count_students
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the live count of the header, or ERR_DB_FILE
+ *
+ *  console:  Does not produce any console I/O
+ */
+int count_students(int fd)
+{
+    if (map_db(fd, 0) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    return db_hdr->live;
+}
+
 /*
  *  count_db_records
  *      fd:     linux file descriptor
@@ -227,6 +1782,8 @@ int del_student(int fd, int id)
  *  compare memcmp() for this. Create a counter variable and initialize it
  *  to zero, every time a non-zero record is read increment the counter.
  *
+ *  The count is kept in the header of the database, so no record is read.
+ *
  *  returns:  <number>       returns the number of records in db on success
  *            ERR_DB_FILE    database file I/O issue
  *            ERR_DB_OP      database operation logically failed (aka student
@@ -241,22 +1798,9 @@ int del_student(int fd, int id)
  */
 int count_db_records(int fd)
 {
-    student_t record;
-    int count = 0;
-    ssize_t bytesRead;
-
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        perror(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
-
-    while ((bytesRead = read(fd, &record, STUDENT_RECORD_SIZE)) > 0) {
-        if (memcmp(&record, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
-            count++;
-        }
-    }
+    int count = count_students(fd);
 
-    if (bytesRead == -1) {
+    if (count < 0) {
         perror(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
@@ -295,6 +1839,9 @@ int count_db_records(int fd)
  *  the GPA in the student structure is an int, to convert it into a real
  *  gpa divide by 100.0 and store in a float variable.
  *
+ *  Only the slots the occupancy bitmap of the header marks as used are
+ *  read, see hdr_next().
+ *
  *  returns:  NO_ERROR       on success
  *            ERR_DB_FILE    database file I/O issue
  *
@@ -305,37 +1852,178 @@ int count_db_records(int fd)
  */
 int print_db(int fd)
 {
-    student_t record;
-    ssize_t bytesRead;
+    student_t *record;
     int foundValidRecord = 0;
+    int num;
 
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+    // the records are locked shared, no change is seen half done
+    if (read_lock(fd, 0, DB_LOCK_RECORDS) != NO_ERROR) {
         perror(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    while ((bytesRead = read(fd, &record, STUDENT_RECORD_SIZE)) > 0) {
-        if (memcmp(&record, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
+    num = db_records();
+    for (int i = hdr_next(0); i >= 0 && i < num; i = hdr_next(i + 1)) {
+        record = &db_map[i];
+        if (record->id != DELETED_STUDENT_ID) {
             if (!foundValidRecord) {
                 printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
                 foundValidRecord = 1;
             }
 
-            float realGPA = record.gpa / 100.0;
+            float realGPA = record->gpa / 100.0;
 
-            printf(STUDENT_PRINT_FMT_STRING, record.id, record.fname, record.lname, realGPA);
+            printf(STUDENT_PRINT_FMT_STRING, record->id, record->fname, record->lname, realGPA);
         }
     }
 
+    db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+
     if (!foundValidRecord) {
         printf("Database contains no student records.\n");
     }
 
-    if (bytesRead == -1) {
-        perror(M_ERR_DB_READ);
+    return NO_ERROR;
+}
+
+/*
+ *  snapshot_db
+ *      fd:   linux file descriptor
+ *      out:  receives a malloc()ed array of every student, in id order,
+ *            NULL if there is none
+ *
+ *  Copies the students with the records locked shared, so the copy is
+ *  one state of the database even while other processes change it.
+ *
+ *  returns:  the number of students, or ERR_DB_FILE
+ *
+ *  console:  Does not produce any console I/O
+ */
+int snapshot_db(int fd, student_t **out)
+{
+    student_t *copy = NULL;
+    int num = 0;
+
+    *out = NULL;
+    if (read_lock(fd, 0, DB_LOCK_RECORDS) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (db_hdr->live > 0) {
+        copy = malloc(db_hdr->live * sizeof(student_t));
+        if (copy == NULL) {
+            db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+            return ERR_DB_FILE;
+        }
+    }
+    for (int i = hdr_next(0); i >= 0 && i < db_records() && num < (int)db_hdr->live;
+         i = hdr_next(i + 1)) {
+        if (db_map[i].id != DELETED_STUDENT_ID) {
+            copy[num++] = db_map[i];
+        }
+    }
+    db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+
+    *out = copy;
+    return num;
+}
+
+/*
+ *  find_by_lname
+ *      fd:     linux file descriptor
+ *      lname:  last name to look for
+ *
+ *  Prints every student with that last name, in id order, using the
+ *  last name index: a binary search for the first entry, then the
+ *  entries that follow while the name matches.
+ *
+ *  returns:  NO_ERROR        at least one student printed
+ *            SRCH_NOT_FOUND  no student has that last name
+ *            ERR_DB_FILE     database file I/O issue
+ *
+ *  console:  the students as print_db() prints them, on success
+ *            M_STD_LNAME_NOT_FND  no student has that last name
+ *            M_ERR_DB_READ        error reading the database or an index
+ */
+int find_by_lname(int fd, char *lname)
+{
+    char key[sizeof(((student_t *)0)->lname)] = {0};
+    int found = 0;
+
+    // the header lock shared keeps the index still while it is read
+    if (map_db(fd, 0) != NO_ERROR || map_idx() != NO_ERROR ||
+        read_lock(fd, DB_LOCK_META, 1) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    strncpy(key, lname, sizeof(key));
+    for (int i = lname_lower_bound(key, 0); i < (int)db_lname->hdr.count; i++) {
+        db_lname_entry_t *e = &db_lname->entries[i];
+
+        if (strncmp(e->lname, key, sizeof(key)) != 0) {
+            break;
+        }
+        if (!found) {
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            found = 1;
+        }
+        printf(STUDENT_PRINT_FMT_STRING, db_map[e->id].id, db_map[e->id].fname,
+               db_map[e->id].lname, db_map[e->id].gpa / 100.0);
+    }
+    db_lock(fd, F_UNLCK, DB_LOCK_META, 1);
+
+    if (!found) {
+        printf(M_STD_LNAME_NOT_FND, lname);
+        return SRCH_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  find_by_gpa
+ *      fd:   linux file descriptor
+ *      min:  lowest gpa, as a 3 digit int
+ *      max:  highest gpa, as a 3 digit int
+ *
+ *  Prints every student with a gpa from min to max, ordered by gpa and
+ *  then id.  The GPA index keeps those students in one contiguous range
+ *  of ids[], no record outside the range is read.
+ *
+ *  returns:  NO_ERROR        at least one student printed
+ *            SRCH_NOT_FOUND  no student in that range
+ *            ERR_DB_FILE     database file I/O issue
+ *
+ *  console:  the students as print_db() prints them, on success
+ *            M_STD_GPA_NOT_FND  no student in that range
+ *            M_ERR_DB_READ      error reading the database or an index
+ */
+int find_by_gpa(int fd, int min, int max)
+{
+    int first;
+    int last;
+
+    if (map_db(fd, 0) != NO_ERROR || map_idx() != NO_ERROR ||
+        read_lock(fd, DB_LOCK_META, 1) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
+    first = db_gpa->start[min];
+    last = db_gpa->start[max + 1];
+    if (first == last) {
+        db_lock(fd, F_UNLCK, DB_LOCK_META, 1);
+        printf(M_STD_GPA_NOT_FND, min / 100.0, max / 100.0);
+        return SRCH_NOT_FOUND;
+    }
+
+    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    for (int i = first; i < last; i++) {
+        student_t *record = &db_map[db_gpa->ids[i]];
+
+        printf(STUDENT_PRINT_FMT_STRING, record->id, record->fname,
+               record->lname, record->gpa / 100.0);
+    }
+    db_lock(fd, F_UNLCK, DB_LOCK_META, 1);
     return NO_ERROR;
 }
 
@@ -381,6 +2069,65 @@ void print_student(student_t *s)
     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, realGPA);
 }
 
+/*
+ *  copy_live
+ *      fd:       database file
+ *      temp_fd:  file sized to hold the records up to last
+ *      last:     last live student id, -1 if there is none
+ *
+ *  Copies the live records to the same offsets of temp_fd, one run at a
+ *  time.  A run ends at a gap of deleted records spanning a whole block,
+ *  smaller gaps could not become a hole anyway and are copied along (a
+ *  deleted record is zero), which keeps a fragmented database from
+ *  costing a system call per record.  copy_file_range() lets the kernel
+ *  copy, or share, the data without it passing through user space; file
+ *  systems that do not support it get a pwrite() of the run straight
+ *  from the mapping.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int copy_live(int fd, int temp_fd, int last)
+{
+    struct stat st;
+    int gap;
+    int first = hdr_next(0);
+
+    if (fstat(temp_fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    gap = st.st_blksize / STUDENT_RECORD_SIZE;
+
+    while (first >= 0 && first <= last) {
+        int next = first;
+        off_t off = (off_t)first * STUDENT_RECORD_SIZE;
+        size_t len;
+
+        // next ends up one past the last live record of the run
+        for (int i = first; i >= 0 && i <= last && i - next < gap; i = hdr_next(i + 1)) {
+            next = i + 1;
+        }
+        len = (size_t)(next - first) * STUDENT_RECORD_SIZE;
+
+        while (len > 0) {
+            off_t in_off = off;
+            off_t out_off = off;
+            ssize_t n = copy_file_range(fd, &in_off, temp_fd, &out_off, len, 0);
+
+            if (n <= 0) {
+                n = pwrite(temp_fd, (char *)db_map + off, len, off);
+            }
+            if (n <= 0) {
+                perror("compress_db");
+                return ERR_DB_FILE;
+            }
+            off += n;
+            len -= n;
+        }
+        first = hdr_next(next);
+    }
+    return NO_ERROR;
+}
+
 /*
  *  NOTE IMPLEMENTING THIS FUNCTION IS EXTRA CREDIT
  *
@@ -413,6 +2160,19 @@ void print_student(student_t *s)
  *  compressed file after you create it, it is a good design to return the fd
  *  of the new compressed file from this function
  *
+ *  Records are found by their id, so the compressed file keeps every live
+ *  record at its slot and ends with the last one.  The temporary file is
+ *  sized with ftruncate(), which leaves it a hole, and every run of
+ *  neighbouring live records is copied into it with one copy_file_range()
+ *  (or one pwrite() from the mapping where the file system cannot), so the
+ *  pages of deleted records take no storage any more.
+ *
+ *  The temporary file is fsync()ed before the rename and the directory
+ *  after it, so a crash leaves either the old or the new database.  The
+ *  header and indexes stay valid: the slots did not move, only the inode
+ *  they record is changed, after the rename.  They are marked dirty until
+ *  then, a crash in between has them rebuilt.
+ *
  *  returns:  <number>       returns the fd of the compressed database file
  *            ERR_DB_FILE    database file I/O issue
  *
@@ -431,45 +2191,161 @@ void print_student(student_t *s)
  */
 int compress_db(int fd)
 {
-    student_t student;
-    int temp_fd = open(TMP_DB_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    size_t temp_len;
+    int last = -1;
+    int temp_fd;
+    int dir_fd;
+
+    // No change may run while the records are copied.  A process that
+    // keeps the old file open is not seen by the lock, -x is meant to run
+    // with nothing else using the database.
+    if (wal_lock(fd, F_WRLCK) != NO_ERROR ||
+        db_lock(fd, F_WRLCK, 0, DB_LOCK_RECORDS) != NO_ERROR ||
+        map_db(fd, 0) != NO_ERROR || map_idx() != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
+    }
+    for (int i = hdr_next(0); i >= 0 && i < db_records(); i = hdr_next(i + 1)) {
+        last = i;
+    }
+    temp_len = (size_t)(last + 1) * STUDENT_RECORD_SIZE;
+
+    temp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
     if (temp_fd == -1) {
         printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
+    }
+    if (ftruncate(temp_fd, temp_len) == -1 || copy_live(fd, temp_fd, last) != NO_ERROR ||
+        fsync(temp_fd) == -1) {
+        printf(M_ERR_DB_WRITE);
+        close(temp_fd);
+        unlink(TMP_DB_FILE);
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
     }
 
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
+    if (meta_begin(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
         close(temp_fd);
-        return ERR_DB_FILE;
+        unlink(TMP_DB_FILE);
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
+    }
+    msync(db_hdr, sizeof(db_header_t), MS_SYNC);
+    if (rename(TMP_DB_FILE, DB_FILE) == -1) {
+        meta_end(fd);
+        printf(M_ERR_DB_CREATE);
+        close(temp_fd);
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
+    }
+    dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
     }
 
-    while (read(fd, &student, sizeof(student_t)) == sizeof(student_t)) {
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, sizeof(student_t)) != 0) {
-            if (write(temp_fd, &student, sizeof(student_t)) != sizeof(student_t)) {
-                printf(M_ERR_DB_WRITE);
-                close(temp_fd);
-                return ERR_DB_FILE;
-            }
-        }
+    // the header and indexes now describe the new file
+    if (fstat(temp_fd, &st) == -1) {
+        meta_end(fd);
+        printf(M_ERR_DB_OPEN);
+        close(temp_fd);
+        temp_fd = ERR_DB_FILE;
+        goto unlock;
     }
+    db_hdr->db_ino = st.st_ino;
+    db_hdr->db_size = st.st_size;
+    db_hdr->db_ctime = ctime_ns(&st);
+    db_lname->hdr.db_ino = db_gpa->hdr.db_ino = st.st_ino;
+    db_lname->hdr.db_size = db_gpa->hdr.db_size = st.st_size;
+    meta_end(fd);
+    printf(M_DB_COMPRESSED_OK);
 
-    close(fd);
-    close(temp_fd);
+unlock:
+    db_lock(fd, F_UNLCK, 0, DB_LOCK_RECORDS);
+    wal_lock(fd, F_UNLCK);
+    if (temp_fd >= 0) {
+        unmap_db();
+        close(fd);
+    }
+    return temp_fd;
+}
 
-    if (rename(TMP_DB_FILE, DB_FILE) == -1) {
-        printf(M_ERR_DB_CREATE);
+/*
+ *  punch_db
+ *      fd:     linux file descriptor
+ *
+ *  Compacts the database online: the blocks only deleted records use are
+ *  released with fallocate(FALLOC_FL_PUNCH_HOLE), the ones after the last
+ *  student too.  No live record is copied or moved and the file keeps its
+ *  inode and size, so the header, the indexes and any process mapping the
+ *  file stay valid.  Deleted records are zero and a hole reads as zero, a
+ *  crash part way leaves a correct database.  The log lock is held
+ *  exclusive so no student is added to a block while it is punched,
+ *  readers go on.
+ *
+ *  returns:  NO_ERROR       holes punched
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_DB_PUNCHED    on success, with the bytes released
+ *            M_ERR_DB_READ   error reading the database file
+ *            M_ERR_DB_WRITE  error punching or truncating the database file
+ */
+int punch_db(int fd)
+{
+    struct stat st;
+    blkcnt_t blocks;
+    off_t blk;
+    off_t from = 0;
+
+    if (wal_lock(fd, F_WRLCK) != NO_ERROR || map_db(fd, 0) != NO_ERROR ||
+        map_db(fd, db_hdr->db_size) != NO_ERROR || fstat(fd, &st) == -1) {
+        wal_lock(fd, F_UNLCK);
+        printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
+    blocks = st.st_blocks;
+    blk = st.st_blksize;
 
-    int new_fd = open(DB_FILE, O_RDWR);
-    if (new_fd == -1) {
-        printf(M_ERR_DB_OPEN);
+    // every gap between live records, only its whole blocks can be freed.
+    // Punching moves the ctime of the file, the header records it after
+    if (meta_begin(fd) != NO_ERROR) {
+        wal_lock(fd, F_UNLCK);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    for (int i = hdr_next(0); ; i = hdr_next(i + 1)) {
+        bool end = i < 0 || i >= db_records();
+        off_t to = end ? st.st_size : (off_t)i * STUDENT_RECORD_SIZE;
+        off_t first = (from + blk - 1) / blk * blk;
+        off_t stop = end ? (to + blk - 1) / blk * blk : to / blk * blk;
+
+        if (stop > first &&
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, stop - first) == -1) {
+            perror("fallocate");
+            meta_end(fd);
+            wal_lock(fd, F_UNLCK);
+            printf(M_ERR_DB_WRITE);
+            return ERR_DB_FILE;
+        }
+        if (end) {
+            break;
+        }
+        from = to + STUDENT_RECORD_SIZE;
+    }
+    meta_end(fd);
+    wal_lock(fd, F_UNLCK);
+
+    if ((db_sync && fsync(fd) == -1) || fstat(fd, &st) == -1) {
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    printf(M_DB_COMPRESSED_OK);
-    return new_fd;
+    printf(M_DB_PUNCHED, (long)(blocks - st.st_blocks) * 512);
+    return NO_ERROR;
 }
 
 /*
@@ -512,15 +2388,24 @@ int validate_range(int id, int gpa)
  */
 void usage(char *exename)
 {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s -[h|a|b|B|c|d|f|g|l|o|p|S|x|z] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
+    printf("\t-b file:  adds the students in file (- for stdin), one id,first_name,last_name,gpa per line\n");
+    printf("\t-B file [ops_per_commit]:  runs the adds (a id first_name last_name gpa) and deletes (d id) in file, one per line\n");
     printf("\t-c:  counts the records in the database\n");
     printf("\t-d id:  deletes a student\n");
     printf("\t-f id:  finds and prints a student in the database\n");
+    printf("\t-l last_name:  prints the students with that last name\n");
+    printf("\t-g min max(as 3 digit ints):  prints the students with a gpa in that range\n");
     printf("\t-p:  prints all records in the student database\n");
-    printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
-    printf("\t-z:  zero db file (remove all records)\n");
+    printf("\t-x:  compress the database file, with no other process using it [EXTRA CREDIT]\n");
+    printf("\t-o:  compress online, releasing the blocks of deleted records in place\n");
+    printf("\t-z:  zero db file (remove all records), with no other process using it\n");
+    printf("\t-S:  serves -a, -c, -d, -f and -p to clients on %s until Ctrl-C\n", DB_SOCK_FILE);
+    printf("\t-C before -a, -c, -d, -f or -p:  sends it to the server started with -S\n");
+    printf("\t-s before any of the above:  write every change to disk before exiting,\n");
+    printf("\t    through a log that -B syncs once per ops_per_commit changes (default %d)\n", WAL_GROUP_MAX);
 }
 
 // Welcome to main()
@@ -532,12 +2417,31 @@ int main(int argc, char *argv[])
     int exit_code; // exit code to shell
     int id;        // userid from argv[2]
     int gpa;       // gpa from argv[5]
+    int gpa_max;   // upper end of the gpa range from argv[3] of -g
 
     // space for a student structure which we will get back from
     // some of the functions we will be writing such as get_student(),
     // and print_student().
     student_t student = {0};
 
+    // -s in front of the option makes every change durable before the
+    // program exits, for example:  prog_name -s -a 1 John Doe 341
+    if (argc > 2 && strcmp(argv[1], "-s") == 0)
+    {
+        set_db_sync(true);
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    // -C sends the option to a server started with -S instead of opening
+    // the database, for example:  prog_name -C -f 1
+    if (argc > 2 && strcmp(argv[1], "-C") == 0 && *argv[2] == '-')
+    {
+        argv[1] = argv[0];
+        exit(run_client(argc - 1, argv + 1));
+    }
+
     // This function must have at least one arg, and the arg must start
     // with a dash
     if ((argc < 2) || (*argv[1] != '-'))
@@ -603,6 +2507,40 @@ int main(int argc, char *argv[])
 
         break;
 
+    case 'b':
+        //   arv[0] arv[1]  arv[2]
+        // prog_name     -b    file
+        //-------------------------
+        // example:  prog_name -b students.csv
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = bulk_load(fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'B':
+        //   arv[0] arv[1]  arv[2]  arv[3]
+        // prog_name     -B    file  ops_per_commit
+        //-----------------------------------------
+        // example:  prog_name -s -B changes.txt 64
+        if (argc != 3 && argc != 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        if (argc == 4)
+            set_wal_group(atoi(argv[3]));
+        rc = run_batch(fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'c':
         //    arv[0] arv[1]
         // prog_name     -c
@@ -661,6 +2599,46 @@ int main(int argc, char *argv[])
         }
         break;
 
+    case 'l':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -l  last_name
+        //-------------------------
+        // example:  prog_name -l doe
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_lname(fd, argv[2]);
+        if (rc != NO_ERROR)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'g':
+        //    arv[0] arv[1]  arv[2] arv[3]
+        // prog_name     -g     min    max
+        //-------------------------
+        // example:  prog_name -g 300 400
+        if (argc != 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        gpa = atoi(argv[2]);
+        gpa_max = atoi(argv[3]);
+        if (gpa < MIN_STD_GPA || gpa_max > MAX_STD_GPA || gpa > gpa_max)
+        {
+            printf(M_ERR_GPA_RNG);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_gpa(fd, gpa, gpa_max);
+        if (rc != NO_ERROR)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'p':
         //    arv[0] arv[1]
         // prog_name     -p
@@ -684,6 +2662,26 @@ int main(int argc, char *argv[])
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'o':
+        //    arv[0] arv[1]
+        // prog_name     -o
+        //-----------------
+        // example:  prog_name -o
+        rc = punch_db(fd);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'S':
+        //    arv[0] arv[1]
+        // prog_name     -S
+        //-----------------
+        // example:  prog_name -s -S
+        rc = run_server(fd);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'z':
         //    arv[0] arv[1]
         // prog_name     -x
@@ -691,6 +2689,7 @@ int main(int argc, char *argv[])
         // example:  prog_name -x
         // HINT:  close the db file, we already have fd
         //       and reopen db indicating truncate=true
+        unmap_db();
         close(fd);
         fd = open_db(DB_FILE, true);
         if (fd < 0)
@@ -708,6 +2707,12 @@ int main(int argc, char *argv[])
 
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
+    if (wal_close(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        exit_code = EXIT_FAIL_DB;
+    }
+    unmap_db();
     close(fd);
     exit(exit_code);
 }
@@ -5,15 +5,34 @@
 //prototypes for functions go below for this assignment
 int open_db(char *dbFile, bool should_truncate);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
+int bulk_load(int fd, char *path);
+int run_batch(int fd, char *path);
 int get_student(int fd, int id, student_t *s);
 int del_student(int fd, int id);
+int find_by_lname(int fd, char *lname);
+int find_by_gpa(int fd, int min, int max);
 int compress_db(int fd);
+int punch_db(int fd);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
+int count_students(int fd);
 int print_db(int fd);
+int snapshot_db(int fd, student_t **out);
 void usage(char *);
 
+//query server and thin client, see sdb_server.c
+int run_server(int fd);
+int run_client(int argc, char *argv[]);
+
+//memory mapped storage, see map_db()
+int map_db(int fd, off_t need);
+void unmap_db(void);
+void set_db_sync(bool sync);
+void set_wal_group(int ops);
+int wal_commit(int fd);
+int wal_close(int fd);
+
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
 // ERR_DB_FILE is returned if there is are any issues with the database file itself
@@ -49,10 +68,21 @@ void usage(char *);
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
+#define M_DB_PUNCHED      "Database compressed online, %ld bytes released!\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_BULK_LOADED     "%d student(s) added to database.\n"
+#define M_ERR_BULK_LINE   "Skipping line %d, expected id,first_name,last_name,gpa in range.\n"
+#define M_ERR_BATCH_LINE  "Skipping line %d, expected a id first_name last_name gpa or d id.\n"
+#define M_ERR_GPA_RNG     "GPA range must be min <= max, both from 0 to 500!\n"
+#define M_STD_LNAME_NOT_FND "No student with last name %s in database.\n"
+#define M_STD_GPA_NOT_FND "No student with a GPA from %.2f to %.2f in database.\n"
+#define M_SRV_STARTED     "Serving %s on %s, stop with Ctrl-C.\n"
+#define M_ERR_SRV_RUNNING "A server is already running on %s!\n"
+#define M_ERR_SRV_CONNECT "Cant reach the server on %s, start it with -S!\n"
+#define M_ERR_SRV_OPT     "Option -%c is not served by the server!\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -6,6 +6,7 @@ setup_file() {
     if [ -f "student.db" ]; then
         rm "student.db"
     fi
+    rm -f "student.db.hdr" "student.db.lname" "student.db.gpa" "student.db.wal" "student.db.sock"
 }
 
 @test "Check if database is empty to start" {
@@ -191,4 +192,404 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "Synced add keeps students at their id slot" {
+    run ./sdbsc -s -a 70 sync student 400
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 70 added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 70
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "70 sync student 4.00" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    # the file ends with the record of student 70
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "4544" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "Bulk load adds valid students and skips the rest" {
+    printf 'id,first_name,last_name,gpa\n5,bulk,five,350\n3,dup,three,100\n4,bulk,four,400\nnot a student\n6,bulk,six,999\n' > bulk.csv
+    run ./sdbsc -b bulk.csv
+    rm -f bulk.csv
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Skipping line 5, expected id,first_name,last_name,gpa in range." ]
+    [ "${lines[1]}" = "Skipping line 6, expected id,first_name,last_name,gpa in range." ]
+    [ "${lines[2]}" = "Cant add student with ID=3, already exists in db." ]
+    [ "${lines[3]}" = "2 student(s) added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 6 student record(s)." ]
+
+    run ./sdbsc -f 4
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "4 bulk four 4.00" ]
+}
+
+@test "Bulk load adds the first line of a student given twice" {
+    printf '7,first,seven,100\n8,bulk,eight,200\n7,second,seven,200\n7,third,seven,300\n9,bulk,nine,300\n7,fourth,seven,400\n' > bulk.csv
+    run ./sdbsc -b bulk.csv
+    rm -f bulk.csv
+    [ "$status" -eq 1 ]
+    [ "${lines[3]}" = "3 student(s) added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 7
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "7 first seven 1.00" ]
+
+    for id in 7 8 9; do
+        ./sdbsc -d $id
+    done
+}
+
+@test "Bulk load skips negative values that would wrap into range" {
+    printf 'id,first_name,last_name,gpa\n-4294967295,neg,wrap,300\n10,neg,gpa,-4294967000\n99999999999999999999,big,id,300\n' > bulk.csv
+    run ./sdbsc -b bulk.csv
+    rm -f bulk.csv
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Skipping line 2, expected id,first_name,last_name,gpa in range." ]
+    [ "${lines[1]}" = "Skipping line 3, expected id,first_name,last_name,gpa in range." ]
+    [ "${lines[2]}" = "Skipping line 4, expected id,first_name,last_name,gpa in range." ]
+    [ "${lines[3]}" = "0 student(s) added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 6 student record(s)." ]
+}
+
+@test "Header is rebuilt when it is missing or stale" {
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 6 student record(s)." ]
+
+    rm -f student.db.hdr
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 6 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    # a header written for another database file does not count
+    cp student.db student.copy
+    mv student.copy student.db
+    run ./sdbsc -d 4
+    [ "${lines[0]}" = "Student 4 was deleted from database." ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 5 student record(s)." ]
+
+    # nor does one of the same file that was copied over since, a backup
+    # is restored together with its log
+    cp student.db student.backup
+    cp student.db.wal student.wal.backup
+    run ./sdbsc -d 3
+    [ "${lines[0]}" = "Student 3 was deleted from database." ]
+    cp student.backup student.db
+    cp student.wal.backup student.db.wal
+    rm -f student.backup student.wal.backup
+    run ./sdbsc -f 3
+    [ "$status" -eq 0 ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    run ./sdbsc -g 350 400
+    ids=$(echo "$output" | tail -n +2 | awk '{print $1}' | tr '\n' ' ')
+    [ "$ids" = "5 3 70 " ]
+
+    # the database size is still that of its last record
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "4544" ]
+}
+
+@test "Find students by last name and GPA range" {
+    run ./sdbsc -l doe
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 4 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1 john doe 3.45" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    normalized_output=$(echo -n "${lines[3]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "63 jim doe 2.85" ]
+
+    run ./sdbsc -g 350 400
+    [ "$status" -eq 0 ]
+    ids=$(echo "$output" | tail -n +2 | awk '{print $1}' | tr '\n' ' ')
+    [ "$ids" = "5 3 70 " ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    # the indexes follow adds and deletes
+    run ./sdbsc -a 64 jill doe 350
+    run ./sdbsc -d 1
+    run ./sdbsc -l doe
+    ids=$(echo "$output" | tail -n +2 | awk '{print $1}' | tr '\n' ' ')
+    [ "$ids" = "3 63 64 " ]
+    run ./sdbsc -g 350 350
+    ids=$(echo "$output" | tail -n +2 | awk '{print $1}' | tr '\n' ' ')
+    [ "$ids" = "5 64 " ]
+
+    # and are rebuilt when they are missing
+    rm -f student.db.lname
+    run ./sdbsc -l doe
+    ids=$(echo "$output" | tail -n +2 | awk '{print $1}' | tr '\n' ' ')
+    [ "$ids" = "3 63 64 " ]
+
+    run ./sdbsc -l nobody
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student with last name nobody in database." ]
+
+    run ./sdbsc -g 400 300
+    [ "$status" -eq 2 ]
+}
+
+@test "Online and full compress release deleted records in place" {
+    run ./sdbsc -a 500 punch me 100
+    run ./sdbsc -a 1000 punch too 200
+    run ./sdbsc -d 500
+    blocks=$(stat --format="%b" ./student.db)
+
+    run ./sdbsc -o
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database compressed online, 4096 bytes released!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ "$(stat --format="%b" ./student.db)" -lt "$blocks" ]
+    run ./sdbsc -f 1000
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1000 punch too 2.00" ]
+
+    # the blocks after the last student are released, the size is kept
+    run ./sdbsc -d 1000
+    run ./sdbsc -o
+    [ "$status" -eq 0 ]
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "64064" ]
+    [ "$(stat --format="%b" ./student.db)" -le 16 ]
+
+    # a full compress keeps the slots, the header and the indexes
+    run ./sdbsc -a 1000 punch too 200
+    run ./sdbsc -x
+    [ "${lines[0]}" = "Database successfully compressed!" ]
+    [ ! -e .tmp_student.db ]
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "64064" ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 6 student record(s)." ]
+    run ./sdbsc -l too
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1000 punch too 2.00" ]
+}
+
+@test "Synced changes are logged, group committed and replayed" {
+    # SDB_BOOT_ID is only read by the sdbsc that make test builds
+    # a log left by an earlier boot is replayed and emptied
+    SDB_BOOT_ID=feed run ./sdbsc -c
+    run stat --format="%s" ./student.db.wal
+    [ "${lines[0]}" = "0" ]
+
+    run ./sdbsc -s -B - 2 <<'CMDS'
+a 200 wal one 300
+a 201 wal two 310
+x 5
+a 202 wal three 320
+CMDS
+    [ "$status" -eq 1 ]
+    [ "${lines[1]}" = "Student 201 added to database." ]
+    [ "${lines[2]}" = "Skipping line 3, expected a id first_name last_name gpa or d id." ]
+    [ "${lines[3]}" = "Student 202 added to database." ]
+
+    # the log starts with the boot it was written in
+    run stat --format="%s" ./student.db.wal
+    [ "${lines[0]}" = "320" ]
+
+    # after a reboot a change lost from the database is replayed
+    dd if=/dev/zero of=student.db bs=64 seek=201 count=1 conv=notrunc 2>/dev/null
+    SDB_BOOT_ID=feed run ./sdbsc -f 201
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "201 wal two 3.10" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    run ./sdbsc -l two
+    [ "${#lines[@]}" -eq 2 ]
+    run stat --format="%s" ./student.db.wal
+    [ "${lines[0]}" = "0" ]
+
+    # a torn record at the end of the log is cut off
+    run ./sdbsc -s -d 200
+    printf 'torn' >> student.db.wal
+    SDB_BOOT_ID=feed run ./sdbsc -f 200
+    [ "$status" -eq 1 ]
+    run stat --format="%s" ./student.db.wal
+    [ "${lines[0]}" = "0" ]
+
+    # a change made without -s is logged too, without a sync
+    run ./sdbsc -d 202
+    run stat --format="%s" ./student.db.wal
+    [ "${lines[0]}" = "160" ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 7 student record(s)." ]
+}
+
+@test "Concurrent writers add each id once and lose no change" {
+    # eight processes race to add the same student, exactly one wins
+    for i in 1 2 3 4 5 6 7 8; do
+        ./sdbsc -a 300 race "r$i" 300 > "race.$i" 2>&1 &
+    done
+    wait
+    [ "$(cat race.* | grep -c 'Student 300 added to database.')" -eq 1 ]
+    [ "$(cat race.* | grep -c 'Cant add student with ID=300, already exists in db.')" -eq 7 ]
+    rm -f race.*
+
+    # writers with their own ids all land, readers run alongside
+    for w in 0 1 2 3; do
+        seq $((2000 + w * 50)) $((2049 + w * 50)) |
+            sed 's/.*/a & w w 250/' | ./sdbsc -s -B - 1 > /dev/null &
+    done
+    ./sdbsc -p > /dev/null &
+    ./sdbsc -g 250 250 > /dev/null &
+    wait
+    run ./sdbsc -g 250 250
+    [ "${#lines[@]}" -eq 201 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 208 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    # a second add of an id waiting in a batch group keeps the record
+    # locked until the group is committed
+    rm -f batch.fifo
+    mkfifo batch.fifo
+    ./sdbsc -B - 8 < batch.fifo > /dev/null &
+    batch=$!
+    exec 3> batch.fifo
+    printf 'a 500 lock one 300\na 500 lock two 300\na 501 lock three 300\n' >&3
+    for i in $(seq 100); do
+        [ "$(./sdbsc -c)" = "Database contains 210 student record(s)." ] && break
+        sleep 0.05
+    done
+    run timeout 1 ./sdbsc -d 500
+    [ "$status" -eq 124 ]
+    exec 3>&-
+    status=0
+    wait $batch || status=$?
+    rm -f batch.fifo
+    [ "$status" -eq 1 ]
+    run ./sdbsc -d 500
+    [ "${lines[0]}" = "Student 500 was deleted from database." ]
+    run ./sdbsc -d 501
+    [ "${lines[0]}" = "Student 501 was deleted from database." ]
+}
+
+@test "Server answers client requests like the command line" {
+    ./sdbsc -S > /dev/null 2>&1 &
+    server=$!
+    for i in $(seq 50); do
+        [ -S student.db.sock ] && break
+        sleep 0.1
+    done
+
+    run ./sdbsc -C -a 400 sock client 330
+    [ "${lines[0]}" = "Student 400 added to database." ]
+    run ./sdbsc -C -a 400 sock client 330
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=400, already exists in db." ]
+    run ./sdbsc -C -f 400
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "400 sock client 3.30" ]
+    run ./sdbsc -C -c
+    [ "${lines[0]}" = "Database contains 209 student record(s)." ]
+
+    # the server and the command line see each other's changes
+    run ./sdbsc -f 400
+    [ "$status" -eq 0 ]
+    run ./sdbsc -d 400
+    run ./sdbsc -C -d 400
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 400 was not found in database." ]
+    [ "$(./sdbsc -C -p)" = "$(./sdbsc -p)" ]
+
+    # a get in the same round as a change of its student runs after the
+    # commit, the stopped server takes both requests in one round
+    kill -STOP $server
+    ./sdbsc -C -f 401 > round.get &
+    get=$!
+    sleep 0.2
+    ./sdbsc -C -a 401 same round 300 > /dev/null &
+    add=$!
+    sleep 0.2
+    kill -CONT $server
+    wait $get $add
+    normalized_output=$(echo -n "$(sed -n 2p round.get)" | tr -s "[:space:]" " ")
+    rm -f round.get
+    [ "$normalized_output" = "401 same round 3.00" ]
+    run ./sdbsc -d 401
+
+    run ./sdbsc -S
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "A server is already running on student.db.sock!" ]
+    kill -INT $server
+    wait $server
+    [ ! -e student.db.sock ]
+    run ./sdbsc -C -c
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant reach the server on student.db.sock, start it with -S!" ]
+}
+
+@test "Server keeps serving while a client is slow to read its response" {
+    # a print larger than the socket buffers
+    seq 10001 30000 | awk '{ print $1 ",slow,reader," $1 % 500 }' > bulk.csv
+    ./sdbsc -b bulk.csv > /dev/null
+    rm -f bulk.csv
+
+    ./sdbsc -S > /dev/null 2>&1 &
+    server=$!
+    for i in $(seq 50); do
+        [ -S student.db.sock ] && break
+        sleep 0.1
+    done
+
+    # the print is queued while the server is stopped, and its client is
+    # stopped before the server answers
+    kill -STOP $server
+    ./sdbsc -C -p > slow.print &
+    reader=$!
+    sleep 0.2
+    kill -STOP $reader
+    kill -CONT $server
+
+    run ./sdbsc -C -c
+    [ "${lines[0]}" = "Database contains 20208 student record(s)." ]
+
+    # the rest of the print is sent once its client reads again
+    sleep 1.5
+    kill -CONT $reader
+    wait $reader
+    lines_printed=$(wc -l < slow.print)
+    rm -f slow.print
+    kill -INT $server
+    wait $server
+    [ "$lines_printed" -eq 20209 ]
+}
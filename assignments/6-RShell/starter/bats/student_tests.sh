@@ -6,16 +6,28 @@
 SERVER_PORT=5678
 SERVER_IP="127.0.0.1"
 
+# Wait until a server accepts connections on port $1
+wait_for_server() {
+    local try
+
+    for try in $(seq 100); do
+        (exec 3<>/dev/tcp/$SERVER_IP/$1) 2> /dev/null && return 0
+        sleep 0.05
+    done
+    return 1
+}
+
 setup() {
     # Start the server in the background before each test
-    ./dsh -s -p $SERVER_PORT -x &  
-    sleep 1  # Allow time for the server to start
+    ./dsh -s -p $SERVER_PORT -x &
+    setup_server_pid=$!
+    wait_for_server $SERVER_PORT
 }
 
 teardown() {
-    # Stop the server after each test
+    # Stop the server after each test, it has exited once wait returns
     echo "stop-server" | ./dsh -c $SERVER_IP -p $SERVER_PORT
-    sleep 2  # Allow time for shutdown
+    wait $setup_server_pid
 }
 
 @test "Verify ls command runs correctly" {
@@ -41,26 +53,45 @@ EOF
     [ "$status" -eq 0 ]
 }
 
-@test "Exceeding maximum allowed pipes" {
+@test "Long pipelines have no stage limit" {
     # Create a long pipeline
     long_pipe="echo sample"
-    for i in {1..18}; do
+    for i in {1..100}; do
         long_pipe="$long_pipe | grep sample"
     done
     
     run "./dsh" <<EOF                
 $long_pipe
+echo a b c d e f g h i j k l m n o p
 EOF
 
     # Strip whitespace from the output
     stripped_output=$(echo "$output" | tr -d '[:space:]')
 
-    # Should contain error about too many commands
-    [[ "$stripped_output" == *"error"* && "$stripped_output" == *"pipe"* ]] 
+    # Every stage and every argument ran
+    [[ "$stripped_output" == *"dsh4>sample"* ]]
+    [[ "$stripped_output" == *"abcdefghijklmnop"* ]]
+    [[ "$stripped_output" != *"error"* ]]
 
     [ "$status" -eq 0 ]
 }
 
+@test "Redirections and quotes are lexed out of argv" {
+    tmp_file=$(mktemp)
+
+    run "./dsh" <<EOF
+echo "one  two">$tmp_file
+echo three >> "$tmp_file"
+cat <$tmp_file|wc -l
+EOF
+
+    [ "$status" -eq 0 ]
+    [ "$(head -1 $tmp_file)" = "one  two" ]
+    [ "$(tail -1 $tmp_file)" = "three" ]
+    [[ "$output" == *"2"* ]]
+    rm -f $tmp_file
+}
+
 @test "Exit after pipe execution" {
     run "./dsh" <<EOF                
 echo "done" | grep done
@@ -310,7 +341,7 @@ EOF
 ls
 exit
 EOF
-    wait  # Ensure first client exits before running the second
+    wait $!  # Ensure first client exits before running the second
 
     run ./dsh -c $SERVER_IP -p $SERVER_PORT <<EOF
 echo Multi-client test
@@ -319,3 +350,358 @@ EOF
     [ "$status" -eq 0 ]
     [[ "$output" == *"Multi-client test"* ]]
 }
+
+@test "Epoll server handles concurrent clients" {
+    ./dsh -s -p 5679 -e &
+    server_pid=$!
+    wait_for_server 5679
+
+    ./dsh -c -p 5679 <<EOF2 > epoll_client1.out &
+seq 1 50000 | tail -1
+exit
+EOF2
+    client1_pid=$!
+
+    run ./dsh -c -p 5679 <<EOF2
+echo epoll-client-2
+exit
+EOF2
+    wait $client1_pid
+
+    echo "stop-server" | ./dsh -c -p 5679
+    wait $server_pid
+    client1_output=$(cat epoll_client1.out)
+    rm -f epoll_client1.out
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"epoll-client-2"* ]]
+    [[ "$client1_output" == *"50000"* ]]
+}
+
+@test "Pre-fork server replaces a crashed worker" {
+    ./dsh -s -p 5680 -f 2 &
+    server_pid=$!
+    sleep 1  # the workers are forked after the socket listens
+
+    # crash one of the workers, the master should fork a replacement
+    worker_pid=$(pgrep -P $server_pid | head -1)
+    kill -SEGV $worker_pid
+    sleep 1
+
+    run ./dsh -c -p 5680 <<EOF2
+echo prefork-alive
+exit
+EOF2
+
+    echo "stop-server" | ./dsh -c -p 5680
+    wait $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"prefork-alive"* ]]
+}
+
+@test "Threaded server reports thread pool counters" {
+    run ./dsh -c -p $SERVER_PORT <<EOF2
+rstats
+exit
+EOF2
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"pool threads"* ]]
+    [[ "$output" == *"queue depth"* ]]
+}
+
+@test "Framed protocol keeps output that contains the EOF character" {
+    printf 'before\004after\n' > eof_in_middle.txt
+
+    run ./dsh -c -p $SERVER_PORT <<EOF2
+cat eof_in_middle.txt
+echo still-connected
+exit
+EOF2
+    rm -f eof_in_middle.txt
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"before"$'\004'"after"* ]]
+    [[ "$output" == *"still-connected"* ]]
+}
+
+@test "Spliced and copied output are identical" {
+    seq 1 300000 > splice_in.txt
+
+    ./dsh -s -p 5681 &
+    server_pid=$!
+    ./dsh -s -p 5682 -u &
+    copy_pid=$!
+    wait_for_server 5681
+    wait_for_server 5682
+
+    spliced=$(printf 'cat splice_in.txt | md5sum\ncat splice_in.txt | wc -c\nexit\n' | ./dsh -c -p 5681)
+    copied=$(printf 'cat splice_in.txt | md5sum\ncat splice_in.txt | wc -c\nexit\n' | ./dsh -c -p 5682)
+    spliced_all=$(printf 'cat splice_in.txt\nexit\n' | ./dsh -c -p 5681 | grep -c '^[0-9]')
+
+    echo "stop-server" | ./dsh -c -p 5681
+    echo "stop-server" | ./dsh -c -p 5682
+    wait $server_pid
+    wait $copy_pid
+    expected=$(md5sum < splice_in.txt)
+    rm -f splice_in.txt
+
+    [[ "$spliced" == *"$expected"* ]]
+    [[ "$copied" == *"$expected"* ]]
+    [ "$spliced_all" -ge 299999 ]
+}
+
+@test "Batch mode runs sessions concurrently and prints in script order" {
+    printf 'sleep 1\nsleep 1\necho batch-first\necho batch-second\n' > batch_script.txt
+
+    start=$(date +%s)
+    run ./dsh -c -p $SERVER_PORT -b batch_script.txt -n 2
+    elapsed=$(( $(date +%s) - start ))
+    rm -f batch_script.txt
+
+    stripped_output=$(echo "$output" | tr -d '[:space:]')
+
+    [ "$status" -eq 0 ]
+    [[ "$stripped_output" == *"batch-firstbatch-second"* ]]
+    [ "$elapsed" -le 2 ]
+}
+
+@test "Batch mode exits non zero when a command fails" {
+    printf 'echo before\nfalse\nnosuchcmd\necho after\n' > batch_script.txt
+    run ./dsh -c -p $SERVER_PORT -b batch_script.txt
+    rm -f batch_script.txt
+
+    [ "$status" -eq 1 ]
+    [[ "$output" == *"before"*"nosuchcmd: command not found"*"after"* ]]
+}
+
+@test "Client --stats reports latency and throughput" {
+    run ./dsh -c -p $SERVER_PORT --stats <<EOF2
+seq 1 1000
+exit
+EOF2
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"1000"* ]]
+    [[ "$output" == *"[stats] seq 1 1000: 3893 bytes, ttfb"* ]]
+    [[ "$output" == *"2 commands"* ]]
+}
+
+@test "posix_spawn launcher handles pipes, redirection and missing commands" {
+    run ./dsh -L spawn <<EOF2
+echo spawned > spawn_out.txt
+cat spawn_out.txt | tr a-z A-Z
+nosuchcommand
+exit
+EOF2
+    rm -f spawn_out.txt
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"SPAWNED"* ]]
+    [[ "$output" == *"nosuchcommand: command not found"* ]]
+}
+
+@test "fork and posix_spawn launchers report failures the same way" {
+    script=$'nosuchcommand\necho x > /nonexistent/dir/f\ncat < /nonexistent\nexit\n'
+    fork_out=$(printf '%s' "$script" | ./dsh -L fork 2>&1)
+    spawn_out=$(printf '%s' "$script" | ./dsh -L spawn 2>&1)
+
+    [ "$fork_out" = "$spawn_out" ]
+    [[ "$spawn_out" == *"nosuchcommand: command not found"* ]]
+    [[ "$spawn_out" == *"open output file"* ]]
+    [[ "$spawn_out" != *"Failed executing command"* ]]
+}
+
+@test "hash built-in remembers and forgets resolved commands" {
+    run ./dsh <<EOF2
+hash -r
+echo one
+echo two
+hash
+hash -r
+hash
+exit
+EOF2
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"hits"* ]]
+    [[ "$output" =~ 2[[:space:]]+/[^[:space:]]*/echo ]]
+    [[ "$output" == *"hash table empty"* ]]
+}
+
+@test "rstats reports per-command metrics and -m dumps them" {
+    rm -f metrics_out.txt
+    ./dsh -s -p 5683 -e -m metrics_out.txt &
+    server_pid=$!
+    wait_for_server 5683
+
+    run ./dsh -c -p 5683 <<EOF2
+echo measured
+seq 1 1000 | sort -n | tail -1
+rstats
+exit
+EOF2
+
+    echo "stop-server" | ./dsh -c -p 5683
+    wait $server_pid
+    dump=$(cat metrics_out.txt)
+    rm -f metrics_out.txt
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"server commands:   2 run, 0 failed"* ]]
+    [[ "$output" == *"client commands:   2 run, 0 failed"* ]]
+    [[ "$output" == *"wall ms:"*"p99"* ]]
+    [[ "$output" == *"max rss:"* ]]
+    [[ "$dump" == *"# dsh server pid $server_pid"* ]]
+    [[ "$dump" == *"wall histogram:"* ]]
+}
+
+@test "Server parses commands longer than its initial arena" {
+    long_arg=$(printf 'x%.0s' $(seq 1 20000))
+
+    run ./dsh -c -p $SERVER_PORT <<EOF2
+echo $long_arg | wc -c
+echo $long_arg$long_arg | wc -c
+echo after-long
+exit
+EOF2
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"20001"* ]]
+    [[ "$output" == *"40001"* ]]
+    [[ "$output" == *"after-long"* ]]
+}
+
+@test "Legacy commands may span or share packets" {
+    ./dsh -s -p 5684 -e &
+    server_pid=$!
+    wait_for_server 5684
+
+    exec 3<>/dev/tcp/127.0.0.1/5684
+    printf 'echo fir' >&3
+    sleep 0.01
+    printf 'st\0echo second\necho third\0exit\0' >&3
+    output=$(timeout 5 cat <&3 | tr -d '\000\004')
+    exec 3>&-
+
+    echo "stop-server" | ./dsh -c -p 5684
+    wait $server_pid
+
+    [[ "$output" == *"first"*"second"*"third"*"Exiting client session."* ]]
+}
+
+@test "A slow client may pause in the middle of a command" {
+    for mode in -e -x; do
+        ./dsh -s -p 5689 $mode &
+        server_pid=$!
+        wait_for_server 5689
+
+        exec 3<>/dev/tcp/127.0.0.1/5689
+        printf 'echo fir' >&3
+        sleep 0.2
+        printf 'st\0exit\0' >&3
+        output=$(timeout 5 cat <&3 | tr -d '\000\004')
+        exec 3>&-
+
+        echo "stop-server" | ./dsh -c -p 5689
+        wait $server_pid
+
+        [[ "$output" == *"first"*"Exiting client session."* ]]
+        [[ "$output" != *"fir"$'\n'* ]]
+    done
+}
+
+@test "Epoll server answers HELLO and keeps the commands sent with it" {
+    ./dsh -s -p 5688 -e 2> server.log &
+    server_pid=$!
+    wait_for_server 5688
+
+    # HELLO frame offering version 1, followed by legacy commands
+    exec 3<>/dev/tcp/127.0.0.1/5688
+    printf '\x04F\x01\x01\0\0\0\0\0\0\0\0\0\0\0\x01\x01echo after-hello\0exit\0' >&3
+    hello_output=$(timeout 5 cat <&3 | tr -d '\000\004')
+    exec 3>&-
+
+    printf 'echo batch-one\necho batch-two\n' > batch_script.txt
+    run ./dsh -c -p 5688 -b batch_script.txt -n 2
+    rm -f batch_script.txt
+
+    echo "stop-server" | ./dsh -c -p 5688
+    wait $server_pid
+    server_log=$(cat server.log)
+    rm -f server.log
+
+    [[ "$hello_output" == *"after-hello"*"Exiting client session."* ]]
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"one command at a time"*"-n is ignored"* ]]
+    [[ "$output" == *"batch-one"*"batch-two"* ]]
+    [[ "$server_log" == *"framed clients run one command at a time"* ]]
+}
+
+@test "Warm helpers run repeated commands" {
+    ./dsh -s -p 5685 -w 2 &
+    server_pid=$!
+    wait_for_server 5685
+
+    run ./dsh -c -p 5685 <<EOF2
+echo warm 1
+echo warm 2 | tr a-z A-Z
+echo warm 3 | tr a-z A-Z
+nosuchcmd
+nosuchcmd
+rstats
+exit
+EOF2
+
+    echo "stop-server" | ./dsh -c -p 5685
+    wait $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"warm 1"*"WARM 2"*"WARM 3"* ]]
+    [[ "$output" == *"nosuchcmd: command not found"*"nosuchcmd: command not found"* ]]
+    [[ "$output" == *"warm helpers:"*"hits"* ]]
+    [[ "$output" != *", 0 hits"* ]]
+}
+
+@test "rsh-bench reports latency percentiles as CSV" {
+    make -s rsh-bench
+    ./dsh -s -p 5686 -x &
+    server_pid=$!
+
+    run ./rsh-bench -p 5686 -c 4 -n 20 --csv -l threaded
+
+    echo "stop-server" | ./dsh -c -p 5686
+    wait $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "${lines[0]}" == "label,proto,conns,commands,failed_conns,"*"p50_ms,p99_ms,p999_ms,max_ms" ]]
+    [[ "${lines[1]}" == "threaded,legacy,4,80,0,"* ]]
+}
+
+@test "stop-server drains running commands and kills them at the deadline" {
+    for mode in -x -e "-f 2"; do
+        ./dsh -s -p 5687 $mode -d 1 > server.log 2>&1 &
+        server_pid=$!
+        wait_for_server 5687
+
+        echo "sleep 30" | ./dsh -c -p 5687 > /dev/null &
+        slow_pid=$!
+        echo 'bash -c "sleep 0.3; echo finished"' | ./dsh -c -p 5687 > short.log &
+        short_pid=$!
+        sleep 0.2
+
+        SECONDS=0
+        echo "stop-server" | ./dsh -c -p 5687
+        wait $server_pid
+        took=$SECONDS
+        wait $slow_pid $short_pid
+
+        run cat server.log short.log
+        rm -f server.log short.log
+
+        [ "$took" -le 4 ]
+        [[ "$output" == *"drained in"*"1 pipeline killed at the 1 s deadline"* ]]
+        [[ "$output" == *"finished"* ]]
+    done
+}
@@ -27,22 +27,25 @@ EOF
     [ "$status" -eq 0 ]
 }
 
-@test "Exceeding maximum allowed pipes" {
+@test "Long pipelines have no stage limit" {
     # Create a long pipeline
     long_pipe="echo sample"
-    for i in {1..18}; do
+    for i in {1..100}; do
         long_pipe="$long_pipe | grep sample"
     done
     
     run "./dsh" <<EOF                
 $long_pipe
+echo a b c d e f g h i j k l m n o p
 EOF
 
     # Strip whitespace from the output
     stripped_output=$(echo "$output" | tr -d '[:space:]')
 
-    # Should contain error about too many commands
-    [[ "$stripped_output" == *"error"* && "$stripped_output" == *"pipe"* ]] 
+    # Every stage and every argument ran
+    [[ "$stripped_output" == *"dsh4>sample"* ]]
+    [[ "$stripped_output" == *"abcdefghijklmnop"* ]]
+    [[ "$stripped_output" != *"error"* ]]
 
     [ "$status" -eq 0 ]
 }
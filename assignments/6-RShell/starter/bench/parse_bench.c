@@ -0,0 +1,165 @@
+/*
+ * parse_bench.c - allocations, time and throughput of the command parser
+ *
+ * Parses a mix of command lines over and over, the recorded lines of the
+ * corpus file given as argument (bench/cmd_corpus.txt in the makefile)
+ * or a few built in ones without it.  They are parsed once the way the local
+ * shell does (build_cmd_list() + free_cmd_list()) and once the way the
+ * rsh server does (build_cmd_list_arena() into a per-connection arena
+ * that is reset between commands).  malloc(), realloc() and strdup() are
+ * wrapped at link time (see the bench-parse target in the makefile) so every
+ * allocation made by dshlib.c is counted.  The first WARMUP commands are
+ * not measured, they are where the arena grows to its steady size.
+ *
+ * Not part of dsh, the makefile only compiles the .c files of starter/.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../dshlib.h"
+
+#define WARMUP      1000
+#define ITERATIONS  500000
+
+static char *builtin_lines[] = {
+    "ls -la",
+    "cat data.txt | grep -v foo | sort -n > out.txt",
+    "echo \"hello   world\" | tr a-z A-Z",
+    "sort < in.txt | uniq -c >> counts.txt",
+};
+
+static char **lines = builtin_lines;
+static int num_lines = sizeof(builtin_lines) / sizeof(builtin_lines[0]);
+static double avg_len;
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *str);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *str) {
+    allocs++;
+    return __real_strdup(str);
+}
+
+/*
+ * load_corpus(path)
+ *
+ *  Replaces the built in lines with the non blank lines of path that do
+ *  not start with #.  Exits if the file cannot be read.
+ */
+static void load_corpus(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t sz = 0;
+    int cap = 0;
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    lines = NULL;
+    num_lines = 0;
+    while (getline(&line, &sz, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (num_lines == cap) {
+            cap = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(char *));
+        }
+        lines[num_lines++] = strdup(line);
+    }
+    free(line);
+    fclose(fp);
+    if (num_lines == 0) {
+        fprintf(stderr, "%s: no command lines\n", path);
+        exit(1);
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * run(arena, count)
+ *
+ *  Parses count command lines, with arena NULL through the malloc()
+ *  parser.  Exits if a line does not parse.
+ */
+static void run(cmd_arena_t *arena, int count) {
+    command_list_t clist;
+    char *line;
+
+    for (int i = 0; i < count; i++) {
+        line = lines[i % num_lines];
+        if (arena != NULL) {
+            cmd_arena_reset(arena);
+        }
+        if (build_cmd_list_arena(line, &clist, arena) != OK) {
+            fprintf(stderr, "parse failed: %s\n", line);
+            exit(1);
+        }
+        free_cmd_list(&clist);
+    }
+}
+
+static void report(const char *name, cmd_arena_t *arena) {
+    unsigned long before;
+    double start;
+
+    run(arena, WARMUP);
+    before = allocs;
+    start = now_ns();
+    run(arena, ITERATIONS);
+    double ns = (now_ns() - start) / ITERATIONS;
+    printf("%-8s %12.2f %10.1f %10.1f\n", name,
+           (double)(allocs - before) / ITERATIONS, ns, avg_len / ns * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    cmd_arena_t arena;
+    size_t bytes = 0;
+
+    if (cmd_arena_init(&arena, 0) != OK) {
+        perror("cmd_arena_init");
+        return 1;
+    }
+
+    if (argc > 1) {
+        load_corpus(argv[1]);
+    }
+    for (int i = 0; i < num_lines; i++) {
+        bytes += strlen(lines[i]);
+    }
+    avg_len = (double)bytes / num_lines;
+
+    printf("%d commands, %d distinct lines, %.1f bytes on average\n",
+           ITERATIONS, num_lines, avg_len);
+    printf("%-8s %12s %10s %10s\n", "parser", "allocs/cmd", "ns/cmd", "MB/s");
+    report("malloc", NULL);
+    report("arena", &arena);
+    printf("arena: %zu bytes, %lu mallocs over its lifetime\n",
+           arena.size, arena.mallocs);
+
+    cmd_arena_free(&arena);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * pipeline_bench.c - parse and launch cost of a long pipeline
+ *
+ * Builds "echo x | cat | cat | ... | cat" with 100 stages (or the number
+ * given as the first argument), then times parsing it with the malloc()
+ * parser and into a command arena, and running it with exec_pipeline()
+ * under both launchers (-L fork and -L spawn).  A run is timed from the
+ * call until the last stage was reaped, the pipeline output goes to
+ * /dev/null.
+ *
+ * Not part of dsh, the makefile only compiles the .c files of starter/.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "../dshlib.h"
+
+#define DEF_STAGES      100
+#define PARSE_RUNS      20000
+#define LAUNCH_RUNS     20
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * make_pipeline(stages)
+ *
+ *  Returns a malloc()ed command line of stages stages.
+ */
+static char *make_pipeline(int stages) {
+    char *line = malloc(8 + stages * 6);
+    int len;
+
+    if (line == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    len = sprintf(line, "echo x");
+    for (int i = 1; i < stages; i++) {
+        len += sprintf(line + len, " | cat");
+    }
+    return line;
+}
+
+static void bench_parse(const char *name, char *line, int stages,
+                        cmd_arena_t *arena) {
+    command_list_t clist;
+    double start = now_ns();
+
+    for (int i = 0; i < PARSE_RUNS; i++) {
+        if (arena != NULL) {
+            cmd_arena_reset(arena);
+        }
+        if (build_cmd_list_arena(line, &clist, arena) != OK ||
+            clist.num != stages) {
+            fprintf(stderr, "parse failed\n");
+            exit(1);
+        }
+        free_cmd_list(&clist);
+    }
+    printf("parse   %-8s %12.1f %12.1f\n", name,
+           (now_ns() - start) / PARSE_RUNS / 1e3,
+           (now_ns() - start) / PARSE_RUNS / stages);
+}
+
+static void bench_launch(const char *launcher, char *line, int stages,
+                         cmd_arena_t *arena) {
+    command_list_t clist;
+    double start;
+    int null_fd = open("/dev/null", O_WRONLY);
+    int saved = dup(STDOUT_FILENO);
+
+    set_launcher(launcher);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    start = now_ns();
+    for (int i = 0; i < LAUNCH_RUNS; i++) {
+        cmd_arena_reset(arena);
+        build_cmd_list_arena(line, &clist, arena);
+        if (exec_pipeline(&clist) != OK) {
+            dup2(saved, STDOUT_FILENO);
+            fprintf(stderr, "pipeline failed\n");
+            exit(1);
+        }
+        free_cmd_list(&clist);
+    }
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null_fd);
+
+    printf("run     %-8s %12.1f %12.1f\n", launcher,
+           (now_ns() - start) / LAUNCH_RUNS / 1e3,
+           (now_ns() - start) / LAUNCH_RUNS / stages);
+}
+
+int main(int argc, char *argv[]) {
+    int stages = (argc > 1) ? atoi(argv[1]) : DEF_STAGES;
+    cmd_arena_t arena;
+    char *line;
+
+    if (stages < 1 || cmd_arena_init(&arena, 0) != OK) {
+        fprintf(stderr, "usage: %s [stages]\n", argv[0]);
+        return 1;
+    }
+    line = make_pipeline(stages);
+
+    printf("%d stage pipeline, %d parses, %d runs per launcher\n",
+           stages, PARSE_RUNS, LAUNCH_RUNS);
+    printf("%-16s %12s %12s\n", "", "us/pipeline", "ns/stage");
+    bench_parse("malloc", line, stages, NULL);
+    bench_parse("arena", line, stages, &arena);
+    bench_launch("fork", line, stages, &arena);
+    bench_launch("spawn", line, stages, &arena);
+    printf("arena: %zu bytes after growing to fit\n", arena.size);
+
+    free(line);
+    cmd_arena_free(&arena);
+    return 0;
+}
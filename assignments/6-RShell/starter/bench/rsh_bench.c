@@ -0,0 +1,475 @@
+/*
+ * rsh_bench.c - load generator and latency benchmark for the rsh server
+ *
+ * Opens N connections to a running server (./dsh -s, in any mode), each
+ * served by its own thread, and has every connection replay a command mix
+ * one command at a time: send it, read the whole response, send the next.
+ * The latency of a command is from sending it to receiving the end of its
+ * response.  At the end the latencies of all connections are sorted and
+ * reported as p50/p99/p99.9, together with commands/s and response bytes/s
+ * over the time from the first command to the last response.
+ *
+ * The mix is the non blank lines of a file (-f) that do not start with #,
+ * or a few built in commands.  Connection i starts at line i of the mix so
+ * concurrent connections do not run the same command in lockstep.
+ *
+ * Commands are sent with the legacy EOF character protocol, or with the
+ * framed protocol with -F.  --csv prints one CSV line (with a header line
+ * unless --no-header), -l sets its first column, so the runs of several
+ * server modes can be collected in one file, see bench/rsh_modes.sh.
+ *
+ * Not part of dsh, the makefile only compiles the .c files of starter/ and
+ * builds this one as the rsh-bench target.
+ */
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+#define DEF_CONNS       8
+#define DEF_COMMANDS    200         //per connection
+#define CONNECT_WAIT_MS 2000        //time the server gets to start listening
+
+#define OPT_CSV         256
+#define OPT_NO_HEADER   257
+
+static char *builtin_mix[] = {
+    "echo hello",
+    "ls",
+    "cat /etc/passwd | wc -l",
+    "grep -c root /etc/passwd",
+};
+
+static char **mix = builtin_mix;
+static int mix_len = sizeof(builtin_mix) / sizeof(builtin_mix[0]);
+
+static struct {
+    char   *ip;
+    int     port;
+    int     conns;
+    int     commands;
+    double  seconds;        //run for this long instead of -n commands
+    int     framed;
+    int     csv;
+    int     header;
+    char   *label;
+} opts = { RDSH_DEF_CLI_CONNECT, RDSH_DEF_PORT, DEF_CONNS, DEF_COMMANDS,
+           0, 0, 0, 1, "rsh" };
+
+typedef struct bench_conn {
+    pthread_t      thread;
+    int            idx;
+    int            sock;
+    double        *lat_us;      //latency of every command
+    int            num;
+    int            cap;
+    unsigned long  bytes;       //response bytes, protocol overhead excluded
+    int            failed;      //the connection broke
+} bench_conn_t;
+
+static pthread_barrier_t start_line;
+
+static double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-i IP] [-p PORT] [-c CONNS] [-n N | -d SECONDS] [-f MIX] [-F] "
+           "[-l LABEL] [--csv [--no-header]]\n", prog);
+    printf("  -i IP         Server address, default %s\n", RDSH_DEF_CLI_CONNECT);
+    printf("  -p PORT       Server port, default %d\n", RDSH_DEF_PORT);
+    printf("  -c CONNS      Concurrent connections, default %d\n", DEF_CONNS);
+    printf("  -n N          Commands per connection, default %d\n", DEF_COMMANDS);
+    printf("  -d SECONDS    Send commands for SECONDS instead of -n\n");
+    printf("  -f MIX        File with one command per line\n");
+    printf("  -F            Use the framed protocol\n");
+    printf("  -l LABEL      First column of the CSV line, default rsh\n");
+    printf("  --csv         Print the results as CSV\n");
+    printf("  --no-header   Leave out the CSV header line\n");
+    exit(1);
+}
+
+/*
+ * load_mix(path)
+ *
+ *  Replaces the built in mix with the non blank lines of path that do
+ *  not start with #.  Exits if the file cannot be read or has no commands.
+ */
+static void load_mix(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t sz = 0;
+    int cap = 0;
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    mix = NULL;
+    mix_len = 0;
+    while (getline(&line, &sz, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (mix_len == cap) {
+            cap = cap ? cap * 2 : 64;
+            mix = realloc(mix, cap * sizeof(char *));
+        }
+        if (mix == NULL || (mix[mix_len++] = strdup(line)) == NULL) {
+            perror("load_mix");
+            exit(1);
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (mix_len == 0) {
+        fprintf(stderr, "%s: no commands\n", path);
+        exit(1);
+    }
+}
+
+/*
+ * bench_connect()
+ *
+ *  Connects to the server, retrying for CONNECT_WAIT_MS so a script can
+ *  start the server and the benchmark without sleeping in between.
+ *
+ *  Returns the socket, or -1.
+ */
+static int bench_connect(void) {
+    struct sockaddr_in addr;
+    double give_up = now_us() + CONNECT_WAIT_MS * 1e3;
+    int one = 1;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    if (inet_pton(AF_INET, opts.ip, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "invalid address %s\n", opts.ip);
+        return -1;
+    }
+
+    while (1) {
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sock;
+        }
+        close(sock);
+        if (errno != ECONNREFUSED || now_us() > give_up) {
+            perror("connect");
+            return -1;
+        }
+        usleep(10000);
+    }
+}
+
+/*
+ * run_legacy(conn, cmd, buff)
+ *
+ *  Sends a command with the EOF character protocol and reads until the
+ *  last byte received is RDSH_EOF_CHAR.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+static int run_legacy(bench_conn_t *conn, const char *cmd, char *buff) {
+    ssize_t io_size;
+
+    if (send(conn->sock, cmd, strlen(cmd) + 1, MSG_NOSIGNAL) == -1) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    while (1) {
+        io_size = recv(conn->sock, buff, RDSH_COMM_BUFF_SZ, 0);
+        if (io_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (io_size <= 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (buff[io_size - 1] == RDSH_EOF_CHAR) {
+            conn->bytes += io_size - 1;
+            return OK;
+        }
+        conn->bytes += io_size;
+    }
+}
+
+/*
+ * run_framed(conn, req_id, cmd, buff)
+ *
+ *  Sends a command in a CMD frame and reads frames until its EXIT frame.
+ *
+ *  Returns OK or a negative ERR_RDSH_ code.
+ */
+static int run_framed(bench_conn_t *conn, uint32_t req_id, const char *cmd, char *buff) {
+    rdsh_frame_hdr_t hdr;
+    int rc;
+
+    if (rdsh_send_cmd(conn->sock, 0, req_id, cmd, 0) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    while (1) {
+        rc = rdsh_recv_frame(conn->sock, &hdr, buff, RDSH_MAX_PAYLOAD);
+        if (rc < 0) {
+            return rc;
+        }
+        if (hdr.type == RDSH_FT_EXIT && hdr.req_id == req_id) {
+            return OK;
+        }
+        if (hdr.type == RDSH_FT_STDOUT || hdr.type == RDSH_FT_STDERR) {
+            conn->bytes += rc;
+        }
+    }
+}
+
+/*
+ * conn_main(arg)
+ *
+ *  Body of the thread of one connection.  The command loop starts when
+ *  every connection is connected, the framed HELLO is sent after that: a
+ *  single threaded server only accepts the next client when the one
+ *  before it left.  The time spent waiting to be served counts towards
+ *  the first command with both protocols.
+ */
+static void *conn_main(void *arg) {
+    bench_conn_t *conn = arg;
+    char *buff = malloc(RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD);
+    double deadline;
+    double t0;
+    int rc = OK;
+
+    pthread_barrier_wait(&start_line);
+    t0 = now_us();
+    if (conn->sock < 0 || buff == NULL) {
+        conn->failed = 1;
+        free(buff);
+        return NULL;
+    }
+
+    if (opts.framed && rdsh_client_hello(conn->sock) < RDSH_PROTO_VERSION) {
+        if (conn->idx == 0) {
+            fprintf(stderr, "server does not speak the framed protocol\n");
+        }
+        conn->failed = 1;
+        free(buff);
+        return NULL;
+    }
+
+    deadline = now_us() + opts.seconds * 1e6;
+    for (int i = 0; opts.seconds > 0 ? now_us() < deadline : i < opts.commands; i++) {
+        const char *cmd = mix[(conn->idx + i) % mix_len];
+
+        if (conn->num == conn->cap) {
+            conn->cap = conn->cap ? conn->cap * 2 : 1024;
+            conn->lat_us = realloc(conn->lat_us, conn->cap * sizeof(double));
+            if (conn->lat_us == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        if (i > 0) {
+            t0 = now_us();
+        }
+        rc = opts.framed ? run_framed(conn, i + 1, cmd, buff)
+                         : run_legacy(conn, cmd, buff);
+        if (rc != OK) {
+            fprintf(stderr, "connection %d: lost after %d commands\n", conn->idx, conn->num);
+            conn->failed = 1;
+            break;
+        }
+        conn->lat_us[conn->num++] = now_us() - t0;
+    }
+
+    close(conn->sock);
+    conn->sock = -1;
+    free(buff);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * percentile(sorted, num, pct)
+ *
+ *  Nearest rank percentile of sorted latencies.
+ */
+static double percentile(double *sorted, int num, double pct) {
+    int rank = (int)(num * pct / 100.0 + 0.999999);
+
+    if (num == 0) {
+        return 0;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank < num ? rank : num) - 1];
+}
+
+static void report(bench_conn_t *conns, double secs) {
+    unsigned long bytes = 0;
+    double sum = 0;
+    double *all;
+    int failed = 0;
+    int num = 0;
+
+    for (int i = 0; i < opts.conns; i++) {
+        num += conns[i].num;
+    }
+    all = malloc((num ? num : 1) * sizeof(double));
+    if (all == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    num = 0;
+    for (int i = 0; i < opts.conns; i++) {
+        memcpy(all + num, conns[i].lat_us, conns[i].num * sizeof(double));
+        num += conns[i].num;
+        bytes += conns[i].bytes;
+        failed += conns[i].failed;
+    }
+    qsort(all, num, sizeof(double), cmp_double);
+    for (int i = 0; i < num; i++) {
+        sum += all[i];
+    }
+
+    if (opts.csv) {
+        if (opts.header) {
+            printf("label,proto,conns,commands,failed_conns,seconds,cmds_per_s,bytes_per_s,"
+                   "avg_ms,p50_ms,p99_ms,p999_ms,max_ms\n");
+        }
+        printf("%s,%s,%d,%d,%d,%.3f,%.1f,%.0f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               opts.label, opts.framed ? "framed" : "legacy", opts.conns, num, failed,
+               secs, num / secs, bytes / secs, num ? sum / num / 1e3 : 0.0,
+               percentile(all, num, 50) / 1e3, percentile(all, num, 99) / 1e3,
+               percentile(all, num, 99.9) / 1e3, num ? all[num - 1] / 1e3 : 0.0);
+    } else {
+        printf("%d connections, %s protocol, %d commands in %.3f s",
+               opts.conns, opts.framed ? "framed" : "legacy", num, secs);
+        if (failed) {
+            printf(", %d connections lost", failed);
+        }
+        printf("\n");
+        printf("  throughput:      %.1f commands/s, %.1f kB/s\n", num / secs, bytes / secs / 1024);
+        printf("  latency ms:      avg %.3f  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+               num ? sum / num / 1e3 : 0.0,
+               percentile(all, num, 50) / 1e3, percentile(all, num, 99) / 1e3,
+               percentile(all, num, 99.9) / 1e3, num ? all[num - 1] / 1e3 : 0.0);
+    }
+    free(all);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_opts[] = {
+        {"csv",       no_argument, NULL, OPT_CSV},
+        {"no-header", no_argument, NULL, OPT_NO_HEADER},
+        {"help",      no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    bench_conn_t *conns;
+    double t_start;
+    double secs;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "i:p:c:n:d:f:Fl:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                opts.ip = optarg;
+                break;
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'c':
+                opts.conns = atoi(optarg);
+                break;
+            case 'n':
+                opts.commands = atoi(optarg);
+                break;
+            case 'd':
+                opts.seconds = atof(optarg);
+                break;
+            case 'f':
+                load_mix(optarg);
+                break;
+            case 'F':
+                opts.framed = 1;
+                break;
+            case 'l':
+                opts.label = optarg;
+                break;
+            case OPT_CSV:
+                opts.csv = 1;
+                break;
+            case OPT_NO_HEADER:
+                opts.header = 0;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (opts.conns <= 0 || opts.port <= 0 || (opts.commands <= 0 && opts.seconds <= 0)) {
+        usage(argv[0]);
+    }
+
+    conns = calloc(opts.conns, sizeof(bench_conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Step 1: Connect everything before the clock starts, the threads
+    //         wait at the barrier until the last one is connected
+    pthread_barrier_init(&start_line, NULL, opts.conns + 1);
+    for (int i = 0; i < opts.conns; i++) {
+        conns[i].idx = i;
+        conns[i].sock = bench_connect();
+        if (pthread_create(&conns[i].thread, NULL, conn_main, &conns[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    // Step 2: Run and time the whole load
+    t_start = now_us();
+    pthread_barrier_wait(&start_line);
+    for (int i = 0; i < opts.conns; i++) {
+        pthread_join(conns[i].thread, NULL);
+        failed += conns[i].failed;
+    }
+    secs = (now_us() - t_start) / 1e6;
+
+    report(conns, secs);
+
+    for (int i = 0; i < opts.conns; i++) {
+        free(conns[i].lat_us);
+    }
+    free(conns);
+    pthread_barrier_destroy(&start_line);
+    return failed ? 1 : 0;
+}
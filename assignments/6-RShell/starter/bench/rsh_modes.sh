@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# rsh_modes.sh - run rsh-bench against every server mode
+#
+# Starts the server in each mode on the same port, runs ./rsh-bench
+# against it and prints one CSV line per mode and protocol, so the
+# modes can be compared on one machine.  The epoll loop only speaks the
+# legacy protocol.  Extra arguments are passed to
+# rsh-bench, e.g. bench/rsh_modes.sh -c 32 -n 100 -f mix.txt
+#
+# usage: bench/rsh_modes.sh [rsh-bench options]
+
+PORT=${RSH_BENCH_PORT:-7791}
+MODES=("single::legacy framed" "threaded:-x:legacy framed" "epoll:-e:legacy"
+       "prefork:-f 4:legacy framed")
+header=""
+
+for entry in "${MODES[@]}"; do
+    IFS=: read -r label flags protos <<< "$entry"
+
+    for proto in $protos; do
+        ./dsh -s -p $PORT $flags > /dev/null 2>&1 &
+        server=$!
+
+        ./rsh-bench -p $PORT -l $label $([ $proto = framed ] && echo -F) \
+            --csv $header "$@"
+        header="--no-header"
+
+        echo stop-server | ./dsh -c -p $PORT > /dev/null 2>&1
+        wait $server
+    done
+done
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# warm_bench.sh - per request latency with and without warm helpers
+#
+# Starts a server with -w 0 and with -w 8, sends it the same commands
+# one at a time from a single client and prints the client's wall time
+# and the wall and launch latencies of the server's rstats report.
+#
+# usage: bench/warm_bench.sh [commands] [port]
+
+COUNT=${1:-1000}
+PORT=${2:-7790}
+CMD="grep -c root /etc/passwd"
+DSH=./dsh
+
+for warm in 0 8; do
+    $DSH -s -p $PORT -w $warm > /dev/null 2>&1 &
+    server=$!
+    sleep 0.3
+
+    start=$(date +%s%N)
+    { for ((i = 0; i < COUNT; i++)); do echo "$CMD"; done; echo rstats; echo exit; } |
+        $DSH -c -p $PORT > /tmp/warm_bench.$$ 2>&1
+    end=$(date +%s%N)
+
+    echo "-w $warm, $COUNT x '$CMD':"
+    awk -v n=$COUNT -v ns=$((end - start)) \
+        'BEGIN { printf "  client:          %.1f us per command\n", ns / n / 1000 }'
+    grep -a -A2 "server commands:" /tmp/warm_bench.$$ | sed 's/^rsh> //'
+    grep -a "warm helpers:" /tmp/warm_bench.$$ | sed 's/^rsh> /  /'
+
+    echo stop-server | $DSH -c -p $PORT > /dev/null 2>&1
+    wait $server
+done
+rm -f /tmp/warm_bench.$$
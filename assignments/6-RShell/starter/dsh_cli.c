@@ -20,8 +20,21 @@ typedef struct cmd_args{
   char  ip[16];   //e.g., 192.168.100.101\0
   int   port;
   int   threaded_server;
+  int   epoll_server;
+  int   prefork_workers;
+  int   pool_threads;
+  int   pool_depth;
+  int   copy_output;
+  char *batch_script;
+  int   batch_sessions;
+  int   client_stats;
+  char *metrics_file;
+  int   warm_helpers;
+  int   drain_timeout;
 }cmd_args_t;
 
+#define OPT_STATS   256     //--stats, has no short form
+
 
 
 //You dont really need to understand this but the C runtime library provides
@@ -30,26 +43,44 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x [-t N] [-q N] | -e | -f N] [-u] [-m FILE] [-w N] [-d SECS] [-b FILE [-n N]] [--stats] [-L fork|spawn] [-h]\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
   printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -t N          Worker threads for threaded mode (only valid with -x)\n");
+  printf("  -q N          Queued clients for threaded mode (only valid with -x)\n");
+  printf("  -e            Enable epoll event-loop mode (only valid with -s)\n");
+  printf("  -f N          Pre-fork N worker processes (only valid with -s)\n");
+  printf("  -u            Copy output through user space, no splice() (only valid with -s)\n");
+  printf("  -m FILE       Append command metrics to FILE on rstats and shutdown (only valid with -s)\n");
+  printf("  -w N          Keep warm helper processes for N programs (only valid with -s)\n");
+  printf("  -d SECS       Seconds running commands get after stop-server, default %d (only valid with -s)\n", RDSH_DRAIN_TIMEOUT);
+  printf("  -b FILE       Run the commands in FILE (- for stdin) pipelined (only valid with -c)\n");
+  printf("  -n N          Spread batch commands over N sessions (only valid with -b)\n");
+  printf("  --stats       Print latency and throughput of every command (only valid with -c)\n");
+  printf("  -L LAUNCHER   Start commands with fork or spawn (posix_spawn), default fork\n");
   printf("  -h            Show this help message\n");
   exit(0);
 }
 
 void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
+  static struct option long_opts[] = {
+      {"stats", no_argument, NULL, OPT_STATS},
+      {"help",  no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}
+  };
   int opt;
   memset(cargs, 0, sizeof(cmd_args_t));
 
   //defaults
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
+  cargs->drain_timeout = RDSH_DRAIN_TIMEOUT;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt_long(argc, argv, "csi:p:xt:q:ef:um:w:d:b:n:L:h", long_opts, NULL)) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
@@ -93,6 +124,103 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
               }
               cargs->threaded_server = 1;
               break;
+          case 't':
+          case 'q':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -%c can only be used with -x\n", opt);
+                  exit(EXIT_FAILURE);
+              }
+              if (atoi(optarg) <= 0) {
+                  fprintf(stderr, "Error: Invalid thread pool size\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (opt == 't') {
+                  cargs->pool_threads = atoi(optarg);
+              } else {
+                  cargs->pool_depth = atoi(optarg);
+              }
+              break;
+          case 'e':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -e can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->epoll_server = 1;
+              break;
+          case 'f':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -f can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->prefork_workers = atoi(optarg);
+              if (cargs->prefork_workers <= 0) {
+                  fprintf(stderr, "Error: Invalid worker count\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'u':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -u can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->copy_output = 1;
+              break;
+          case 'm':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -m can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->metrics_file = optarg;
+              break;
+          case 'w':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -w can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->warm_helpers = atoi(optarg);
+              if (cargs->warm_helpers < 0) {
+                  fprintf(stderr, "Error: Invalid warm helper count\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'd':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -d can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->drain_timeout = atoi(optarg);
+              if (cargs->drain_timeout < 0) {
+                  fprintf(stderr, "Error: Invalid drain timeout\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'b':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -b can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->batch_script = optarg;
+              break;
+          case 'n':
+              cargs->batch_sessions = atoi(optarg);
+              if (cargs->batch_sessions <= 0 || cargs->batch_sessions > RDSH_MAX_SESSIONS) {
+                  fprintf(stderr, "Error: -n must be between 1 and %d\n", RDSH_MAX_SESSIONS);
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'L':
+              if (set_launcher(optarg) != OK) {
+                  fprintf(stderr, "Error: -L must be fork or spawn\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case OPT_STATS:
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: --stats can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->client_stats = 1;
+              break;
           case 'h':
               print_usage(argv[0]);
               break;
@@ -105,6 +233,22 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       fprintf(stderr, "Error: -x can only be used with -s\n");
       exit(EXIT_FAILURE);
   }
+
+  if (cargs->batch_sessions && cargs->batch_script == NULL) {
+      fprintf(stderr, "Error: -n can only be used with -b\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if ((cargs->pool_threads || cargs->pool_depth) && !cargs->threaded_server) {
+      fprintf(stderr, "Error: -t and -q can only be used with -x\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if ((cargs->threaded_server != 0) + (cargs->epoll_server != 0) +
+      (cargs->prefork_workers != 0) > 1) {
+      fprintf(stderr, "Error: Only one of -x, -e and -f can be used\n");
+      exit(EXIT_FAILURE);
+  }
 }
 
 
@@ -118,6 +262,7 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
 int main(int argc, char *argv[]){
   cmd_args_t cargs;
   int rc;
+  int svr_mode;
 
   memset(&cargs, 0, sizeof(cmd_args_t));
   parse_args(argc, argv, &cargs);
@@ -129,16 +274,36 @@ int main(int argc, char *argv[]){
       break;
     case MODE_SCLI:
       printf("socket client mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
+      set_client_stats(cargs.client_stats);
+      if (cargs.batch_script != NULL) {
+        rc = exec_remote_cmd_batch(cargs.ip, cargs.port, cargs.batch_script,
+                                   cargs.batch_sessions ? cargs.batch_sessions : 1);
+      } else {
+        rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
+      }
       break;
     case MODE_SSVR:
       printf("socket server mode:  addr:%s:%d\n", cargs.ip, cargs.port);
       if (cargs.threaded_server){
         printf("-> Multi-Threaded Mode\n");
+        svr_mode = RDSH_SVR_THREADED;
+        set_thread_pool(cargs.pool_threads, cargs.pool_depth);
+      } else if (cargs.epoll_server){
+        printf("-> Epoll Event-Loop Mode\n");
+        svr_mode = RDSH_SVR_EPOLL;
+      } else if (cargs.prefork_workers){
+        printf("-> Pre-Fork Mode\n");
+        svr_mode = RDSH_SVR_PREFORK;
+        set_prefork_workers(cargs.prefork_workers);
       } else {
         printf("-> Single-Threaded Mode\n");
+        svr_mode = RDSH_SVR_SINGLE;
       }
-      rc = start_server(cargs.ip, cargs.port, cargs.threaded_server);
+      set_splice_output(!cargs.copy_output);
+      set_metrics_file(cargs.metrics_file);
+      set_coproc_pool(cargs.warm_helpers);
+      set_drain_timeout(cargs.drain_timeout);
+      rc = start_server(cargs.ip, cargs.port, svr_mode);
       break;
     default:
       printf("error unknown mode\n");
@@ -146,4 +311,7 @@ int main(int argc, char *argv[]){
   }
 
   printf("cmd loop returned %d\n", rc);
+
+  //a batch script fails when one of its commands did
+  return (rc == ERR_RDSH_CMD_EXEC) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,22 +7,30 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "dshlib.h"
+
+extern char **environ;
 int free_cmd_list(command_list_t *cmd_lst);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
 
-// Function to allocate memory for command buffer
+// Function to allocate memory for command buffer, the command line
+// buffer and argv are grown by build_cmd_buff() to fit the command
 int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
-    cmd_buff->_cmd_buffer = malloc(SH_CMD_MAX * sizeof(char));
-    if (cmd_buff->_cmd_buffer == NULL) {
-        return ERR_MEMORY;
-    }
-
+    cmd_buff->_cmd_buffer = NULL;
     cmd_buff->argc = 0;
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
-        cmd_buff->argv[i] = NULL;
-    }
+    cmd_buff->argv_cap = 0;
+    cmd_buff->argv = NULL;
     cmd_buff->input_file = NULL;
     cmd_buff->output_file = NULL;
     cmd_buff->append_output = false;
@@ -36,106 +45,403 @@ int free_cmd_buff(cmd_buff_t *cmd_buff) {
     }
 
     cmd_buff->argc = 0;
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
-        cmd_buff->argv[i] = NULL;
-    }
-    if (cmd_buff->input_file) {
-        free(cmd_buff->input_file);
-        cmd_buff->input_file = NULL;
-    }
-    if (cmd_buff->output_file) {
-        free(cmd_buff->output_file);
-        cmd_buff->output_file = NULL;
-    }
+    free(cmd_buff->argv);
+    cmd_buff->argv = NULL;
+    cmd_buff->argv_cap = 0;
+    cmd_buff->input_file = NULL;
+    cmd_buff->output_file = NULL;
     cmd_buff->append_output = false;
     return OK;
 }
 
-// Clear the command buffer
+// Clear the command buffer, argv keeps its slots for the next command
 int clear_cmd_buff(cmd_buff_t *cmd_buff) {
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
-        cmd_buff->argv[i] = NULL;
+    cmd_buff->argc = 0;
+    if (cmd_buff->argv != NULL) {
+        cmd_buff->argv[0] = NULL;
+    }
+    cmd_buff->input_file = NULL;
+    cmd_buff->output_file = NULL;
+    cmd_buff->append_output = false;
+    return OK;
+}
+
+/**************   COMMAND ARENA  ***************/
+
+/*
+ * The remote shell parses every request into memory taken from a
+ * per-connection bump arena instead of malloc()ing and freeing the
+ * copies of the command line and the redirection file names each time.
+ * Everything parsed for one request is released at once by
+ * cmd_arena_reset(), which only rewinds the offset.  A request that does
+ * not fit spills into malloc()ed overflow blocks, and the next reset
+ * grows the arena so it fits from then on, so a connection settles at
+ * zero allocations per command.
+ */
+typedef struct cmd_arena_spill {
+    struct cmd_arena_spill *next;
+    char   data[];
+} cmd_arena_spill_t;
+
+/*
+ * cmd_arena_init(arena, size)
+ *      arena:  the arena to set up
+ *      size:   initial capacity in bytes, CMD_ARENA_SZ if 0
+ *
+ *  Returns OK, or ERR_MEMORY if the block could not be allocated.
+ */
+int cmd_arena_init(cmd_arena_t *arena, size_t size) {
+    memset(arena, 0, sizeof(cmd_arena_t));
+    arena->size = size ? size : CMD_ARENA_SZ;
+    arena->base = malloc(arena->size);
+    if (arena->base == NULL) {
+        return ERR_MEMORY;
     }
-    if (cmd_buff->input_file) {
-        free(cmd_buff->input_file);
-        cmd_buff->input_file = NULL;
+    arena->mallocs = 1;
+    return OK;
+}
+
+/*
+ * cmd_arena_alloc(arena, len)
+ *
+ *  Returns len bytes aligned for any pointer or integer type, valid
+ *  until the next cmd_arena_reset(), or NULL if memory ran out.
+ */
+void *cmd_arena_alloc(cmd_arena_t *arena, size_t len) {
+    cmd_arena_spill_t *spill;
+    void *mem;
+
+    len = (len + CMD_ARENA_ALIGN - 1) & ~(size_t)(CMD_ARENA_ALIGN - 1);
+    if (arena->used + len <= arena->size) {
+        mem = arena->base + arena->used;
+        arena->used += len;
+        return mem;
     }
-    if (cmd_buff->output_file) {
-        free(cmd_buff->output_file);
-        cmd_buff->output_file = NULL;
+
+    spill = malloc(sizeof(cmd_arena_spill_t) + len);
+    if (spill == NULL) {
+        return NULL;
     }
-    cmd_buff->append_output = false;
+    arena->mallocs++;
+    spill->next = arena->spill;
+    arena->spill = spill;
+    arena->spilled += len;
+    return spill->data;
+}
+
+/*
+ * cmd_arena_strdup(arena, str)
+ *
+ *  strdup() into the arena.  Returns NULL if memory ran out.
+ */
+char *cmd_arena_strdup(cmd_arena_t *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = cmd_arena_alloc(arena, len);
+
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/*
+ * cmd_arena_reset(arena)
+ *
+ *  Releases everything allocated since the last reset.  When the last
+ *  request spilled, the overflow blocks are freed and the arena is grown
+ *  to twice what that request needed, if that fails the old block is
+ *  kept.
+ */
+void cmd_arena_reset(cmd_arena_t *arena) {
+    cmd_arena_spill_t *spill;
+    size_t want;
+    char *base;
+
+    if (arena->spill != NULL) {
+        want = 2 * (arena->used + arena->spilled);
+        while (arena->spill != NULL) {
+            spill = arena->spill;
+            arena->spill = spill->next;
+            free(spill);
+        }
+        base = malloc(want);
+        if (base != NULL) {
+            arena->mallocs++;
+            free(arena->base);
+            arena->base = base;
+            arena->size = want;
+        }
+        arena->spilled = 0;
+    }
+    arena->used = 0;
+}
+
+/*
+ * cmd_arena_free(arena)
+ *
+ *  Frees the arena and everything allocated from it.
+ */
+void cmd_arena_free(cmd_arena_t *arena) {
+    cmd_arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+/*
+ * cmd_grow(arena, old, used, size)
+ *
+ *  Grows a vector of a parsed command to size bytes, keeping its first
+ *  used bytes.  From the arena the vector is copied to a new block, the
+ *  old one is released with everything else at the next reset, without
+ *  one it is realloc()ed.
+ *
+ *  Returns the vector, or NULL if memory ran out and old is unchanged.
+ */
+static void *cmd_grow(cmd_arena_t *arena, void *old, size_t used, size_t size) {
+    void *grown;
+
+    if (arena == NULL) {
+        return realloc(old, size);
+    }
+    grown = cmd_arena_alloc(arena, size);
+    if (grown != NULL && used > 0) {
+        memcpy(grown, old, used);
+    }
+    return grown;
+}
+
+/*
+ * argv_reserve(cmd_buff, arena, slots)
+ *
+ *  Makes argv at least slots long, doubling it as often as needed.
+ *
+ *  Returns OK or ERR_MEMORY.
+ */
+static int argv_reserve(cmd_buff_t *cmd_buff, cmd_arena_t *arena, int slots) {
+    char **grown;
+    int cap = cmd_buff->argv_cap ? cmd_buff->argv_cap : CMD_ARGV_INIT;
+
+    if (slots <= cmd_buff->argv_cap) {
+        return OK;
+    }
+    while (cap < slots) {
+        cap *= 2;
+    }
+    grown = cmd_grow(arena, cmd_buff->argv,
+                     cmd_buff->argc * sizeof(char *), cap * sizeof(char *));
+    if (grown == NULL) {
+        return ERR_MEMORY;
+    }
+    cmd_buff->argv = grown;
+    cmd_buff->argv_cap = cap;
     return OK;
 }
 
-// Function to build the command buffer
-int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-    while (isspace(*cmd_line)) {
-        cmd_line++;
+/*
+ * argv_push(cmd_buff, arena, arg)
+ *
+ *  Appends arg to argv, which stays NULL terminated.
+ *
+ *  Returns OK or ERR_MEMORY.
+ */
+static int argv_push(cmd_buff_t *cmd_buff, cmd_arena_t *arena, char *arg) {
+    if (argv_reserve(cmd_buff, arena, cmd_buff->argc + 2) != OK) {
+        return ERR_MEMORY;
     }
+    cmd_buff->argv[cmd_buff->argc++] = arg;
+    cmd_buff->argv[cmd_buff->argc] = NULL;
+    return OK;
+}
 
-    if (*cmd_line == '\0') {
-        return WARN_NO_CMDS;
+/**************   COMMAND LEXER  ***************/
+
+/*
+ * A command line is lexed in one pass over a single copy of it.  Every
+ * byte is classified through cmd_char_class[], words are cut in place by
+ * writing a '\0' over the byte that ends them, and argv and the
+ * redirection targets point straight into the copy, nothing else is
+ * copied.  On long lines runs of ordinary characters are skipped 16
+ * bytes at a time with SSE2 where the CPU has it.
+ */
+enum {
+    CC_WORD,        //part of a word, must be 0
+    CC_SPACE,       //isspace() in the C locale
+    CC_QUOTE,
+    CC_PIPE,
+    CC_IN,
+    CC_OUT,
+    CC_END,         //the '\0' ending the line
+};
+
+static const unsigned char cmd_char_class[256] = {
+    ['\0'] = CC_END,
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' ']  = CC_SPACE,
+    ['"']  = CC_QUOTE,
+    [PIPE_CHAR] = CC_PIPE,
+    ['<']  = CC_IN,
+    ['>']  = CC_OUT,
+};
+
+#define CMD_CLASS(p)    (cmd_char_class[(unsigned char)*(p)])
+
+/*
+ * cmd_scan(p, end)
+ *      end:  the '\0' ending the line, never read past
+ *
+ *  Returns the first byte from p on that is not part of a word.  With
+ *  SSE2, while at least CMD_LEX_VEC_MIN bytes are left, 16 bytes are
+ *  compared at once against the special characters and everything up
+ *  to '\r', the few control characters that are not spaces are sorted
+ *  out by the table.  Short lines only use the table, loading vectors
+ *  does not pay off for words of a few bytes.
+ */
+static char *cmd_scan(char *p, char *end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i pipe  = _mm_set1_epi8(PIPE_CHAR);
+    const __m128i in    = _mm_set1_epi8('<');
+    const __m128i out   = _mm_set1_epi8('>');
+    const __m128i ctrl  = _mm_set1_epi8('\r');
+
+    while (end - p >= CMD_LEX_VEC_MIN) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, quote)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, pipe),
+                _mm_or_si128(_mm_cmpeq_epi8(v, in), _mm_cmpeq_epi8(v, out))));
+        //unsigned v <= '\r'
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+
+        int mask = _mm_movemask_epi8(hit);
+        if (mask == 0) {
+            p += 16;
+            continue;
+        }
+        p += __builtin_ctz(mask);
+        if (CMD_CLASS(p) != CC_WORD) {
+            return p;
+        }
+        p++;
+    }
+#else
+    (void)end;
+#endif
+    while (CMD_CLASS(p) == CC_WORD) {
+        p++;
     }
+    return p;
+}
 
-    strcpy(cmd_buff->_cmd_buffer, cmd_line);
-    cmd_buff->argc = 0;
+/*
+ * lex_quoted(p, end)
+ *      p:  first byte after the opening quote
+ *
+ *  Ends the quoted word at its closing quote, an unterminated quote runs
+ *  to the end of the line.
+ *
+ *  Returns where lexing goes on.
+ */
+static char *lex_quoted(char *p, char *end) {
+    char *close = memchr(p, '"', end - p);
+
+    if (close == NULL) {
+        return end;
+    }
+    *close = '\0';
+    return close + 1;
+}
 
-    char *token = cmd_buff->_cmd_buffer;
-    bool in_quotes = false;
-    char *start = token;
+/*
+ * lex_stage(pos, end, cmd, arena)
+ *      pos:    start of the stage, moved past the | that ends it or to
+ *              the end of the line
+ *      end:    the '\0' ending the line
+ *      cmd:    receives argv and the redirections, argv grows from the
+ *              arena, or with realloc() when it is NULL
+ *
+ *  Lexes one stage of a pipeline.  Words are split at spaces, a quoted
+ *  string is one word, and < file, > file and >> file set the
+ *  redirections, the file name may be quoted.  A quote, | or redirection
+ *  also ends the word in front of it.
+ *
+ *  Returns CC_PIPE or CC_END for what ended the stage, or ERR_MEMORY.
+ */
+static int lex_stage(char **pos, char *end, cmd_buff_t *cmd, cmd_arena_t *arena) {
+    char *p = *pos;
+    char *word;
+    int cls;
+
+    cmd->argc = 0;
+    if (argv_reserve(cmd, arena, 1) != OK) {
+        return ERR_MEMORY;
+    }
+    cmd->argv[0] = NULL;
 
-    while (*token != '\0' && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        if (*token == '"') {
-            if (!in_quotes) {
-                start = token + 1;
-                in_quotes = true;
-            } else {
-                *token = '\0';
-                cmd_buff->argv[cmd_buff->argc++] = start;
-                in_quotes = false;
-                start = token + 1;
+    while (1) {
+        word = p;
+        p = cmd_scan(p, end);
+        if (p > word && argv_push(cmd, arena, word) != OK) {
+            return ERR_MEMORY;
+        }
+
+        cls = CMD_CLASS(p);
+        if (cls == CC_END || cls == CC_PIPE) {
+            *p = '\0';
+            *pos = (cls == CC_PIPE) ? p + 1 : p;
+            return cls;
+        }
+        *p++ = '\0';
+
+        if (cls == CC_QUOTE) {
+            word = p;
+            p = lex_quoted(p, end);
+            if (argv_push(cmd, arena, word) != OK) {
+                return ERR_MEMORY;
             }
-        } else if (!in_quotes && isspace(*token)) {
-            if (start != token) {
-                *token = '\0';
-                cmd_buff->argv[cmd_buff->argc++] = start;
+        } else if (cls == CC_IN || cls == CC_OUT) {
+            char **file = (cls == CC_IN) ? &cmd->input_file : &cmd->output_file;
+
+            if (cls == CC_OUT) {
+                cmd->append_output = (*p == '>');
+                p += cmd->append_output;
+            }
+            while (CMD_CLASS(p) == CC_SPACE) {
+                p++;
             }
-            start = token + 1;
-        } else if (!in_quotes && *token == '<') {
-            *token = '\0';
-            cmd_buff->argv[cmd_buff->argc++] = start;
-            start = token + 1;
-            while (isspace(*start)) start++;
-            char *file_start = start;
-            while (!isspace(*start) && *start != '\0') start++;
-            *start = '\0';
-            cmd_buff->input_file = strdup(file_start);
-            start++;
-        } else if (!in_quotes && *token == '>') {
-            *token = '\0';
-            cmd_buff->argv[cmd_buff->argc++] = start;
-            start = token + 1;
-            if (*start == '>') {
-                cmd_buff->append_output = true;
-                start++;
+            if (CMD_CLASS(p) == CC_QUOTE) {
+                *file = p + 1;
+                p = lex_quoted(p + 1, end);
+            } else {
+                //the byte ending the name is cut on the next round
+                *file = p;
+                p = cmd_scan(p, end);
             }
-            while (isspace(*start)) start++;
-            char *file_start = start;
-            while (!isspace(*start) && *start != '\0') start++;
-            *start = '\0';
-            cmd_buff->output_file = strdup(file_start);
-            start++;
         }
-        token++;
     }
+}
 
-    if (start < token && *start != '\0' && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        cmd_buff->argv[cmd_buff->argc++] = start;
+// Function to build the command buffer, a | ends the command
+int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+    size_t len = strlen(cmd_line);
+    char *line;
+    int rc;
+
+    // the buffer is reused between commands, drop the last redirections
+    clear_cmd_buff(cmd_buff);
+    line = realloc(cmd_buff->_cmd_buffer, len + 1);
+    if (line == NULL) {
+        return ERR_MEMORY;
     }
+    cmd_buff->_cmd_buffer = memcpy(line, cmd_line, len + 1);
 
-    cmd_buff->argv[cmd_buff->argc] = NULL;
-    return OK;
+    rc = lex_stage(&line, line + len, cmd_buff, NULL);
+    if (rc < 0) {
+        return rc;
+    }
+    return (cmd_buff->argc == 0) ? WARN_NO_CMDS : OK;
 }
 
 // Function to match built-in commands like "exit" and "cd"
@@ -144,6 +450,8 @@ Built_In_Cmds match_command(const char *input) {
         return BI_CMD_EXIT;
     } else if (strcmp(input, "cd") == 0) {
         return BI_CMD_CD;
+    } else if (strcmp(input, HASH_CMD) == 0) {
+        return BI_CMD_HASH;
     }
     return BI_NOT_BI;
 }
@@ -167,64 +475,565 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
             }
             return BI_EXECUTED;
 
+        case BI_CMD_HASH: {
+            char out[PATH_HASH_OUT_SZ];
+            path_hash_cmd(cmd, out, sizeof(out));
+            printf("%s", out);
+            return BI_EXECUTED;
+        }
+
         default:
             return BI_NOT_BI;
     }
 }
 
-// Function to execute non-built-in commands
-int exec_cmd(cmd_buff_t *cmd) {
-    pid_t pid = fork();
+/**************   PATH LOOKUP CACHE  ***************/
+
+/*
+ * execvp() walks $PATH for every command, paying one failed execve() per
+ * directory in front of the one that holds the program.  Resolved paths
+ * are remembered here by command name, like the hash built-in of bash.
+ * The whole table is dropped when PATH changes, or when a PATH directory
+ * was modified since it was filled, since a program added to an earlier
+ * directory must shadow the remembered one.  Directories are checked at
+ * most every PATH_HASH_RECHECK_MS, and a remembered program that is gone
+ * makes the launchers fall back to a normal PATH search.  One table is
+ * shared by every thread of the server.
+ */
+typedef struct path_ent {
+    char            *name;
+    char            *path;
+    unsigned long    hits;
+    struct path_ent *next;
+} path_ent_t;
+
+typedef struct path_hash {
+    pthread_mutex_t  lock;
+    path_ent_t      *buckets[PATH_HASH_BUCKETS];
+    int              entries;
+    char            *path_env;      //PATH the table was filled for
+    int              ndirs;
+    char           **dirs;
+    struct timespec *mtimes;        //of dirs when the table was started
+    long long        checked_ms;
+} path_hash_t;
+
+static path_hash_t path_hash = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static long long path_hash_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-    if (pid < 0) {
-        perror("fork");
-        fprintf(stderr, "Failed to create process for command '%s'\n", cmd->argv[0]);
-        return ERR_EXEC_CMD;
+static unsigned path_hash_key(const char *name) {
+    unsigned key = 2166136261u;     //FNV-1a
+
+    while (*name) {
+        key = (key ^ (unsigned char)*name++) * 16777619u;
+    }
+    return key % PATH_HASH_BUCKETS;
+}
+
+/*
+ * path_hash_clear_locked()
+ *
+ *  Forgets every entry and the PATH they were resolved against.
+ */
+static void path_hash_clear_locked(void) {
+    path_ent_t *ent;
+
+    for (int i = 0; i < PATH_HASH_BUCKETS; i++) {
+        while ((ent = path_hash.buckets[i]) != NULL) {
+            path_hash.buckets[i] = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+        }
+    }
+    for (int i = 0; i < path_hash.ndirs; i++) {
+        free(path_hash.dirs[i]);
+    }
+    free(path_hash.dirs);
+    free(path_hash.mtimes);
+    free(path_hash.path_env);
+    path_hash.dirs = NULL;
+    path_hash.mtimes = NULL;
+    path_hash.path_env = NULL;
+    path_hash.ndirs = 0;
+    path_hash.entries = 0;
+}
+
+/*
+ * path_hash_start_locked(env)
+ *
+ *  Starts an empty table for PATH env, recording the modification time
+ *  of every directory in it.  An empty PATH element means the current
+ *  directory, same as execvp().
+ */
+static void path_hash_start_locked(const char *env) {
+    struct stat sb;
+    const char *dir = env;
+    const char *end;
+    int n = 1;
+
+    path_hash_clear_locked();
+    for (const char *c = env; *c; c++) {
+        n += (*c == ':');
+    }
+    path_hash.path_env = strdup(env);
+    path_hash.dirs = calloc(n, sizeof(char *));
+    path_hash.mtimes = calloc(n, sizeof(struct timespec));
+    if (!path_hash.path_env || !path_hash.dirs || !path_hash.mtimes) {
+        path_hash_clear_locked();
+        return;
     }
 
-    if (pid == 0) {
-        // Check if the input and output files are the same
-        if (cmd->input_file && cmd->output_file && strcmp(cmd->input_file, cmd->output_file) == 0) {
-            fprintf(stderr, "Cannot redirect input and output to the same file: %s\n", cmd->input_file);
-            exit(1);
+    for (int i = 0; i < n; i++) {
+        end = strchr(dir, ':');
+        if (end == NULL) {
+            end = dir + strlen(dir);
         }
+        path_hash.dirs[i] = (end == dir) ? strdup(".") : strndup(dir, end - dir);
+        if (path_hash.dirs[i] == NULL) {
+            break;
+        }
+        path_hash.ndirs++;
+        if (stat(path_hash.dirs[i], &sb) == 0) {
+            path_hash.mtimes[i] = sb.st_mtim;
+        }
+        dir = end + 1;
+    }
+    path_hash.checked_ms = path_hash_now_ms();
+}
 
-        // Handle input redirection
-        if (cmd->input_file) {
-            int fd_in = open(cmd->input_file, O_RDONLY);
-            if (fd_in < 0) {
-                perror("open input file");
-                exit(1);
+/*
+ * path_hash_stale_locked()
+ *
+ *  Returns 1 when a PATH directory changed since the table was started.
+ */
+static int path_hash_stale_locked(void) {
+    struct timespec zero = { 0, 0 };
+    struct stat sb;
+    long long now = path_hash_now_ms();
+
+    if (now - path_hash.checked_ms < PATH_HASH_RECHECK_MS) {
+        return 0;
+    }
+    path_hash.checked_ms = now;
+
+    for (int i = 0; i < path_hash.ndirs; i++) {
+        if (stat(path_hash.dirs[i], &sb) != 0) {
+            sb.st_mtim = zero;
+        }
+        if (sb.st_mtim.tv_sec != path_hash.mtimes[i].tv_sec ||
+            sb.st_mtim.tv_nsec != path_hash.mtimes[i].tv_nsec) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * path_hash_find(name, path, len, count)
+ *      name:   command name without a '/'
+ *      path:   receives the full path of the program
+ *      count:  counts the lookup as a use in the hits column
+ *
+ *  Returns OK, or ERR_EXEC_CMD when no PATH directory has the program.
+ *  Programs found through a relative PATH directory are not remembered,
+ *  their full path depends on the working directory.
+ */
+static int path_hash_find(const char *name, char *path, size_t len, int count) {
+    const char *env = getenv("PATH");
+    unsigned key = path_hash_key(name);
+    struct stat sb;
+    path_ent_t *ent;
+    int rc = ERR_EXEC_CMD;
+
+    if (env == NULL) {
+        env = PATH_HASH_DEF_PATH;
+    }
+
+    pthread_mutex_lock(&path_hash.lock);
+
+    if (path_hash.path_env == NULL || strcmp(env, path_hash.path_env) != 0 ||
+        path_hash_stale_locked()) {
+        path_hash_start_locked(env);
+    }
+
+    for (ent = path_hash.buckets[key]; ent != NULL; ent = ent->next) {
+        if (strcmp(ent->name, name) == 0) {
+            ent->hits += count;
+            snprintf(path, len, "%s", ent->path);
+            pthread_mutex_unlock(&path_hash.lock);
+            return OK;
+        }
+    }
+
+    for (int i = 0; i < path_hash.ndirs; i++) {
+        if ((size_t)snprintf(path, len, "%s/%s", path_hash.dirs[i], name) >= len) {
+            continue;
+        }
+        if (stat(path, &sb) != 0 || !S_ISREG(sb.st_mode) || access(path, X_OK) != 0) {
+            continue;
+        }
+        rc = OK;
+        if (path_hash.dirs[i][0] != '/' || path_hash.entries >= PATH_HASH_MAX_ENTRIES) {
+            break;
+        }
+        ent = malloc(sizeof(path_ent_t));
+        if (ent != NULL) {
+            ent->name = strdup(name);
+            ent->path = strdup(path);
+            ent->hits = count;
+            if (ent->name == NULL || ent->path == NULL) {
+                free(ent->name);
+                free(ent->path);
+                free(ent);
+                break;
             }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
+            ent->next = path_hash.buckets[key];
+            path_hash.buckets[key] = ent;
+            path_hash.entries++;
         }
+        break;
+    }
 
-        // Handle output redirection
-        if (cmd->output_file) {
-            int fd_out;
-            if (cmd->append_output) {
-                fd_out = open(cmd->output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            } else {
-                fd_out = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pthread_mutex_unlock(&path_hash.lock);
+    return rc;
+}
+
+/*
+ * path_hash_lookup(name, path, len)
+ *
+ *  Resolves a command name to the program execvp() would run.
+ *
+ *  Returns OK, or ERR_EXEC_CMD if the name is not in any PATH directory.
+ */
+int path_hash_lookup(const char *name, char *path, size_t len) {
+    return path_hash_find(name, path, len, 1);
+}
+
+/*
+ * path_hash_forget(name)
+ *
+ *  Drops one entry, used when the remembered program could not be run.
+ */
+void path_hash_forget(const char *name) {
+    path_ent_t **link;
+    path_ent_t *ent;
+
+    pthread_mutex_lock(&path_hash.lock);
+    for (link = &path_hash.buckets[path_hash_key(name)]; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            ent = *link;
+            *link = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+            path_hash.entries--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&path_hash.lock);
+}
+
+void path_hash_reset(void) {
+    pthread_mutex_lock(&path_hash.lock);
+    path_hash_clear_locked();
+    pthread_mutex_unlock(&path_hash.lock);
+}
+
+/*
+ * path_hash_cmd(cmd, out, len)
+ *      cmd:  the parsed `hash` command
+ *      out:  receives what the command prints
+ *
+ *  The hash built-in, shared by dsh and the rsh server:
+ *
+ *      hash            lists the remembered programs and their hits
+ *      hash -r         forgets every program
+ *      hash NAME...    looks the names up and remembers them
+ *
+ *  Returns OK, or ERR_EXEC_CMD if a NAME was not found.
+ */
+int path_hash_cmd(cmd_buff_t *cmd, char *out, int len) {
+    char path[PATH_MAX];
+    path_ent_t *ent;
+    int used = 0;
+    int rc = OK;
+
+    out[0] = '\0';
+
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-r") == 0) {
+        path_hash_reset();
+        return OK;
+    }
+
+    if (cmd->argc > 1) {
+        for (int i = 1; i < cmd->argc && used < len; i++) {
+            if (strchr(cmd->argv[i], '/') != NULL) {
+                continue;
             }
-            if (fd_out < 0) {
-                perror("open output file");
-                exit(1);
+            if (path_hash_find(cmd->argv[i], path, sizeof(path), 0) != OK) {
+                used += snprintf(out + used, len - used, "hash: %s: not found\n",
+                                 cmd->argv[i]);
+                rc = ERR_EXEC_CMD;
             }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
         }
+        return rc;
+    }
 
-        // Execute the command
-        execvp(cmd->argv[0], cmd->argv);
-        perror("execvp");
-        exit(1);
+    pthread_mutex_lock(&path_hash.lock);
+    if (path_hash.entries == 0) {
+        snprintf(out, len, "hash: hash table empty\n");
     } else {
-        int status;
-        waitpid(pid, &status, 0);
-        return OK;
+        used = snprintf(out, len, "hits\tcommand\n");
+        for (int i = 0; i < PATH_HASH_BUCKETS && used < len; i++) {
+            for (ent = path_hash.buckets[i]; ent != NULL && used < len; ent = ent->next) {
+                used += snprintf(out + used, len - used, "%4lu\t%s\n",
+                                 ent->hits, ent->path);
+            }
+        }
     }
+    pthread_mutex_unlock(&path_hash.lock);
+    return rc;
+}
+
+/**************   PROCESS LAUNCHERS  ***************/
+
+/*
+ * Every command is started through launch_stage().  LAUNCH_FORK is the
+ * classic fork() + dup2() + execvp().  LAUNCH_SPAWN uses posix_spawnp()
+ * with file actions for the pipe ends and redirections, which glibc runs
+ * with clone(CLONE_VM|CLONE_VFORK) so the parent's page tables are never
+ * copied.  That matters for a server with a large resident set.
+ */
+static int launcher = LAUNCH_FORK;
+
+/*
+ * set_launcher(name)
+ *      name:  "fork" or "spawn"
+ *
+ *  Returns OK, or ERR_CMD_ARGS_BAD for an unknown launcher.
+ */
+int set_launcher(const char *name) {
+    if (strcmp(name, "fork") == 0) {
+        launcher = LAUNCH_FORK;
+    } else if (strcmp(name, "spawn") == 0) {
+        launcher = LAUNCH_SPAWN;
+    } else {
+        return ERR_CMD_ARGS_BAD;
+    }
+    return OK;
+}
+
+int get_launcher(void) {
+    return launcher;
+}
+
+/*
+ * launch_fork(cmd, file, in_fd, out_fd, err_fd)
+ *
+ *  fork() version of launch_stage().
+ */
+static pid_t launch_fork(cmd_buff_t *cmd, const char *file, int in_fd,
+                         int out_fd, int err_fd) {
+    sigset_t no_signals;
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("fork");
+        }
+        return pid;
+    }
+
+    // Server modes may block signals, commands start with none blocked
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    if (err_fd >= 0 && err_fd != STDERR_FILENO) {
+        dup2(err_fd, STDERR_FILENO);
+    }
+
+    if (cmd->input_file) {
+        fd = open(cmd->input_file, O_RDONLY);
+        if (fd < 0) {
+            perror("open input file");
+            _exit(1);
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (cmd->output_file) {
+        fd = open(cmd->output_file, O_WRONLY | O_CREAT |
+                  (cmd->append_output ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0) {
+            perror("open output file");
+            _exit(1);
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    if (file != cmd->argv[0]) {
+        execv(file, cmd->argv);
+        //the remembered program went away, search PATH after all
+    }
+    execvp(cmd->argv[0], cmd->argv);
+    dprintf(STDERR_FILENO, "%s: command not found\n", cmd->argv[0]);
+    _exit(EXIT_NOT_FOUND);
+}
+
+/*
+ * launch_spawn(cmd, file, in_fd, out_fd, err_fd)
+ *
+ *  posix_spawnp() version of launch_stage().  The child starts with no
+ *  signals blocked and SIGPIPE at its default action, same as the fork
+ *  path.  A command that cannot be started is reported on err_fd here,
+ *  the child never ran.
+ */
+static pid_t launch_spawn(cmd_buff_t *cmd, const char *file, int in_fd,
+                          int out_fd, int err_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+    int rc;
+    int fd = -1;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (err_fd >= 0 && err_fd != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    }
+    if (cmd->input_file) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->input_file,
+                                         O_RDONLY, 0);
+    }
+    if (cmd->output_file) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->output_file,
+                                         O_WRONLY | O_CREAT |
+                                         (cmd->append_output ? O_APPEND : O_TRUNC),
+                                         0644);
+    }
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+
+    rc = ENOENT;
+    if (file != cmd->argv[0]) {
+        rc = posix_spawn(&pid, file, &actions, &attr, cmd->argv, environ);
+        if (rc == ENOENT) {
+            path_hash_forget(cmd->argv[0]);
+        }
+    }
+    if (rc == ENOENT) {
+        rc = posix_spawnp(&pid, cmd->argv[0], &actions, &attr, cmd->argv, environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) {
+        if (err_fd < 0) {
+            err_fd = STDERR_FILENO;
+        }
+        //report the first step that failed, in the order the forked child
+        //takes them (the output file is opened without truncating it)
+        if (cmd->input_file && access(cmd->input_file, R_OK) != 0) {
+            dprintf(err_fd, "open input file: %s\n", strerror(errno));
+        } else if (cmd->output_file && (fd = open(cmd->output_file,
+                                                  O_WRONLY | O_CREAT | O_APPEND,
+                                                  0644)) < 0) {
+            dprintf(err_fd, "open output file: %s\n", strerror(errno));
+        } else if (rc == ENOENT) {
+            dprintf(err_fd, "%s: command not found\n", cmd->argv[0]);
+        } else {
+            dprintf(err_fd, "%s: %s\n", cmd->argv[0], strerror(rc));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * launch_stage(cmd, in_fd, out_fd, err_fd)
+ *      cmd:     the command, its < > >> redirections are applied after
+ *               the descriptors below
+ *      in_fd, out_fd, err_fd:  become STDIN, STDOUT and STDERR of the
+ *               command, -1 keeps the one of this process
+ *
+ *  Starts one command with the launcher picked by set_launcher().  The
+ *  program is looked up in the PATH cache, see path_hash_lookup().  Any
+ *  other descriptor the command must not inherit has to be O_CLOEXEC,
+ *  neither launcher closes descriptors one by one.
+ *
+ *  Returns the pid of the command, or -1 if it could not be started (the
+ *  reason has been printed, errno is EAGAIN or ENOMEM when no process
+ *  could be created).
+ */
+pid_t launch_stage(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    char path[PATH_MAX];
+    const char *file = cmd->argv[0];
+
+    if (strchr(file, '/') == NULL && path_hash_lookup(file, path, sizeof(path)) == OK) {
+        file = path;
+    }
+
+    if (launcher == LAUNCH_SPAWN) {
+        return launch_spawn(cmd, file, in_fd, out_fd, err_fd);
+    }
+    return launch_fork(cmd, file, in_fd, out_fd, err_fd);
+}
+
+// Function to execute non-built-in commands
+int exec_cmd(cmd_buff_t *cmd) {
+    int status;
+    pid_t pid;
+
+    // Check if the input and output files are the same
+    if (cmd->input_file && cmd->output_file && strcmp(cmd->input_file, cmd->output_file) == 0) {
+        fprintf(stderr, "Cannot redirect input and output to the same file: %s\n", cmd->input_file);
+        return ERR_EXEC_CMD;
+    }
+
+    fflush(stdout);
+    pid = launch_stage(cmd, -1, -1, -1);
+    if (pid < 0) {
+        //launch_stage() said why.  A command that was not found ran and
+        //failed, as a forked child that reported it and exited 127 does,
+        //only a process that could not be created fails the command line
+        return (errno == EAGAIN || errno == ENOMEM) ? ERR_EXEC_CMD : OK;
+    }
+
+    waitpid(pid, &status, 0);
+    return OK;
 }
 
 // Function to execute a pipeline of commands
@@ -243,151 +1052,181 @@ int exec_pipeline(command_list_t *clist) {
         return exec_cmd(&(clist->commands[0]));
     }
 
-    int pipes[CMD_MAX - 1][2]; 
-    pid_t pids[CMD_MAX];       
+    // Built-in commands are refused before anything is started
+    for (int i = 0; i < clist->num; i++) {
+        Built_In_Cmds bi_rc = exec_built_in_cmd(&(clist->commands[i]));
 
-    for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
+        if (i == 0 && bi_rc == BI_CMD_EXIT) {
+            return OK_EXIT;
+        } else if (i == 0 ? bi_rc == BI_EXECUTED : bi_rc != BI_NOT_BI) {
+            printf("error: Built-in commands cannot be used in pipelines\n");
             return ERR_EXEC_CMD;
         }
     }
 
-    for (int i = 0; i < clist->num; i++) {
-        cmd_buff_t *cmd = &(clist->commands[i]);
-
-        // Check for built-in commands
-        Built_In_Cmds bi_rc = exec_built_in_cmd(cmd);
+    pid_t *pids = (clist->arena != NULL)
+                ? cmd_arena_alloc(clist->arena, clist->num * sizeof(pid_t))
+                : malloc(clist->num * sizeof(pid_t));
+    if (pids == NULL) {
+        return ERR_MEMORY;
+    }
 
-        if (i == 0) {
-            if (bi_rc == BI_CMD_EXIT) {
-                for (int j = 0; j < clist->num - 1; j++) {
-                    close(pipes[j][0]);
-                    close(pipes[j][1]);
-                }
-                return OK_EXIT;
-            } else if (bi_rc == BI_EXECUTED) {
-                printf("error: Built-in commands cannot be used in pipelines\n");
+    // Each pipe is created right before the stage that writes to it, so
+    // only the read end of the previous one is held however long the
+    // pipeline is.  Close on exec, so no stage inherits another stage's
+    // pipe ends.  A stage that cannot be started is skipped, its
+    // neighbours see EOF.
+    int rc = OK;
+    int prev_read = -1;
 
-                for (int j = 0; j < clist->num - 1; j++) {
-                    close(pipes[j][0]);
-                    close(pipes[j][1]);
-                }
-                return ERR_EXEC_CMD;
-            }
-        } else if (bi_rc != BI_NOT_BI) {
-            printf("error: Built-in commands cannot be used in pipelines\n");
+    fflush(stdout);
+    for (int i = 0; i < clist->num; i++) {
+        int fds[2] = { -1, -1 };
 
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+        if (i < clist->num - 1 && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (int j = i; j < clist->num; j++) {
+                pids[j] = -1;
             }
-            return ERR_EXEC_CMD;
+            rc = ERR_EXEC_CMD;
+            break;
         }
-
-        pid_t pid = fork();
-
-        if (pid == -1) {
-            perror("fork");
-
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            return ERR_EXEC_CMD;
+        pids[i] = launch_stage(&(clist->commands[i]), prev_read, fds[1], -1);
+        if (prev_read >= 0) {
+            close(prev_read);
         }
-
-        if (pid == 0) {
-            if (i > 0) {
-                dup2(pipes[i - 1][0], STDIN_FILENO);
-            }
-
-            if (i < clist->num - 1) {
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
-
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-
-            execvp(cmd->argv[0], cmd->argv);
-            perror("execvp");
-            exit(1);
-        } else {
-            pids[i] = pid;
+        if (fds[1] >= 0) {
+            close(fds[1]);
         }
+        prev_read = fds[0];
     }
-
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    if (prev_read >= 0) {
+        close(prev_read);
     }
 
     for (int i = 0; i < clist->num; i++) {
         int status;
-        waitpid(pids[i], &status, 0);
+        if (pids[i] > 0) {
+            waitpid(pids[i], &status, 0);
+        }
     }
-    return OK;
+    if (clist->arena == NULL) {
+        free(pids);
+    }
+    return rc;
 }
 
-
 int build_cmd_list(char *cmd_line, command_list_t *clist)
 {
-    char *cmd_copy = strdup(cmd_line);
-    if (cmd_copy == NULL)
+    return build_cmd_list_arena(cmd_line, clist, NULL);
+}
+
+/*
+ * cmd_list_reserve(clist)
+ *
+ *  Makes room for one more stage, doubling commands when it is full.
+ *
+ *  Returns OK or ERR_MEMORY.
+ */
+static int cmd_list_reserve(command_list_t *clist)
+{
+    cmd_buff_t *grown;
+    int cap;
+
+    if (clist->num < clist->cap)
+    {
+        return OK;
+    }
+    cap = clist->cap ? clist->cap * 2 : CMD_LIST_INIT;
+    grown = cmd_grow(clist->arena, clist->commands,
+                     clist->num * sizeof(cmd_buff_t), cap * sizeof(cmd_buff_t));
+    if (grown == NULL)
     {
         return ERR_MEMORY;
     }
+    clist->commands = grown;
+    clist->cap = cap;
+    return OK;
+}
 
-    clist->num = 0;
+/*
+ * build_cmd_list_arena(cmd_line, clist, arena)
+ *      cmd_line:  the command line, left untouched
+ *      clist:     receives the parsed pipeline
+ *      arena:     arena every part of clist is allocated from, or NULL
+ *                 to malloc() them like build_cmd_list()
+ *
+ *  The command line is copied once and lexed in a single pass, see
+ *  lex_stage(), every stage and its argv point into that copy.  There is
+ *  no limit on the number of stages or arguments, the stage and argv
+ *  vectors double as the line is lexed.  With an arena the copy and the
+ *  vectors are taken from it and nothing is malloc()ed, the list stays
+ *  valid until the arena is reset and free_cmd_list() only forgets the
+ *  stages.  A stage without a command is left out with a warning.
+ *
+ *  Returns OK, WARN_NO_CMDS or ERR_MEMORY.
+ */
+int build_cmd_list_arena(char *cmd_line, command_list_t *clist,
+                         cmd_arena_t *arena)
+{
+    size_t len = strlen(cmd_line);
+    int stages = 0;
+    int rc;
 
-    char *cmd_token;
-    char *saveptr;
+    clist->num = 0;
+    clist->cap = 0;
+    clist->commands = NULL;
+    clist->arena = arena;
+    clist->line = (arena != NULL) ? cmd_arena_alloc(arena, len + 1)
+                                  : malloc(len + 1);
+    if (clist->line == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    memcpy(clist->line, cmd_line, len + 1);
 
-    cmd_token = strtok_r(cmd_copy, PIPE_STRING, &saveptr);
+    char *pos = clist->line;
+    char *end = clist->line + len;
 
-    while (cmd_token != NULL && clist->num < CMD_MAX)
+    do
     {
-        int rc = alloc_cmd_buff(&(clist->commands[clist->num]));
+        rc = cmd_list_reserve(clist);
         if (rc != OK)
         {
-            free(cmd_copy);
-            free_cmd_list(clist);
-            return rc;
+            break;
         }
 
-        rc = build_cmd_buff(cmd_token, &(clist->commands[clist->num]));
-        if (rc == WARN_NO_CMDS)
-        {
-            printf("%s", CMD_WARN_NO_CMD);
-            free_cmd_buff(&(clist->commands[clist->num]));
+        cmd_buff_t *cmd = &(clist->commands[clist->num]);
+        alloc_cmd_buff(cmd);
+        cmd->_cmd_buffer = pos;
+        rc = lex_stage(&pos, end, cmd, arena);
+        stages++;
 
-            // Continue parsing the next command
-            cmd_token = strtok_r(NULL, PIPE_STRING, &saveptr);
+        if (rc >= 0 && cmd->argc > 0)
+        {
+            clist->num++;
             continue;
         }
-
-        if (rc == OK)
+        if (arena == NULL)
         {
-            clist->num++;
+            free(cmd->argv);
         }
+        // a blank line is left to the caller to report
+        if (rc >= 0 && (rc == CC_PIPE || stages > 1))
+        {
+            printf("%s", CMD_WARN_NO_CMD);
+        }
+    } while (rc == CC_PIPE);
 
-        cmd_token = strtok_r(NULL, PIPE_STRING, &saveptr);
-    }
-
-    if (cmd_token != NULL && clist->num >= CMD_MAX)
+    if (rc < 0)
     {
-        printf("error: pipe limit reached, piping limited to %d commands\n", CMD_MAX);
-        free(cmd_copy);
         free_cmd_list(clist);
-        return ERR_TOO_MANY_COMMANDS;
+        return rc;
     }
 
-    free(cmd_copy);
-
     if (clist->num == 0)
     {
+        free_cmd_list(clist);
         return WARN_NO_CMDS;
     }
 
@@ -395,39 +1234,42 @@ int build_cmd_list(char *cmd_line, command_list_t *clist)
 }
 
 int free_cmd_list(command_list_t *cmd_lst) {
-    for (int i = 0; i < cmd_lst->num; i++) {
-        free_cmd_buff(&(cmd_lst->commands[i]));
+    // arena backed lists are released by cmd_arena_reset()
+    if (cmd_lst->arena == NULL) {
+        for (int i = 0; i < cmd_lst->num; i++) {
+            free(cmd_lst->commands[i].argv);
+        }
+        free(cmd_lst->commands);
+        free(cmd_lst->line);
     }
 
+    cmd_lst->commands = NULL;
+    cmd_lst->line = NULL;
+    cmd_lst->cap = 0;
     cmd_lst->num = 0;
     return OK;
 }
 
-// Main command execution loop
+// Main command execution loop, every line is parsed into one arena that
+// is reset before the next line, so commands cost no malloc() once it
+// has grown to fit them
 int exec_local_cmd_loop() {
-    char *cmd_buff;
+    char *cmd_buff = NULL;
+    size_t cmd_sz = 0;
     int rc = 0;
-    cmd_buff_t cmd;
-    command_list_t cmd_list; 
+    command_list_t cmd_list;
+    cmd_arena_t arena;
 
-    // Allocate memory for command buffer
-    cmd_buff = malloc(SH_CMD_MAX * sizeof(char));
-    if (cmd_buff == NULL) {
+    if (cmd_arena_init(&arena, 0) != OK) {
         return ERR_MEMORY;
     }
 
-    rc = alloc_cmd_buff(&cmd);
-    if (rc != OK) {
-        free(cmd_buff);
-        return rc;
-    }
-
     while(1) {
         // Print the prompt, but only the prompt itself
         printf("%s", SH_PROMPT);
 
-        // Get the command input
-        if (fgets(cmd_buff, ARG_MAX, stdin) == NULL) {
+        // Get the command input, of any length
+        if (getline(&cmd_buff, &cmd_sz, stdin) == -1) {
             printf("\n");
             break;
         }
@@ -440,53 +1282,33 @@ int exec_local_cmd_loop() {
             continue;  // Skip empty inputs
         }
 
-        // Check if the command includes a pipe
-        if (strchr(cmd_buff, PIPE_CHAR) != NULL) {
-            rc = build_cmd_list(cmd_buff, &cmd_list);
-
-            if (rc == WARN_NO_CMDS) {
-                printf("%s", CMD_WARN_NO_CMD);
-                continue;
-            }
-            
-            if (rc == ERR_TOO_MANY_COMMANDS) {
-                printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
-                continue;
-            }
+        cmd_arena_reset(&arena);
+        rc = build_cmd_list_arena(cmd_buff, &cmd_list, &arena);
 
-            rc = exec_pipeline(&cmd_list);
-        
-            if (rc == OK_EXIT) {
-                break;
-            }
-            
-            free_cmd_list(&cmd_list);
-        } else {
-            rc = build_cmd_buff(cmd_buff, &cmd);
-
-            if (rc == WARN_NO_CMDS) {
-                printf("%s", CMD_WARN_NO_CMD);
-                continue;
-            }
+        if (rc == WARN_NO_CMDS) {
+            printf("%s", CMD_WARN_NO_CMD);
+            continue;
+        }
+        if (rc != OK) {
+            printf("Failed parsing command\n");
+            continue;
+        }
 
-            Built_In_Cmds bi_rc = exec_built_in_cmd(&cmd);
-            if (bi_rc == BI_CMD_EXIT) {
-                rc = OK_EXIT;
-                break;
-            } else if (bi_rc == BI_EXECUTED) {
-                continue;
-            }
+        // a single command runs through exec_cmd(), built-ins included
+        int num = cmd_list.num;
+        rc = exec_pipeline(&cmd_list);
+        free_cmd_list(&cmd_list);
 
-            rc = exec_cmd(&cmd);
-            if (rc != OK) {
-                printf("Failed executing command\n");
-            }
+        if (rc == OK_EXIT) {
+            break;
+        }
+        if (rc != OK && num == 1) {
+            printf("Failed executing command\n");
         }
     }
 
     free(cmd_buff);
-    free_cmd_buff(&cmd);
+    cmd_arena_free(&arena);
 
     return rc;
 }
-
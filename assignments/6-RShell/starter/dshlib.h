@@ -2,37 +2,42 @@
 #define __DSHLIB_H__
 
 #include <stdbool.h>
+#include <sys/types.h>
 
-//Constants for command structure sizes
-#define EXE_MAX 64
-#define ARG_MAX 256
-#define CMD_MAX 8
-#define CMD_ARGV_MAX (CMD_MAX + 1)
-// Longest command that can be read from the shell
-#define SH_CMD_MAX EXE_MAX + ARG_MAX
-
-typedef struct command
-{
-    char exe[EXE_MAX];
-    char args[ARG_MAX];
-} command_t;
-
-#include <stdbool.h>
+//Initial sizes of the growable command structures, there is no limit
+//on the number of arguments or pipeline stages
+#define CMD_ARGV_INIT   8       //argv slots, including the NULL
+#define CMD_LIST_INIT   4       //pipeline stages
 
 typedef struct cmd_buff
 {
     int  argc;
-    char *argv[CMD_ARGV_MAX];
+    int  argv_cap;      // slots in argv, grown by tokenizing
+    char **argv;
     char *_cmd_buffer;
-    char *input_file;  // extra credit, stores input redirection file (for `<`)
-    char *output_file; // extra credit, stores output redirection file (for `>`)
+    char *input_file;  // extra credit, stores input redirection file (for `<`), in _cmd_buffer
+    char *output_file; // extra credit, stores output redirection file (for `>`), in _cmd_buffer
     bool append_mode;
     bool append_output; // extra credit, sets append mode fomr output_file
 } cmd_buff_t;
 
+//bump allocator the remote shell parses requests into, see cmd_arena_init()
+typedef struct cmd_arena
+{
+    char   *base;
+    size_t  size;
+    size_t  used;
+    size_t  spilled;                // bytes that did not fit since the reset
+    struct cmd_arena_spill *spill;  // malloc()ed blocks holding them
+    unsigned long mallocs;          // malloc() calls made by the arena
+} cmd_arena_t;
+
 typedef struct command_list{
     int num;
-    cmd_buff_t commands[CMD_MAX];
+    int cap;                        // slots in commands
+    cmd_buff_t *commands;
+    char *line;                     // copy of the line the stages point into
+    cmd_arena_t *arena;             // owns everything, NULL if malloc()ed
 }command_list_t;
 
 //Special character #defines
@@ -42,6 +47,7 @@ typedef struct command_list{
 
 #define SH_PROMPT       "dsh4> "
 #define EXIT_CMD        "exit"
+#define HASH_CMD        "hash"
 #define RC_SC           99
 #define EXIT_SC         100
 
@@ -55,6 +61,26 @@ typedef struct command_list{
 #define ERR_EXEC_CMD            -6
 #define OK_EXIT                 -7
 
+#define EXIT_NOT_FOUND          127     //exit status of a command not found
+
+//PATH lookup cache, see path_hash_lookup()
+#define PATH_HASH_BUCKETS       64
+#define PATH_HASH_MAX_ENTRIES   1024
+#define PATH_HASH_RECHECK_MS    1000    //how often PATH directories are
+                                        //checked for new programs
+#define PATH_HASH_DEF_PATH      "/bin:/usr/bin"     //when PATH is unset
+#define PATH_HASH_OUT_SZ        (64*1024)           //output of `hash`
+
+//command arena, see cmd_arena_init()
+#define CMD_ARENA_SZ            4096    //initial size, grows to fit
+#define CMD_ARENA_ALIGN         16      //alignment of every allocation
+#define CMD_LEX_VEC_MIN         64      //bytes left in a line for the lexer
+                                        //to scan it with SSE2
+
+//process launchers, see set_launcher()
+#define LAUNCH_FORK             0       //fork() + execvp()
+#define LAUNCH_SPAWN            1       //posix_spawnp(), no page table copy
+
 
 
 //prototypes
@@ -64,7 +90,14 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff);
 int close_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
+int build_cmd_list_arena(char *cmd_line, command_list_t *clist,
+                         cmd_arena_t *arena);
 int free_cmd_list(command_list_t *cmd_lst);
+int cmd_arena_init(cmd_arena_t *arena, size_t size);
+void *cmd_arena_alloc(cmd_arena_t *arena, size_t len);
+char *cmd_arena_strdup(cmd_arena_t *arena, const char *str);
+void cmd_arena_reset(cmd_arena_t *arena);
+void cmd_arena_free(cmd_arena_t *arena);
 
 //built in command stuff
 typedef enum {
@@ -73,6 +106,8 @@ typedef enum {
     BI_CMD_CD,
     BI_CMD_RC,              //extra credit command
     BI_CMD_STOP_SVR,        //new command "stop-server"
+    BI_CMD_RSTATS,          //rsh server statistics "rstats"
+    BI_CMD_HASH,            //PATH lookup cache "hash" and "hash -r"
     BI_NOT_BI,
     BI_EXECUTED,
 } Built_In_Cmds;
@@ -82,13 +117,19 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 //main execution context
 int exec_local_cmd_loop();
 int exec_cmd(cmd_buff_t *cmd);
-int execute_pipeline(command_list_t *clist);
+int exec_pipeline(command_list_t *clist);
+int set_launcher(const char *name);
+int get_launcher(void);
+pid_t launch_stage(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+int path_hash_lookup(const char *name, char *path, size_t len);
+void path_hash_forget(const char *name);
+void path_hash_reset(void);
+int path_hash_cmd(cmd_buff_t *cmd, char *out, int len);
 
 
 //output constants
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
-#define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
 #define BI_NOT_IMPLEMENTED "not implemented"
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,11 +8,225 @@
 #include <unistd.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 
 #include "dshlib.h"
 #include "rshlib.h"
 
+static void drain_until_closed(int cli_socket, char *rsp_buff);
 
+/*
+ * Timing of one command for --stats, in CLOCK_MONOTONIC milliseconds.
+ */
+typedef struct cmd_stats {
+    double        t_sent;
+    double        t_first;          //0 until the first response byte
+    double        t_done;
+    unsigned long bytes;            //output bytes received
+} cmd_stats_t;
+
+typedef struct stats_total {
+    unsigned long cmds;
+    unsigned long bytes;
+    double        latency_ms;
+    double        max_latency_ms;
+    double        ttfb_ms;
+    double        t_start;
+    double        t_end;
+} stats_total_t;
+
+/*
+ * Received bytes not handled yet.  A recv() may end in the middle of a
+ * frame or hold several of them.
+ */
+typedef struct frame_reader {
+    char *buff;                     //RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD
+    int   len;
+    int   used;
+} frame_reader_t;
+
+static int client_stats = 0;
+static stats_total_t stats_total;
+
+/*
+ * One line of a batch script.  Output of the command that is next in
+ * script order is printed as it arrives, output of later commands is
+ * held here until every command before them has finished.
+ */
+typedef struct batch_cmd {
+    char    *line;
+    uint16_t session;
+    int      done;
+    char    *out;
+    int      out_len;
+    char    *err;
+    int      err_len;
+    cmd_stats_t st;
+} batch_cmd_t;
+
+typedef struct batch {
+    batch_cmd_t *cmds;
+    int          num;
+    int          sent;              //commands handed to the server
+    int          finished;          //commands whose EXIT arrived
+    int          printed;           //commands printed, in script order
+    int          failed;            //commands whose exit status was not 0
+    char        *sbuf;              //frame being sent
+    int          slen;
+    int          soff;
+    frame_reader_t rd;
+} batch_t;
+
+
+
+
+/*
+ * set_client_stats(val)
+ *      val:  non zero prints timing of every command and a summary to
+ *            stderr, the --stats option
+ */
+void set_client_stats(int val) {
+    client_stats = val;
+}
+
+static double stats_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void stats_start(cmd_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->t_sent = stats_now_ms();
+    if (stats_total.cmds == 0) {
+        stats_total.t_start = st->t_sent;
+    }
+}
+
+static void stats_output(cmd_stats_t *st, int len) {
+    if (st->t_first == 0) {
+        st->t_first = stats_now_ms();
+    }
+    st->bytes += len;
+}
+
+/*
+ * stats_report(cmd, st)
+ *
+ *  Prints the time to first byte, latency and throughput of one finished
+ *  command and adds it to the totals printed by stats_summary().
+ */
+static void stats_report(const char *cmd, cmd_stats_t *st) {
+    double latency = st->t_done - st->t_sent;
+    double ttfb = st->t_first ? st->t_first - st->t_sent : latency;
+
+    stats_total.cmds++;
+    stats_total.bytes += st->bytes;
+    stats_total.latency_ms += latency;
+    stats_total.ttfb_ms += ttfb;
+    if (latency > stats_total.max_latency_ms) {
+        stats_total.max_latency_ms = latency;
+    }
+    if (st->t_done > stats_total.t_end) {
+        stats_total.t_end = st->t_done;
+    }
+
+    fprintf(stderr, "[stats] %.*s: %lu bytes, ttfb %.3f ms, latency %.3f ms, %.2f MB/s\n",
+            (int)strcspn(cmd, "\n"), cmd, st->bytes, ttfb, latency,
+            latency > 0 ? st->bytes / latency / 1000.0 : 0.0);
+}
+
+static void stats_summary(void) {
+    double elapsed = stats_total.t_end - stats_total.t_start;
+
+    if (stats_total.cmds == 0) {
+        return;
+    }
+    fprintf(stderr, "[stats] %lu commands, %lu bytes in %.3f ms, %.2f MB/s, "
+            "%.1f cmds/s, latency avg %.3f ms max %.3f ms, ttfb avg %.3f ms\n",
+            stats_total.cmds, stats_total.bytes, elapsed,
+            elapsed > 0 ? stats_total.bytes / elapsed / 1000.0 : 0.0,
+            elapsed > 0 ? stats_total.cmds * 1000.0 / elapsed : 0.0,
+            stats_total.latency_ms / stats_total.cmds, stats_total.max_latency_ms,
+            stats_total.ttfb_ms / stats_total.cmds);
+}
+
+/*
+ * write_all(fd, buff, len)
+ *
+ *  Output goes to STDOUT and STDERR with write() rather than stdio, so
+ *  nothing sits in a buffer while the next frame is awaited.
+ */
+static int write_all(int fd, const char *buff, int len) {
+    ssize_t io_size;
+
+    while (len > 0) {
+        io_size = write(fd, buff, len);
+        if (io_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_CLIENT;
+        }
+        buff += io_size;
+        len -= io_size;
+    }
+    return OK;
+}
+
+/*
+ * reader_fill(cli_socket, rd)
+ *
+ *  Receives whatever the socket holds without blocking, after dropping
+ *  the frames already handled.
+ *
+ *  Returns OK, WARN_RDSH_SVR_CLOSED or ERR_RDSH_COMMUNICATION.
+ */
+static int reader_fill(int cli_socket, frame_reader_t *rd) {
+    ssize_t io_size;
+
+    memmove(rd->buff, rd->buff + rd->used, rd->len - rd->used);
+    rd->len -= rd->used;
+    rd->used = 0;
+
+    io_size = recv(cli_socket, rd->buff + rd->len,
+                   RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD - rd->len, MSG_DONTWAIT);
+    if (io_size < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return OK;
+        }
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (io_size == 0) {
+        return WARN_RDSH_SVR_CLOSED;
+    }
+    rd->len += io_size;
+    return OK;
+}
+
+/*
+ * reader_next(rd, hdr, payload)
+ *
+ *  Returns 1 and the next complete frame, 0 when more bytes are needed,
+ *  or ERR_RDSH_PROTOCOL.
+ */
+static int reader_next(frame_reader_t *rd, rdsh_frame_hdr_t *hdr, char **payload) {
+    if (rd->len - rd->used < RDSH_FRAME_HDR_SZ) {
+        return 0;
+    }
+    if (rdsh_decode_hdr(rd->buff + rd->used, hdr) != OK) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    if (rd->len - rd->used < RDSH_FRAME_HDR_SZ + (int)hdr->length) {
+        return 0;
+    }
+    *payload = rd->buff + rd->used + RDSH_FRAME_HDR_SZ;
+    rd->used += RDSH_FRAME_HDR_SZ + hdr->length;
+    return 1;
+}
 
 
 /*
@@ -66,6 +281,12 @@
  *                    if is_eof is true, this is the last part of the transmission
  *                    from the server and you can break out of the recv() loop. 
  * 
+ *      Before the first prompt the client offers the framed protocol with
+ *      rdsh_client_hello() and falls back to the EOF character protocol
+ *      described above when the server does not speak it.  With the
+ *      framed protocol a running command gets what is typed at the
+ *      terminal as its STDIN, see exec_remote_cmd_framed().
+ * 
  *   returns:
  *          OK:      The client executed all of its commands and is exiting
  *                   either by the `exit` command that terminates the client
@@ -92,10 +313,11 @@
  */
  int exec_remote_cmd_loop(char *address, int port) {
     char *cmd_buff = malloc(RDSH_COMM_BUFF_SZ);
-    char *rsp_buff = malloc(RDSH_COMM_BUFF_SZ);
-    int cli_socket;
-    ssize_t io_size;
-    int is_eof;
+    char *rsp_buff = malloc(RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD);
+    int cli_socket = -1;
+    uint32_t req_id = 0;
+    int proto;
+    int rc = OK;
 
     if (!cmd_buff || !rsp_buff) {
         return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_MEMORY);
@@ -108,6 +330,23 @@
         return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
     }
 
+    // Step 1b: Negotiate the framed protocol.  A server that predates it
+    //          ran the HELLO frame as a command and dropped us, reconnect
+    //          and talk to it with the EOF character protocol.
+    proto = rdsh_client_hello(cli_socket);
+    if (proto == ERR_RDSH_PROTOCOL) {
+        drain_until_closed(cli_socket, rsp_buff);
+        close(cli_socket);
+        cli_socket = start_client(address, port);
+        if (cli_socket < 0) {
+            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
+        }
+        proto = RDSH_PROTO_LEGACY;
+    }
+    if (proto < 0) {
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    }
+
     while (1) {
         // Step 2: Print prompt
         printf("rsh> ");
@@ -118,33 +357,591 @@
             break;
         }
 
-        // Step 4: Send command to server
-        if (send(cli_socket, cmd_buff, strlen(cmd_buff), 0) == -1) {
-            perror("send failed");
-            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+        // Step 4: Send the command and print the response
+        if (proto == RDSH_PROTO_LEGACY) {
+            rc = exec_remote_cmd_legacy(cli_socket, cmd_buff, rsp_buff);
+        } else {
+            rc = exec_remote_cmd_framed(cli_socket, ++req_id, cmd_buff, rsp_buff);
+        }
+
+        if (rc == WARN_RDSH_SVR_CLOSED) {
+            printf("Server disconnected.\n");
+            rc = OK;
+            break;
+        }
+        if (rc != OK) {
+            break;
+        }
+    }
+
+    if (client_stats) {
+        stats_summary();
+    }
+    return client_cleanup(cli_socket, cmd_buff, rsp_buff, rc);
+}
+
+
+/*
+ * drain_until_closed(cli_socket, rsp_buff)
+ *
+ *  Reads and discards until the server closes the connection.  Used when
+ *  a legacy server answered our HELLO frame with an error, closing first
+ *  would make that server write to a reset connection and die of SIGPIPE.
+ *  Gives up after RDSH_HELLO_TIMEOUT seconds of silence.
+ */
+static void drain_until_closed(int cli_socket, char *rsp_buff) {
+    struct timeval tv = { RDSH_HELLO_TIMEOUT, 0 };
+
+    setsockopt(cli_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ, 0) > 0) {
+        ;
+    }
+}
+
+
+/*
+ * exec_remote_cmd_legacy(cli_socket, cmd_buff, rsp_buff)
+ *      cli_socket:  connected socket
+ *      cmd_buff:    the command line to run
+ *      rsp_buff:    RDSH_COMM_BUFF_SZ bytes used to receive the response
+ *
+ *  Sends one command with the EOF character protocol and prints the
+ *  response until the last byte received is RDSH_EOF_CHAR.
+ *
+ *   returns:
+ *          OK:                      the response was printed
+ *          WARN_RDSH_SVR_CLOSED:    the server closed the connection
+ *          ERR_RDSH_COMMUNICATION:  send() or recv() failed
+ */
+int exec_remote_cmd_legacy(int cli_socket, char *cmd_buff, char *rsp_buff) {
+    cmd_stats_t st;
+    ssize_t io_size;
+    int is_eof;
+
+    stats_start(&st);
+    //the null byte ends the command, see exec_client_requests()
+    if (send(cli_socket, cmd_buff, strlen(cmd_buff) + 1, 0) == -1) {
+        perror("send failed");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    while (1) {
+        io_size = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ, 0);
+        if (io_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv failed");
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (io_size == 0) {
+            return WARN_RDSH_SVR_CLOSED;
+        }
+
+        is_eof = (rsp_buff[io_size - 1] == RDSH_EOF_CHAR);
+        stats_output(&st, io_size - is_eof);
+        write_all(STDOUT_FILENO, rsp_buff, io_size);
+
+        if (is_eof) {
+            if (client_stats) {
+                st.t_done = stats_now_ms();
+                stats_report(cmd_buff, &st);
+            }
+            return OK;
+        }
+    }
+}
+
+
+/*
+ * exec_remote_cmd_framed(cli_socket, req_id, cmd_buff, rsp_buff)
+ *      cli_socket:  connected socket that negotiated the framed protocol
+ *      req_id:      request id for this command
+ *      cmd_buff:    the command line to run
+ *      rsp_buff:    RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD bytes used to
+ *                   receive frames
+ *
+ *  Sends the command in a CMD frame, then waits in poll() for both the
+ *  socket and the terminal.  STDOUT and STDERR frames are written with
+ *  write() to STDOUT and STDERR as they arrive, until the EXIT frame for
+ *  req_id.  When STDIN is a terminal, what is typed meanwhile is sent to
+ *  the command in STDIN frames, so interactive programs work, and ^D
+ *  ends its input.  When STDIN is a file or pipe its lines are the
+ *  commands of a script and the command gets no input.
+ *
+ *   returns:
+ *          OK:                      the response was printed
+ *          WARN_RDSH_SVR_CLOSED:    the server closed the connection
+ *          ERR_RDSH_COMMUNICATION:  send() or recv() failed
+ *          ERR_RDSH_PROTOCOL:       the server sent an invalid frame
+ */
+int exec_remote_cmd_framed(int cli_socket, uint32_t req_id, char *cmd_buff, char *rsp_buff) {
+    frame_reader_t rd = { rsp_buff, 0, 0 };
+    rdsh_frame_hdr_t hdr;
+    struct pollfd pfd[2];
+    cmd_stats_t st;
+    char in_buff[4096];
+    char *payload;
+    ssize_t io_size;
+    int fwd_stdin = isatty(STDIN_FILENO);
+    int rc;
+
+    stats_start(&st);
+    if (rdsh_send_cmd(cli_socket, 0, req_id, cmd_buff,
+                      fwd_stdin ? RDSH_FL_STDIN : 0) != OK) {
+        perror("send failed");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    while (1) {
+        pfd[0].fd = cli_socket;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = fwd_stdin ? STDIN_FILENO : -1;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        // Forward terminal input, an empty frame is end of input
+        if (pfd[1].revents) {
+            io_size = read(STDIN_FILENO, in_buff, sizeof(in_buff));
+            if (io_size < 0 && errno == EINTR) {
+                continue;
+            }
+            if (io_size <= 0) {
+                io_size = 0;
+                fwd_stdin = 0;
+            }
+            if (rdsh_send_frame(cli_socket, RDSH_FT_STDIN, 0, req_id,
+                                in_buff, io_size) != OK) {
+                return ERR_RDSH_COMMUNICATION;
+            }
+        }
+
+        if (!pfd[0].revents) {
+            continue;
+        }
+        rc = reader_fill(cli_socket, &rd);
+        if (rc != OK) {
+            return rc;
+        }
+        while ((rc = reader_next(&rd, &hdr, &payload)) == 1) {
+            if (hdr.req_id != req_id) {
+                continue;
+            }
+            switch (hdr.type) {
+                case RDSH_FT_STDOUT:
+                    stats_output(&st, hdr.length);
+                    write_all(STDOUT_FILENO, payload, hdr.length);
+                    break;
+                case RDSH_FT_STDERR:
+                    stats_output(&st, hdr.length);
+                    write_all(STDERR_FILENO, payload, hdr.length);
+                    break;
+                case RDSH_FT_EXIT:
+                    if (client_stats) {
+                        st.t_done = stats_now_ms();
+                        stats_report(cmd_buff, &st);
+                    }
+                    return OK;
+                default:
+                    break;
+            }
+        }
+        if (rc < 0) {
+            return rc;
+        }
+    }
+}
+
+
+/*
+ * batch_load(batch, script, sessions)
+ *
+ *  Reads the commands of a batch script, "-" reads them from stdin.
+ *  Blank lines and lines starting with # are skipped and an `exit` line
+ *  ends the script.  Commands are dealt to the sessions round robin.
+ *
+ *  Returns OK, ERR_MEMORY, or ERR_RDSH_CLIENT if the script cannot be read.
+ */
+static int batch_load(batch_t *batch, char *script, int sessions) {
+    char *line = NULL;
+    size_t line_sz = 0;
+    batch_cmd_t *grown;
+    FILE *fp = stdin;
+    int cap = 0;
+    int rc = OK;
+    char *cmd;
+
+    if (strcmp(script, "-") != 0) {
+        fp = fopen(script, "r");
+        if (fp == NULL) {
+            perror(script);
+            return ERR_RDSH_CLIENT;
+        }
+    }
+
+    while (getline(&line, &line_sz, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        cmd = line;
+        while (*cmd == ' ' || *cmd == '\t') {
+            cmd++;
+        }
+        if (*cmd == '\0' || *cmd == '#') {
+            continue;
+        }
+        if (strcmp(cmd, EXIT_CMD) == 0) {
+            break;
+        }
+        if (strlen(cmd) >= RDSH_MAX_PAYLOAD) {
+            fprintf(stderr, "Error: command longer than %d bytes: %.40s...\n",
+                    RDSH_MAX_PAYLOAD - 1, cmd);
+            rc = ERR_RDSH_CLIENT;
+            break;
+        }
+
+        if (batch->num == cap) {
+            cap = cap ? cap * 2 : 64;
+            grown = realloc(batch->cmds, cap * sizeof(batch_cmd_t));
+            if (grown == NULL) {
+                rc = ERR_MEMORY;
+                break;
+            }
+            batch->cmds = grown;
+        }
+        memset(&batch->cmds[batch->num], 0, sizeof(batch_cmd_t));
+        batch->cmds[batch->num].line = strdup(cmd);
+        if (batch->cmds[batch->num].line == NULL) {
+            rc = ERR_MEMORY;
+            break;
+        }
+        batch->cmds[batch->num].session = batch->num % sessions;
+        batch->num++;
+    }
+
+    if (rc == OK && ferror(fp)) {
+        rc = ERR_RDSH_CLIENT;
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+/*
+ * batch_hold(buff, len, data, data_len)
+ *
+ *  Appends output of a command that cannot be printed yet.
+ */
+static int batch_hold(char **buff, int *len, const char *data, int data_len) {
+    char *grown = realloc(*buff, *len + data_len);
+
+    if (grown == NULL) {
+        return ERR_MEMORY;
+    }
+    memcpy(grown + *len, data, data_len);
+    *buff = grown;
+    *len += data_len;
+    return OK;
+}
+
+/*
+ * batch_print(batch)
+ *
+ *  Prints held output in script order: every finished command at the
+ *  front, then whatever the first unfinished one has produced so far,
+ *  after which its output is printed as it arrives.
+ */
+static void batch_print(batch_t *batch) {
+    batch_cmd_t *cmd;
+
+    while (batch->printed < batch->num) {
+        cmd = &batch->cmds[batch->printed];
+        write_all(STDOUT_FILENO, cmd->out, cmd->out_len);
+        write_all(STDERR_FILENO, cmd->err, cmd->err_len);
+        free(cmd->out);
+        free(cmd->err);
+        cmd->out = cmd->err = NULL;
+        cmd->out_len = cmd->err_len = 0;
+        if (!cmd->done) {
+            break;
+        }
+        batch->printed++;
+    }
+}
+
+/*
+ * batch_frame(batch, hdr, payload)
+ *
+ *  Matches one frame from the server to its command by req_id, which is
+ *  the command's position in the script plus one.
+ */
+static int batch_frame(batch_t *batch, rdsh_frame_hdr_t *hdr, char *payload) {
+    batch_cmd_t *cmd;
+    int idx = (int)hdr->req_id - 1;
+
+    if (idx < 0 || idx >= batch->sent) {
+        return OK;
+    }
+    cmd = &batch->cmds[idx];
+
+    switch (hdr->type) {
+        case RDSH_FT_STDOUT:
+            stats_output(&cmd->st, hdr->length);
+            if (idx == batch->printed) {
+                return write_all(STDOUT_FILENO, payload, hdr->length);
+            }
+            return batch_hold(&cmd->out, &cmd->out_len, payload, hdr->length);
+        case RDSH_FT_STDERR:
+            stats_output(&cmd->st, hdr->length);
+            if (idx == batch->printed) {
+                return write_all(STDERR_FILENO, payload, hdr->length);
+            }
+            return batch_hold(&cmd->err, &cmd->err_len, payload, hdr->length);
+        case RDSH_FT_EXIT:
+            if (!cmd->done) {
+                uint32_t status = 0;
+
+                if (hdr->length >= sizeof(status)) {
+                    memcpy(&status, payload, sizeof(status));
+                }
+                if (ntohl(status) != 0) {
+                    batch->failed++;
+                }
+                cmd->st.t_done = stats_now_ms();
+                cmd->done = 1;
+                batch->finished++;
+                batch_print(batch);
+            }
+            return OK;
+        default:
+            return OK;
+    }
+}
+
+/*
+ * batch_recv(cli_socket, batch)
+ *
+ *  Receives what the server sent and handles every complete frame.
+ *
+ *  Returns OK, WARN_RDSH_SVR_CLOSED, or a negative error code.
+ */
+static int batch_recv(int cli_socket, batch_t *batch) {
+    rdsh_frame_hdr_t hdr;
+    char *payload;
+    int rc;
+
+    rc = reader_fill(cli_socket, &batch->rd);
+    if (rc != OK) {
+        return rc;
+    }
+    while ((rc = reader_next(&batch->rd, &hdr, &payload)) == 1) {
+        rc = batch_frame(batch, &hdr, payload);
+        if (rc != OK) {
+            return rc;
         }
+    }
+    return rc;
+}
 
-        // Step 5: Receive response from server
-        while (1) {
-            io_size = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-            if (io_size < 0) {
-                perror("recv failed");
-                return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+/*
+ * batch_send(cli_socket, batch)
+ *
+ *  Sends CMD frames without blocking until the socket is full or
+ *  RDSH_BATCH_WINDOW commands are waiting for their EXIT.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+static int batch_send(int cli_socket, batch_t *batch) {
+    batch_cmd_t *cmd;
+    ssize_t io_size;
+    int len;
+
+    while (1) {
+        if (batch->soff == batch->slen) {
+            if (batch->sent == batch->num ||
+                batch->sent - batch->finished >= RDSH_BATCH_WINDOW) {
+                return OK;
             }
-            if (io_size == 0) {
-                printf("Server disconnected.\n");
-                return client_cleanup(cli_socket, cmd_buff, rsp_buff, OK);
+            cmd = &batch->cmds[batch->sent];
+            len = strlen(cmd->line);
+            rdsh_encode_hdr(batch->sbuf, RDSH_FT_CMD, cmd->session,
+                            batch->sent + 1, len);
+            memcpy(batch->sbuf + RDSH_FRAME_HDR_SZ, cmd->line, len);
+            batch->slen = RDSH_FRAME_HDR_SZ + len;
+            batch->soff = 0;
+            batch->sent++;
+            stats_start(&cmd->st);
+        }
+
+        io_size = send(cli_socket, batch->sbuf + batch->soff,
+                       batch->slen - batch->soff, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (io_size < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return OK;
             }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        batch->soff += io_size;
+    }
+}
+
+/*
+ * exec_remote_cmd_batch(address, port, script, sessions)
+ *      address, port:  the server to connect to
+ *      script:         file with one command per line, "-" for stdin
+ *      sessions:       number of sessions to spread the commands over
+ *
+ *  Runs a script without a round trip per command.  Commands are sent
+ *  ahead of their results, up to RDSH_BATCH_WINDOW at a time, and dealt
+ *  round robin to the sessions of the connection so up to `sessions`
+ *  commands run on the server at once.  Commands in the same session
+ *  run in script order, so with one session (the default) the script
+ *  behaves exactly as if typed at the prompt.  Output is matched to its
+ *  command by req_id and always printed in script order.
+ *
+ *  A server that does not speak the framed protocol, including the epoll
+ *  server, gets the commands one at a time with the EOF character
+ *  protocol, with a warning on stderr.
+ *
+ *   returns:
+ *          OK:                      every command of the script ran, or
+ *                                   the server closed the connection
+ *          ERR_RDSH_CMD_EXEC:       every command ran, at least one of
+ *                                   them exited with a non zero status
+ *          ERR_MEMORY:              out of memory
+ *          ERR_RDSH_CLIENT:         the script could not be read or the
+ *                                   client could not connect
+ *          ERR_RDSH_COMMUNICATION:  send() or recv() failed
+ *          ERR_RDSH_PROTOCOL:       the server sent an invalid frame
+ */
+int exec_remote_cmd_batch(char *address, int port, char *script, int sessions) {
+    struct pollfd pfd;
+    batch_t batch;
+    int cli_socket = -1;
+    int shut = 0;
+    int proto;
+    int rc;
 
-            rsp_buff[io_size] = '\0'; 
-            printf("%.*s", (int)io_size, rsp_buff);
+    memset(&batch, 0, sizeof(batch));
+    if (sessions < 1 || sessions > RDSH_MAX_SESSIONS) {
+        fprintf(stderr, "Error: sessions must be between 1 and %d\n", RDSH_MAX_SESSIONS);
+        return ERR_RDSH_CLIENT;
+    }
 
-            is_eof = (rsp_buff[io_size - 1] == RDSH_EOF_CHAR);
-            if (is_eof) break;
+    // Step 1: Read the script
+    rc = batch_load(&batch, script, sessions);
+    batch.sbuf = malloc(RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD);
+    batch.rd.buff = malloc(RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD);
+    if (rc == OK && (batch.sbuf == NULL || batch.rd.buff == NULL)) {
+        rc = ERR_MEMORY;
+    }
+    if (rc != OK) {
+        goto done;
+    }
+
+    // Step 2: Connect and negotiate, a legacy server gets one command at
+    //         a time
+    cli_socket = start_client(address, port);
+    if (cli_socket < 0) {
+        rc = ERR_RDSH_CLIENT;
+        goto done;
+    }
+    proto = rdsh_client_hello(cli_socket);
+    if (proto == ERR_RDSH_PROTOCOL) {
+        drain_until_closed(cli_socket, batch.rd.buff);
+        close(cli_socket);
+        cli_socket = start_client(address, port);
+        if (cli_socket < 0) {
+            rc = ERR_RDSH_CLIENT;
+            goto done;
+        }
+        proto = RDSH_PROTO_LEGACY;
+    }
+    if (proto < 0) {
+        rc = ERR_RDSH_COMMUNICATION;
+        goto done;
+    }
+    //output is written with write(), the banner must not trail it
+    fflush(stdout);
+    if (proto == RDSH_PROTO_LEGACY) {
+        //e.g. dsh -s -e, say so instead of quietly running the script
+        //one command per round trip
+        fprintf(stderr, "Warning: the server only runs one command at a time, "
+                "the script is not pipelined%s\n",
+                sessions > 1 ? " and -n is ignored" : "");
+        for (int i = 0; i < batch.num && rc == OK; i++) {
+            snprintf(batch.sbuf, RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD, "%s\n",
+                     batch.cmds[i].line);
+            rc = exec_remote_cmd_legacy(cli_socket, batch.sbuf, batch.rd.buff);
         }
+        goto done;
     }
 
-    return client_cleanup(cli_socket, cmd_buff, rsp_buff, OK);
+    // Step 3: Keep the send window full while printing results, until
+    //         every command has finished
+    while (batch.finished < batch.num) {
+        rc = batch_send(cli_socket, &batch);
+        if (rc != OK) {
+            break;
+        }
+        if (!shut && batch.sent == batch.num && batch.soff == batch.slen) {
+            //nothing more to send, lets the server close when it is done
+            shutdown(cli_socket, SHUT_WR);
+            shut = 1;
+        }
+
+        pfd.fd = cli_socket;
+        pfd.events = POLLIN;
+        if (batch.soff < batch.slen) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            rc = batch_recv(cli_socket, &batch);
+            if (rc != OK) {
+                break;
+            }
+        }
+    }
+    batch_print(&batch);
+
+    if (client_stats) {
+        for (int i = 0; i < batch.num; i++) {
+            if (batch.cmds[i].done) {
+                stats_report(batch.cmds[i].line, &batch.cmds[i].st);
+            }
+        }
+    }
+
+done:
+    if (rc == WARN_RDSH_SVR_CLOSED) {
+        printf("Server disconnected.\n");
+        rc = OK;
+    }
+    if (rc == OK && batch.failed > 0) {
+        rc = ERR_RDSH_CMD_EXEC;
+    }
+    if (client_stats) {
+        stats_summary();
+    }
+    for (int i = 0; i < batch.num; i++) {
+        free(batch.cmds[i].line);
+        free(batch.cmds[i].out);
+        free(batch.cmds[i].err);
+    }
+    free(batch.cmds);
+    return client_cleanup(cli_socket, batch.sbuf, batch.rd.buff, rc);
 }
 
 
@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Warm helpers, enabled with -w N.
+ *
+ * A helper is a child of the server that was forked ahead of time for
+ * one program, keyed by argv[0], and waits on a SOCK_SEQPACKET socket
+ * for a request: the arguments, and the stdin, stdout and stderr of the
+ * stage passed with SCM_RIGHTS.  It then dup2()s them into place and
+ * execv()s the program it was forked for.  Starting a stage this way is
+ * one sendmsg() on the request path, fork() and the PATH search already
+ * happened, and the replacement helper is forked by the refill thread
+ * while the command runs.
+ *
+ * exec and dynamic linking cannot be done ahead of time: a program reads
+ * its arguments when it starts and most exit at the end of their input,
+ * so a process that already exec()ed grep cannot be handed a new grep
+ * command.  Those costs stay on the request path, the helpers only take
+ * fork() off it, which is what grows with the size of the server.
+ *
+ * A helper is a plain child of the server, so the stage it becomes is
+ * reaped with wait4() by rsh_wait_pipeline() like any other.  At most N
+ * programs have a helper, the least recently used one is killed to make
+ * room for a new program.  Stages with redirections, more than
+ * RSH_COPROC_ARGV_MAX arguments or RSH_COPROC_MSG_SZ bytes of arguments
+ * are started with launch_stage().
+ */
+#define COPROC_EMPTY    0       //slot unused
+#define COPROC_WANTED   1       //the refill thread must fork a helper
+#define COPROC_FORKING  2       //the refill thread is forking it
+#define COPROC_READY    3       //a helper waits on ctl
+
+#define COPROC_CTL_FD   3       //control socket inside a helper
+
+typedef struct rsh_coproc {
+    int            state;
+    char          *name;        //argv[0] the helper is for
+    char          *path;        //program it runs
+    pid_t          pid;
+    int            ctl;         //server end of the control socket
+    unsigned long  used;        //LRU tick of the last request
+} rsh_coproc_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    rsh_coproc_t   *slots;
+    int             cap;        //-w N, 0 when disabled
+    int             started;    //refill thread running
+    int             stopping;
+    pthread_t       thread;
+    unsigned long   tick;
+    unsigned long   hits;       //stages started by a helper
+    unsigned long   misses;     //no helper was ready
+} coprocs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * set_coproc_pool(num)
+ *      num:  programs to keep a warm helper for, 0 disables them
+ */
+void set_coproc_pool(int num) {
+    coprocs.cap = num;
+}
+
+/*
+ * coproc_helper(path)
+ *
+ *  Body of a helper, never returns.  It runs in the child of a threaded
+ *  process, so it sticks to async-signal-safe calls and static buffers.
+ */
+static void coproc_helper(const char *path) {
+    static char buff[RSH_COPROC_MSG_SZ];
+    static char *argv[RSH_COPROC_ARGV_MAX + 1];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buff, sizeof(buff) - 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    sigset_t no_signals;
+    int fds[3];
+    ssize_t len;
+    int argc = 0;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    // Step 1: Wait for the request, the server closing the socket means
+    //         the helper was dropped
+    do {
+        len = recvmsg(COPROC_CTL_FD, &msg, MSG_CMSG_CLOEXEC);
+    } while (len < 0 && errno == EINTR);
+    cm = CMSG_FIRSTHDR(&msg);
+    if (len <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || cm == NULL ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        _exit(0);
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    // Step 2: Split the arguments, they arrive as NUL terminated strings
+    buff[len] = '\0';
+    for (char *p = buff; p < buff + len && argc < RSH_COPROC_ARGV_MAX; p += strlen(p) + 1) {
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+
+    // Step 3: Become the stage, same as the fork launcher
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[2], STDERR_FILENO);
+    close(COPROC_CTL_FD);
+
+    execv(path, argv);
+    write(STDERR_FILENO, argv[0], strlen(argv[0]));
+    write(STDERR_FILENO, ": command not found\n", 20);
+    _exit(EXIT_NOT_FOUND);
+}
+
+/*
+ * coproc_fork(path, ctl)
+ *      ctl:  receives the server end of the control socket
+ *
+ *  Forks a helper for path.  The helper keeps nothing but its control
+ *  socket and the standard descriptors, a client socket it inherited
+ *  would otherwise stay open as long as the helper waits.
+ *
+ *  Returns the process id of the helper, or -1.
+ */
+static pid_t coproc_fork(const char *path, int *ctl) {
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        if (dup2(sv[1], COPROC_CTL_FD) < 0) {
+            _exit(1);
+        }
+        close_range(COPROC_CTL_FD + 1, ~0U, 0);
+        coproc_helper(path);
+    }
+
+    close(sv[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+    *ctl = sv[0];
+    return pid;
+}
+
+/*
+ * coproc_drop_locked(slot)
+ *
+ *  Ends the helper of a slot, if it has one, and empties the slot.
+ */
+static void coproc_drop_locked(rsh_coproc_t *slot) {
+    if (slot->state == COPROC_READY) {
+        close(slot->ctl);       //the helper sees EOF and exits
+        kill(slot->pid, SIGKILL);
+        waitpid(slot->pid, NULL, 0);
+    }
+    free(slot->name);
+    free(slot->path);
+    memset(slot, 0, sizeof(rsh_coproc_t));
+}
+
+/*
+ * coproc_refill(arg)
+ *
+ *  The refill thread: forks a helper for every slot that wants one.  The
+ *  lock is not held while forking, a slot dropped in the meantime is no
+ *  longer COPROC_FORKING and the new helper is ended.
+ */
+static void *coproc_refill(void *arg) {
+    rsh_coproc_t *slot;
+    char *name;
+    char *path;
+    pid_t pid;
+    int ctl;
+
+    (void)arg;
+    pthread_mutex_lock(&coprocs.lock);
+    while (!coprocs.stopping) {
+        slot = NULL;
+        for (int i = 0; i < coprocs.cap && slot == NULL; i++) {
+            if (coprocs.slots[i].state == COPROC_WANTED) {
+                slot = &coprocs.slots[i];
+            }
+        }
+        if (slot == NULL) {
+            pthread_cond_wait(&coprocs.wake, &coprocs.lock);
+            continue;
+        }
+
+        slot->state = COPROC_FORKING;
+        name = slot->name;
+        path = slot->path;
+        pthread_mutex_unlock(&coprocs.lock);
+
+        pid = coproc_fork(path, &ctl);
+
+        pthread_mutex_lock(&coprocs.lock);
+        if (slot->state != COPROC_FORKING || slot->name != name) {
+            if (pid > 0) {
+                close(ctl);
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+            }
+        } else if (pid < 0) {
+            coproc_drop_locked(slot);
+        } else {
+            slot->pid = pid;
+            slot->ctl = ctl;
+            slot->state = COPROC_READY;
+        }
+    }
+    pthread_mutex_unlock(&coprocs.lock);
+    return NULL;
+}
+
+/*
+ * coproc_start_locked()
+ *
+ *  Allocates the slots and starts the refill thread on first use, so
+ *  every pre-fork worker starts its own after it was forked.
+ *
+ *  Returns OK or ERR_RDSH_SERVER.
+ */
+static int coproc_start_locked(void) {
+    sigset_t all, old;
+    int rc;
+
+    if (coprocs.started) {
+        return OK;
+    }
+    coprocs.slots = calloc(coprocs.cap, sizeof(rsh_coproc_t));
+    if (coprocs.slots == NULL) {
+        perror("calloc");
+        coprocs.cap = 0;
+        return ERR_RDSH_SERVER;
+    }
+
+    //signals stay with the threads that expect them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(&coprocs.thread, NULL, coproc_refill, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+        free(coprocs.slots);
+        coprocs.slots = NULL;
+        coprocs.cap = 0;
+        return ERR_RDSH_SERVER;
+    }
+    coprocs.started = 1;
+    return OK;
+}
+
+/*
+ * coproc_take_locked(name, path, ctl)
+ *
+ *  Looks up the helper for name.  A ready helper for the same path is
+ *  handed out and a replacement asked for.  A program without a slot
+ *  gets one, the least recently used slot is reused when all are taken.
+ *
+ *  Returns the helper's process id, or -1 if none is ready.
+ */
+static pid_t coproc_take_locked(const char *name, const char *path, int *ctl) {
+    rsh_coproc_t *slot = NULL;
+    rsh_coproc_t *victim = NULL;
+    pid_t pid;
+
+    for (int i = 0; i < coprocs.cap; i++) {
+        rsh_coproc_t *s = &coprocs.slots[i];
+
+        if (s->state != COPROC_EMPTY && strcmp(s->name, name) == 0) {
+            slot = s;
+            break;
+        }
+        if (s->state == COPROC_FORKING) {
+            continue;
+        }
+        if (victim == NULL || victim->state != COPROC_EMPTY) {
+            if (s->state == COPROC_EMPTY || victim == NULL || s->used < victim->used) {
+                victim = s;
+            }
+        }
+    }
+
+    if (slot != NULL && strcmp(slot->path, path) != 0 && slot->state != COPROC_FORKING) {
+        //PATH now finds another program under that name
+        coproc_drop_locked(slot);
+        victim = slot;
+        slot = NULL;
+    }
+
+    if (slot == NULL) {
+        if (victim == NULL) {
+            return -1;
+        }
+        coproc_drop_locked(victim);
+        victim->name = strdup(name);
+        victim->path = strdup(path);
+        if (victim->name == NULL || victim->path == NULL) {
+            coproc_drop_locked(victim);
+            return -1;
+        }
+        victim->state = COPROC_WANTED;
+        victim->used = ++coprocs.tick;
+        pthread_cond_signal(&coprocs.wake);
+        return -1;
+    }
+
+    slot->used = ++coprocs.tick;
+    if (slot->state != COPROC_READY) {
+        return -1;
+    }
+    pid = slot->pid;
+    *ctl = slot->ctl;
+    slot->state = COPROC_WANTED;
+    pthread_cond_signal(&coprocs.wake);
+    return pid;
+}
+
+/*
+ * coproc_send(ctl, cmd, in_fd, out_fd, err_fd)
+ *
+ *  Sends a request to a helper, the arguments as NUL terminated strings
+ *  and the three descriptors.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if the helper is gone.
+ */
+static int coproc_send(int ctl, cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    struct iovec iov[RSH_COPROC_ARGV_MAX];
+    int fds[3] = { in_fd, out_fd, err_fd };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    ssize_t sent;
+    size_t len = 0;
+
+    for (int i = 0; i < cmd->argc; i++) {
+        iov[i].iov_base = cmd->argv[i];
+        iov[i].iov_len = strlen(cmd->argv[i]) + 1;
+        len += iov[i].iov_len;
+    }
+
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cmd->argc;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    do {
+        sent = sendmsg(ctl, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return (sent == (ssize_t)len) ? OK : ERR_RDSH_COMMUNICATION;
+}
+
+/*
+ * rsh_coproc_launch(cmd, in_fd, out_fd, err_fd)
+ *
+ *  launch_stage() for the server: the stage is handed to a warm helper
+ *  when one is ready for its program, and started with launch_stage()
+ *  otherwise.
+ *
+ *  Returns the process id of the stage, or -1 if it could not be started.
+ */
+pid_t rsh_coproc_launch(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    char path[PATH_MAX];
+    size_t len = 0;
+    pid_t pid;
+    int ctl;
+
+    if (coprocs.cap == 0 || cmd->input_file || cmd->output_file ||
+        cmd->argc > RSH_COPROC_ARGV_MAX || in_fd < 0 || out_fd < 0 || err_fd < 0) {
+        return launch_stage(cmd, in_fd, out_fd, err_fd);
+    }
+    for (int i = 0; i < cmd->argc; i++) {
+        len += strlen(cmd->argv[i]) + 1;
+    }
+    if (len >= RSH_COPROC_MSG_SZ) {
+        return launch_stage(cmd, in_fd, out_fd, err_fd);
+    }
+
+    // A program PATH does not find is left to launch_stage() to report
+    if (strchr(cmd->argv[0], '/') != NULL) {
+        snprintf(path, sizeof(path), "%s", cmd->argv[0]);
+    } else if (path_hash_lookup(cmd->argv[0], path, sizeof(path)) != OK) {
+        return launch_stage(cmd, in_fd, out_fd, err_fd);
+    }
+
+    pthread_mutex_lock(&coprocs.lock);
+    pid = -1;
+    if (coproc_start_locked() == OK) {
+        pid = coproc_take_locked(cmd->argv[0], path, &ctl);
+    }
+    if (pid > 0) {
+        coprocs.hits++;
+    } else {
+        coprocs.misses++;
+    }
+    pthread_mutex_unlock(&coprocs.lock);
+
+    if (pid < 0) {
+        return launch_stage(cmd, in_fd, out_fd, err_fd);
+    }
+
+    if (coproc_send(ctl, cmd, in_fd, out_fd, err_fd) != OK) {
+        //the helper died while it waited, start the stage the slow way
+        close(ctl);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return launch_stage(cmd, in_fd, out_fd, err_fd);
+    }
+    close(ctl);
+    return pid;
+}
+
+/*
+ * rsh_coproc_shutdown()
+ *
+ *  Stops the refill thread and ends every helper, called before the
+ *  server or a pre-fork worker exits.
+ */
+void rsh_coproc_shutdown(void) {
+    pthread_mutex_lock(&coprocs.lock);
+    if (!coprocs.started) {
+        pthread_mutex_unlock(&coprocs.lock);
+        return;
+    }
+    coprocs.stopping = 1;
+    pthread_cond_signal(&coprocs.wake);
+    pthread_mutex_unlock(&coprocs.lock);
+    pthread_join(coprocs.thread, NULL);
+
+    pthread_mutex_lock(&coprocs.lock);
+    for (int i = 0; i < coprocs.cap; i++) {
+        coproc_drop_locked(&coprocs.slots[i]);
+    }
+    free(coprocs.slots);
+    coprocs.slots = NULL;
+    coprocs.started = 0;
+    coprocs.stopping = 0;
+    pthread_mutex_unlock(&coprocs.lock);
+}
+
+/*
+ * rsh_format_coproc(buff, buff_sz)
+ *
+ *  Formats the warm helper line of the `rstats` report, nothing when
+ *  helpers are disabled.
+ *
+ *  Returns the length of the line.
+ */
+int rsh_format_coproc(char *buff, int buff_sz) {
+    int ready = 0;
+    int len;
+
+    if (coprocs.cap == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&coprocs.lock);
+    for (int i = 0; i < coprocs.cap && coprocs.slots != NULL; i++) {
+        ready += (coprocs.slots[i].state == COPROC_READY);
+    }
+    len = snprintf(buff, buff_sz, "warm helpers:      %d of %d ready, %lu hits, %lu misses\n",
+                   ready, coprocs.cap, coprocs.hits, coprocs.misses);
+    pthread_mutex_unlock(&coprocs.lock);
+    return (len < buff_sz) ? len : buff_sz - 1;
+}
@@ -0,0 +1,298 @@
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Every pipeline the server runs is recorded twice: in the rsh_metrics_t
+ * of the client that sent it, owned by the thread serving that client,
+ * and in the server wide table below, shared by all threads.  Prefork
+ * workers are separate processes, each keeps its own server wide table.
+ */
+static rsh_metrics_t   global_metrics;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static char           *metrics_file = NULL;
+
+/*
+ * set_metrics_file(path)
+ *      path:  file the server appends its metrics to, NULL disables
+ */
+void set_metrics_file(char *path) {
+    metrics_file = path;
+}
+
+/*
+ * rsh_usec_since(from)
+ *
+ *  Returns the microseconds elapsed on CLOCK_MONOTONIC since from.
+ */
+double rsh_usec_since(struct timespec *from) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1e6 +
+           (now.tv_nsec - from->tv_nsec) / 1e3;
+}
+
+/*
+ * rsh_usage_start(usage)
+ *
+ *  Clears the usage of a command and stamps the time it was received,
+ *  the start of its wall clock latency.
+ */
+void rsh_usage_start(rsh_cmd_usage_t *usage) {
+    memset(usage, 0, sizeof(rsh_cmd_usage_t));
+    clock_gettime(CLOCK_MONOTONIC, &usage->received);
+}
+
+/*
+ * rsh_usage_add(usage, ru)
+ *
+ *  Adds the rusage wait4() returned for one stage.  CPU time and context
+ *  switches are summed over the stages, the resident set size is the
+ *  largest of them.
+ */
+void rsh_usage_add(rsh_cmd_usage_t *usage, struct rusage *ru) {
+    usage->user_us += ru->ru_utime.tv_sec * 1e6 + ru->ru_utime.tv_usec;
+    usage->sys_us += ru->ru_stime.tv_sec * 1e6 + ru->ru_stime.tv_usec;
+    if (ru->ru_maxrss > usage->max_rss_kb) {
+        usage->max_rss_kb = ru->ru_maxrss;
+    }
+    usage->nvcsw += ru->ru_nvcsw;
+    usage->nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * hist_bucket(us)
+ *
+ *  Log-linear bucket of a value: 0 to 3 have a bucket each, above that
+ *  every power of two is split into 4 equal buckets.
+ */
+static int hist_bucket(double us) {
+    unsigned long long v = (us < 0) ? 0 : (unsigned long long)us;
+    int msb;
+    int idx;
+
+    if (v < 4) {
+        return (int)v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    idx = 4 * (msb - 1) + (int)((v >> (msb - 2)) & 3);
+    return (idx < RSH_HIST_BUCKETS) ? idx : RSH_HIST_BUCKETS - 1;
+}
+
+/*
+ * hist_upper(idx)
+ *
+ *  Returns the largest value that falls in a bucket.
+ */
+static double hist_upper(int idx) {
+    int shift;
+
+    if (idx < 4) {
+        return idx;
+    }
+    shift = idx / 4 - 1;
+    return (double)(((5ULL + idx % 4) << shift) - 1);
+}
+
+static void hist_add(rsh_hist_t *h, double us) {
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->buckets[hist_bucket(us)]++;
+}
+
+/*
+ * hist_percentile(h, pct)
+ *
+ *  Returns the upper bound of the bucket holding the pct percentile, in
+ *  microseconds, never more than the largest value recorded.
+ */
+static double hist_percentile(rsh_hist_t *h, double pct) {
+    unsigned long rank = (unsigned long)(h->count * pct / 100.0 + 0.5);
+    unsigned long seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < RSH_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return (hist_upper(i) < h->max_us) ? hist_upper(i) : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void metrics_add(rsh_metrics_t *m, rsh_cmd_usage_t *usage,
+                        double wall_us, int rc) {
+    m->commands++;
+    if (rc != 0) {
+        m->failed++;
+    }
+    hist_add(&m->wall, wall_us);
+    hist_add(&m->launch, usage->launch_us);
+    hist_add(&m->cpu, usage->user_us + usage->sys_us);
+    m->user_us += usage->user_us;
+    m->sys_us += usage->sys_us;
+    if (usage->max_rss_kb > m->max_rss_kb) {
+        m->max_rss_kb = usage->max_rss_kb;
+    }
+    m->nvcsw += usage->nvcsw;
+    m->nivcsw += usage->nivcsw;
+}
+
+/*
+ * rsh_metrics_record(client, usage, rc)
+ *      client:  metrics of the client that sent the command, may be NULL
+ *      usage:   the command, its wall clock latency ends now
+ *      rc:      status the command was reported with
+ *
+ *  Called right after the end of a command was sent to the client.
+ */
+void rsh_metrics_record(rsh_metrics_t *client, rsh_cmd_usage_t *usage, int rc) {
+    double wall_us = rsh_usec_since(&usage->received);
+
+    if (client != NULL) {
+        metrics_add(client, usage, wall_us, rc);
+    }
+    pthread_mutex_lock(&global_lock);
+    metrics_add(&global_metrics, usage, wall_us, rc);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static int format_hist(char *buff, int buff_sz, const char *name, rsh_hist_t *h) {
+    return snprintf(buff, buff_sz,
+        "  %-16s avg %.3f  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n", name,
+        h->count ? h->sum_us / h->count / 1000 : 0.0,
+        hist_percentile(h, 50) / 1000, hist_percentile(h, 99) / 1000,
+        hist_percentile(h, 99.9) / 1000, h->max_us / 1000);
+}
+
+/*
+ * format_metrics(buff, buff_sz, scope, m)
+ *
+ *  Appends one block of the report, never writes past buff_sz.
+ *
+ *  Returns the number of bytes written.
+ */
+static int format_metrics(char *buff, int buff_sz, const char *scope,
+                          rsh_metrics_t *m) {
+    int len;
+
+    len = snprintf(buff, buff_sz, "%-19s%lu run, %lu failed\n",
+                   scope, m->commands, m->failed);
+    if (m->commands == 0 || len >= buff_sz) {
+        return (len < buff_sz) ? len : buff_sz - 1;
+    }
+    len += format_hist(buff + len, buff_sz - len, "wall ms:", &m->wall);
+    if (len < buff_sz) {
+        len += format_hist(buff + len, buff_sz - len, "launch ms:", &m->launch);
+    }
+    if (len < buff_sz) {
+        len += format_hist(buff + len, buff_sz - len, "cpu ms:", &m->cpu);
+    }
+    if (len < buff_sz) {
+        len += snprintf(buff + len, buff_sz - len,
+            "  cpu total:       user %.3f s, sys %.3f s\n"
+            "  max rss:         %ld kB\n"
+            "  ctx switches:    %lu voluntary, %lu involuntary\n",
+            m->user_us / 1e6, m->sys_us / 1e6, m->max_rss_kb,
+            m->nvcsw, m->nivcsw);
+    }
+    return (len < buff_sz) ? len : buff_sz - 1;
+}
+
+/*
+ * rsh_format_metrics(buff, buff_sz, client)
+ *      buff:     buffer that receives the report as a C string
+ *      buff_sz:  size of buff
+ *      client:   metrics of the asking client, NULL for the server only
+ *
+ *  Formats the command metrics part of the `rstats` report.  Latencies
+ *  are percentiles read from the histograms, in milliseconds: wall is
+ *  from receiving the command to sending its end, launch is the time
+ *  spent starting the stages and cpu the user plus system time of all
+ *  stages, so a slow command can be told apart as network or queueing
+ *  (wall much larger than cpu), process creation (launch) or the
+ *  command itself (cpu).
+ *
+ *  Returns the length of the report.
+ */
+int rsh_format_metrics(char *buff, int buff_sz, rsh_metrics_t *client) {
+    rsh_metrics_t snap;
+    int len = 0;
+
+    pthread_mutex_lock(&global_lock);
+    snap = global_metrics;
+    pthread_mutex_unlock(&global_lock);
+
+    len += format_metrics(buff + len, buff_sz - len, "server commands:", &snap);
+    if (client != NULL) {
+        len += format_metrics(buff + len, buff_sz - len, "client commands:", client);
+    }
+    return len;
+}
+
+/*
+ * rsh_dump_metrics()
+ *
+ *  Appends the server wide metrics to the file given with -m, if any,
+ *  followed by every non empty bucket of the wall clock histogram
+ *  ("upper bound us: count") for offline analysis.  Every dump starts
+ *  with the pid, so the sections written by prefork workers sharing
+ *  the file can be told apart.
+ *
+ *  Returns OK, or ERR_RDSH_SERVER if the file could not be written.
+ */
+int rsh_dump_metrics(void) {
+    rsh_metrics_t snap;
+    char *buff;
+    FILE *fp;
+    time_t now = time(NULL);
+
+    if (metrics_file == NULL) {
+        return OK;
+    }
+
+    buff = malloc(RDSH_COMM_BUFF_SZ);
+    if (buff == NULL) {
+        return ERR_MEMORY;
+    }
+    fp = fopen(metrics_file, "a");
+    if (fp == NULL) {
+        perror(metrics_file);
+        free(buff);
+        return ERR_RDSH_SERVER;
+    }
+
+    pthread_mutex_lock(&global_lock);
+    snap = global_metrics;
+    pthread_mutex_unlock(&global_lock);
+
+    format_metrics(buff, RDSH_COMM_BUFF_SZ, "server commands:", &snap);
+    fprintf(fp, "# dsh server pid %d, %s", getpid(), ctime(&now));
+    fputs(buff, fp);
+    fprintf(fp, "  wall histogram:\n");
+    for (int i = 0; i < RSH_HIST_BUCKETS; i++) {
+        if (snap.wall.buckets[i] > 0) {
+            fprintf(fp, "    %12.0f: %lu\n", hist_upper(i), snap.wall.buckets[i]);
+        }
+    }
+
+    free(buff);
+    if (fclose(fp) != 0) {
+        perror(metrics_file);
+        return ERR_RDSH_SERVER;
+    }
+    return OK;
+}
@@ -0,0 +1,223 @@
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+
+/*
+ * send_all_iov(sock, iov, iovcnt)
+ *
+ *  writev() until every byte of every iovec has been sent.  A socket send
+ *  may be partial, the iovecs are advanced past what was written and the
+ *  call is repeated.  MSG_NOSIGNAL keeps a vanished peer from killing the
+ *  process with SIGPIPE.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+static int send_all_iov(int sock, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return OK;
+}
+
+/*
+ * rdsh_encode_hdr(raw, type, session, req_id, len)
+ *      raw:  receives RDSH_FRAME_HDR_SZ bytes ready to be sent
+ *
+ *  Encodes a frame header in network byte order.
+ */
+void rdsh_encode_hdr(char *raw, uint8_t type, uint16_t session,
+                     uint32_t req_id, uint32_t len) {
+    rdsh_frame_hdr_t hdr;
+
+    hdr.magic = htons(RDSH_FRAME_MAGIC);
+    hdr.version = RDSH_PROTO_VERSION;
+    hdr.type = type;
+    hdr.session = htons(session);
+    hdr.flags = 0;
+    hdr.req_id = htonl(req_id);
+    hdr.length = htonl(len);
+    memcpy(raw, &hdr, RDSH_FRAME_HDR_SZ);
+}
+
+/*
+ * rdsh_send_frame(sock, type, session, req_id, data, len)
+ *      sock:     connected socket
+ *      type:     one of the RDSH_FT_* frame types
+ *      session:  logical session the frame belongs to
+ *      req_id:   request the frame belongs to
+ *      data:     payload, may be NULL when len is 0
+ *      len:      payload length, at most RDSH_MAX_PAYLOAD
+ *
+ *  Encodes the header in network byte order and sends it together with
+ *  the payload in a single sendmsg() when possible.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rdsh_send_frame(int sock, uint8_t type, uint16_t session, uint32_t req_id,
+                    const void *data, uint32_t len) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+    struct iovec iov[2];
+
+    rdsh_encode_hdr(hdr, type, session, req_id, len);
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = RDSH_FRAME_HDR_SZ;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    return send_all_iov(sock, iov, len > 0 ? 2 : 1);
+}
+
+/*
+ * rdsh_send_cmd(sock, session, req_id, cmd, flags)
+ *
+ *  Sends a command line in a CMD frame, flags is a mask of RDSH_FL_*.
+ */
+int rdsh_send_cmd(int sock, uint16_t session, uint32_t req_id,
+                  const char *cmd, uint16_t flags) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+    uint16_t net_flags = htons(flags);
+    struct iovec iov[2];
+    uint32_t len = strlen(cmd);
+
+    rdsh_encode_hdr(hdr, RDSH_FT_CMD, session, req_id, len);
+    memcpy(hdr + offsetof(rdsh_frame_hdr_t, flags), &net_flags, sizeof(net_flags));
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = RDSH_FRAME_HDR_SZ;
+    iov[1].iov_base = (void *)cmd;
+    iov[1].iov_len = len;
+
+    return send_all_iov(sock, iov, len > 0 ? 2 : 1);
+}
+
+/*
+ * rdsh_send_exit(sock, session, req_id, status)
+ *
+ *  Sends the EXIT frame that ends the response to a command.
+ */
+int rdsh_send_exit(int sock, uint16_t session, uint32_t req_id, int status) {
+    uint32_t payload = htonl((uint32_t)status);
+
+    return rdsh_send_frame(sock, RDSH_FT_EXIT, session, req_id,
+                           &payload, sizeof(payload));
+}
+
+/*
+ * rdsh_decode_hdr(raw, hdr)
+ *      raw:  RDSH_FRAME_HDR_SZ bytes as received from the network
+ *      hdr:  receives the header in host byte order
+ *
+ *  Returns OK, or ERR_RDSH_PROTOCOL if the magic or length is invalid.
+ */
+int rdsh_decode_hdr(const char *raw, rdsh_frame_hdr_t *hdr) {
+    memcpy(hdr, raw, RDSH_FRAME_HDR_SZ);
+    hdr->magic = ntohs(hdr->magic);
+    hdr->session = ntohs(hdr->session);
+    hdr->flags = ntohs(hdr->flags);
+    hdr->req_id = ntohl(hdr->req_id);
+    hdr->length = ntohl(hdr->length);
+
+    if (hdr->magic != RDSH_FRAME_MAGIC || hdr->length > RDSH_MAX_PAYLOAD) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    return OK;
+}
+
+/*
+ * rdsh_recv_frame(sock, hdr, payload, payload_sz)
+ *      sock:        connected socket
+ *      hdr:         receives the decoded header
+ *      payload:     receives the payload
+ *      payload_sz:  size of payload, frames that do not fit are an error
+ *
+ *  Blocking receive of exactly one frame.
+ *
+ *  Returns:
+ *
+ *      <length>:                payload length of the received frame
+ *      ERR_RDSH_COMMUNICATION:  recv() failed or the peer closed the
+ *                               connection
+ *      ERR_RDSH_PROTOCOL:       the bytes received are not a valid frame
+ */
+int rdsh_recv_frame(int sock, rdsh_frame_hdr_t *hdr, char *payload, uint32_t payload_sz) {
+    char raw[RDSH_FRAME_HDR_SZ];
+    ssize_t io_size;
+
+    io_size = recv(sock, raw, RDSH_FRAME_HDR_SZ, MSG_WAITALL);
+    if (io_size != RDSH_FRAME_HDR_SZ) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (rdsh_decode_hdr(raw, hdr) != OK || hdr->length > payload_sz) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    if (hdr->length > 0) {
+        io_size = recv(sock, payload, hdr->length, MSG_WAITALL);
+        if (io_size != (ssize_t)hdr->length) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+    }
+    return hdr->length;
+}
+
+/*
+ * rdsh_client_hello(sock)
+ *      sock:  socket returned from start_client()
+ *
+ *  Offers RDSH_PROTO_VERSION to the server and waits for its answer.
+ *
+ *  Returns:
+ *
+ *      <version>:          the version the server picked, RDSH_PROTO_LEGACY
+ *                          if it only speaks the EOF delimited protocol
+ *      ERR_RDSH_PROTOCOL:  the server does not understand HELLO at all.
+ *                          It ran the frame as a command, so the caller
+ *                          has to reconnect before using legacy mode.
+ */
+int rdsh_client_hello(int sock) {
+    rdsh_frame_hdr_t hdr;
+    uint8_t version = RDSH_PROTO_VERSION;
+    char payload[16];
+    int rc;
+
+    if (rdsh_send_frame(sock, RDSH_FT_HELLO, 0, 0, &version, sizeof(version)) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    rc = rdsh_recv_frame(sock, &hdr, payload, sizeof(payload));
+    if (rc < 1 || hdr.type != RDSH_FT_HELLO) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    return (uint8_t)payload[0];
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -7,7 +8,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/pidfd.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 //INCLUDES for extra credit
 #include <signal.h>
@@ -17,399 +26,2909 @@
 #include "dshlib.h"
 #include "rshlib.h"
 
-void *handle_client(void *arg);
 int process_cli_requests_threaded(int svr_socket);
+static int is_framed_client(int cli_socket);
+static int legacy_next_command(int cli_socket, rsh_stream_t *stream, char **cmd);
 
+static int splice_output = 1;
 
+
+/**************   GRACEFUL STOP  ***************/
+
+/*
+ * `stop-server` drains the server in every mode: it stops accepting,
+ * idle sessions are closed, and commands that are already running get
+ * drain_timeout seconds to finish before they are killed.  The request
+ * is an eventfd that every blocking wait of the server polls next to its
+ * own descriptors, so the sessions of all threads see it at once.  It is
+ * created before pre-fork workers are started, so the worker that serves
+ * `stop-server` stops its siblings through the same eventfd.
+ *
+ * A pipeline is only ever killed by the session that started it, right
+ * before reaping it, so its process ids cannot have been reused.
+ */
+static int stop_fd = -1;
+static volatile sig_atomic_t stop_requested = 0;
+static struct timespec stop_time;               //when this process saw it
+static int drain_timeout = RDSH_DRAIN_TIMEOUT;
+static int drain_killed = 0;                    //pipelines killed at the
+                                                //deadline, under stop_lock
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * set_drain_timeout(secs)
+ *      secs:  seconds running commands get to finish after `stop-server`
+ */
+void set_drain_timeout(int secs) {
+    if (secs >= 0) {
+        drain_timeout = secs;
+    }
+}
+
+/*
+ * rsh_stop_init()
+ *
+ *  Creates the stop eventfd, called by start_server() before any client
+ *  is accepted.
+ *
+ *  Returns OK or ERR_RDSH_SERVER.
+ */
+int rsh_stop_init(void) {
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0) {
+        perror("eventfd");
+        return ERR_RDSH_SERVER;
+    }
+    stop_requested = 0;
+    drain_killed = 0;
+    return OK;
+}
+
+/*
+ * rsh_stop_fd()
+ *
+ *  Returns the descriptor that becomes readable once the server stops,
+ *  to be polled for POLLIN.  It is never read, it stays readable.
+ */
+int rsh_stop_fd(void) {
+    return stop_fd;
+}
+
+/*
+ * rsh_request_stop()
+ *
+ *  Starts the drain, called when a client sent `stop-server` and when a
+ *  wait saw the stop descriptor become readable.  Only the first call
+ *  starts the drain clock.
+ */
+void rsh_request_stop(void) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&stop_lock);
+    if (!stop_requested) {
+        clock_gettime(CLOCK_MONOTONIC, &stop_time);
+        stop_requested = 1;
+        if (stop_fd >= 0 && write(stop_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd");
+        }
+    }
+    pthread_mutex_unlock(&stop_lock);
+}
+
+/*
+ * rsh_stopping()
+ *
+ *  Returns 1 once this process knows the server is stopping.
+ */
+int rsh_stopping(void) {
+    return stop_requested;
+}
+
+/*
+ * rsh_drain_left_ms()
+ *
+ *  Returns the milliseconds running commands have left, 0 once the
+ *  deadline passed, or -1 while the server is not stopping, so it can be
+ *  used as a poll() timeout.
+ */
+int rsh_drain_left_ms(void) {
+    double left;
+
+    if (!stop_requested) {
+        return -1;
+    }
+    left = drain_timeout * 1000.0 - rsh_usec_since(&stop_time) / 1000;
+    return (left > 0) ? (int)left + 1 : 0;
+}
+
+/*
+ * drain_wait(pid)
+ *
+ *  Waits for a stage to exit without reaping it, or for the drain
+ *  deadline once the server is stopping.
+ *
+ *  Returns 1 if the deadline passed first, 0 otherwise.
+ */
+static int drain_wait(pid_t pid) {
+    struct pollfd pfd[2];
+    int timed_out = 0;
+    int n;
+
+    pfd[0].fd = pidfd_open(pid, 0);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stop_fd;
+    pfd[1].events = POLLIN;
+    if (pfd[0].fd < 0) {
+        return 0;   //no pidfd, wait4() blocks without a deadline
+    }
+
+    while (1) {
+        n = poll(pfd, stop_requested ? 1 : 2, rsh_drain_left_ms());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || pfd[0].revents) {
+            break;
+        }
+        if (n == 0) {
+            timed_out = 1;
+            break;
+        }
+        rsh_request_stop();
+    }
+    close(pfd[0].fd);
+    return timed_out;
+}
+
+/*
+ * rsh_drain_report(who)
+ *
+ *  Prints how long the drain took and how many pipelines were killed at
+ *  its deadline, nothing if the server was not stopped by a client.
+ */
+void rsh_drain_report(const char *who) {
+    int killed;
+
+    if (!stop_requested) {
+        return;
+    }
+    pthread_mutex_lock(&stop_lock);
+    killed = drain_killed;
+    pthread_mutex_unlock(&stop_lock);
+
+    printf("%s drained in %.1f ms", who, rsh_usec_since(&stop_time) / 1000);
+    if (killed > 0) {
+        printf(", %d pipeline%s killed at the %d s deadline", killed,
+               killed == 1 ? "" : "s", drain_timeout);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/**************   THREAD POOL MODE  ***************/
+
+/*
+ * The threaded server runs a fixed number of worker threads that take
+ * accepted client sockets from a bounded queue.  The accepting thread
+ * only calls accept() when the queue has room, so a connection storm is
+ * held in the kernel listen backlog instead of growing the server.  On
+ * `stop-server` queued clients are dropped, idle workers exit and the
+ * acceptor waits for the busy ones to end their session.
+ */
+typedef struct pool_item {
+    int             cli_socket;
+    struct timespec enqueued;
+} pool_item_t;
+
+typedef struct rsh_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    pthread_cond_t  idle;           //busy dropped to 0 while stopping
+    pool_item_t    *items;
+    int             head;
+    int             count;
+    int             closed;         //the pool failed to start, workers exit
+    rsh_pool_stats_t stats;
+} rsh_pool_t;
+
+static int pool_threads = RDSH_DEF_POOL_THREADS;
+static int pool_depth = RDSH_DEF_POOL_DEPTH;
+static rsh_pool_t *active_pool = NULL;
+
+/*
+ * set_thread_pool(threads, depth)
+ *      threads:  number of worker threads used by RDSH_SVR_THREADED
+ *      depth:    number of accepted clients that may wait for a worker
+ */
+void set_thread_pool(int threads, int depth) {
+    if (threads > 0) {
+        pool_threads = threads;
+    }
+    if (depth > 0) {
+        pool_depth = depth;
+    }
+}
+
+static double elapsed_ms(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 +
+           (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+/*
+ * get_thread_pool_stats(stats)
+ *      stats:  receives a snapshot of the thread pool counters
+ *
+ *  Returns OK, or ERR_RDSH_SERVER if the server is not running a pool.
+ */
+int get_thread_pool_stats(rsh_pool_stats_t *stats) {
+    rsh_pool_t *pool = active_pool;
+
+    if (pool == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return ERR_RDSH_SERVER;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->depth = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+    return OK;
+}
+
+/*
+ * rsh_format_stats(buff, buff_sz, client)
+ *      buff:     buffer that receives the report as a C string
+ *      buff_sz:  size of buff
+ *      client:   command metrics of the asking client, may be NULL
+ *
+ *  Formats the server counters returned to clients by the `rstats`
+ *  built-in command, the thread pool counters when the pool is running
+ *  followed by the command metrics, see rsh_format_metrics().  Every
+ *  report is also appended to the -m metrics file.
+ *
+ *  Returns the length of the report.
+ */
+int rsh_format_stats(char *buff, int buff_sz, rsh_metrics_t *client) {
+    rsh_pool_stats_t ps;
+    int len = 0;
+
+    if (get_thread_pool_stats(&ps) == OK) {
+        len = snprintf(buff, buff_sz,
+            "pool threads:      %d (%d busy)\n"
+            "queue depth:       %d of %d (max %d)\n"
+            "clients:           %lu accepted, %lu served\n"
+            "queue wait:        %.3f ms avg, %.3f ms max\n"
+            "accept held back:  %lu times, %.3f ms total\n",
+            ps.threads, ps.busy,
+            ps.depth, ps.capacity, ps.max_depth,
+            ps.accepted, ps.served,
+            ps.served ? ps.queue_wait_ms / ps.served : 0.0, ps.max_queue_wait_ms,
+            ps.full_waits, ps.full_wait_ms);
+    }
+
+    len += rsh_format_coproc(buff + len, buff_sz - len);
+    len += rsh_format_metrics(buff + len, buff_sz - len, client);
+    rsh_dump_metrics();
+    return len;
+}
+
+/*
+ * pool_put(pool, cli_socket)
+ *
+ *  Adds an accepted client to the queue.  The acceptor waits for room
+ *  before calling accept(), so the queue is never full here.
+ */
+static void pool_put(rsh_pool_t *pool, int cli_socket) {
+    pool_item_t *item;
+
+    pthread_mutex_lock(&pool->lock);
+    item = &pool->items[(pool->head + pool->count) % pool->stats.capacity];
+    item->cli_socket = cli_socket;
+    clock_gettime(CLOCK_MONOTONIC, &item->enqueued);
+    pool->count++;
+    pool->stats.accepted++;
+    if (pool->count > pool->stats.max_depth) {
+        pool->stats.max_depth = pool->count;
+    }
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * pool_wait_for_room(pool)
+ *
+ *  Blocks the acceptor while the queue is full.  This is the backpressure
+ *  point, time spent here is counted in stats.full_wait_ms.  Returns
+ *  early when the server is stopping.
+ */
+static void pool_wait_for_room(rsh_pool_t *pool) {
+    struct timespec start, now;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->stats.capacity) {
+        pool->stats.full_waits++;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (pool->count == pool->stats.capacity && !rsh_stopping()) {
+            pthread_cond_wait(&pool->not_full, &pool->lock);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pool->stats.full_wait_ms += elapsed_ms(&start, &now);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * pool_get(pool)
+ *
+ *  Removes the oldest client from the queue, waiting if it is empty, and
+ *  records how long the client waited for a worker.
+ *
+ *  Returns the client socket, or -1 when the server is stopping or the
+ *  pool is closed.
+ */
+static int pool_get(rsh_pool_t *pool) {
+    struct timespec now;
+    pool_item_t *item;
+    int cli_socket;
+    double waited;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == 0 && !pool->closed && !rsh_stopping()) {
+        pthread_cond_wait(&pool->not_empty, &pool->lock);
+    }
+    if (pool->closed || rsh_stopping()) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    item = &pool->items[pool->head];
+    cli_socket = item->cli_socket;
+    pool->head = (pool->head + 1) % pool->stats.capacity;
+    pool->count--;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = elapsed_ms(&item->enqueued, &now);
+    pool->stats.served++;
+    pool->stats.busy++;
+    pool->stats.queue_wait_ms += waited;
+    if (waited > pool->stats.max_queue_wait_ms) {
+        pool->stats.max_queue_wait_ms = waited;
+    }
+
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+    return cli_socket;
+}
+
+/*
+ * handle_client(arg)
+ *      arg:  the rsh_pool_t the worker thread serves
+ *
+ *  Worker thread body, serves one queued client at a time until the
+ *  server stops.  A session that ends while the server is stopping wakes
+ *  the idle workers and the acceptor, the client that sent `stop-server`
+ *  is always served by one.
+ */
 void *handle_client(void *arg) {
-    int cli_socket = *(int *)arg;
-    free(arg);  // Free memory allocated for socket
+    rsh_pool_t *pool = arg;
+    int cli_socket;
+
+    while ((cli_socket = pool_get(pool)) >= 0) {
+        printf("Client connected (Threaded).\n");
+
+        exec_client_requests(cli_socket);
+        close(cli_socket);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.busy--;
+        if (rsh_stopping()) {
+            pthread_cond_broadcast(&pool->not_empty);
+            pthread_cond_broadcast(&pool->not_full);
+            if (pool->stats.busy == 0) {
+                pthread_cond_signal(&pool->idle);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*
+ * pool_drain(pool)
+ *
+ *  Called by the acceptor once the server is stopping.  Clients still
+ *  queued never started a command and are dropped, then the acceptor
+ *  waits for the busy workers.  Their sessions kill what still runs at
+ *  the drain deadline, a session stuck past it is given up on one second
+ *  later, the process is about to exit anyway.
+ */
+static void pool_drain(rsh_pool_t *pool) {
+    struct timespec until;
+    int left = rsh_drain_left_ms();
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += left / 1000 + 1;
+    until.tv_nsec += (left % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->not_empty);
+    while (pool->count > 0) {
+        close(pool->items[pool->head].cli_socket);
+        pool->head = (pool->head + 1) % pool->stats.capacity;
+        pool->count--;
+    }
+    while (pool->stats.busy > 0) {
+        if (pthread_cond_timedwait(&pool->idle, &pool->lock, &until) == ETIMEDOUT) {
+            printf("%d sessions did not end, stopping anyway\n", pool->stats.busy);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * pool_abort(pool, tids, started)
+ *      tids:     the worker threads started so far
+ *      started:  how many there are
+ *
+ *  Undoes a pool that could not start all of its workers.  The queue is
+ *  still empty, so the workers are woken, joined and the pool is freed.
+ */
+static void pool_abort(rsh_pool_t *pool, pthread_t *tids, int started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    active_pool = NULL;
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->items);
+    free(pool);
+    free(tids);
+}
+
+/*
+ * process_cli_requests_threaded(svr_socket)
+ *      svr_socket:  The server socket that was obtained from boot_server()
+ *
+ *  Starts the worker threads (see set_thread_pool() for the sizes) and
+ *  then runs the accept loop on the calling thread, until a client sends
+ *  `stop-server` and the pool is drained.
+ *
+ *  Returns:
+ *
+ *      OK_EXIT:                 A client sent the `stop-server` command
+ *      ERR_RDSH_SERVER:         The pool could not be allocated or started
+ *      ERR_RDSH_COMMUNICATION:  accept() failed
+ */
+int process_cli_requests_threaded(int svr_socket) {
+    pthread_condattr_t attr;
+    struct pollfd pfd[2];
+    rsh_pool_t *pool;
+    pthread_t *tids;
+    int cli_socket;
+
+    pool = calloc(1, sizeof(rsh_pool_t));
+    tids = calloc(pool_threads, sizeof(pthread_t));
+    if (pool == NULL || tids == NULL ||
+        (pool->items = calloc(pool_depth, sizeof(pool_item_t))) == NULL) {
+        perror("calloc");
+        free(pool);
+        free(tids);
+        return ERR_RDSH_SERVER;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->idle, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->stats.threads = pool_threads;
+    pool->stats.capacity = pool_depth;
+    active_pool = pool;
+
+    //client sockets are inherited by pipelines of other threads unless
+    //they are close-on-exec, which would hold connections open
+    fcntl(svr_socket, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 0; i < pool_threads; i++) {
+        if (pthread_create(&tids[i], NULL, handle_client, pool) != 0) {
+            perror("pthread_create");
+            pool_abort(pool, tids, i);
+            return ERR_RDSH_SERVER;
+        }
+    }
+    for (int i = 0; i < pool_threads; i++) {
+        pthread_detach(tids[i]);  // Auto-clean up thread
+    }
+    free(tids);
+
+    pfd[0].fd = svr_socket;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rsh_stop_fd();
+    pfd[1].events = POLLIN;
+
+    while (1) {
+        pool_wait_for_room(pool);
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        cli_socket = accept4(svr_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (cli_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        pool_put(pool, cli_socket);
+    }
+
+    printf("Server shutting down...\n");
+    rsh_request_stop();
+    pool_drain(pool);
+    rsh_drain_report("Server");
+    return OK_EXIT;
+}
+
+
+/**************   EPOLL EVENT LOOP MODE  ***************/
+
+/*
+ * Every client connection in the epoll server is a small state machine.
+ * A connection is either waiting for a command (CONN_READ_CMD), streaming
+ * the output of a running pipeline back to the client (CONN_RUNNING),
+ * flushing its last message before being closed (CONN_CLOSING), or closed
+ * and waiting to be freed at the end of the current epoll batch
+ * (CONN_CLOSED).
+ *
+ * The epoll data pointer of each registered descriptor points at an
+ * rsh_ev_t so the loop knows which connection, and which of its
+ * descriptors (socket or pipeline output pipe), became ready.
+ */
+typedef enum {
+    CONN_READ_CMD,
+    CONN_RUNNING,
+    CONN_CLOSING,
+    CONN_CLOSED,
+} conn_state_t;
+
+#define EV_LISTEN   0
+#define EV_SOCK     1
+#define EV_PIPE     2
+
+struct rsh_conn;
+
+typedef struct rsh_ev {
+    int kind;
+    struct rsh_conn *conn;
+} rsh_ev_t;
+
+typedef struct rsh_conn {
+    int          sock;
+    conn_state_t state;
+    rsh_ev_t     sock_ev;
+    rsh_ev_t     pipe_ev;
+    int          out_pipe;          //read end of the last stage output
+    int          pipe_watched;      //out_pipe is registered with epoll
+    pid_t       *pids;              //of the running pipeline, grown to
+    int          pids_cap;          //the longest one of the connection
+    int          num_pids;
+    rsh_cmd_usage_t usage;          //of the running pipeline
+    rsh_metrics_t   metrics;        //of every command of this client
+    cmd_arena_t     arena;          //the current command is parsed into
+    rsh_stream_t    stream;         //received bytes, cut into commands
+    int             greeted;        //the opening bytes were checked for
+                                    //a HELLO frame
+    int             eof;            //the client shut down its side, an
+                                    //unterminated command may now run
+    char        *in_buff;           //replies of built-in commands
+    char        *out_buff;
+    int          out_len;
+    int          out_off;
+    struct rsh_conn *next;
+} rsh_conn_t;
+
+typedef struct rsh_loop {
+    int          epfd;
+    int          svr_socket;
+    int          null_fd;           //stdin for pipelines, the socket is
+                                    //non-blocking and owned by the loop
+    int          stopping;
+    rsh_ev_t     listen_ev;
+    rsh_conn_t  *conns;
+} rsh_loop_t;
+
+static const char RDSH_MSG_EXEC_FAILED[] =
+    "Error: Command not found or failed to execute.\n";
+
+static void conn_dispatch(rsh_loop_t *loop, rsh_conn_t *conn);
+
+/*
+ * conn_watch(loop, conn, sock_events, pipe_events)
+ *
+ *  Updates the epoll interest set of the connection socket, and of its
+ *  pipeline output pipe if a pipeline is running.  Passing 0 as the
+ *  events for the socket parks it, errors and hang ups are still reported.
+ *  A parked pipe is removed from epoll altogether, otherwise the EPOLLHUP
+ *  raised when the pipeline exits would be reported on every wait while
+ *  the client is still draining earlier output.
+ */
+static void conn_watch(rsh_loop_t *loop, rsh_conn_t *conn,
+                       uint32_t sock_events, uint32_t pipe_events) {
+    struct epoll_event ev;
+
+    ev.events = sock_events;
+    ev.data.ptr = &conn->sock_ev;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->sock, &ev);
+
+    if (conn->out_pipe < 0) {
+        return;
+    }
+
+    if (pipe_events == 0) {
+        if (conn->pipe_watched) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->out_pipe, NULL);
+            conn->pipe_watched = 0;
+        }
+        return;
+    }
+
+    ev.events = pipe_events;
+    ev.data.ptr = &conn->pipe_ev;
+    epoll_ctl(loop->epfd, conn->pipe_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+              conn->out_pipe, &ev);
+    conn->pipe_watched = 1;
+}
+
+/*
+ * conn_queue(conn, data, len)
+ *
+ *  Appends bytes to the pending output of a connection.  The buffer is
+ *  RDSH_COMM_BUFF_SZ long and callers only queue short messages while it
+ *  is drained, pipeline output is only read when the buffer is empty.
+ */
+static void conn_queue(rsh_conn_t *conn, const char *data, int len) {
+    if (conn->out_len + len > RDSH_COMM_BUFF_SZ) {
+        len = RDSH_COMM_BUFF_SZ - conn->out_len;
+    }
+    memcpy(conn->out_buff + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+/*
+ * conn_queue_message(conn, msg)
+ *
+ *  Non-blocking equivalent of send_message_string(), queues the null
+ *  terminated message followed by the EOF character.
+ */
+static void conn_queue_message(rsh_conn_t *conn, const char *msg) {
+    conn_queue(conn, msg, strlen(msg) + 1);
+    conn_queue(conn, &RDSH_EOF_CHAR, sizeof(RDSH_EOF_CHAR));
+}
+
+/*
+ * conn_close(loop, conn)
+ *
+ *  Closes the descriptors of a connection.  A pipeline that is still
+ *  running has lost its client, so it is killed before being reaped.  The
+ *  memory is released by loop_reap() once the current batch of epoll
+ *  events, which may still reference this connection, has been handled.
+ */
+static void conn_close(rsh_loop_t *loop, rsh_conn_t *conn) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+
+    if (conn->out_pipe >= 0) {
+        conn_watch(loop, conn, 0, 0);
+        close(conn->out_pipe);
+        conn->out_pipe = -1;
+    }
+    if (conn->num_pids > 0) {
+        rsh_abort_pipeline(conn->pids, conn->num_pids);
+        conn->num_pids = 0;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+    close(conn->sock);
+
+    conn->state = CONN_CLOSED;
+    printf("Client disconnected.\n");
+}
+
+/*
+ * loop_reap(loop)
+ *
+ *  Frees every connection closed during the last batch of events.
+ */
+static void loop_reap(rsh_loop_t *loop) {
+    rsh_conn_t **link = &loop->conns;
+    rsh_conn_t *conn;
+
+    while (*link != NULL) {
+        conn = *link;
+        if (conn->state != CONN_CLOSED) {
+            link = &conn->next;
+            continue;
+        }
+        *link = conn->next;
+        free(conn->in_buff);
+        free(conn->out_buff);
+        free(conn->pids);
+        cmd_arena_free(&conn->arena);
+        rsh_stream_free(&conn->stream);
+        free(conn);
+    }
+}
+
+/*
+ * conn_flush(loop, conn)
+ *
+ *  Sends as much pending output as the socket accepts.  When the socket
+ *  would block the loop waits for EPOLLOUT and stops reading the pipeline
+ *  so a slow client applies backpressure to the pipeline instead of the
+ *  server buffering without bound.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if the connection was closed.
+ */
+static int conn_flush(rsh_loop_t *loop, rsh_conn_t *conn) {
+    ssize_t sent;
+
+    while (conn->out_off < conn->out_len) {
+        sent = send(conn->sock, conn->out_buff + conn->out_off,
+                    conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_watch(loop, conn, EPOLLOUT, 0);
+                return OK;
+            }
+            conn_close(loop, conn);
+            return ERR_RDSH_COMMUNICATION;
+        }
+        conn->out_off += sent;
+    }
+
+    conn->out_len = 0;
+    conn->out_off = 0;
+
+    switch (conn->state) {
+        case CONN_CLOSING:
+            conn_close(loop, conn);
+            return ERR_RDSH_COMMUNICATION;
+        case CONN_RUNNING:
+            conn_watch(loop, conn, 0, EPOLLIN);
+            break;
+        case CONN_READ_CMD:
+            conn_watch(loop, conn, EPOLLIN, 0);
+            break;
+        case CONN_CLOSED:
+            return ERR_RDSH_COMMUNICATION;
+    }
+    return OK;
+}
+
+/*
+ * conn_finish_pipeline(loop, conn)
+ *
+ *  Called when the pipeline output pipe reports EOF.  Reaps the stages
+ *  and queues the EOF character, or the same error message that
+ *  exec_client_requests() sends before dropping the client.
+ */
+static void conn_finish_pipeline(rsh_loop_t *loop, rsh_conn_t *conn) {
+    int rc;
+
+    conn_watch(loop, conn, 0, 0);
+    close(conn->out_pipe);
+    conn->out_pipe = -1;
+
+    //every stage has closed its output so the waits below are expected
+    //to be short
+    rc = rsh_wait_pipeline(conn->pids, conn->num_pids, &conn->usage);
+    conn->num_pids = 0;
+
+    if (rc != 0) {
+        conn_queue_message(conn, RDSH_MSG_EXEC_FAILED);
+        conn->state = CONN_CLOSING;
+    } else {
+        conn_queue(conn, &RDSH_EOF_CHAR, sizeof(RDSH_EOF_CHAR));
+        conn->state = CONN_READ_CMD;
+    }
+    conn_flush(loop, conn);
+    rsh_metrics_record(&conn->metrics, &conn->usage, rc);
+    conn_dispatch(loop, conn);
+}
+
+/*
+ * conn_start_command(loop, conn, cmd)
+ *
+ *  Parses and dispatches one command.  Built-in exit and stop-server
+ *  behave as in exec_client_requests(), anything else is started as a
+ *  pipeline whose STDOUT and STDERR go to a pipe owned by the loop.
+ */
+static void conn_start_command(rsh_loop_t *loop, rsh_conn_t *conn, char *cmd) {
+    command_list_t cmd_list;
+    struct timespec start;
+    int out_pipe[2];
+    int rc;
+
+    cmd_arena_reset(&conn->arena);
+    rc = build_cmd_list_arena(cmd, &cmd_list, &conn->arena);
+    if (rc != OK) {
+        conn_queue_message(conn, "Error: Invalid command format.\n");
+        conn->state = CONN_CLOSING;
+        conn_flush(loop, conn);
+        return;
+    }
+
+    switch (rsh_match_command(cmd_list.commands[0].argv[0])) {
+        case BI_CMD_EXIT:
+            free_cmd_list(&cmd_list);
+            conn_queue_message(conn, "Exiting client session.\n");
+            conn->state = CONN_CLOSING;
+            conn_flush(loop, conn);
+            return;
+        case BI_CMD_STOP_SVR:
+            free_cmd_list(&cmd_list);
+            conn_queue_message(conn, "Server stopping.\n");
+            conn->state = CONN_CLOSING;
+            loop->stopping = 1;
+            rsh_request_stop();
+            conn_flush(loop, conn);
+            return;
+        case BI_CMD_RSTATS:
+            free_cmd_list(&cmd_list);
+            rsh_format_stats(conn->in_buff, RDSH_COMM_BUFF_SZ, &conn->metrics);
+            conn_queue_message(conn, conn->in_buff);
+            conn_flush(loop, conn);
+            return;
+        case BI_CMD_HASH:
+            path_hash_cmd(&cmd_list.commands[0], conn->in_buff, RDSH_COMM_BUFF_SZ);
+            free_cmd_list(&cmd_list);
+            conn_queue_message(conn, conn->in_buff);
+            conn_flush(loop, conn);
+            return;
+        default:
+            break;
+    }
+
+    if (rsh_reserve_pids(&conn->pids, &conn->pids_cap, cmd_list.num) != OK) {
+        free_cmd_list(&cmd_list);
+        conn_queue_message(conn, RDSH_MSG_EXEC_FAILED);
+        conn->state = CONN_CLOSING;
+        conn_flush(loop, conn);
+        return;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        free_cmd_list(&cmd_list);
+        conn_queue_message(conn, RDSH_MSG_EXEC_FAILED);
+        conn->state = CONN_CLOSING;
+        conn_flush(loop, conn);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = rsh_start_pipeline(&cmd_list, loop->null_fd, out_pipe[1],
+                            out_pipe[1], conn->pids);
+    conn->usage.launch_us = rsh_usec_since(&start);
+    conn->num_pids = (rc == OK) ? cmd_list.num : 0;
+    free_cmd_list(&cmd_list);
+    close(out_pipe[1]);
+
+    if (rc != OK) {
+        close(out_pipe[0]);
+        conn_queue_message(conn, RDSH_MSG_EXEC_FAILED);
+        conn->state = CONN_CLOSING;
+        conn_flush(loop, conn);
+        return;
+    }
+
+    fcntl(out_pipe[0], F_SETFL, fcntl(out_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(out_pipe[0], F_SETPIPE_SZ, RDSH_PIPE_SZ);
+    conn->out_pipe = out_pipe[0];
+    conn->pipe_watched = 0;
+    conn->state = CONN_RUNNING;
+    conn_watch(loop, conn, 0, EPOLLIN);
+}
+
+/*
+ * conn_dispatch(loop, conn)
+ *
+ *  Starts the commands waiting in the stream of a connection, one at a
+ *  time, whenever the connection is idle: no pipeline running and all
+ *  output sent.  Called after bytes were received, a pipeline finished
+ *  or output drained.  A command without terminator only runs once the
+ *  client shut down its side, see legacy_next_command(), and the
+ *  connection is closed when nothing is left.  Once the server is
+ *  stopping an idle connection is closed instead.
+ */
+static void conn_dispatch(rsh_loop_t *loop, rsh_conn_t *conn) {
+    char *cmd;
+    int rc;
+
+    if (loop->stopping && conn->state == CONN_READ_CMD && conn->out_len == 0) {
+        conn_close(loop, conn);
+        return;
+    }
+
+    while (conn->state == CONN_READ_CMD && conn->out_len == 0) {
+        rc = rsh_stream_next(&conn->stream, &cmd);
+        if (rc == 0) {
+            if (!conn->eof) {
+                return;
+            }
+            cmd = rsh_stream_flush(&conn->stream);
+            if (cmd == NULL) {
+                conn_close(loop, conn);
+                return;
+            }
+            rc = 1;
+        }
+
+        if (rc == ERR_RDSH_CMD_TOO_LONG) {
+            conn_queue_message(conn, "Error: Command too long. Input rejected.\n");
+            conn_flush(loop, conn);
+            continue;
+        }
+
+        rsh_usage_start(&conn->usage);
+        conn_start_command(loop, conn, cmd);
+    }
+}
+
+/*
+ * conn_hello(loop, conn)
+ *
+ *  A framed client opens with a HELLO frame.  This loop only runs legacy
+ *  commands, so the answer is version 0 and the client falls back to one
+ *  command at a time: batch sessions and a framed rsh-bench need -x or
+ *  -f.  The frame is cut out of the stream, bytes received after it are
+ *  commands.  Nothing is run before the whole frame arrived.
+ *
+ *  Returns 1 once the opening bytes are dealt with, 0 while more of the
+ *  frame is needed, -1 if the connection was closed.
+ */
+static int conn_hello(rsh_loop_t *loop, rsh_conn_t *conn) {
+    static int warned = 0;
+    rsh_stream_t *stream = &conn->stream;
+    char *first = stream->buff + stream->start;
+    char hello[RDSH_FRAME_HDR_SZ + 1];
+    rdsh_frame_hdr_t hdr;
+
+    if (first[0] != RDSH_EOF_CHAR) {
+        conn->greeted = 1;
+        return 1;
+    }
+    if (rsh_stream_pending(stream) < (size_t)RDSH_FRAME_HDR_SZ) {
+        return 0;
+    }
+    if (rdsh_decode_hdr(first, &hdr) != OK || hdr.type != RDSH_FT_HELLO) {
+        conn_close(loop, conn);
+        return -1;
+    }
+    if (rsh_stream_pending(stream) < RDSH_FRAME_HDR_SZ + hdr.length) {
+        return 0;
+    }
+    rsh_stream_skip(stream, RDSH_FRAME_HDR_SZ + hdr.length);
+    conn->greeted = 1;
+
+    if (!warned) {
+        fprintf(stderr, "Warning: framed clients run one command at a time "
+                "in epoll mode, use -x or -f for batch sessions\n");
+        warned = 1;
+    }
+    rdsh_encode_hdr(hello, RDSH_FT_HELLO, 0, 0, 1);
+    hello[RDSH_FRAME_HDR_SZ] = RDSH_PROTO_LEGACY;
+    conn_queue(conn, hello, sizeof(hello));
+    conn_flush(loop, conn);
+    return 1;
+}
+
+/*
+ * conn_on_socket(loop, conn, events)
+ *
+ *  Socket readiness.  EPOLLOUT drains pending output; EPOLLIN receives
+ *  bytes into the stream of the connection, which may hold part of a
+ *  command or several commands.  Errors and hang ups are reported by
+ *  epoll even while the socket is parked, they close the connection.
+ */
+static void conn_on_socket(rsh_loop_t *loop, rsh_conn_t *conn, uint32_t events) {
+    ssize_t io_size;
+    size_t room;
+    char *space;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(loop, conn);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        conn_flush(loop, conn);
+        conn_dispatch(loop, conn);
+        return;
+    }
+
+    if (conn->state != CONN_READ_CMD) {
+        return;
+    }
+
+    space = rsh_stream_space(&conn->stream, &room);
+    if (space == NULL) {
+        perror("rsh_stream_space");
+        conn_close(loop, conn);
+        return;
+    }
+    io_size = recv(conn->sock, space, room, 0);
+    if (io_size < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        perror("recv");
+        conn_close(loop, conn);
+        return;
+    }
+    if (io_size == 0) {
+        //the commands already received still run, their output can be
+        //sent to a client that only shut down its writing side
+        if (!conn->greeted || rsh_stream_pending(&conn->stream) == 0) {
+            conn_close(loop, conn);
+            return;
+        }
+        conn->eof = 1;
+        conn_dispatch(loop, conn);
+        return;
+    }
+
+    rsh_stream_wrote(&conn->stream, io_size);
+    if (!conn->greeted && conn_hello(loop, conn) != 1) {
+        return;
+    }
+    conn_dispatch(loop, conn);
+}
+
+/*
+ * conn_on_pipe(loop, conn)
+ *
+ *  Pipeline output is ready.  Reads one buffer worth and pushes it to the
+ *  client, or finishes the command on EOF.
+ */
+static void conn_on_pipe(rsh_loop_t *loop, rsh_conn_t *conn) {
+    ssize_t io_size;
+
+    if (conn->out_len > 0) {
+        return;
+    }
+
+    //legacy output is not framed, so it can go from the pipe to the
+    //socket without a copy.  The pipe is readable, so EAGAIN means the
+    //socket is full and the pipe is parked until it drains.
+    if (splice_output) {
+        io_size = splice(conn->out_pipe, NULL, conn->sock, NULL, RDSH_PIPE_SZ,
+                         SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (io_size > 0) {
+            return;
+        }
+        if (io_size == 0) {
+            conn_finish_pipeline(loop, conn);
+            return;
+        }
+        if (errno == EAGAIN) {
+            conn_watch(loop, conn, EPOLLOUT, 0);
+            return;
+        }
+        if (errno == EINTR) {
+            return;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            conn_close(loop, conn);
+            return;
+        }
+        splice_output = 0;
+    }
+
+    io_size = read(conn->out_pipe, conn->out_buff, RDSH_COMM_BUFF_SZ);
+    if (io_size < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        perror("read");
+        io_size = 0;
+    }
+    if (io_size == 0) {
+        conn_finish_pipeline(loop, conn);
+        return;
+    }
+
+    conn->out_len = io_size;
+    conn->out_off = 0;
+    conn_flush(loop, conn);
+}
+
+/*
+ * loop_accept(loop)
+ *
+ *  Accepts every pending connection.  Client sockets are created
+ *  non-blocking and close-on-exec so pipelines never inherit them.
+ */
+static int loop_accept(rsh_loop_t *loop) {
+    struct epoll_event ev;
+    rsh_conn_t *conn;
+    int cli_socket;
+
+    while (1) {
+        cli_socket = accept4(loop->svr_socket, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cli_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return OK;
+            }
+            perror("accept");
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        conn = calloc(1, sizeof(rsh_conn_t));
+        if (conn != NULL) {
+            conn->in_buff = malloc(RDSH_COMM_BUFF_SZ);
+            conn->out_buff = malloc(RDSH_COMM_BUFF_SZ);
+            cmd_arena_init(&conn->arena, 0);
+            rsh_stream_init(&conn->stream, RDSH_MAX_CMD_LEN);
+        }
+        if (conn == NULL || conn->in_buff == NULL || conn->out_buff == NULL ||
+            conn->arena.base == NULL || conn->stream.buff == NULL) {
+            perror("malloc");
+            if (conn != NULL) {
+                free(conn->in_buff);
+                free(conn->out_buff);
+                cmd_arena_free(&conn->arena);
+                rsh_stream_free(&conn->stream);
+                free(conn);
+            }
+            close(cli_socket);
+            continue;
+        }
+
+        conn->sock = cli_socket;
+        conn->state = CONN_READ_CMD;
+        conn->out_pipe = -1;
+        conn->sock_ev.kind = EV_SOCK;
+        conn->sock_ev.conn = conn;
+        conn->pipe_ev.kind = EV_PIPE;
+        conn->pipe_ev.conn = conn;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn->sock_ev;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cli_socket, &ev) == -1) {
+            perror("epoll_ctl");
+            close(cli_socket);
+            free(conn->in_buff);
+            free(conn->out_buff);
+            cmd_arena_free(&conn->arena);
+            rsh_stream_free(&conn->stream);
+            free(conn);
+            continue;
+        }
+
+        conn->next = loop->conns;
+        loop->conns = conn;
+        printf("Client connected (epoll).\n");
+    }
+}
+
+/*
+ * loop_drain(loop)
+ *
+ *  Called on every pass of the loop once the server is stopping.  The
+ *  first call stops accepting and closes the idle connections, at the
+ *  drain deadline the pipelines still running are killed and every
+ *  connection is closed.
+ *
+ *  Returns the epoll_wait() timeout until the deadline.
+ */
+static int loop_drain(rsh_loop_t *loop) {
+    int left = rsh_drain_left_ms();
+
+    if (loop->svr_socket >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->svr_socket, NULL);
+        loop->svr_socket = -1;
+        for (rsh_conn_t *conn = loop->conns; conn != NULL; conn = conn->next) {
+            conn_dispatch(loop, conn);
+        }
+    }
+    if (left > 0) {
+        return left;
+    }
+
+    for (rsh_conn_t *conn = loop->conns; conn != NULL; conn = conn->next) {
+        if (conn->num_pids > 0) {
+            //past the deadline, so the wait kills and counts them
+            conn_watch(loop, conn, 0, 0);
+            close(conn->out_pipe);
+            conn->out_pipe = -1;
+            rsh_wait_pipeline(conn->pids, conn->num_pids, NULL);
+            conn->num_pids = 0;
+        }
+        conn_close(loop, conn);
+    }
+    return 0;
+}
+
+/*
+ * process_cli_requests_epoll(svr_socket)
+ *      svr_socket:  The server socket that was obtained from boot_server()
+ *
+ *  Serves every client from a single thread.  The listening socket, every
+ *  client socket and the output pipe of every running pipeline are
+ *  registered with one epoll instance, and each client is driven through
+ *  the conn_state_t state machine above.  Compared with one thread per
+ *  client this costs two RDSH_COMM_BUFF_SZ buffers per connection instead
+ *  of a thread stack, and connections do not block each other while a
+ *  pipeline is running.
+ *
+ *  exec_client_requests() remains the blocking reference implementation,
+ *  this loop follows its protocol and built-in command handling.
+ *
+ *  After `stop-server` the loop keeps running without the listening
+ *  socket until the connections with a running pipeline are done, see
+ *  loop_drain().
+ *
+ *  Returns:
+ *
+ *      OK_EXIT:                 A client sent the `stop-server` command
+ *      ERR_RDSH_SERVER:         epoll could not be set up
+ *      ERR_RDSH_COMMUNICATION:  accept() failed
+ */
+int process_cli_requests_epoll(int svr_socket) {
+    struct epoll_event events[RDSH_EPOLL_EVENTS];
+    struct epoll_event ev;
+    rsh_loop_t loop;
+    rsh_ev_t *rev;
+    int timeout;
+    int nready;
+    int rc = OK;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.svr_socket = svr_socket;
+    loop.listen_ev.kind = EV_LISTEN;
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        perror("epoll_create1");
+        return ERR_RDSH_SERVER;
+    }
+
+    loop.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (loop.null_fd < 0) {
+        perror("open /dev/null");
+        close(loop.epfd);
+        return ERR_RDSH_SERVER;
+    }
+
+    fcntl(svr_socket, F_SETFL, fcntl(svr_socket, F_GETFL) | O_NONBLOCK);
+    fcntl(svr_socket, F_SETFD, FD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.listen_ev;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, svr_socket, &ev) == -1) {
+        perror("epoll_ctl");
+        close(loop.null_fd);
+        close(loop.epfd);
+        return ERR_RDSH_SERVER;
+    }
+
+    while (!loop.stopping || loop.conns != NULL) {
+        //only the drain deadline wakes the loop up without an event
+        timeout = -1;
+        if (loop.stopping) {
+            timeout = loop_drain(&loop);
+            loop_reap(&loop);
+            if (loop.conns == NULL) {
+                break;
+            }
+        }
+        nready = epoll_wait(loop.epfd, events, RDSH_EPOLL_EVENTS, timeout);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+
+        for (int i = 0; i < nready; i++) {
+            rev = events[i].data.ptr;
+
+            //a handler earlier in this batch may have closed the connection
+            if (rev->kind != EV_LISTEN && rev->conn->state == CONN_CLOSED) {
+                continue;
+            }
+
+            switch (rev->kind) {
+                case EV_LISTEN:
+                    rc = loop_accept(&loop);
+                    break;
+                case EV_SOCK:
+                    conn_on_socket(&loop, rev->conn, events[i].events);
+                    break;
+                case EV_PIPE:
+                    conn_on_pipe(&loop, rev->conn);
+                    break;
+            }
+        }
+        loop_reap(&loop);
+
+        if (rc == ERR_RDSH_COMMUNICATION) {
+            break;
+        }
+    }
+
+    if (loop.stopping) {
+        printf("Server shutting down...\n");
+        rsh_drain_report("Server");
+        rc = OK_EXIT;
+    }
+
+    for (rsh_conn_t *conn = loop.conns; conn != NULL; conn = conn->next) {
+        conn_close(&loop, conn);
+    }
+    loop_reap(&loop);
+    close(loop.null_fd);
+    close(loop.epfd);
+    return rc;
+}
+
+
+
+/**************   PRE-FORK WORKER MODE  ***************/
+
+static int prefork_workers = RDSH_DEF_WORKERS;
+static volatile sig_atomic_t worker_stop = 0;
+
+/*
+ * set_prefork_workers(num)
+ *      num:  number of worker processes started by RDSH_SVR_PREFORK
+ */
+void set_prefork_workers(int num) {
+    if (num > 0) {
+        prefork_workers = num;
+    }
+}
+
+static void worker_sigterm(int sig) {
+    (void)sig;
+    worker_stop = 1;
+}
+
+/*
+ * prefork_worker(svr_socket, wait_mask)
+ *      svr_socket:  The listening socket inherited from the master
+ *      wait_mask:   Signal mask used while waiting for a connection
+ *
+ *  Body of a worker process.  Every worker waits on the shared listening
+ *  socket and runs the same accept()/exec_client_requests() loop as
+ *  process_cli_requests().  SIGTERM is the drain request from the master,
+ *  it is blocked while a client is being served and only delivered inside
+ *  ppoll(), so a worker always finishes its current client session before
+ *  exiting.  The listening socket is non-blocking because every worker is
+ *  woken for a new connection and all but one lose the race to accept it.
+ *
+ *  The stop eventfd is shared by all workers, so the sessions of every
+ *  worker start draining as soon as one of them serves `stop-server`,
+ *  and idle workers exit without waiting for the master.
+ *
+ *  Never returns.  Exits with STOP_SERVER_SC when its client sent the
+ *  `stop-server` command and with 0 when drained, after dumping the
+ *  metrics of the clients it served.
+ */
+static void prefork_worker(int svr_socket, sigset_t *wait_mask) {
+    struct pollfd pfd[2];
+    char who[32];
+    int cli_socket;
+    int rc = OK;
+
+    pfd[0].fd = svr_socket;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rsh_stop_fd();
+    pfd[1].events = POLLIN;
+
+    while (!worker_stop && !rsh_stopping()) {
+        if (ppoll(pfd, 2, NULL, wait_mask) < 0) {
+            continue;   //EINTR, the SIGTERM handler may have run
+        }
+        if (pfd[1].revents) {
+            rsh_request_stop();
+            break;
+        }
+
+        cli_socket = accept4(svr_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (cli_socket < 0) {
+            continue;   //another worker accepted this connection
+        }
+
+        printf("Client connected (worker %d).\n", getpid());
+        rc = exec_client_requests(cli_socket);
+        close(cli_socket);
+
+        if (rc == OK_EXIT) {
+            break;
+        }
+    }
+    snprintf(who, sizeof(who), "Worker %d", getpid());
+    rsh_drain_report(who);
+    rsh_coproc_shutdown();
+    rsh_dump_metrics();
+    exit(rc == OK_EXIT ? STOP_SERVER_SC : 0);
+}
+
+/*
+ * prefork_spawn(svr_socket, wait_mask)
+ *
+ *  Forks one worker.  Returns the pid of the worker, or -1 on failure.
+ */
+static pid_t prefork_spawn(int svr_socket, sigset_t *wait_mask) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        prefork_worker(svr_socket, wait_mask);
+    }
+    if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+/*
+ * prefork_drain(workers, num)
+ *
+ *  Sends SIGTERM to every live worker and waits for them to finish their
+ *  current session.  Workers still running a second after the drain
+ *  deadline (see set_drain_timeout()) are killed.
+ */
+static void prefork_drain(pid_t *workers, int num) {
+    int remaining = 0;
+    int waited_ms = 0;
+    pid_t pid;
+
+    for (int i = 0; i < num; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+            remaining++;
+        }
+    }
+
+    while (remaining > 0) {
+        pid = waitpid(-1, NULL, WNOHANG);
+        if (pid < 0) {
+            break;
+        }
+        if (pid == 0) {
+            //workers kill their own pipelines at the drain deadline,
+            //one that is still around a second later is stuck
+            if (waited_ms >= drain_timeout * 1000 + 1000) {
+                for (int i = 0; i < num; i++) {
+                    if (workers[i] > 0) {
+                        printf("Worker %d did not drain, killing it\n", workers[i]);
+                        kill(workers[i], SIGKILL);
+                    }
+                }
+                waited_ms = 0;
+            }
+            usleep(10000);
+            waited_ms += 10;
+            continue;
+        }
+        for (int i = 0; i < num; i++) {
+            if (workers[i] == pid) {
+                workers[i] = 0;
+                remaining--;
+            }
+        }
+    }
+}
+
+/*
+ * process_cli_requests_prefork(svr_socket, num_workers)
+ *      svr_socket:   The server socket that was obtained from boot_server()
+ *      num_workers:  Number of worker processes to keep running
+ *
+ *  Pre-forks num_workers processes that all accept() from the listening
+ *  socket, so clients are spread over several cores without a thread per
+ *  client.  The master process only supervises:
+ *
+ *      1.  A worker that exits with STOP_SERVER_SC served a `stop-server`
+ *          command.  The remaining workers are drained and the server
+ *          stops.
+ *      2.  A worker that crashed (killed by a signal or any other exit
+ *          status) is replaced, so one bad client only costs the session
+ *          it was in.
+ *
+ *  Returns:
+ *
+ *      OK_EXIT:          A client sent the `stop-server` command
+ *      ERR_RDSH_SERVER:  The workers could not be started
+ */
+int process_cli_requests_prefork(int svr_socket, int num_workers) {
+    struct sigaction sa;
+    sigset_t block_mask;
+    sigset_t wait_mask;
+    pid_t *workers;
+    pid_t pid;
+    int status;
+    int slot;
+
+    workers = calloc(num_workers, sizeof(pid_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return ERR_RDSH_SERVER;
+    }
+
+    //workers keep SIGTERM blocked except while waiting in ppoll()
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = worker_sigterm;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block_mask, &wait_mask);
+    sigdelset(&wait_mask, SIGTERM);
+
+    fcntl(svr_socket, F_SETFL, fcntl(svr_socket, F_GETFL) | O_NONBLOCK);
+    fcntl(svr_socket, F_SETFD, FD_CLOEXEC);
+    fflush(stdout);
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = prefork_spawn(svr_socket, &wait_mask);
+        if (workers[i] < 0) {
+            prefork_drain(workers, num_workers);
+            free(workers);
+            return ERR_RDSH_SERVER;
+        }
+    }
+
+    while (1) {
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            break;
+        }
+
+        for (slot = 0; slot < num_workers; slot++) {
+            if (workers[slot] == pid) {
+                break;
+            }
+        }
+        if (slot == num_workers) {
+            continue;
+        }
+        workers[slot] = 0;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == STOP_SERVER_SC) {
+            break;
+        }
+
+        if (WIFSIGNALED(status)) {
+            printf("Worker %d killed by signal %d, restarting\n",
+                   pid, WTERMSIG(status));
+        } else {
+            printf("Worker %d exited with %d, restarting\n",
+                   pid, WEXITSTATUS(status));
+        }
+        fflush(stdout);
+        workers[slot] = prefork_spawn(svr_socket, &wait_mask);
+    }
+
+    printf("Server shutting down...\n");
+    rsh_request_stop();
+    prefork_drain(workers, num_workers);
+    rsh_drain_report("Server");
+    free(workers);
+
+    sigprocmask(SIG_UNBLOCK, &block_mask, NULL);
+    return OK_EXIT;
+}
+
+
+
+
+/*
+ * start_server(ifaces, port, svr_mode)
+ *      ifaces:  a string in ip address format, indicating the interface
+ *              where the server will bind.  In almost all cases it will
+ *              be the default "0.0.0.0" which binds to all interfaces.
+ *              note the constant RDSH_DEF_SVR_INTFACE in rshlib.h
+ * 
+ *      port:   The port the server will use.  Note the constant 
+ *              RDSH_DEF_PORT which is 1234 in rshlib.h.  If you are using
+ *              tux you may need to change this to your own default, or even
+ *              better use the command line override -s implemented in dsh_cli.c
+ *              For example ./dsh -s 0.0.0.0:5678 where 5678 is the new port  
+ * 
+ *      svr_mode:    Selects how clients are served, one of the RDSH_SVR_*
+ *                   constants in rshlib.h.  RDSH_SVR_THREADED implements
+ *                   per thread connections for clients (extra credit) and
+ *                   RDSH_SVR_EPOLL serves every client from one epoll loop
+ *                   and RDSH_SVR_PREFORK hands clients to a pool of worker
+ *                   processes, see set_prefork_workers()
+ * 
+ *      This function basically runs the server by: 
+ *          1. Booting up the server
+ *          2. Processing client requests until the client requests the
+ *             server to stop by running the `stop-server` command
+ *          3. Stopping the server. 
+ * 
+ *      This function is fully implemented for you and should not require
+ *      any changes for basic functionality.  
+ * 
+ *      IF YOU IMPLEMENT THE MULTI-THREADED SERVER FOR EXTRA CREDIT YOU NEED
+ *      TO DO SOMETHING WITH THE svr_mode ARGUMENT HOWEVER.  
+ */
+ int start_server(char *ifaces, int port, int svr_mode){
+    int svr_socket;
+    int rc;
+
+    //writes to a pipeline whose reader is gone must fail with EPIPE, not
+    //kill the server, commands get the default action back before exec
+    signal(SIGPIPE, SIG_IGN);
+
+    svr_socket = boot_server(ifaces, port);
+    if (svr_socket < 0){
+        int err_code = svr_socket;  //server socket will carry error code
+        return err_code;
+    }
+    if (rsh_stop_init() != OK) {
+        stop_server(svr_socket);
+        return ERR_RDSH_SERVER;
+    }
+
+    if (svr_mode == RDSH_SVR_THREADED) {
+        printf("Running in multi-threaded mode\n");
+        rc = process_cli_requests_threaded(svr_socket); // New function to handle multi-threading
+    } else if (svr_mode == RDSH_SVR_EPOLL) {
+        printf("Running in epoll event-loop mode\n");
+        rc = process_cli_requests_epoll(svr_socket);
+    } else if (svr_mode == RDSH_SVR_PREFORK) {
+        printf("Running in pre-fork mode with %d workers\n", prefork_workers);
+        rc = process_cli_requests_prefork(svr_socket, prefork_workers);
+    } else {
+        rc = process_cli_requests(svr_socket);
+    }
+
+    stop_server(svr_socket);
+    rsh_coproc_shutdown();
+
+    //prefork workers dumped the metrics of their own clients
+    if (svr_mode != RDSH_SVR_PREFORK) {
+        rsh_dump_metrics();
+    }
+
+    return rc;
+}
+
+
+/*
+ * stop_server(svr_socket)
+ *      svr_socket: The socket that was created in the boot_server()
+ *                  function. 
+ * 
+ *      This function simply returns the value of close() when closing
+ *      the socket.  
+ */
+int stop_server(int svr_socket){
+    return close(svr_socket);
+}
+
+/*
+ * boot_server(ifaces, port)
+ *      ifaces & port:  see start_server for description.  They are passed
+ *                      as is to this function.   
+ * 
+ *      This function "boots" the rsh server.  It is responsible for all
+ *      socket operations prior to accepting client connections.  Specifically: 
+ * 
+ *      1. Create the server socket using the socket() function. 
+ *      2. Calling bind to "bind" the server to the interface and port
+ *      3. Calling listen to get the server ready to listen for connections.
+ * 
+ *      after creating the socket and prior to calling bind you might want to 
+ *      include the following code:
+ * 
+ *      int enable=1;
+ *      setsockopt(svr_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+ * 
+ *      when doing development you often run into issues where you hold onto
+ *      the port and then need to wait for linux to detect this issue and free
+ *      the port up.  The code above tells linux to force allowing this process
+ *      to use the specified port making your life a lot easier.
+ * 
+ *  Returns:
+ * 
+ *      server_socket:  Sockets are just file descriptors, if this function is
+ *                      successful, it returns the server socket descriptor, 
+ *                      which is just an integer.
+ * 
+ *      ERR_RDSH_COMMUNICATION:  This error code is returned if the socket(),
+ *                               bind(), or listen() call fails. 
+ * 
+ */
+ int boot_server(char *ifaces, int port) {
+    int svr_socket;
+    int ret;
+    struct sockaddr_in addr;
+    int enable = 1; // Used for setsockopt
+
+    // Step 1: Create a socket (IPv4, Stream/TCP)
+    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (svr_socket == -1) {
+        perror("socket");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    // Step 2: Allow address reuse to avoid "Address already in use" errors
+    if (setsockopt(svr_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    // Step 3: Configure the sockaddr_in structure
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;               // IPv4
+    addr.sin_port = htons(port);             // Convert port to network byte order
+    addr.sin_addr.s_addr = inet_addr(ifaces); // Bind to specified interface
+
+    // Step 4: Bind the socket to the address and port
+    ret = bind(svr_socket, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == -1) {
+        perror("bind");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    // Step 5: Start listening with a backlog of 20 connections
+    ret = listen(svr_socket, 20);
+    if (ret == -1) {
+        perror("listen");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    printf("Server started on %s:%d\n", ifaces, port);
+    return svr_socket;
+}
+
+
+/*
+ * process_cli_requests(svr_socket)
+ *      svr_socket:  The server socket that was obtained from boot_server()
+ *   
+ *  This function handles managing client connections.  It does this using
+ *  the following logic
+ * 
+ *      1.  Starts a while(1) loop:
+ *  
+ *          a. Calls accept() to wait for a client connection. Recall that 
+ *             the accept() function returns another socket specifically
+ *             bound to a client connection. 
+ *          b. Calls exec_client_requests() to handle executing commands
+ *             sent by the client. It will use the socket returned from
+ *             accept().
+ *          c. Loops back to the top (step 2) to accept connecting another
+ *             client.  
+ * 
+ *          note that the exec_client_requests() return code should be
+ *          negative if the client requested the server to stop by sending
+ *          the `stop-server` command.  If this is the case step 2b breaks
+ *          out of the while(1) loop. 
+ * 
+ *      2.  After we exit the loop, we need to cleanup.  Dont forget to 
+ *          free the buffer you allocated in step #1.  Then call stop_server()
+ *          to close the server socket. 
+ * 
+ *  Returns:
+ * 
+ *      OK_EXIT:  When the client sends the `stop-server` command this function
+ *                should return OK_EXIT. 
+ * 
+ *      ERR_RDSH_COMMUNICATION:  This error code terminates the loop and is
+ *                returned from this function in the case of the accept() 
+ *                function failing. 
+ * 
+ *      OTHERS:   See exec_client_requests() for return codes.  Note that positive
+ *                values will keep the loop running to accept additional client
+ *                connections, and negative values terminate the server. 
+ * 
+ */
+ int process_cli_requests(int svr_socket){
+    int cli_socket;
+    int rc = OK;    
+
+    while(1){
+        
+        cli_socket = accept(svr_socket, NULL, NULL);
+        if (cli_socket < 0) {
+            perror("accept");
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        printf("Client connected.\n");
+
+        
+        rc = exec_client_requests(cli_socket);
+
+        
+        close(cli_socket);
+
+        if (rc == OK_EXIT) {
+            printf("Server shutting down...\n");
+            rsh_drain_report("Server");
+            break;
+        }
+    }
+
+    stop_server(svr_socket);
+    return rc;
+}
+
+
+/*
+ * exec_client_requests(cli_socket)
+ *      cli_socket:  The server-side socket that is connected to the client
+ *   
+ *  This function handles accepting remote client commands. The function will
+ *  loop and continue to accept and execute client commands.  There are 2 ways
+ *  that this ongoing loop accepting client commands ends:
+ * 
+ *      1.  When the client executes the `exit` command, this function returns
+ *          to process_cli_requests() so that we can accept another client
+ *          connection. 
+ *      2.  When the client executes the `stop-server` command this function
+ *          returns to process_cli_requests() with a return code of OK_EXIT
+ *          indicating that the server should stop. 
+ * 
+ *  Note that this function largely follows the implementation of the
+ *  exec_local_cmd_loop() function that you implemented in the last 
+ *  shell program deliverable. The main difference is that the command will
+ *  arrive over the recv() socket call rather than reading a string from the
+ *  keyboard. 
+ * 
+ *  This function also must send the EOF character after a command is
+ *  successfully executed to let the client know that the output from the
+ *  command it sent is finished.  Use the send_message_eof() to accomplish 
+ *  this. 
+ * 
+ *  Clients that open the connection with a HELLO frame (see rshlib.h)
+ *  are handed to exec_client_requests_framed() instead, the loop below
+ *  is the legacy EOF character protocol.
+ * 
+ *  Commands arrive null terminated, a newline ends one as well.  They
+ *  are cut out of the received bytes by an rsh_stream_t, so they may
+ *  be split over or share recv() calls, see legacy_next_command().
+ * 
+ *  Of final note, this function must allocate a buffer for storage to 
+ *  store the data received by the client. For example:
+ *     io_buff = malloc(RDSH_COMM_BUFF_SZ);
+ *  And since it is allocating storage, it must also properly clean it up
+ *  prior to exiting.
+ * 
+ *  Returns:
+ * 
+ *      OK:       The client sent the `exit` command, or another client
+ *                stopped the server while this one was idle.  Get ready to
+ *                connect another client.
+ *      OK_EXIT:  The client sent `stop-server` command to terminate the server
+ * 
+ *      ERR_RDSH_COMMUNICATION:  A catch all for any socket() related send
+ *                or receive errors. 
+ */
+ int exec_client_requests(int cli_socket) {
+    command_list_t cmd_list;
+    rsh_cmd_usage_t usage;
+    rsh_metrics_t *metrics;
+    rsh_stream_t stream;
+    cmd_arena_t arena;
+    int rc;
+    char *io_buff;
+    char *cmd;
+
+    // New clients open with a HELLO frame, which starts with the EOF
+    // character that never begins a legacy command
+    if (is_framed_client(cli_socket)) {
+        return exec_client_requests_framed(cli_socket);
+    }
+
+    // Allocate the buffer for replies of built-in commands, the metrics of
+    // this client, the stream its bytes are split into commands with and
+    // the arena the commands are parsed into
+    io_buff = malloc(RDSH_COMM_BUFF_SZ);
+    metrics = calloc(1, sizeof(rsh_metrics_t));
+    if (io_buff == NULL || metrics == NULL ||
+        rsh_stream_init(&stream, RDSH_MAX_CMD_LEN) != OK) {
+        perror("malloc");
+        free(io_buff);
+        free(metrics);
+        return ERR_RDSH_SERVER;
+    }
+    if (cmd_arena_init(&arena, 0) != OK) {
+        perror("malloc");
+        free(io_buff);
+        free(metrics);
+        rsh_stream_free(&stream);
+        return ERR_RDSH_SERVER;
+    }
 
-    exec_client_requests(cli_socket);
-    close(cli_socket);
-    return NULL;
-}
+    while (1) {
+        // Step 1: Take the next whole command from the stream, receiving
+        //         from the client until one arrived.  The previous command
+        //         is done with everything it parsed.
+        cmd_arena_reset(&arena);
+        rc = legacy_next_command(cli_socket, &stream, &cmd);
+        rsh_usage_start(&usage);
 
-int process_cli_requests_threaded(int svr_socket) {
-    int *cli_socket;
-    pthread_t tid;
+        // Step 2: Handle recv() errors
+        if (rc == 0) {
+            // Client disconnected
+            printf("Client disconnected.\n");
+            rc = OK;
+            break;
+        }
+        if (rc == WARN_RDSH_STOPPING) {
+            printf("Server stopping, closing client session.\n");
+            rc = OK;
+            break;
+        }
 
-    while (1) {
-        cli_socket = malloc(sizeof(int));
-        if (cli_socket == NULL) {
-            perror("malloc");
-            return ERR_RDSH_SERVER;
+        // Step 3: Reject overly long input, the stream dropped it
+        if (rc == ERR_RDSH_CMD_TOO_LONG) {
+            send_message_string(cli_socket, "Error: Command too long. Input rejected.\n");
+            continue;
+        }
+        if (rc < 0) {
+            perror("exec_client_requests");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
         }
 
-        *cli_socket = accept(svr_socket, NULL, NULL);
-        if (*cli_socket < 0) {
-            perror("accept");
-            free(cli_socket);
-            return ERR_RDSH_COMMUNICATION;
+        // Step 4: The command is null-terminated inside the stream
+        printf("Received command from client: %s\n", cmd);  // Debug logging
+
+        // Step 5: Parse command into a command list
+        rc = build_cmd_list_arena(cmd, &cmd_list, &arena);
+        if (rc != OK) {
+            send_message_string(cli_socket, "Error: Invalid command format.\n");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
         }
 
-        printf("Client connected (Threaded).\n");
+        // Step 6: Check for built-in commands
+        if (cmd_list.num > 0) {
+            Built_In_Cmds bi_cmd = rsh_match_command(cmd_list.commands[0].argv[0]);
 
-        if (pthread_create(&tid, NULL, handle_client, cli_socket) != 0) {
-            perror("pthread_create");
-            free(cli_socket);
-            return ERR_RDSH_SERVER;
+            if (bi_cmd == BI_CMD_EXIT) {
+                send_message_string(cli_socket, "Exiting client session.\n");
+                free_cmd_list(&cmd_list);
+                rc = OK;
+                break;
+            }
+            if (bi_cmd == BI_CMD_STOP_SVR) {
+                rsh_request_stop();
+                send_message_string(cli_socket, "Server stopping.\n");
+                free_cmd_list(&cmd_list);
+                rc = OK_EXIT;
+                break;
+            }
+            if (bi_cmd == BI_CMD_RSTATS) {
+                rsh_format_stats(io_buff, RDSH_COMM_BUFF_SZ, metrics);
+                send_message_string(cli_socket, io_buff);
+                free_cmd_list(&cmd_list);
+                continue;
+            }
+            if (bi_cmd == BI_CMD_HASH) {
+                path_hash_cmd(&cmd_list.commands[0], io_buff, RDSH_COMM_BUFF_SZ);
+                send_message_string(cli_socket, io_buff);
+                free_cmd_list(&cmd_list);
+                continue;
+            }
+        }
+
+        // Step 7: Execute the pipeline command
+        rc = rsh_execute_pipeline(cli_socket, &cmd_list, &usage);
+        free_cmd_list(&cmd_list);
+
+        // **🚀 FIX: Handle Invalid Commands Properly**
+        if (rc != 0) {  
+            send_message_string(cli_socket, "Error: Command not found or failed to execute.\n");
+            rsh_metrics_record(metrics, &usage, rc);
+            rc = ERR_EXEC_CMD;  // Return a non-zero error code
+            break;
         }
 
-        pthread_detach(tid);  // Auto-clean up thread
+        // Step 8: Send EOF message to signal end of response
+        if (send_message_eof(cli_socket) != OK) {
+            perror("send_message_eof failed");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+        rsh_metrics_record(metrics, &usage, rc);
     }
 
-    return OK;
+    free(io_buff);
+    free(metrics);
+    cmd_arena_free(&arena);
+    rsh_stream_free(&stream);
+    return rc;
+}
+
+/*
+ * legacy_next_command(cli_socket, stream, cmd)
+ *      cli_socket:  The server-side socket that is connected to the client
+ *      stream:      Bytes received from the client and not yet used
+ *      cmd:         Receives the command, valid until the next call
+ *
+ *  TCP may split one command over several recv() calls or deliver
+ *  several commands in one, so received bytes go into the stream and
+ *  commands are taken out at their terminator, however long the client
+ *  pauses in the middle of one.  Bytes left without a terminator when
+ *  the client shuts down its side are the last command, its output can
+ *  still be sent.
+ *
+ *  The wait for the client also watches the stop descriptor, a session
+ *  that is between commands ends as soon as the server stops.
+ *
+ *  Returns:
+ *
+ *      1:                       *cmd is the next command
+ *      0:                       The client disconnected and every command
+ *                               it sent was returned
+ *      WARN_RDSH_STOPPING:      The server is stopping
+ *      ERR_RDSH_CMD_TOO_LONG:   A command longer than RDSH_MAX_CMD_LEN was
+ *                               dropped
+ *      ERR_RDSH_COMMUNICATION:  recv() failed
+ *      ERR_MEMORY:              The stream could not grow
+ */
+static int legacy_next_command(int cli_socket, rsh_stream_t *stream, char **cmd) {
+    struct pollfd pfd[2];
+    ssize_t io_size;
+    size_t room;
+    char *space;
+    int n;
+    int rc;
+
+    pfd[0].fd = cli_socket;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rsh_stop_fd();
+    pfd[1].events = POLLIN;
+
+    while ((rc = rsh_stream_next(stream, cmd)) == 0) {
+        if (rsh_stopping()) {
+            return WARN_RDSH_STOPPING;
+        }
+        n = poll(pfd, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (pfd[1].revents) {
+            rsh_request_stop();
+            return WARN_RDSH_STOPPING;
+        }
+
+        space = rsh_stream_space(stream, &room);
+        if (space == NULL) {
+            return ERR_MEMORY;
+        }
+        io_size = recv(cli_socket, space, room, 0);
+        if (io_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (io_size == 0) {
+            //recv() reports EOF again on the next call
+            *cmd = rsh_stream_flush(stream);
+            return *cmd != NULL;
+        }
+        rsh_stream_wrote(stream, io_size);
+    }
+    return rc;
 }
 
 
+/**************   FRAMED PROTOCOL  ***************/
 
+/*
+ * Commands received in CMD frames are queued on the session named in the
+ * frame header.  Each session runs its commands one at a time in arrival
+ * order, and up to RDSH_MAX_SESSIONS sessions of one connection run at
+ * the same time.  While a command runs its STDOUT and STDERR are pipes
+ * owned by the server, and every read from them is forwarded as a STDOUT
+ * or STDERR frame tagged with the session and request id of the command.
+ *
+ * A CMD frame with RDSH_FL_STDIN set gets a pipe as STDIN instead of
+ * /dev/null.  STDIN frames for it are queued on the session behind the
+ * command, so input sent right after the command waits for it to start,
+ * and are written to the pipe as the command reads it.
+ */
+typedef struct rdsh_pending {
+    uint8_t  type;                  //RDSH_FT_CMD or RDSH_FT_STDIN
+    uint16_t flags;
+    uint32_t req_id;
+    uint16_t session;
+    int      len;                   //STDIN bytes, 0 is end of input
+    int      off;                   //STDIN bytes already written
+    struct timespec received;       //when the frame was read
+    struct rdsh_pending *next;
+    char     cmd[];
+} rdsh_pending_t;
+
+typedef struct rdsh_job {
+    int      active;
+    uint32_t req_id;
+    uint16_t session;
+    pid_t   *pids;                  //grown to the longest pipeline
+    int      pids_cap;
+    int      num_pids;
+    int      in_fd;                 //-1 unless the client sends STDIN
+    int      out_fd;                //-1 once drained
+    int      err_fd;                //-1 once drained
+    rsh_cmd_usage_t usage;
+} rdsh_job_t;
+
+typedef struct rdsh_session {
+    rdsh_pending_t *head;           //commands waiting for the job to end
+    rdsh_pending_t *tail;
+    rdsh_job_t      job;
+} rdsh_session_t;
+
+typedef struct rdsh_framed {
+    int             cli_socket;
+    int             null_fd;
+    int             client_eof;     //client will send no more frames
+    char           *rbuf;           //received bytes not yet handled
+    int             rlen;
+    char           *obuf;           //pipeline output on its way to a frame
+    int             running;        //sessions with an active job
+    rsh_metrics_t   metrics;        //of every command of this client
+    cmd_arena_t     arena;          //commands are parsed into, only
+                                    //needed until their job started
+    rdsh_session_t  sessions[RDSH_MAX_SESSIONS];
+} rdsh_framed_t;
 
 /*
- * start_server(ifaces, port, is_threaded)
- *      ifaces:  a string in ip address format, indicating the interface
- *              where the server will bind.  In almost all cases it will
- *              be the default "0.0.0.0" which binds to all interfaces.
- *              note the constant RDSH_DEF_SVR_INTFACE in rshlib.h
- * 
- *      port:   The port the server will use.  Note the constant 
- *              RDSH_DEF_PORT which is 1234 in rshlib.h.  If you are using
- *              tux you may need to change this to your own default, or even
- *              better use the command line override -s implemented in dsh_cli.c
- *              For example ./dsh -s 0.0.0.0:5678 where 5678 is the new port  
- * 
- *      is_threded:  Used for extra credit to indicate the server should implement
- *                   per thread connections for clients  
- * 
- *      This function basically runs the server by: 
- *          1. Booting up the server
- *          2. Processing client requests until the client requests the
- *             server to stop by running the `stop-server` command
- *          3. Stopping the server. 
- * 
- *      This function is fully implemented for you and should not require
- *      any changes for basic functionality.  
- * 
- *      IF YOU IMPLEMENT THE MULTI-THREADED SERVER FOR EXTRA CREDIT YOU NEED
- *      TO DO SOMETHING WITH THE is_threaded ARGUMENT HOWEVER.  
+ * is_framed_client(cli_socket)
+ *
+ *  Peeks at the first byte sent by the client without consuming it.  A
+ *  server that stops before the client sent anything treats it as a
+ *  legacy client, whose session then ends right away.
+ *
+ *  Returns 1 if the client opened with a frame, 0 otherwise.
  */
- int start_server(char *ifaces, int port, int is_threaded){
-    int svr_socket;
+static int is_framed_client(int cli_socket) {
+    struct pollfd pfd[2];
+    char first;
+
+    pfd[0].fd = cli_socket;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rsh_stop_fd();
+    pfd[1].events = POLLIN;
+    while (poll(pfd, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    if (pfd[1].revents) {
+        return 0;
+    }
+    if (recv(cli_socket, &first, 1, MSG_PEEK) != 1) {
+        return 0;
+    }
+    return first == RDSH_EOF_CHAR;
+}
+
+/*
+ * framed_reply(fs, session, req_id, type, msg, status)
+ *
+ *  Answers a request that did not start a pipeline, a message on the
+ *  given channel followed by the EXIT frame.
+ */
+static int framed_reply(rdsh_framed_t *fs, uint16_t session, uint32_t req_id,
+                        uint8_t type, const char *msg, int status) {
+    if (msg != NULL && rdsh_send_frame(fs->cli_socket, type, session,
+                                       req_id, msg, strlen(msg)) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return rdsh_send_exit(fs->cli_socket, session, req_id, status);
+}
+
+/*
+ * framed_drop_queue(sess)
+ *
+ *  Frees the commands still waiting on a session.
+ */
+static void framed_drop_queue(rdsh_session_t *sess) {
+    rdsh_pending_t *req;
+
+    while (sess->head != NULL) {
+        req = sess->head;
+        sess->head = req->next;
+        free(req);
+    }
+    sess->tail = NULL;
+}
+
+/*
+ * framed_start_job(fs, req)
+ *
+ *  Runs the built-in commands and starts everything else as a pipeline.
+ *
+ *  Returns BI_CMD_EXIT or BI_CMD_STOP_SVR when the session or the server
+ *  should end, BI_EXECUTED otherwise.
+ */
+static Built_In_Cmds framed_start_job(rdsh_framed_t *fs, rdsh_pending_t *req) {
+    rdsh_job_t *job = &fs->sessions[req->session].job;
+    command_list_t cmd_list;
+    int in_pipe[2] = { fs->null_fd, -1 };
+    int out_pipe[2];
+    int err_pipe[2];
     int rc;
 
-    svr_socket = boot_server(ifaces, port);
-    if (svr_socket < 0){
-        int err_code = svr_socket;  //server socket will carry error code
-        return err_code;
+    cmd_arena_reset(&fs->arena);
+    rc = build_cmd_list_arena(req->cmd, &cmd_list, &fs->arena);
+    if (rc == WARN_NO_CMDS) {
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, CMD_WARN_NO_CMD, rc);
+        return BI_EXECUTED;
+    }
+    if (rc != OK) {
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, "Error: Invalid command format.\n", rc);
+        return BI_EXECUTED;
     }
 
-    if (is_threaded) {
-        printf("Running in multi-threaded mode\n");
-        rc = process_cli_requests_threaded(svr_socket); // New function to handle multi-threading
-    } else {
-        rc = process_cli_requests(svr_socket);
+    switch (rsh_match_command(cmd_list.commands[0].argv[0])) {
+        case BI_CMD_EXIT:
+            free_cmd_list(&cmd_list);
+            framed_reply(fs, req->session, req->req_id, RDSH_FT_STDOUT, "Exiting client session.\n", OK);
+            return BI_CMD_EXIT;
+        case BI_CMD_STOP_SVR:
+            free_cmd_list(&cmd_list);
+            framed_reply(fs, req->session, req->req_id, RDSH_FT_STDOUT, "Server stopping.\n", OK);
+            return BI_CMD_STOP_SVR;
+        case BI_CMD_RSTATS:
+            free_cmd_list(&cmd_list);
+            rsh_format_stats(fs->obuf, RDSH_COMM_BUFF_SZ, &fs->metrics);
+            framed_reply(fs, req->session, req->req_id, RDSH_FT_STDOUT, fs->obuf, OK);
+            return BI_EXECUTED;
+        case BI_CMD_HASH:
+            rc = path_hash_cmd(&cmd_list.commands[0], fs->obuf, RDSH_COMM_BUFF_SZ);
+            free_cmd_list(&cmd_list);
+            framed_reply(fs, req->session, req->req_id,
+                         rc == OK ? RDSH_FT_STDOUT : RDSH_FT_STDERR, fs->obuf, rc);
+            return BI_EXECUTED;
+        default:
+            break;
     }
 
-    stop_server(svr_socket);
+    if (rsh_reserve_pids(&job->pids, &job->pids_cap, cmd_list.num) != OK) {
+        free_cmd_list(&cmd_list);
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, CMD_ERR_RDSH_EXEC, ERR_RDSH_CMD_EXEC);
+        return BI_EXECUTED;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        free_cmd_list(&cmd_list);
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, CMD_ERR_RDSH_EXEC, ERR_RDSH_CMD_EXEC);
+        return BI_EXECUTED;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        free_cmd_list(&cmd_list);
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, CMD_ERR_RDSH_EXEC, ERR_RDSH_CMD_EXEC);
+        return BI_EXECUTED;
+    }
+    if ((req->flags & RDSH_FL_STDIN) && pipe2(in_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        in_pipe[0] = fs->null_fd;
+        in_pipe[1] = -1;
+    }
 
-    return rc;
+    rsh_usage_start(&job->usage);
+    rc = rsh_start_pipeline(&cmd_list, in_pipe[0], out_pipe[1], err_pipe[1],
+                            job->pids);
+    job->usage.launch_us = rsh_usec_since(&job->usage.received);
+    job->usage.received = req->received;
+    job->num_pids = cmd_list.num;
+    free_cmd_list(&cmd_list);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (in_pipe[1] >= 0) {
+        close(in_pipe[0]);
+        fcntl(in_pipe[1], F_SETFL, fcntl(in_pipe[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    if (rc != OK) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        if (in_pipe[1] >= 0) {
+            close(in_pipe[1]);
+        }
+        framed_reply(fs, req->session, req->req_id, RDSH_FT_STDERR, CMD_ERR_RDSH_EXEC, rc);
+        return BI_EXECUTED;
+    }
+
+    //a bigger pipe lets each splice() move more data per frame
+    fcntl(out_pipe[0], F_SETPIPE_SZ, RDSH_PIPE_SZ);
+
+    job->active = 1;
+    job->req_id = req->req_id;
+    job->session = req->session;
+    job->in_fd = in_pipe[1];
+    job->out_fd = out_pipe[0];
+    job->err_fd = err_pipe[0];
+    fs->running++;
+    return BI_EXECUTED;
 }
 
+/*
+ * set_splice_output(val)
+ *      val:  0 copies pipeline output through a user space buffer, any
+ *            other value moves it to the socket with splice()
+ */
+void set_splice_output(int val) {
+    splice_output = val;
+}
 
 /*
- * stop_server(svr_socket)
- *      svr_socket: The socket that was created in the boot_server()
- *                  function. 
- * 
- *      This function simply returns the value of close() when closing
- *      the socket.  
+ * send_all(sock, buff, len, flags)
+ *
+ *  send() until len bytes went out.  Returns OK or ERR_RDSH_COMMUNICATION.
  */
-int stop_server(int svr_socket){
-    return close(svr_socket);
+static int send_all(int sock, const char *buff, int len, int flags) {
+    ssize_t sent;
+
+    while (len > 0) {
+        sent = send(sock, buff, len, flags | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        buff += sent;
+        len -= sent;
+    }
+    return OK;
 }
 
 /*
- * boot_server(ifaces, port)
- *      ifaces & port:  see start_server for description.  They are passed
- *                      as is to this function.   
- * 
- *      This function "boots" the rsh server.  It is responsible for all
- *      socket operations prior to accepting client connections.  Specifically: 
- * 
- *      1. Create the server socket using the socket() function. 
- *      2. Calling bind to "bind" the server to the interface and port
- *      3. Calling listen to get the server ready to listen for connections.
- * 
- *      after creating the socket and prior to calling bind you might want to 
- *      include the following code:
- * 
- *      int enable=1;
- *      setsockopt(svr_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
- * 
- *      when doing development you often run into issues where you hold onto
- *      the port and then need to wait for linux to detect this issue and free
- *      the port up.  The code above tells linux to force allowing this process
- *      to use the specified port making your life a lot easier.
- * 
- *  Returns:
- * 
- *      server_socket:  Sockets are just file descriptors, if this function is
- *                      successful, it returns the server socket descriptor, 
- *                      which is just an integer.
- * 
- *      ERR_RDSH_COMMUNICATION:  This error code is returned if the socket(),
- *                               bind(), or listen() call fails. 
- * 
+ * framed_splice(fs, job, fd, type)
+ *
+ *  Zero-copy version of framed_pump().  FIONREAD tells how many bytes
+ *  the pipe holds, and only this process reads the pipe, so those bytes
+ *  are guaranteed to be there.  The frame header for exactly that many
+ *  bytes is sent with MSG_MORE, so it leaves in the same segment as the
+ *  data, and splice() then moves the bytes from the pipe buffer to the
+ *  socket without them ever entering user space.
+ *
+ *  If the kernel refuses to splice, output falls back to copying for the
+ *  rest of the server's life.  The header is already on the wire at that
+ *  point, so the remainder of the frame is copied.
+ *
+ *  Returns like framed_pump().
  */
- int boot_server(char *ifaces, int port) {
-    int svr_socket;
-    int ret;
-    struct sockaddr_in addr;
-    int enable = 1; // Used for setsockopt
+static int framed_splice(rdsh_framed_t *fs, rdsh_job_t *job, int fd,
+                         uint8_t type) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+    ssize_t moved;
+    int avail = 0;
+    int left;
+
+    if (ioctl(fd, FIONREAD, &avail) < 0 || avail <= 0) {
+        return 0;   //readable with nothing buffered is EOF
+    }
+    if (avail > RDSH_MAX_PAYLOAD) {
+        avail = RDSH_MAX_PAYLOAD;
+    }
 
-    // Step 1: Create a socket (IPv4, Stream/TCP)
-    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (svr_socket == -1) {
-        perror("socket");
+    rdsh_encode_hdr(hdr, type, job->session, job->req_id, avail);
+    if (send_all(fs->cli_socket, hdr, RDSH_FRAME_HDR_SZ, MSG_MORE) != OK) {
         return ERR_RDSH_COMMUNICATION;
     }
 
-    // Step 2: Allow address reuse to avoid "Address already in use" errors
-    if (setsockopt(svr_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        perror("setsockopt");
-        close(svr_socket);
-        return ERR_RDSH_COMMUNICATION;
+    left = avail;
+    while (left > 0 && splice_output) {
+        moved = splice(fd, NULL, fs->cli_socket, NULL, left, SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return ERR_RDSH_COMMUNICATION;
+            }
+            printf("splice() not supported, copying output\n");
+            splice_output = 0;
+            break;
+        }
+        left -= moved;
     }
 
-    // Step 3: Configure the sockaddr_in structure
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;               // IPv4
-    addr.sin_port = htons(port);             // Convert port to network byte order
-    addr.sin_addr.s_addr = inet_addr(ifaces); // Bind to specified interface
+    while (left > 0) {
+        moved = read(fd, fs->obuf, left);
+        if (moved <= 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (send_all(fs->cli_socket, fs->obuf, moved, 0) != OK) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        left -= moved;
+    }
+    return avail;
+}
 
-    // Step 4: Bind the socket to the address and port
-    ret = bind(svr_socket, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret == -1) {
-        perror("bind");
-        close(svr_socket);
+/*
+ * framed_pump(fs, job, fd, type)
+ *
+ *  Forwards one read worth of pipeline output as a frame.
+ *
+ *  Returns the number of bytes forwarded, 0 at EOF, or a negative error
+ *  code if the client can no longer be written to.
+ */
+static int framed_pump(rdsh_framed_t *fs, rdsh_job_t *job, int fd,
+                       uint8_t type) {
+    ssize_t io_size;
+
+    if (splice_output) {
+        return framed_splice(fs, job, fd, type);
+    }
+
+    do {
+        io_size = read(fd, fs->obuf, RDSH_COMM_BUFF_SZ);
+    } while (io_size < 0 && errno == EINTR);
+
+    if (io_size <= 0) {
+        return 0;
+    }
+    if (rdsh_send_frame(fs->cli_socket, type, job->session, job->req_id,
+                        fs->obuf, io_size) != OK) {
         return ERR_RDSH_COMMUNICATION;
     }
+    return io_size;
+}
+
+/*
+ * framed_end_job(fs, job, abort)
+ *
+ *  Reaps a session's pipeline.  A normal end sends the EXIT frame, an
+ *  aborted job (the client went away) is killed first.
+ */
+static int framed_end_job(rdsh_framed_t *fs, rdsh_job_t *job, int abort) {
+    int rc;
+
+    if (job->in_fd >= 0) {
+        close(job->in_fd);
+        job->in_fd = -1;
+    }
+    if (job->out_fd >= 0) {
+        close(job->out_fd);
+        job->out_fd = -1;
+    }
+    if (job->err_fd >= 0) {
+        close(job->err_fd);
+        job->err_fd = -1;
+    }
+    if (abort) {
+        rsh_abort_pipeline(job->pids, job->num_pids);
+        job->active = 0;
+        fs->running--;
+        return OK;
+    }
+    rc = rsh_wait_pipeline(job->pids, job->num_pids, &job->usage);
+    job->active = 0;
+    fs->running--;
 
-    // Step 5: Start listening with a backlog of 20 connections
-    ret = listen(svr_socket, 20);
-    if (ret == -1) {
-        perror("listen");
-        close(svr_socket);
+    if (rdsh_send_exit(fs->cli_socket, job->session, job->req_id, rc) != OK) {
         return ERR_RDSH_COMMUNICATION;
     }
-
-    printf("Server started on %s:%d\n", ifaces, port);
-    return svr_socket;
+    rsh_metrics_record(&fs->metrics, &job->usage, rc);
+    return OK;
 }
 
-
 /*
- * process_cli_requests(svr_socket)
- *      svr_socket:  The server socket that was obtained from boot_server()
- *   
- *  This function handles managing client connections.  It does this using
- *  the following logic
- * 
- *      1.  Starts a while(1) loop:
- *  
- *          a. Calls accept() to wait for a client connection. Recall that 
- *             the accept() function returns another socket specifically
- *             bound to a client connection. 
- *          b. Calls exec_client_requests() to handle executing commands
- *             sent by the client. It will use the socket returned from
- *             accept().
- *          c. Loops back to the top (step 2) to accept connecting another
- *             client.  
- * 
- *          note that the exec_client_requests() return code should be
- *          negative if the client requested the server to stop by sending
- *          the `stop-server` command.  If this is the case step 2b breaks
- *          out of the while(1) loop. 
- * 
- *      2.  After we exit the loop, we need to cleanup.  Dont forget to 
- *          free the buffer you allocated in step #1.  Then call stop_server()
- *          to close the server socket. 
- * 
- *  Returns:
- * 
- *      OK_EXIT:  When the client sends the `stop-server` command this function
- *                should return OK_EXIT. 
- * 
- *      ERR_RDSH_COMMUNICATION:  This error code terminates the loop and is
- *                returned from this function in the case of the accept() 
- *                function failing. 
- * 
- *      OTHERS:   See exec_client_requests() for return codes.  Note that positive
- *                values will keep the loop running to accept additional client
- *                connections, and negative values terminate the server. 
- * 
+ * framed_feed(sess)
+ *
+ *  Writes the STDIN frame at the head of a session's queue to the pipe of
+ *  the command it belongs to.  Input for a command that already ended, or
+ *  that never asked for input, is dropped, and an empty frame closes the
+ *  pipe so the command sees end of input.
+ *
+ *  Returns 1 when the frame was used up, 0 when the pipe is full.
  */
- int process_cli_requests(int svr_socket){
-    int cli_socket;
-    int rc = OK;    
-
-    while(1){
-        
-        cli_socket = accept(svr_socket, NULL, NULL);
-        if (cli_socket < 0) {
-            perror("accept");
-            return ERR_RDSH_COMMUNICATION;
+static int framed_feed(rdsh_session_t *sess) {
+    rdsh_pending_t *req = sess->head;
+    rdsh_job_t *job = &sess->job;
+    ssize_t io_size;
+
+    while (job->active && job->req_id == req->req_id && job->in_fd >= 0) {
+        if (req->off == req->len) {
+            if (req->len == 0) {
+                close(job->in_fd);
+                job->in_fd = -1;
+            }
+            break;
         }
+        io_size = write(job->in_fd, req->cmd + req->off, req->len - req->off);
+        if (io_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            //EPIPE, the command stopped reading
+            close(job->in_fd);
+            job->in_fd = -1;
+            break;
+        }
+        req->off += io_size;
+    }
 
-        printf("Client connected.\n");
-
-        
-        rc = exec_client_requests(cli_socket);
+    sess->head = req->next;
+    if (sess->head == NULL) {
+        sess->tail = NULL;
+    }
+    free(req);
+    return 1;
+}
 
-        
-        close(cli_socket);
+/*
+ * framed_read(fs)
+ *
+ *  Receives from the client and handles every complete frame.  HELLO is
+ *  answered with the version this server picks, CMD and STDIN frames are
+ *  queued on their session.  Once the client said `exit` no more frames
+ *  are read.
+ *
+ *  Returns OK, or a negative error code if the client sent something that
+ *  is not a valid frame or the connection failed.
+ */
+static int framed_read(rdsh_framed_t *fs) {
+    rdsh_frame_hdr_t hdr;
+    rdsh_pending_t *req;
+    rdsh_session_t *sess;
+    ssize_t io_size;
+    uint8_t version;
+    int used = 0;
+
+    io_size = recv(fs->cli_socket, fs->rbuf + fs->rlen,
+                   RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD - fs->rlen, 0);
+    if (io_size < 0) {
+        return (errno == EINTR) ? OK : ERR_RDSH_COMMUNICATION;
+    }
+    if (io_size == 0) {
+        fs->client_eof = 1;
+        return OK;
+    }
+    fs->rlen += io_size;
 
-        if (rc == OK_EXIT) {
-            printf("Server shutting down...\n");
+    while (!fs->client_eof && fs->rlen - used >= RDSH_FRAME_HDR_SZ) {
+        if (rdsh_decode_hdr(fs->rbuf + used, &hdr) != OK) {
+            return ERR_RDSH_PROTOCOL;
+        }
+        if (fs->rlen - used < RDSH_FRAME_HDR_SZ + (int)hdr.length) {
             break;
         }
+
+        switch (hdr.type) {
+            case RDSH_FT_HELLO:
+                version = RDSH_PROTO_VERSION;
+                if (hdr.length > 0 &&
+                    (uint8_t)fs->rbuf[used + RDSH_FRAME_HDR_SZ] < version) {
+                    version = fs->rbuf[used + RDSH_FRAME_HDR_SZ];
+                }
+                if (rdsh_send_frame(fs->cli_socket, RDSH_FT_HELLO, 0, 0,
+                                    &version, sizeof(version)) != OK) {
+                    return ERR_RDSH_COMMUNICATION;
+                }
+                break;
+            case RDSH_FT_CMD:
+            case RDSH_FT_STDIN:
+                if (hdr.session >= RDSH_MAX_SESSIONS) {
+                    if (hdr.type == RDSH_FT_STDIN) {
+                        break;
+                    }
+                    if (framed_reply(fs, hdr.session, hdr.req_id, RDSH_FT_STDERR,
+                                     CMD_ERR_RDSH_SESSION, ERR_RDSH_PROTOCOL) != OK) {
+                        return ERR_RDSH_COMMUNICATION;
+                    }
+                    break;
+                }
+                req = malloc(sizeof(rdsh_pending_t) + hdr.length + 1);
+                if (req == NULL) {
+                    return ERR_MEMORY;
+                }
+                req->type = hdr.type;
+                req->flags = hdr.flags;
+                req->req_id = hdr.req_id;
+                req->session = hdr.session;
+                req->len = hdr.length;
+                req->off = 0;
+                req->next = NULL;
+                clock_gettime(CLOCK_MONOTONIC, &req->received);
+                memcpy(req->cmd, fs->rbuf + used + RDSH_FRAME_HDR_SZ, hdr.length);
+                req->cmd[hdr.length] = '\0';
+                sess = &fs->sessions[hdr.session];
+                if (sess->tail != NULL) {
+                    sess->tail->next = req;
+                } else {
+                    sess->head = req;
+                }
+                sess->tail = req;
+                break;
+            default:
+                //frames from newer clients that this server does not
+                //know are skipped
+                break;
+        }
+        used += RDSH_FRAME_HDR_SZ + hdr.length;
     }
 
-    stop_server(svr_socket);
-    return rc;
+    memmove(fs->rbuf, fs->rbuf + used, fs->rlen - used);
+    fs->rlen -= used;
+    return OK;
 }
 
-
 /*
- * exec_client_requests(cli_socket)
+ * exec_client_requests_framed(cli_socket)
  *      cli_socket:  The server-side socket that is connected to the client
- *   
- *  This function handles accepting remote client commands. The function will
- *  loop and continue to accept and execute client commands.  There are 2 ways
- *  that this ongoing loop accepting client commands ends:
- * 
- *      1.  When the client executes the `exit` command, this function returns
- *          to process_cli_requests() so that we can accept another client
- *          connection. 
- *      2.  When the client executes the `stop-server` command this function
- *          returns to process_cli_requests() with a return code of OK_EXIT
- *          indicating that the server should stop. 
- * 
- *  Note that this function largely follows the implementation of the
- *  exec_local_cmd_loop() function that you implemented in the last 
- *  shell program deliverable. The main difference is that the command will
- *  arrive over the recv() socket call rather than reading a string from the
- *  keyboard. 
- * 
- *  This function also must send the EOF character after a command is
- *  successfully executed to let the client know that the output from the
- *  command it sent is finished.  Use the send_message_eof() to accomplish 
- *  this. 
- * 
- *  Of final note, this function must allocate a buffer for storage to 
- *  store the data received by the client. For example:
- *     io_buff = malloc(RDSH_COMM_BUFF_SZ);
- *  And since it is allocating storage, it must also properly clean it up
- *  prior to exiting.
- * 
+ *
+ *  Framed protocol version of exec_client_requests(), entered when the
+ *  client opened the connection with a HELLO frame.  A single poll() loop
+ *  receives frames from the client while forwarding the output of every
+ *  running command, so clients may send commands ahead without waiting
+ *  for earlier ones to finish.  Commands of one session run in order,
+ *  different sessions run side by side.  Pipelines get /dev/null as
+ *  STDIN because the socket now only carries frames.
+ *
+ *  `exit` drops whatever its session still had queued and stops reading
+ *  from the client, commands already running in other sessions are
+ *  finished before the connection is closed.  Once the server stops, by
+ *  `stop-server` from this or any other client, every session drops its
+ *  queue the same way and running commands are finished until the drain
+ *  deadline, when they are killed and their EXIT frame is sent.
+ *
  *  Returns:
- * 
- *      OK:       The client sent the `exit` command.  Get ready to connect
- *                another client. 
- *      OK_EXIT:  The client sent `stop-server` command to terminate the server
- * 
- *      ERR_RDSH_COMMUNICATION:  A catch all for any socket() related send
- *                or receive errors. 
+ *
+ *      OK:       The client sent the `exit` command or disconnected
+ *      OK_EXIT:  The client sent the `stop-server` command
+ *
+ *      ERR_RDSH_COMMUNICATION, ERR_RDSH_PROTOCOL:  The connection failed
+ *                or the client sent something that is not a frame
  */
- int exec_client_requests(int cli_socket) {
-    int io_size;
-    command_list_t cmd_list;
-    int rc;
-    char *io_buff;
-
-    // Allocate buffer for receiving data
-    io_buff = malloc(RDSH_COMM_BUFF_SZ);
-    if (io_buff == NULL) {
-        perror("malloc");
-        return ERR_RDSH_SERVER;
+int exec_client_requests_framed(int cli_socket) {
+    rdsh_framed_t fs;
+    struct pollfd pfd[2 + 3 * RDSH_MAX_SESSIONS];
+    rdsh_job_t *pjob[1 + 3 * RDSH_MAX_SESSIONS];
+    rdsh_session_t *sess;
+    rdsh_pending_t *req;
+    rdsh_job_t *job;
+    Built_In_Cmds bi_cmd;
+    int stop = 0;       //this client sent `stop-server`
+    int npfd;
+    int n;
+    int rc = OK;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.cli_socket = cli_socket;
+    for (int i = 0; i < RDSH_MAX_SESSIONS; i++) {
+        fs.sessions[i].job.in_fd = -1;
+        fs.sessions[i].job.out_fd = -1;
+        fs.sessions[i].job.err_fd = -1;
+    }
+    fs.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    fs.rbuf = malloc(RDSH_FRAME_HDR_SZ + RDSH_MAX_PAYLOAD);
+    fs.obuf = malloc(RDSH_COMM_BUFF_SZ);
+    if (fs.null_fd < 0 || fs.rbuf == NULL || fs.obuf == NULL ||
+        cmd_arena_init(&fs.arena, 0) != OK) {
+        perror("exec_client_requests_framed");
+        rc = ERR_RDSH_SERVER;
+        goto done;
     }
 
     while (1) {
-        // Step 1: Receive command from client
-        memset(io_buff, 0, RDSH_COMM_BUFF_SZ);
-        io_size = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-
-        // Step 2: Handle recv() errors
-        if (io_size < 0) {
-            perror("recv");
-            free(io_buff);
-            return ERR_RDSH_COMMUNICATION;
-        }
-        if (io_size == 0) {
-            // Client disconnected
-            printf("Client disconnected.\n");
-            free(io_buff);
-            return OK;
+        // Step 1: Once the server stops nothing queued is started, only
+        //         running commands are finished
+        if (rsh_stopping() && !fs.client_eof) {
+            for (int i = 0; i < RDSH_MAX_SESSIONS; i++) {
+                framed_drop_queue(&fs.sessions[i]);
+            }
+            fs.client_eof = 1;
         }
 
-        // Step 3: Ensure received command is null-terminated
-        io_buff[io_size] = '\0';
-
-        // Step 4: Check for overly long input (Buffer Overflow Protection)
-        if (io_size >= RDSH_COMM_BUFF_SZ - 1) {
-            send_message_string(cli_socket, "Error: Command too long. Input rejected.\n");
+        // Step 2: Feed queued input to running commands and start the next
+        //         queued command of every idle session
+        for (int i = 0; i < RDSH_MAX_SESSIONS; i++) {
+            sess = &fs.sessions[i];
+            while (sess->head != NULL) {
+                if (sess->head->type == RDSH_FT_STDIN) {
+                    if (!framed_feed(sess)) {
+                        break;
+                    }
+                    continue;
+                }
+                if (sess->job.active) {
+                    break;
+                }
+                req = sess->head;
+                sess->head = req->next;
+                if (sess->head == NULL) {
+                    sess->tail = NULL;
+                }
+                bi_cmd = framed_start_job(&fs, req);
+                free(req);
+                if (bi_cmd == BI_CMD_EXIT) {
+                    framed_drop_queue(sess);
+                    fs.client_eof = 1;
+                }
+                if (bi_cmd == BI_CMD_STOP_SVR) {
+                    rsh_request_stop();
+                    stop = 1;
+                    break;
+                }
+            }
+            if (stop) {
+                break;
+            }
+        }
+        if (stop && !fs.client_eof) {
             continue;
         }
 
-        printf("Received command from client: %s\n", io_buff);  // Debug logging
+        // Step 3: Nothing running, nothing queued and no more input
+        if (fs.running == 0 && fs.client_eof) {
+            printf("Client disconnected.\n");
+            break;
+        }
 
-        // Step 5: Parse command into a command list
-        rc = build_cmd_list(io_buff, &cmd_list);
-        if (rc != OK) {
-            send_message_string(cli_socket, "Error: Invalid command format.\n");
-            free(io_buff);
-            return ERR_RDSH_COMMUNICATION;
+        // Step 4: Wait for frames from the client, pipeline output or the
+        //         server to stop, which is polled last
+        pfd[0].fd = fs.client_eof ? -1 : cli_socket;
+        pfd[0].events = POLLIN;
+        npfd = 1;
+        for (int i = 0; i < RDSH_MAX_SESSIONS; i++) {
+            job = &fs.sessions[i].job;
+            if (!job->active) {
+                continue;
+            }
+            if (fs.sessions[i].head != NULL &&
+                fs.sessions[i].head->type == RDSH_FT_STDIN && job->in_fd >= 0) {
+                //input is waiting for room in the pipe
+                pfd[npfd].fd = job->in_fd;
+                pfd[npfd].events = POLLOUT;
+                pjob[npfd++] = job;
+            }
+            if (job->out_fd >= 0) {
+                pfd[npfd].fd = job->out_fd;
+                pfd[npfd].events = POLLIN;
+                pjob[npfd++] = job;
+            }
+            if (job->err_fd >= 0) {
+                pfd[npfd].fd = job->err_fd;
+                pfd[npfd].events = POLLIN;
+                pjob[npfd++] = job;
+            }
         }
 
-        // Step 6: Check for built-in commands
-        if (cmd_list.num > 0) {
-            Built_In_Cmds bi_cmd = rsh_match_command(cmd_list.commands[0].argv[0]);
+        pfd[npfd].fd = rsh_stopping() ? -1 : rsh_stop_fd();
+        pfd[npfd].events = POLLIN;
 
-            if (bi_cmd == BI_CMD_EXIT) {
-                send_message_string(cli_socket, "Exiting client session.\n");
-                free_cmd_list(&cmd_list);
-                free(io_buff);
-                return OK; 
+        n = poll(pfd, npfd + 1, rsh_drain_left_ms());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (bi_cmd == BI_CMD_STOP_SVR) {
-                send_message_string(cli_socket, "Server stopping.\n");
-                free_cmd_list(&cmd_list);
-                free(io_buff);
-                return OK_EXIT;
+            perror("poll");
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+        if (rsh_drain_left_ms() == 0) {
+            //drain deadline, the jobs are killed as they are reaped
+            for (int i = 0; i < RDSH_MAX_SESSIONS && rc == OK; i++) {
+                if (fs.sessions[i].job.active) {
+                    rc = framed_end_job(&fs, &fs.sessions[i].job, 0);
+                }
             }
+            if (rc != OK) {
+                break;
+            }
+            continue;
+        }
+        if (pfd[npfd].fd >= 0 && pfd[npfd].revents) {
+            rsh_request_stop();
+            continue;
         }
 
-        // Step 7: Execute the pipeline command
-        rc = rsh_execute_pipeline(cli_socket, &cmd_list);
-        free_cmd_list(&cmd_list);
-
-        // **🚀 FIX: Handle Invalid Commands Properly**
-        if (rc != 0) {  
-            send_message_string(cli_socket, "Error: Command not found or failed to execute.\n");
-            free(io_buff);
-            return ERR_EXEC_CMD;  // Return a non-zero error code
+        // Step 5: Forward output, a drained pipe is closed and a job with
+        //         both channels drained is done
+        for (int i = 1; i < npfd && rc >= 0; i++) {
+            if (!pfd[i].revents || pfd[i].events == POLLOUT) {
+                continue;
+            }
+            job = pjob[i];
+            rc = framed_pump(&fs, job, pfd[i].fd, (pfd[i].fd == job->out_fd) ?
+                             RDSH_FT_STDOUT : RDSH_FT_STDERR);
+            if (rc == 0) {
+                close(pfd[i].fd);
+                if (pfd[i].fd == job->out_fd) {
+                    job->out_fd = -1;
+                } else {
+                    job->err_fd = -1;
+                }
+                if (job->out_fd < 0 && job->err_fd < 0) {
+                    rc = framed_end_job(&fs, job, 0);
+                }
+            }
         }
+        if (rc < 0) {
+            break;
+        }
+        rc = OK;
 
-        // Step 8: Send EOF message to signal end of response
-        if (send_message_eof(cli_socket) != OK) {
-            perror("send_message_eof failed");
-            free(io_buff);
-            return ERR_RDSH_COMMUNICATION;
+        // Step 6: Handle frames from the client
+        if (pfd[0].fd >= 0 && pfd[0].revents) {
+            rc = framed_read(&fs);
+            if (rc != OK) {
+                break;
+            }
         }
     }
 
-    free(io_buff);
-    return OK;
+done:
+    for (int i = 0; i < RDSH_MAX_SESSIONS; i++) {
+        if (fs.sessions[i].job.active) {
+            framed_end_job(&fs, &fs.sessions[i].job, 1);
+        }
+        framed_drop_queue(&fs.sessions[i]);
+        free(fs.sessions[i].job.pids);
+    }
+    if (fs.null_fd >= 0) {
+        close(fs.null_fd);
+    }
+    free(fs.rbuf);
+    free(fs.obuf);
+    cmd_arena_free(&fs.arena);
+    if (stop && rc == OK) {
+        rc = OK_EXIT;
+    }
+    return rc;
 }
 
 
@@ -510,6 +3029,9 @@ int send_message_eof(int cli_socket){
  *                                                      the return code
  *                                                      for this function       
  * 
+ *  The time spent starting the stages and their resource usage are
+ *  stored in usage, which may be NULL.
+ *
  *  Returns:
  * 
  *      EXIT_CODE:  This function returns the exit code of the last command
@@ -518,81 +3040,230 @@ int send_message_eof(int cli_socket){
  *                  macro that we discussed during our fork/exec lecture to
  *                  get this value. 
  */
- int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
-    int pipes[clist->num - 1][2];  // Pipes for inter-process communication
-    pid_t pids[clist->num];        // Process IDs of forked processes
-    int pids_st[clist->num];       // Exit statuses
-    int exit_code;
+ int rsh_execute_pipeline(int cli_sock, command_list_t *clist,
+                          rsh_cmd_usage_t *usage) {
+    pid_t *pids = NULL;            // Process IDs of forked processes
+    int pids_cap = 0;
+    struct timespec start;
+    int rc;
 
-    // Step 1: Create pipes for inter-process communication
-    for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            return ERR_EXEC_CMD;
+    // Step 1: Fork the pipeline with the client socket on both ends, the
+    //         process ids live as long as the parsed command when it
+    //         came from an arena
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (clist->arena != NULL) {
+        pids = cmd_arena_alloc(clist->arena, clist->num * sizeof(pid_t));
+    } else {
+        rsh_reserve_pids(&pids, &pids_cap, clist->num);
+    }
+    if (pids == NULL) {
+        return ERR_MEMORY;
+    }
+    rc = rsh_start_pipeline(clist, cli_sock, cli_sock, cli_sock, pids);
+    if (rc == OK) {
+        if (usage != NULL) {
+            usage->launch_us = rsh_usec_since(&start);
         }
+
+        // Step 2: Wait for all child processes and collect the exit code
+        rc = rsh_wait_pipeline(pids, clist->num, usage);
     }
+    if (clist->arena == NULL) {
+        free(pids);
+    }
+    return rc;
+}
 
-    // Step 2: Iterate over commands and fork processes
-    for (int i = 0; i < clist->num; i++) {
-        pids[i] = fork();
 
-        if (pids[i] == -1) {
-            perror("fork");
-            return ERR_EXEC_CMD;
-        }
+/*
+ * rsh_reserve_pids(pids, cap, num)
+ *      pids:  growable array of process ids, *pids may be NULL
+ *      cap:   number of entries *pids has room for
+ *      num:   number of stages of the pipeline about to be started
+ *
+ *  Pipelines have no length limit, so the process ids of a pipeline are
+ *  kept in an array that is doubled until it fits.  The servers keep one
+ *  per connection or session and reuse it, it only grows.
+ *
+ *  Returns OK, or ERR_MEMORY with *pids unchanged.
+ */
+int rsh_reserve_pids(pid_t **pids, int *cap, int num) {
+    pid_t *grown;
+    int want = *cap ? *cap : CMD_LIST_INIT;
 
-        if (pids[i] == 0) {  
-            // Step 3: Handle input redirection
-            if (i == 0) {
-                dup2(cli_sock, STDIN_FILENO);  
-            } else {
-                dup2(pipes[i - 1][0], STDIN_FILENO);
-            }
+    if (num <= *cap) {
+        return OK;
+    }
+    while (want < num) {
+        want *= 2;
+    }
+    grown = realloc(*pids, want * sizeof(pid_t));
+    if (grown == NULL) {
+        perror("realloc");
+        return ERR_MEMORY;
+    }
+    *pids = grown;
+    *cap = want;
+    return OK;
+}
 
-            // Step 4: Handle output redirection
-            if (i == clist->num - 1) {
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
-            } else {
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
 
-            // Step 5: Close all unused pipes
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+/*
+ * rsh_start_pipeline(clist, in_fd, out_fd, err_fd, pids)
+ *      clist:   The parsed command pipeline
+ *      in_fd:   Descriptor used as STDIN of the first process
+ *      out_fd:  Descriptor used as STDOUT of the last process
+ *      err_fd:  Descriptor used as STDERR of the last process
+ *      pids:    Array of at least clist->num entries that receives the
+ *               process id of every stage, -1 for a stage that could not
+ *               be started
+ *
+ *  This is the process starting half of rsh_execute_pipeline(), stages
+ *  are started with launch_stage() so the -L launcher applies, or handed
+ *  to a warm helper, see rsh_coproc_launch().  It is split out
+ *  so that server modes that do not want to block in waitpid() (for
+ *  example the epoll event loop) can start a pipeline, watch its output
+ *  and reap it later with rsh_wait_pipeline().
+ *
+ *  The pipes between stages are created with O_CLOEXEC so that pipelines
+ *  running concurrently for other clients never inherit each others pipe
+ *  ends, which would keep a reader from ever seeing EOF.  Each pipe is
+ *  created just before the stage that writes to it, so however long the
+ *  pipeline the server holds at most two pipe descriptors for it.
+ *
+ *  Returns:
+ *
+ *      OK:            The pipeline was started, if a later pipe() failed
+ *                     the stages after it are -1 in pids
+ *      ERR_EXEC_CMD:  The first pipe() failed, nothing was started
+ */
+int rsh_start_pipeline(command_list_t *clist, int in_fd, int out_fd,
+                       int err_fd, pid_t *pids) {
+    int n = clist->num;
+    int prev_read = in_fd;
+
+    // Start every stage with the selected launcher, all stages report
+    // errors to err_fd so the client sees them.  A stage that cannot be
+    // started is left out, its neighbours see EOF.
+    for (int i = 0; i < n; i++) {
+        int fds[2] = { -1, out_fd };
+
+        // Step 1: Create the pipe this stage writes to, the parent only
+        //         ever holds the read end of the one before it
+        if (i < n - 1 && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            if (i == 0) {
+                return ERR_EXEC_CMD;
+            }
+            //the stages already started see EOF and are reaped normally
+            close(prev_read);
+            for (int j = i; j < n; j++) {
+                pids[j] = -1;
             }
+            break;
+        }
 
-            // Step 6: Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
+        // Step 2: Start the stage
+        pids[i] = rsh_coproc_launch(&clist->commands[i], prev_read, fds[1], err_fd);
 
-            perror("execvp");
-            send_message_string(cli_sock, "command not found\n");
-            exit(ERR_EXEC_CMD);
+        // Step 3: Parent process closes its copies of the stage's pipe ends
+        if (i > 0) {
+            close(prev_read);
         }
+        if (i < n - 1) {
+            close(fds[1]);
+        }
+        prev_read = fds[0];
     }
+    return OK;
+}
 
-    // Step 7: Parent process closes all pipes
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
-    }
 
-    // Step 8: Wait for all child processes
-    for (int i = 0; i < clist->num; i++) {
-        waitpid(pids[i], &pids_st[i], 0);
+/*
+ * rsh_wait_pipeline(pids, num, usage)
+ *      pids:   Process ids returned by rsh_start_pipeline()
+ *      num:    Number of entries in pids
+ *      usage:  Receives the resource usage of every stage, may be NULL
+ *
+ *  Waits for every stage of a pipeline to terminate.  The stages are
+ *  reaped with wait4() so the CPU time, resident set size and context
+ *  switches of each one can be added to usage.  Once the server is
+ *  stopping, stages still running at the drain deadline are killed.
+ *
+ *  Returns:
+ *
+ *      EXIT_CODE:     WEXITSTATUS() of the last stage when every stage
+ *                     exited with 0
+ *      ERR_EXEC_CMD:  Any stage exited with a non zero status, or the
+ *                     pipeline was killed at the drain deadline
+ */
+int rsh_wait_pipeline(pid_t *pids, int num, rsh_cmd_usage_t *usage) {
+    struct rusage ru;
+    int status = 0;
+    int exit_code = 0;
+    int failed = 0;
+    int killed = 0;
+
+    for (int i = 0; i < num; i++) {
+        if (pids[i] < 0) {
+            //never started, launch_stage() reported why
+            failed = 1;
+            continue;
+        }
+        if (!killed && drain_wait(pids[i])) {
+            //the stages before this one are reaped, the rest are not
+            for (int j = i; j < num; j++) {
+                if (pids[j] > 0) {
+                    kill(pids[j], SIGKILL);
+                }
+            }
+            pthread_mutex_lock(&stop_lock);
+            drain_killed++;
+            pthread_mutex_unlock(&stop_lock);
+            killed = 1;
+        }
+        while (wait4(pids[i], &status, 0, &ru) == -1) {
+            if (errno != EINTR) {
+                perror("wait4");
+                failed = 1;
+                break;
+            }
+        }
+        if (usage != NULL) {
+            rsh_usage_add(usage, &ru);
+        }
+        if (WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+        exit_code = WEXITSTATUS(status);
     }
 
-    // Step 9: Get the exit code of the last command
-    exit_code = WEXITSTATUS(pids_st[clist->num - 1]);
+    if (failed || killed) {
+        return ERR_EXEC_CMD;
+    }
+    return exit_code;
+}
 
-    for (int i = 0; i < clist->num; i++) {
-        if (WEXITSTATUS(pids_st[i]) != 0) {
-            return ERR_EXEC_CMD;
+/*
+ * rsh_abort_pipeline(pids, num)
+ *      pids:   Process ids returned by rsh_start_pipeline()
+ *      num:    Number of entries in pids
+ *
+ *  Kills and reaps a pipeline whose client went away.
+ */
+void rsh_abort_pipeline(pid_t *pids, int num) {
+    for (int i = 0; i < num; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+        }
+    }
+    for (int i = 0; i < num; i++) {
+        if (pids[i] > 0) {
+            while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR) {
+                ;
+            }
         }
     }
-
-    return exit_code;
 }
 
 
@@ -644,6 +3315,10 @@ int send_message_eof(int cli_socket){
          return BI_CMD_STOP_SVR;
      if (strcmp(input, "rc") == 0)
          return BI_CMD_RC;
+     if (strcmp(input, "rstats") == 0)
+         return BI_CMD_RSTATS;
+     if (strcmp(input, HASH_CMD) == 0)
+         return BI_CMD_HASH;
  
      return BI_NOT_BI;
  }
@@ -707,6 +3382,7 @@ int send_message_eof(int cli_socket){
                 perror("cd");
                 send_message_string(STDOUT_FILENO, "cd: failed to change directory\n");
                 return BI_NOT_BI; 
+            }
             return BI_EXECUTED;
 
         default:
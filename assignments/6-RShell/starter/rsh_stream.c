@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * An rsh_stream_t turns the bytes received on a legacy connection back
+ * into commands.  Bytes are received straight into the stream buffer
+ * (rsh_stream_space() / rsh_stream_wrote()) and rsh_stream_next() cuts
+ * out every command ended by a null byte or a newline.  The bytes of an
+ * incomplete command are searched once, the next call continues where
+ * the last one stopped, and the buffer grows until the command fits, up
+ * to the limit given to rsh_stream_init().  A longer command is reported
+ * once and then skipped up to its terminator.
+ *
+ *  buff:  | used commands | command being assembled | free space |
+ *         0               start                     len          cap
+ *                         |-- scanned --|
+ */
+
+/*
+ * rsh_stream_init(stream, max_cmd)
+ *      stream:   the stream to set up
+ *      max_cmd:  longest command accepted, in bytes
+ *
+ *  Returns OK, or ERR_MEMORY if the buffer could not be allocated.
+ */
+int rsh_stream_init(rsh_stream_t *stream, size_t max_cmd) {
+    memset(stream, 0, sizeof(rsh_stream_t));
+    stream->max_cmd = max_cmd;
+    stream->cap = RDSH_STREAM_INIT_SZ;
+    stream->buff = malloc(stream->cap);
+    if (stream->buff == NULL) {
+        return ERR_MEMORY;
+    }
+    return OK;
+}
+
+/*
+ * rsh_stream_free(stream)
+ */
+void rsh_stream_free(rsh_stream_t *stream) {
+    free(stream->buff);
+    stream->buff = NULL;
+    stream->cap = 0;
+}
+
+/*
+ * rsh_stream_reset(stream)
+ *
+ *  Drops every byte received so far.
+ */
+void rsh_stream_reset(rsh_stream_t *stream) {
+    stream->start = 0;
+    stream->len = 0;
+    stream->scanned = 0;
+    stream->discarding = 0;
+}
+
+/*
+ * rsh_stream_pending(stream)
+ *
+ *  Returns the number of bytes received that are not part of a command
+ *  returned yet.
+ */
+size_t rsh_stream_pending(rsh_stream_t *stream) {
+    return stream->len - stream->start;
+}
+
+/*
+ * rsh_stream_space(stream, room)
+ *      room:  receives the number of bytes that may be written
+ *
+ *  Makes room for at least RDSH_STREAM_MIN_ROOM more bytes, moving the
+ *  incomplete command to the front of the buffer and doubling the
+ *  buffer when that is not enough.  Commands returned by
+ *  rsh_stream_next() are no longer valid after this call.  One byte is
+ *  always kept spare for the terminator added by rsh_stream_flush().
+ *
+ *  Returns where received bytes go, or NULL if the buffer could not grow.
+ */
+char *rsh_stream_space(rsh_stream_t *stream, size_t *room) {
+    size_t cap;
+    char *buff;
+
+    if (stream->start > 0) {
+        memmove(stream->buff, stream->buff + stream->start,
+                stream->len - stream->start);
+        stream->len -= stream->start;
+        stream->start = 0;
+    }
+
+    if (stream->cap - stream->len < RDSH_STREAM_MIN_ROOM + 1) {
+        cap = stream->cap * 2;
+        buff = realloc(stream->buff, cap);
+        if (buff == NULL) {
+            return NULL;
+        }
+        stream->buff = buff;
+        stream->cap = cap;
+    }
+
+    *room = stream->cap - stream->len - 1;
+    return stream->buff + stream->len;
+}
+
+/*
+ * rsh_stream_wrote(stream, len)
+ *
+ *  Adds len bytes written at the pointer rsh_stream_space() returned.
+ */
+void rsh_stream_wrote(rsh_stream_t *stream, size_t len) {
+    stream->len += len;
+}
+
+/*
+ * rsh_stream_skip(stream, len)
+ *
+ *  Drops the first len pending bytes, which the caller handled itself.
+ */
+void rsh_stream_skip(rsh_stream_t *stream, size_t len) {
+    stream->start += len;
+    stream->scanned = 0;
+}
+
+/*
+ * rsh_stream_next(stream, cmd)
+ *      cmd:  receives the next command as a C string inside the buffer
+ *
+ *  Looks for the end of the next command in the bytes not searched
+ *  yet.  Empty commands, such as the newline of a "ls\n\0" sent by a
+ *  line based client, are skipped.
+ *
+ *  Returns:
+ *
+ *      1:                      *cmd is the next command, valid until the
+ *                              next rsh_stream_space()
+ *      0:                      more bytes are needed
+ *      ERR_RDSH_CMD_TOO_LONG:  a command grew past the limit, its bytes
+ *                              are dropped up to its terminator
+ */
+int rsh_stream_next(rsh_stream_t *stream, char **cmd) {
+    char *p;
+    char *end;
+
+    while (stream->start + stream->scanned < stream->len) {
+        p = stream->buff + stream->start + stream->scanned;
+        end = stream->buff + stream->len;
+        while (p < end && *p != '\0' && *p != '\n') {
+            p++;
+        }
+
+        if (p == end) {
+            stream->scanned = stream->len - stream->start;
+            if (stream->discarding) {
+                stream->len = stream->start;
+                stream->scanned = 0;
+            } else if (stream->scanned > stream->max_cmd) {
+                stream->discarding = 1;
+                stream->len = stream->start;
+                stream->scanned = 0;
+                return ERR_RDSH_CMD_TOO_LONG;
+            }
+            return 0;
+        }
+
+        *p = '\0';
+        *cmd = stream->buff + stream->start;
+        stream->start = p + 1 - stream->buff;
+        stream->scanned = 0;
+        if (stream->discarding) {
+            stream->discarding = 0;
+            continue;
+        }
+        if (**cmd == '\0') {
+            continue;
+        }
+        if ((size_t)(p - *cmd) > stream->max_cmd) {
+            return ERR_RDSH_CMD_TOO_LONG;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * rsh_stream_flush(stream)
+ *
+ *  Ends the incomplete command without a terminator, once the client
+ *  shut down its side and no terminator can follow.
+ *
+ *  Returns the command, valid until the next rsh_stream_space(), or
+ *  NULL if nothing is pending.
+ */
+char *rsh_stream_flush(rsh_stream_t *stream) {
+    char *cmd = stream->buff + stream->start;
+
+    if (stream->discarding || rsh_stream_pending(stream) == 0) {
+        return NULL;
+    }
+    stream->buff[stream->len] = '\0';
+    stream->start = stream->len;
+    stream->scanned = 0;
+    return cmd;
+}
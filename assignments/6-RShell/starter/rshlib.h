@@ -1,6 +1,10 @@
 #ifndef __RSH_LIB_H__
     #define __RSH_LIB_H__
 
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
 #include "dshlib.h"
 
 //common remote shell client and server constants and definitions
@@ -20,6 +24,23 @@
                                             //if the command is to stop the
                                             //server.  See documentation for 
                                             //exec_client_requests() for more info
+#define RDSH_EPOLL_EVENTS       64          //events handled per epoll_wait()
+#define RDSH_PIPE_SZ            (1024*1024) //pipeline output pipe capacity
+#define RDSH_MAX_CMD_LEN        (1024*1024) //longest legacy command accepted
+#define RDSH_STREAM_INIT_SZ     4096        //initial rsh_stream_t buffer
+#define RDSH_STREAM_MIN_ROOM    2048        //free bytes offered to recv()
+
+//server modes, selected on the dsh command line and passed to start_server()
+#define RDSH_SVR_SINGLE         0           //one client at a time
+#define RDSH_SVR_THREADED       1           //-x thread per client
+#define RDSH_SVR_EPOLL          2           //-e single threaded epoll loop
+#define RDSH_SVR_PREFORK        3           //-f N pre-forked worker processes
+
+#define RDSH_DEF_WORKERS        4           //default pre-fork worker count
+#define RDSH_DEF_POOL_THREADS   8           //default -x worker threads
+#define RDSH_DEF_POOL_DEPTH     32          //default -x accepted client queue
+#define RDSH_DRAIN_TIMEOUT      10          //default seconds running commands
+                                            //get after stop-server, see -d
 
 //end of message delimiter.  This is super important.  TCP is a stream, therefore
 //the protocol designer is responsible for managing where messages begin and end
@@ -29,16 +50,72 @@
 //linux based systems. 
 static const char RDSH_EOF_CHAR = 0x04;    
 
+//framed protocol.  The EOF character above cannot delimit binary output,
+//cannot tell stdout from stderr and forces one command at a time, so new
+//clients negotiate a framed protocol instead.  Every message is a fixed
+//size header, with all fields in network byte order, followed by length
+//bytes of payload:
+//
+//  +-------+-----+----+---------+-------+--------+--------+-------------+
+//  | magic | ver |type| session | flags | req_id | length | payload ... |
+//  |  u16  | u8  | u8 |   u16   |  u16  |  u32   |  u32   |             |
+//  +-------+-----+----+---------+-------+--------+--------+-------------+
+//
+//The magic starts with the EOF character, which a legacy client never
+//sends as the first byte of a command.  A new client opens with a HELLO
+//frame carrying the highest version it speaks, the server answers with a
+//HELLO carrying the version it picked, 0 meaning legacy EOF mode.  Every
+//CMD frame gets a client chosen req_id, and the STDOUT, STDERR and EXIT
+//frames produced by that command carry the same req_id, so several
+//commands can be in flight on one connection.  Commands with the same
+//session run in order, different sessions run concurrently.
+#define RDSH_FRAME_MAGIC        0x0446      //0x04 'F'
+#define RDSH_PROTO_LEGACY       0           //EOF character delimited
+#define RDSH_PROTO_VERSION      1           //highest framed version
+#define RDSH_HELLO_TIMEOUT      2           //seconds a legacy server gets to
+                                            //close after rejecting HELLO
+#define RDSH_MAX_SESSIONS       16          //sessions per connection
+#define RDSH_BATCH_WINDOW       64          //commands a batch client keeps
+                                            //in flight
+
+#define RDSH_FT_HELLO           1           //payload: u8 version
+#define RDSH_FT_CMD             2           //payload: command line
+#define RDSH_FT_STDOUT          3           //payload: output bytes
+#define RDSH_FT_STDERR          4           //payload: error output bytes
+#define RDSH_FT_EXIT            5           //payload: i32 exit status
+#define RDSH_FT_STDIN           6           //payload: input bytes, empty
+                                            //means end of input
+
+#define RDSH_FL_STDIN           0x0001      //CMD: STDIN frames will follow
+
+typedef struct rdsh_frame_hdr {
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t session;
+    uint16_t flags;
+    uint32_t req_id;
+    uint32_t length;
+} rdsh_frame_hdr_t;
+
+#define RDSH_FRAME_HDR_SZ       ((int)sizeof(rdsh_frame_hdr_t))
+#define RDSH_MAX_PAYLOAD        RDSH_COMM_BUFF_SZ
+
 //rdsh specific error codes for functions
 #define ERR_RDSH_COMMUNICATION  -50     //Used for communication errors
 #define ERR_RDSH_SERVER         -51     //General server errors
 #define ERR_RDSH_CLIENT         -52     //General client errors
 #define ERR_RDSH_CMD_EXEC       -53     //RSH command execution errors
+#define ERR_RDSH_PROTOCOL       -54     //Malformed or unexpected frame
+#define WARN_RDSH_SVR_CLOSED    -55     //Server closed the connection
+#define ERR_RDSH_CMD_TOO_LONG   -56     //Command longer than RDSH_MAX_CMD_LEN
+#define WARN_RDSH_STOPPING      -57     //Server is stopping, end the session
 #define WARN_RDSH_NOT_IMPL      -99     //Not Implemented yet warning
 
 //Output message constants for server
 #define CMD_ERR_RDSH_COMM   "rdsh-error: communications error\n"
 #define CMD_ERR_RDSH_EXEC   "rdsh-error: command execution error\n"
+#define CMD_ERR_RDSH_SESSION "rdsh-error: invalid session\n"
 #define CMD_ERR_RDSH_ITRNL  "rdsh-error: internal server error - %d\n"
 #define CMD_ERR_RDSH_SEND   "rdsh-error: partial send.  Sent %d, expected to send %d\n"
 #define RCMD_SERVER_EXITED  "server appeared to terminate - exiting\n"
@@ -49,23 +126,159 @@ static const char RDSH_EOF_CHAR = 0x04;
 #define RCMD_MSG_SVR_EXEC_REQ   "rdsh-exec:  %s\n"
 #define RCMD_MSG_SVR_RC_CMD     "rdsh-exec:  rc = %d\n"
 
+//counters kept by the -x thread pool, see get_thread_pool_stats()
+typedef struct rsh_pool_stats {
+    int           threads;              //worker threads
+    int           capacity;             //queue slots
+    int           depth;                //clients waiting right now
+    int           max_depth;            //highest depth seen
+    int           busy;                 //workers serving a client
+    unsigned long accepted;             //clients queued
+    unsigned long served;               //clients handed to a worker
+    unsigned long full_waits;           //times accept was held back
+    double        full_wait_ms;         //total time accept was held back
+    double        queue_wait_ms;        //total time clients sat in queue
+    double        max_queue_wait_ms;    //longest time a client sat in queue
+} rsh_pool_stats_t;
+
+//command metrics kept by every server mode, see rsh_metrics.c.  Times are
+//in microseconds and go into log-linear histograms: 0 to 3 get a bucket
+//each, above that every power of two is split into 4 buckets, so a
+//percentile read from a histogram is within 25% of the real value.
+#define RSH_HIST_BUCKETS        128
+
+//warm helpers (-w N), see rsh_coproc.c.  A stage with more arguments, or
+//more bytes of them, than fits one request is started the normal way.
+#define RSH_COPROC_ARGV_MAX     255
+#define RSH_COPROC_MSG_SZ       (64 * 1024)
+
+typedef struct rsh_hist {
+    unsigned long count;
+    double        sum_us;
+    double        max_us;
+    unsigned long buckets[RSH_HIST_BUCKETS];
+} rsh_hist_t;
+
+typedef struct rsh_metrics {
+    unsigned long commands;             //pipelines run
+    unsigned long failed;               //pipelines reported as failed
+    rsh_hist_t    wall;                 //command received to its end sent
+    rsh_hist_t    launch;               //time spent starting the stages
+    rsh_hist_t    cpu;                  //user + system time of all stages
+    double        user_us;              //total user CPU
+    double        sys_us;               //total system CPU
+    long          max_rss_kb;           //largest stage seen
+    unsigned long nvcsw;                //voluntary context switches
+    unsigned long nivcsw;               //involuntary context switches
+} rsh_metrics_t;
+
+//one pipeline while it runs, rsh_wait_pipeline() adds the wait4() rusage
+//of every stage
+typedef struct rsh_cmd_usage {
+    struct timespec received;           //command read from the client
+    double        launch_us;
+    double        user_us;
+    double        sys_us;
+    long          max_rss_kb;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
+} rsh_cmd_usage_t;
+
+//legacy commands are null (or newline) terminated and cut out of the
+//received bytes by an rsh_stream_t, see rsh_stream.c
+typedef struct rsh_stream {
+    char   *buff;
+    size_t  cap;
+    size_t  start;                      //first byte of the next command
+    size_t  len;                        //bytes received
+    size_t  scanned;                    //bytes after start searched already
+    size_t  max_cmd;                    //longest command accepted
+    int     discarding;                 //skipping a command that was too long
+} rsh_stream_t;
+
+//stream prototypes for rsh_stream.c
+int rsh_stream_init(rsh_stream_t *stream, size_t max_cmd);
+void rsh_stream_free(rsh_stream_t *stream);
+void rsh_stream_reset(rsh_stream_t *stream);
+size_t rsh_stream_pending(rsh_stream_t *stream);
+char *rsh_stream_space(rsh_stream_t *stream, size_t *room);
+void rsh_stream_wrote(rsh_stream_t *stream, size_t len);
+void rsh_stream_skip(rsh_stream_t *stream, size_t len);
+int rsh_stream_next(rsh_stream_t *stream, char **cmd);
+char *rsh_stream_flush(rsh_stream_t *stream);
+
+//framed protocol prototypes for rsh_proto.c
+void rdsh_encode_hdr(char *raw, uint8_t type, uint16_t session,
+                     uint32_t req_id, uint32_t len);
+int rdsh_send_frame(int sock, uint8_t type, uint16_t session, uint32_t req_id,
+                    const void *data, uint32_t len);
+int rdsh_send_cmd(int sock, uint16_t session, uint32_t req_id,
+                  const char *cmd, uint16_t flags);
+int rdsh_send_exit(int sock, uint16_t session, uint32_t req_id, int status);
+int rdsh_decode_hdr(const char *raw, rdsh_frame_hdr_t *hdr);
+int rdsh_recv_frame(int sock, rdsh_frame_hdr_t *hdr, char *payload, uint32_t payload_sz);
+int rdsh_client_hello(int sock);
+
 //client prototypes for rsh_cli.c - - see documentation for each function to
 //see what they do
 int start_client(char *address, int port);
 int client_cleanup(int cli_socket, char *cmd_buff, char *rsp_buff, int rc);
 int exec_remote_cmd_loop(char *address, int port);
+int exec_remote_cmd_legacy(int cli_socket, char *cmd_buff, char *rsp_buff);
+int exec_remote_cmd_framed(int cli_socket, uint32_t req_id, char *cmd_buff, char *rsp_buff);
+int exec_remote_cmd_batch(char *address, int port, char *script, int sessions);
+void set_client_stats(int val);
     
 
 //server prototypes for rsh_server.c - see documentation for each function to
 //see what they do
-int start_server(char *ifaces, int port, int is_threaded);
+int start_server(char *ifaces, int port, int svr_mode);
 int boot_server(char *ifaces, int port);
 int stop_server(int svr_socket);
 int send_message_eof(int cli_socket);
 int send_message_string(int cli_socket, char *buff);
 int process_cli_requests(int svr_socket);
 int exec_client_requests(int cli_socket);
-int rsh_execute_pipeline(int socket_fd, command_list_t *clist);
+int exec_client_requests_framed(int cli_socket);
+int rsh_execute_pipeline(int socket_fd, command_list_t *clist,
+                         rsh_cmd_usage_t *usage);
+int rsh_start_pipeline(command_list_t *clist, int in_fd, int out_fd,
+                       int err_fd, pid_t *pids);
+int rsh_wait_pipeline(pid_t *pids, int num, rsh_cmd_usage_t *usage);
+int rsh_reserve_pids(pid_t **pids, int *cap, int num);
+int process_cli_requests_epoll(int svr_socket);
+int process_cli_requests_prefork(int svr_socket, int num_workers);
+void set_prefork_workers(int num);
+void set_thread_pool(int threads, int depth);
+void set_splice_output(int val);
+int get_thread_pool_stats(rsh_pool_stats_t *stats);
+int rsh_format_stats(char *buff, int buff_sz, rsh_metrics_t *client);
+void rsh_abort_pipeline(pid_t *pids, int num);
+
+//graceful stop prototypes for rsh_server.c
+void set_drain_timeout(int secs);
+int rsh_stop_init(void);
+int rsh_stop_fd(void);
+void rsh_request_stop(void);
+int rsh_stopping(void);
+int rsh_drain_left_ms(void);
+void rsh_drain_report(const char *who);
+
+//metrics prototypes for rsh_metrics.c
+struct rusage;
+void set_metrics_file(char *path);
+double rsh_usec_since(struct timespec *from);
+void rsh_usage_start(rsh_cmd_usage_t *usage);
+void rsh_usage_add(rsh_cmd_usage_t *usage, struct rusage *ru);
+void rsh_metrics_record(rsh_metrics_t *client, rsh_cmd_usage_t *usage, int rc);
+int rsh_format_metrics(char *buff, int buff_sz, rsh_metrics_t *client);
+int rsh_dump_metrics(void);
+
+//warm helper prototypes for rsh_coproc.c
+void set_coproc_pool(int num);
+pid_t rsh_coproc_launch(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+void rsh_coproc_shutdown(void);
+int rsh_format_coproc(char *buff, int buff_sz);
 
 Built_In_Cmds rsh_match_command(const char *input);
 Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd);